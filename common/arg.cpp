@@ -697,6 +697,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cpuparams.poll = std::stoul(value);
         }
     ));
+    add_opt(common_arg(
+        {"--cpu-dep-sched"}, "<0|1>",
+        string_format("run independent graph nodes between the same barriers (default: %u)\n", (unsigned) params.cpuparams.dep_sched),
+        [](common_params & params, const std::string & value) {
+            params.cpuparams.dep_sched = std::stoul(value);
+        }
+    ));
     add_opt(common_arg(
         {"-Cb", "--cpu-mask-batch"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range-batch (default: same as --cpu-mask)",
@@ -741,13 +748,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cpuparams_batch.poll = value;
         }
     ));
+    add_opt(common_arg(
+        {"--cpu-dep-sched-batch"}, "<0|1>",
+        "run independent graph nodes between the same barriers (default: same as --cpu-dep-sched)",
+        [](common_params & params, int value) {
+            params.cpuparams_batch.dep_sched = value;
+        }
+    ));
     add_opt(common_arg(
         {"-lcs", "--lookup-cache-static"}, "FNAME",
         "path to static lookup cache to use for lookup decoding (not updated by generation)",
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -1529,6 +1543,27 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-block-size"}, "N",
+        string_format("number of cells in a block of the paged KV cache, power of 2 (default: %d, 0 = contiguous KV cache)", params.kv_block_size),
+        [](common_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(common_arg(
+        {"--grammar-cache"}, "N",
+        string_format("number of grammars kept compiled for reuse by the requests (default: %d, 0 = disabled)", params.n_grammar_cache),
+        [](common_params & params, int value) {
+            params.n_grammar_cache = value;
+        }
+    ).set_env("LLAMA_ARG_GRAMMAR_CACHE"));
+    add_opt(common_arg(
+        {"--grammar-masks"}, "N",
+        string_format("number of grammar states with a token mask kept per compiled grammar, n_vocab/8 bytes each (default: %d)", params.n_grammar_masks),
+        [](common_params & params, int value) {
+            params.n_grammar_masks = value;
+        }
+    ).set_env("LLAMA_ARG_GRAMMAR_MASKS"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -1601,12 +1636,14 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- partition: like distribute, and split the rows of each weight across the nodes\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggml-org/llama.cpp/issues/1437",
         [](common_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "partition") { params.numa = GGML_NUMA_STRATEGY_PARTITION; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ).set_env("LLAMA_ARG_NUMA"));
@@ -2072,6 +2109,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--threads-sampling"}, "N",
+        string_format("number of threads used to sample the slots after each decode, -1 = one per slot, up to the number of threads (default: %d)", params.n_threads_smpl),
+        [](common_params & params, int value) {
+            params.n_threads_smpl = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_SAMPLING"));
+    add_opt(common_arg(
+        {"--http-epoll"},
+        string_format("multiplex the HTTP connections with an epoll event loop, idle keep-alive connections do not hold a thread (Linux only, not with SSL) (default: %s)", params.http_epoll ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.http_epoll = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_HTTP_EPOLL"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format("min chunk size to attempt reusing from the cache via KV shifting (default: %d)", params.n_cache_reuse),
@@ -2079,6 +2130,41 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format("max number of prompt tokens per batch while other slots are generating, the prompts are interleaved (default: %d, 0 = n_batch)", params.n_prefill),
+        [](common_params & params, int value) {
+            params.n_prefill = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--target-itl"}, "MS",
+        string_format("inter-token latency target in ms, the prefill budget adapts to keep the batches below it (default: %d, 0 = disabled)", params.target_itl),
+        [](common_params & params, int value) {
+            params.target_itl = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TARGET_ITL"));
+    add_opt(common_arg(
+        {"--target-ttft"}, "MS",
+        string_format("time to first token target in ms, prompts waiting for longer are not limited by the prefill budget (default: %d, 0 = disabled)", params.target_ttft),
+        [](common_params & params, int value) {
+            params.target_ttft = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_TARGET_TTFT"));
+    add_opt(common_arg(
+        {"--preempt"},
+        string_format("when the KV cache is full, preempt the most recent slot and resume it once there is room again, instead of failing the requests (default: %s)", params.preempt ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.preempt = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREEMPT"));
+    add_opt(common_arg(
+        {"--swap-space"}, "N",
+        string_format("host memory in MiB to keep the KV cache of the preempted slots, the rest is recomputed when they resume (default: %d)", params.swap_space),
+        [](common_params & params, int value) {
+            params.swap_space = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SWAP_SPACE"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -2118,6 +2204,44 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--prefix-cache-path"}, "PATH",
+        "path to store the KV cache of the prompt prefixes on disk, reused across slots and restarts (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.prefix_cache_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.prefix_cache_path.empty() && params.prefix_cache_path[params.prefix_cache_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.prefix_cache_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_PATH"));
+    add_opt(common_arg(
+        {"--prefix-cache-block"}, "N",
+        string_format("granularity in tokens of the prefixes stored in the prefix cache (default: %d)", params.prefix_cache_block),
+        [](common_params & params, int value) {
+            if (value <= 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.prefix_cache_block = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_BLOCK"));
+    add_opt(common_arg(
+        {"--prefix-cache-size"}, "N",
+        string_format("max size in MiB of the prefix cache, the least recently used prefixes are evicted (default: %d, 0 = unlimited)", params.prefix_cache_size),
+        [](common_params & params, int value) {
+            params.prefix_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_CACHE_SIZE"));
+    add_opt(common_arg(
+        {"--prefix-store"}, "N",
+        string_format("number of prompt prefixes kept in the KV cache after their slots move on, shared by the next prompts that start with them, in extra sequences of the KV cache (default: %d, 0 = disabled)", params.n_prefix_store),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_prefix_store = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFIX_STORE"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
@@ -2409,13 +2533,23 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.n_min = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_MIN"));
+    add_opt(common_arg(
+        {"--draft-branches"}, "N",
+        string_format("max number of branches of the draft tree, verified together in one batch (default: %d, 1 = linear draft)", params.speculative.n_branch),
+        [](common_params & params, int value) {
+            if (value < 1) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.speculative.n_branch = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_BRANCHES"));
     add_opt(common_arg(
         {"--draft-p-split"}, "P",
         string_format("speculative decoding split probability (default: %.1f)", (double)params.speculative.p_split),
         [](common_params & params, const std::string & value) {
             params.speculative.p_split = std::stof(value);
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}).set_env("LLAMA_ARG_DRAFT_P_SPLIT"));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_SPLIT"));
     add_opt(common_arg(
         {"--draft-p-min"}, "P",
         string_format("minimum speculative decoding probability (greedy) (default: %.1f)", (double)params.speculative.p_min),
@@ -2423,6 +2557,20 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.speculative.p_min = std::stof(value);
         }
     ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_MIN"));
+    add_opt(common_arg(
+        {"--draft-batched"},
+        string_format("draft for all slots at once and verify the drafts together with the other tokens of the batch (default: %s)", params.speculative.batched ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.speculative.batched = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_BATCHED"));
+    add_opt(common_arg(
+        {"--draft-lookup"},
+        string_format("by default, draft from the n-grams of the prompt and the generated text instead of a draft model, can be set per request (default: %s)", params.speculative.lookup ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.speculative.lookup = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_LOOKUP"));
     add_opt(common_arg(
         {"-cd", "--ctx-size-draft"}, "N",
         string_format("size of the prompt context for the draft model (default: %d, 0 = loaded from model)", params.speculative.n_ctx),
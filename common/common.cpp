@@ -1083,6 +1083,15 @@ void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adap
     }
 }
 
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora) {
+    llama_clear_adapter_lora_seq(ctx, seq_id);
+    for (auto & la : lora) {
+        if (la.scale != 0.0f) {
+            llama_set_adapter_lora_seq(ctx, seq_id, la.ptr, la.scale);
+        }
+    }
+}
+
 struct llama_model_params common_model_params_to_llama(common_params & params) {
     auto mparams = llama_model_default_params();
 
@@ -1131,6 +1140,9 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.n_grammar_cache   = params.n_grammar_cache;
+    cparams.n_grammar_masks   = params.n_grammar_masks;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1160,6 +1172,7 @@ struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_p
     tpp.prio       = params.priority;
     tpp.poll       = params.poll;
     tpp.strict_cpu = params.strict_cpu;
+    tpp.dep_sched  = params.dep_sched;
 
     return tpp;
 }
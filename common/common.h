@@ -53,6 +53,7 @@ struct cpu_params {
     enum ggml_sched_priority  priority   = GGML_SCHED_PRIO_NORMAL;  // Scheduling prio : (0 - normal, 1 - medium, 2 - high, 3 - realtime)
     bool     strict_cpu                  = false;   // Use strict CPU placement
     uint32_t poll                        = 50;      // Polling (busywait) level (0 - no polling, 100 - mostly polling)
+    bool     dep_sched                   = false;   // Run independent graph nodes between the same barriers
 };
 
 int32_t cpu_get_num_physical_cores();
@@ -191,8 +192,11 @@ struct common_params_speculative {
     int32_t n_max        =    16; // maximum number of tokens to draft during speculative decoding
     int32_t n_min        =     0; // minimum number of draft tokens to use for speculative decoding
     int32_t n_gpu_layers =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
+    int32_t n_branch     =     1; // number of branches of the draft tree, 1 - linear draft
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        = 0.75f; // minimum speculative decoding probability (greedy)
+    bool    batched      = false; // draft for all slots in one draft context and verify the drafts in the main batch
+    bool    lookup       = false; // draft from the n-grams of the context instead of a draft model
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -241,6 +245,9 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t kv_block_size         =     0; // number of cells in a block of the paged KV cache (0 = contiguous KV cache)
+    int32_t n_grammar_cache       =     4; // number of grammars kept compiled for reuse (0 = disabled)
+    int32_t n_grammar_masks       =   256; // number of grammar states with a token mask kept per compiled grammar
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -327,6 +334,7 @@ struct common_params {
     bool flash_attn        = false; // flash attention
     bool no_perf           = false; // disable performance metrics
     bool ctx_shift         = true;  // context shift on inifinite text generation
+    bool preempt           = false; // preempt slots instead of failing when the KV cache is full
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool logits_all        = false; // return logits for all tokens in the batch
@@ -362,7 +370,13 @@ struct common_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    bool    http_epoll     = false;        // multiplex the HTTP connections with an epoll event loop (Linux only)
+    int32_t n_threads_smpl = -1;           // number of threads to sample the slots after each decode (-1 = auto)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_prefill      = 0;            // max prompt tokens per batch while other slots are generating (0 = n_batch)
+    int32_t target_itl     = 0;            // inter-token latency target in ms, adapts the prefill budget (0 = disabled)
+    int32_t target_ttft    = 0;            // time to first token target in ms, older prompts ignore the prefill budget (0 = disabled)
+    int32_t swap_space     = 1024;         // host memory in MiB for the KV cache of the preempted slots
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -386,6 +400,12 @@ struct common_params {
 
     std::string slot_save_path;
 
+    std::string prefix_cache_path;              // directory of the on-disk prompt prefix cache (empty = disabled)
+    int32_t     prefix_cache_block = 256;       // granularity of the stored prefixes, in tokens
+    int32_t     prefix_cache_size  = 4096;      // max size of the prefix cache on disk, in MiB (0 = unlimited)
+
+    int32_t n_prefix_store = 0; // number of prompt prefixes kept in the KV cache after their slots move on (0 = disabled)
+
     float slot_prompt_similarity = 0.5f;
 
     // batched-bench params
@@ -566,6 +586,9 @@ std::pair<std::string, std::string> common_get_hf_file(
 // clear LoRA adapters from context, then apply new list of adapters
 void common_set_adapter_lora(struct llama_context * ctx, std::vector<common_adapter_lora_info> & lora);
 
+// set the adapters of a single sequence, the other sequences of the batch keep theirs
+void common_set_adapter_lora_seq(struct llama_context * ctx, llama_seq_id seq_id, std::vector<common_adapter_lora_info> & lora);
+
 //
 // Batch utils
 //
@@ -2,13 +2,370 @@
 #include "common.h"
 #include "log.h"
 
+#include <cerrno>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <thread>
 #include <algorithm>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#   define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES)
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+#define LLAMA_NGRAM_CACHE_MAGIC   0x6372676eu // 'ngrc'
+#define LLAMA_NGRAM_CACHE_VERSION 1
+
+// the entries are written to and mapped from files as they are
+static_assert(sizeof(common_ngram_cache_entry) == 32, "unexpected common_ngram_cache_entry size");
+static_assert(sizeof(common_ngram_token_count) ==  8, "unexpected common_ngram_token_count size");
+
+struct common_ngram_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t n_table;
+    uint64_t n_used;
+    uint64_t n_pool;
+};
+
+// a list with n tokens has room for pool_capacity(n) tokens in the pool, so it is full when n is a power of 2
+static size_t pool_capacity(size_t n) {
+    size_t capacity = 2;
+    while (capacity < n) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// map a file read-only, nullptr if it cannot be mapped
+static void * ngram_cache_map(const std::string & filename, size_t size) {
+#if defined(_WIN32)
+    GGML_UNUSED(size);
+
+    HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+
+    HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (hMapping == NULL) {
+        return nullptr;
+    }
+
+    void * addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hMapping);
+
+    return addr;
+#elif defined(_POSIX_MAPPED_FILES)
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    void * addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // the n-grams are looked up in no particular order
+    if (posix_madvise(addr, size, POSIX_MADV_RANDOM)) {
+        LOG_WRN("%s: posix_madvise(.., POSIX_MADV_RANDOM) failed: %s\n", __func__, strerror(errno));
+    }
+
+    return addr;
+#else
+    GGML_UNUSED(filename);
+    GGML_UNUSED(size);
+
+    return nullptr;
+#endif
+}
+
+// the list of an entry is within a pool of n_pool tokens - the entries of a file are checked as they are used, so
+// that a large file is not read as a whole when it is loaded
+static bool ngram_cache_entry_in_pool(const common_ngram_cache_entry & entry, size_t n_pool) {
+    return entry.n_tokens <= 1 || (size_t) entry.i_pool + (size_t) entry.n_tokens <= n_pool;
+}
+
+static void ngram_cache_unmap(void * addr, size_t size) {
+#if defined(_WIN32)
+    GGML_UNUSED(size);
+    UnmapViewOfFile(addr);
+#elif defined(_POSIX_MAPPED_FILES)
+    munmap(addr, size);
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+#endif
+}
+
+common_ngram_cache::~common_ngram_cache() {
+    unmap();
+}
+
+common_ngram_cache::common_ngram_cache(const common_ngram_cache & other)
+    : n_table(other.n_table), n_used(other.n_used), table(other.table), pool(other.pool), n_pool_free(other.n_pool_free) {
+    if (other.map_addr) {
+        relayout(other.map_table, other.map_pool, other.map_n_pool);
+    }
+}
+
+common_ngram_cache::common_ngram_cache(common_ngram_cache && other) noexcept {
+    swap(other);
+}
+
+common_ngram_cache & common_ngram_cache::operator=(common_ngram_cache other) noexcept {
+    swap(other);
+    return *this;
+}
+
+void common_ngram_cache::swap(common_ngram_cache & other) noexcept {
+    std::swap(n_table,     other.n_table);
+    std::swap(n_used,      other.n_used);
+    std::swap(table,       other.table);
+    std::swap(pool,        other.pool);
+    std::swap(n_pool_free, other.n_pool_free);
+    std::swap(map_addr,    other.map_addr);
+    std::swap(map_size,    other.map_size);
+    std::swap(map_table,   other.map_table);
+    std::swap(map_pool,    other.map_pool);
+    std::swap(map_n_pool,  other.map_n_pool);
+}
+
+void common_ngram_cache::unmap() {
+    if (map_addr) {
+        ngram_cache_unmap(map_addr, map_size);
+    }
+
+    map_addr  = nullptr;
+    map_size  = 0;
+    map_table  = nullptr;
+    map_pool   = nullptr;
+    map_n_pool = 0;
+}
+
+void common_ngram_cache::clear() {
+    unmap();
+
+    table.clear();
+    pool.clear();
+
+    n_table     = 0;
+    n_used      = 0;
+    n_pool_free = 0;
+}
+
+const common_ngram_cache_entry * common_ngram_cache::find(const common_ngram & ngram) const {
+    if (n_used == 0) {
+        return nullptr;
+    }
+
+    const size_t pos = find_pos(ngram);
+    if (pos == n_table) {
+        return nullptr;
+    }
+
+    const common_ngram_cache_entry & entry = entries()[pos];
+
+    // the entries of a corrupted file are dropped
+    return entry.n_tokens > 0 && in_pool(entry) ? &entry : nullptr;
+}
+
+bool common_ngram_cache::in_pool(const common_ngram_cache_entry & entry) const {
+    return ngram_cache_entry_in_pool(entry, map_pool ? map_n_pool : pool.size());
+}
+
+const common_ngram_token_count * common_ngram_cache::get_tokens(const common_ngram_cache_entry & entry) const {
+    if (!in_pool(entry)) {
+        return nullptr;
+    }
+
+    return entry.n_tokens == 1 ? &entry.token : pool_data() + entry.i_pool;
+}
+
+int32_t common_ngram_cache::get_count(const common_ngram_cache_entry & entry, llama_token token) const {
+    if (entry.n_tokens <= 0 || !in_pool(entry)) {
+        return 0;
+    }
+
+    const common_ngram_token_count * begin = get_tokens(entry);
+    const common_ngram_token_count * end   = begin + entry.n_tokens;
+
+    const common_ngram_token_count * it = std::lower_bound(begin, end, token,
+        [](const common_ngram_token_count & tc, llama_token t) { return tc.token < t; });
+
+    return it != end && it->token == token ? it->count : 0;
+}
+
+void common_ngram_cache::add(const common_ngram & ngram, llama_token token, int32_t count) {
+    if (map_addr) {
+        // the lists of a mapped file have no room to grow
+        relayout(map_table, map_pool, map_n_pool);
+        unmap();
+    }
+
+    if ((n_used + 1)*4 > n_table*3) {
+        resize(std::max<size_t>(256, 2*n_table));
+    }
+
+    common_ngram_cache_entry & entry = table[find_pos(ngram)];
+
+    if (entry.n_tokens == 0) {
+        entry.ngram    = ngram;
+        entry.n_tokens = 1;
+        entry.i_pool   = 0;
+        entry.token    = { token, count };
+        n_used++;
+        return;
+    }
+
+    if (entry.n_tokens == 1) {
+        if (entry.token.token == token) {
+            entry.token.count += count;
+            return;
+        }
+
+        const uint32_t i_pool = pool_alloc(2);
+
+        pool[i_pool + 0] = entry.token.token < token ? entry.token : common_ngram_token_count { token, count };
+        pool[i_pool + 1] = entry.token.token < token ? common_ngram_token_count { token, count } : entry.token;
+
+        entry.n_tokens = 2;
+        entry.i_pool   = i_pool;
+        return;
+    }
+
+    const size_t n_tokens = entry.n_tokens;
+
+    common_ngram_token_count * tokens = pool.data() + entry.i_pool;
+
+    const size_t k = std::lower_bound(tokens, tokens + n_tokens, token,
+        [](const common_ngram_token_count & tc, llama_token t) { return tc.token < t; }) - tokens;
+
+    if (k < n_tokens && tokens[k].token == token) {
+        tokens[k].count += count;
+        return;
+    }
+
+    if (n_tokens == pool_capacity(n_tokens)) {
+        // the list is full, move it to the end of the pool with twice the room
+        const uint32_t i_pool = pool_alloc(2*n_tokens);
+
+        std::copy(pool.begin() + entry.i_pool, pool.begin() + entry.i_pool + n_tokens, pool.begin() + i_pool);
+
+        entry.i_pool = i_pool;
+        n_pool_free += n_tokens;
+    }
+
+    tokens = pool.data() + entry.i_pool;
+
+    std::copy_backward(tokens + k, tokens + n_tokens, tokens + n_tokens + 1);
+    tokens[k] = { token, count };
+
+    entry.n_tokens++;
+
+    // compact the pool once most of it has been left behind
+    if (n_pool_free > 4096 && 2*n_pool_free > pool.size()) {
+        relayout(table.data(), pool.data(), pool.size());
+    }
+}
+
+void common_ngram_cache::relayout(const common_ngram_cache_entry * src_table, const common_ngram_token_count * src_pool, size_t n_src_pool) {
+    std::vector<common_ngram_cache_entry> table_new(src_table, src_table + n_table);
+    std::vector<common_ngram_token_count> pool_new;
+
+    // the entries of a mapped file were not checked when it was loaded, the corrupted ones are dropped here
+    n_used = 0;
+
+    for (common_ngram_cache_entry & entry : table_new) {
+        if (entry.n_tokens < 0 || !ngram_cache_entry_in_pool(entry, n_src_pool)) {
+            entry = common_ngram_cache_entry();
+        }
+
+        n_used += entry.n_tokens > 0;
+
+        if (entry.n_tokens <= 1) {
+            continue;
+        }
+
+        const size_t i_pool = pool_new.size();
+        GGML_ASSERT(i_pool + pool_capacity(entry.n_tokens) <= UINT32_MAX);
+
+        pool_new.insert(pool_new.end(), src_pool + entry.i_pool, src_pool + entry.i_pool + entry.n_tokens);
+        pool_new.resize(i_pool + pool_capacity(entry.n_tokens));
+
+        entry.i_pool = (uint32_t) i_pool;
+    }
+
+    table.swap(table_new);
+    pool.swap(pool_new);
+
+    n_pool_free = 0;
+}
+
+size_t common_ngram_cache::find_pos(const common_ngram & ngram) const {
+    const common_ngram_cache_entry * data = entries();
+
+    const size_t mask = n_table - 1;
+
+    // note: the table of a corrupted file can be full, so the probing stops after n_table entries
+    size_t pos = common_ngram_hash_function{}(ngram) & mask;
+    for (size_t i = 0; i < n_table; ++i) {
+        if (data[pos].n_tokens <= 0 || data[pos].ngram == ngram) {
+            return pos;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    return n_table;
+}
+
+void common_ngram_cache::resize(size_t n_table_new) {
+    GGML_ASSERT((n_table_new & (n_table_new - 1)) == 0);
+
+    std::vector<common_ngram_cache_entry> table_new(n_table_new);
+
+    const size_t mask = n_table_new - 1;
+
+    for (const common_ngram_cache_entry & entry : table) {
+        if (entry.n_tokens == 0) {
+            continue;
+        }
+
+        size_t pos = common_ngram_hash_function{}(entry.ngram) & mask;
+        while (table_new[pos].n_tokens > 0) {
+            pos = (pos + 1) & mask;
+        }
+        table_new[pos] = entry;
+    }
+
+    table.swap(table_new);
+    n_table = n_table_new;
+}
+
+uint32_t common_ngram_cache::pool_alloc(size_t n) {
+    const size_t i_pool = pool.size();
+    GGML_ASSERT(i_pool + n <= UINT32_MAX);
+
+    pool.resize(i_pool + n);
+
+    return (uint32_t) i_pool;
+}
+
 void common_ngram_cache_update(common_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
                               std::vector<llama_token> & inp, int nnew, bool print_progress) {
     const int64_t t_start_ms = ggml_time_ms();
@@ -24,19 +381,7 @@ void common_ngram_cache_update(common_ngram_cache & ngram_cache, int ngram_min,
             common_ngram ngram(&inp[ngram_start], ngram_size);
             const llama_token token = inp[i];
 
-            common_ngram_cache::iterator part_it = ngram_cache.find(ngram);
-            if (part_it == ngram_cache.end()) {
-                common_ngram_cache_part part;
-                part.emplace(token, 1);
-                ngram_cache.emplace(ngram, part);
-            } else {
-                common_ngram_cache_part::iterator token_count_it = part_it->second.find(token);
-                if (token_count_it == part_it->second.end()) {
-                    part_it->second.emplace(token, 1);
-                } else {
-                    token_count_it->second++;
-                }
-            }
+            ngram_cache.add(ngram, token, 1);
             ++n_done;
 
             if (print_progress && n_done % 10000000 == 0) {
@@ -64,19 +409,19 @@ constexpr int     draft_min_percent_strict[LLAMA_NGRAM_MAX] = {75, 66, 66, 66};
 
 // Helper function that tries to draft a token from only the static ngram cache:
 static llama_token try_draft(common_ngram_cache & nc_static, const common_ngram ngram_static) {
-    common_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-    if (part_static_it == nc_static.end()) {
+    const common_ngram_cache_entry * entry_static = nc_static.find(ngram_static);
+    if (entry_static == nullptr) {
         return LLAMA_TOKEN_NULL;
     }
-    const common_ngram_cache_part part_static = part_static_it->second;
+    const common_ngram_token_count * tokens_static = nc_static.get_tokens(*entry_static);
 
     int max_count_static  = 0;
     int sum_count_static  = 0;
     llama_token max_token = LLAMA_TOKEN_NULL;
 
-    for (std::pair<llama_token, int> token_count_static : part_static) {
-        const llama_token token = token_count_static.first;
-        const int32_t count_static  = token_count_static.second;
+    for (int i = 0; i < entry_static->n_tokens; ++i) {
+        const llama_token token = tokens_static[i].token;
+        const int32_t count_static  = tokens_static[i].count;
 
         if (count_static > max_count_static) {
             max_token        = token;
@@ -96,7 +441,8 @@ static llama_token try_draft(common_ngram_cache & nc_static, const common_ngram
 
 // Try to draft a token from primary cache (context/dynamic), validate with static cache:
 static llama_token try_draft(
-    common_ngram_cache & nc_primary, const std::vector<common_ngram> & ngrams_primary, common_ngram_cache_part & part_static,
+    common_ngram_cache & nc_primary, const std::vector<common_ngram> & ngrams_primary,
+    common_ngram_cache & nc_static, const common_ngram_cache_entry * entry_static,
     const int * min_sample_size, const int * min_percent) {
 
     llama_token drafted_token = LLAMA_TOKEN_NULL;
@@ -104,24 +450,24 @@ static llama_token try_draft(
     for (int i = ngrams_primary.size()-1; i >= 0 && drafted_token == LLAMA_TOKEN_NULL; --i) {
         const common_ngram ngram_primary = ngrams_primary[i];
 
-        common_ngram_cache::iterator part_primary_it = nc_primary.find(ngram_primary);
-        if (part_primary_it == nc_primary.end()) {
+        const common_ngram_cache_entry * entry_primary = nc_primary.find(ngram_primary);
+        if (entry_primary == nullptr) {
             continue;
         }
-        const common_ngram_cache_part part_primary = part_primary_it->second;
+        const common_ngram_token_count * tokens_primary = nc_primary.get_tokens(*entry_primary);
 
         int max_count_primary = 0;
         int max_count_static  = 0;
         int sum_count_primary = 0;
         llama_token max_token = LLAMA_TOKEN_NULL;
 
-        for (std::pair<llama_token, int> token_count_primary : part_primary) {
-            const llama_token token = token_count_primary.first;
+        for (int j = 0; j < entry_primary->n_tokens; ++j) {
+            const llama_token token = tokens_primary[j].token;
 
-            common_ngram_cache_part::iterator token_count_static_it = part_static.find(token);
+            const int32_t token_count_static = entry_static != nullptr ? nc_static.get_count(*entry_static, token) : 0;
 
-            const int32_t count_primary = token_count_primary.second;
-            const int32_t count_static  = token_count_static_it != part_static.end() ? 100*token_count_static_it->second : 1;
+            const int32_t count_primary = tokens_primary[j].count;
+            const int32_t count_static  = token_count_static > 0 ? 100*token_count_static : 1;
 
             if (count_primary*count_static > max_count_primary*max_count_static) {
                 max_token         = token;
@@ -162,11 +508,7 @@ void common_ngram_cache_draft(
         for (int j = ngram_start_static; j < ngram_start_static + LLAMA_NGRAM_STATIC; ++j) {
             ngram_static.tokens[j-ngram_start_static] = get_token(inp, draft, j);
         }
-        common_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-        common_ngram_cache_part part_static;
-        if (part_static_it != nc_static.end()) {
-            part_static = part_static_it->second;
-        }
+        const common_ngram_cache_entry * entry_static = nc_static.find(ngram_static);
 
         // cd = context + dynamic
         std::vector<common_ngram> ngrams_cd;
@@ -179,10 +521,10 @@ void common_ngram_cache_draft(
             ngrams_cd.push_back(ngram_cd);
         }
         if (drafted_token == LLAMA_TOKEN_NULL) {
-            drafted_token = try_draft(nc_context, ngrams_cd, part_static, draft_min_sample_size_lax, draft_min_percent_lax);
+            drafted_token = try_draft(nc_context, ngrams_cd, nc_static, entry_static, draft_min_sample_size_lax, draft_min_percent_lax);
         }
         if (drafted_token == LLAMA_TOKEN_NULL) {
-            drafted_token = try_draft(nc_dynamic, ngrams_cd, part_static, draft_min_sample_size_strict, draft_min_percent_strict);
+            drafted_token = try_draft(nc_dynamic, ngrams_cd, nc_static, entry_static, draft_min_sample_size_strict, draft_min_percent_strict);
         }
         if (drafted_token == LLAMA_TOKEN_NULL) {
             drafted_token = try_draft(nc_static, ngram_static);
@@ -192,32 +534,54 @@ void common_ngram_cache_draft(
             break;
         }
 
-        LOG(" - draft candidate: token=%d\n", drafted_token);
+        LOG_DBG(" - draft candidate: token=%d\n", drafted_token);
         draft.push_back(drafted_token);
     }
 }
 
 void common_ngram_cache_save(common_ngram_cache & ngram_cache, std::string & filename) {
+    const size_t n_table = ngram_cache.n_entries();
+    const common_ngram_cache_entry * entries = ngram_cache.entries();
+
+    // the lists are written without the room to grow, the corrupted entries of a mapped file are written empty
+    size_t n_pool = 0;
+    size_t n_used = 0;
+    for (size_t i = 0; i < n_table; ++i) {
+        if (entries[i].n_tokens > 0 && ngram_cache.in_pool(entries[i])) {
+            n_pool += entries[i].n_tokens > 1 ? entries[i].n_tokens : 0;
+            n_used += 1;
+        }
+    }
+    GGML_ASSERT(n_pool <= UINT32_MAX);
+
+    common_ngram_cache_header header;
+    header.magic   = LLAMA_NGRAM_CACHE_MAGIC;
+    header.version = LLAMA_NGRAM_CACHE_VERSION;
+    header.n_table = n_table;
+    header.n_used  = n_used;
+    header.n_pool  = n_pool;
+
     std::ofstream file_out(filename, std::ios::binary);
-    for (std::pair<common_ngram, common_ngram_cache_part> item : ngram_cache) {
-        const common_ngram      ngram        = item.first;
-        common_ngram_cache_part token_counts = item.second;
-        GGML_ASSERT(!token_counts.empty());
-        const int32_t ntokens = token_counts.size();
-        GGML_ASSERT(ntokens > 0);
+    file_out.write(reinterpret_cast<const char *>(&header), sizeof(header));
 
-        file_out.write(reinterpret_cast<const char *>(&ngram),   sizeof(common_ngram));
-        file_out.write(reinterpret_cast<const char *>(&ntokens), sizeof(int32_t));
-        for (std::pair<llama_token, int32_t> item2 : token_counts) {
-            const llama_token token = item2.first;
-            const int32_t     count = item2.second;
-            GGML_ASSERT(count > 0);
+    uint32_t i_pool = 0;
+    for (size_t i = 0; i < n_table; ++i) {
+        common_ngram_cache_entry entry = entries[i];
+        if (entry.n_tokens < 0 || !ngram_cache.in_pool(entry)) {
+            entry = common_ngram_cache_entry();
+        }
+        if (entry.n_tokens > 1) {
+            entry.i_pool = i_pool;
+            i_pool += entry.n_tokens;
+        }
 
-            file_out.write(reinterpret_cast<const char *>(&token), sizeof(llama_token));
-            file_out.write(reinterpret_cast<const char *>(&count), sizeof(int32_t));
+        file_out.write(reinterpret_cast<const char *>(&entry), sizeof(common_ngram_cache_entry));
+    }
+    for (size_t i = 0; i < n_table; ++i) {
+        if (entries[i].n_tokens > 1 && ngram_cache.in_pool(entries[i])) {
+            file_out.write(reinterpret_cast<const char *>(ngram_cache.get_tokens(entries[i])), entries[i].n_tokens*sizeof(common_ngram_token_count));
         }
     }
-
 }
 
 common_ngram_cache common_ngram_cache_load(std::string & filename) {
@@ -227,6 +591,63 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
     }
     common_ngram_cache ngram_cache;
 
+    common_ngram_cache_header header;
+    if (hashmap_file.read(reinterpret_cast<char *>(&header), sizeof(header)) && header.magic == LLAMA_NGRAM_CACHE_MAGIC) {
+        if (header.version != LLAMA_NGRAM_CACHE_VERSION) {
+            throw std::ifstream::failure("Unsupported ngram cache version " + std::to_string(header.version) + " in " + filename);
+        }
+
+        hashmap_file.seekg(0, std::ios::end);
+        const size_t file_size = hashmap_file.tellg();
+
+        const size_t offs_table = sizeof(header);
+        const size_t offs_pool  = offs_table + header.n_table*sizeof(common_ngram_cache_entry);
+
+        if ((header.n_table & (header.n_table - 1)) != 0 || header.n_used >= std::max<uint64_t>(header.n_table, 1) ||
+            header.n_pool > UINT32_MAX || file_size != offs_pool + header.n_pool*sizeof(common_ngram_token_count)) {
+            throw std::ifstream::failure("Corrupted ngram cache " + filename);
+        }
+
+        ngram_cache.n_table = header.n_table;
+        ngram_cache.n_used  = header.n_used;
+
+        if (header.n_table == 0) {
+            return ngram_cache;
+        }
+
+        void * addr = ngram_cache_map(filename, file_size);
+        if (addr != nullptr) {
+            ngram_cache.map_addr  = addr;
+            ngram_cache.map_size  = file_size;
+            ngram_cache.map_table = reinterpret_cast<const common_ngram_cache_entry *>(static_cast<const char *>(addr) + offs_table);
+            ngram_cache.map_pool  = reinterpret_cast<const common_ngram_token_count *>(static_cast<const char *>(addr) + offs_pool);
+
+            ngram_cache.map_n_pool = header.n_pool;
+        } else {
+            // the file cannot be mapped, read it instead
+            LOG_WRN("%s: failed to map %s, reading it into memory\n", __func__, filename.c_str());
+
+            ngram_cache.table.resize(header.n_table);
+            ngram_cache.pool.resize(header.n_pool);
+
+            hashmap_file.seekg(offs_table);
+            hashmap_file.read(reinterpret_cast<char *>(ngram_cache.table.data()), header.n_table*sizeof(common_ngram_cache_entry));
+            hashmap_file.read(reinterpret_cast<char *>(ngram_cache.pool.data()),  header.n_pool*sizeof(common_ngram_token_count));
+            if (!hashmap_file) {
+                throw std::ifstream::failure("Unable to read file " + filename);
+            }
+
+            // the lists have no room to grow yet
+            ngram_cache.relayout(ngram_cache.table.data(), ngram_cache.pool.data(), ngram_cache.pool.size());
+        }
+
+        return ngram_cache;
+    }
+
+    // older files are a list of n-grams, each followed by its tokens and their counts
+    hashmap_file.clear();
+    hashmap_file.seekg(0);
+
     common_ngram ngram;
     int32_t     ntokens;
     llama_token token;
@@ -240,7 +661,6 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
         GGML_ASSERT(!hashmap_file.eof());
         GGML_ASSERT(hashmap_file.read(ntokensc, sizeof(int32_t)));
         GGML_ASSERT(ntokens > 0);
-        common_ngram_cache_part token_counts;
 
         for (int i = 0; i < ntokens; ++i) {
             GGML_ASSERT(!hashmap_file.eof());
@@ -248,10 +668,8 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
             GGML_ASSERT(!hashmap_file.eof());
             GGML_ASSERT(hashmap_file.read(countc, sizeof(int32_t)));
             GGML_ASSERT(count > 0);
-            token_counts.emplace(token, count);
+            ngram_cache.add(ngram, token, count);
         }
-
-        ngram_cache.emplace(ngram, token_counts);
     }
     GGML_ASSERT(hashmap_file.eof());
 
@@ -259,28 +677,18 @@ common_ngram_cache common_ngram_cache_load(std::string & filename) {
 }
 
 void common_ngram_cache_merge(common_ngram_cache & ngram_cache_target, common_ngram_cache & ngram_cache_add) {
-    for (std::pair<common_ngram, common_ngram_cache_part> ngram_part : ngram_cache_add) {
-        const common_ngram      ngram = ngram_part.first;
-        common_ngram_cache_part  part = ngram_part.second;
+    const common_ngram_cache_entry * entries = ngram_cache_add.entries();
 
-        common_ngram_cache::iterator part_merged_it = ngram_cache_target.find(ngram);
-        if (part_merged_it == ngram_cache_target.end()) {
-            ngram_cache_target.emplace(ngram, part);
+    for (size_t i = 0; i < ngram_cache_add.n_entries(); ++i) {
+        const common_ngram_cache_entry & entry = entries[i];
+        if (entry.n_tokens <= 0 || !ngram_cache_add.in_pool(entry)) {
             continue;
         }
 
-        for (std::pair<llama_token, int32_t> token_count : part) {
-            const llama_token token = token_count.first;
-            const int32_t     count = token_count.second;
-            GGML_ASSERT(count > 0);
-
-            common_ngram_cache_part::iterator token_count_merged_it = part_merged_it->second.find(token);
-            if (token_count_merged_it == part_merged_it->second.end()) {
-                part_merged_it->second.emplace(token, count);
-                continue;
-            }
-
-            token_count_merged_it->second += count;
+        const common_ngram_token_count * tokens = ngram_cache_add.get_tokens(entry);
+        for (int j = 0; j < entry.n_tokens; ++j) {
+            GGML_ASSERT(tokens[j].count > 0);
+            ngram_cache_target.add(entry.ngram, tokens[j].token, tokens[j].count);
         }
     }
 }
@@ -2,7 +2,8 @@
 
 #include "llama.h"
 
-#include <unordered_map>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -46,19 +47,111 @@ struct common_token_hash_function {
 
 struct common_ngram_hash_function {
     size_t operator()(const common_ngram & ngram) const {
-        size_t hash = common_token_hash_function{}(ngram.tokens[0]);
-        for (int i = 1; i < LLAMA_NGRAM_MAX; ++i) {
-            hash ^= common_token_hash_function{}(ngram.tokens[i]);
+        // the order of the tokens matters, and the low bits are used to index the open-addressing table
+        uint64_t hash = 0;
+        for (int i = 0; i < LLAMA_NGRAM_MAX; ++i) {
+            hash = (hash ^ (uint32_t) ngram.tokens[i]) * 11400714819323198485llu;
         }
-        return hash;
+        return hash ^ (hash >> 32);
     }
 };
 
-// token -> number of times token has been seen
-typedef std::unordered_map<llama_token, int32_t> common_ngram_cache_part;
+// a token that follows an n-gram and the number of times it has been seen
+struct common_ngram_token_count {
+    llama_token token;
+    int32_t     count;
+};
+
+// an n-gram and the tokens that follow it
+struct common_ngram_cache_entry {
+    common_ngram ngram;
+
+    int32_t  n_tokens = 0; // number of distinct tokens that follow the n-gram, 0 for an empty entry
+    uint32_t i_pool   = 0; // n_tokens > 1: the index of the tokens in the pool of the cache
+
+    common_ngram_token_count token = { LLAMA_TOKEN_NULL, 0 }; // n_tokens == 1: the only token
+};
 
 // n-gram -> empirical distribution of following tokens
-typedef std::unordered_map<common_ngram, common_ngram_cache_part, common_ngram_hash_function> common_ngram_cache;
+//
+// the n-grams are kept in a flat open-addressing table with linear probing - an n-gram that is always followed by the
+// same token keeps it inline, the others point to a list in a shared pool, sorted by token
+// note: only one (token, count) pair fits inline next to the 16 bytes of the n-gram in a 32-byte entry. two pairs
+//       would need 16-bit counts and would break get_tokens, which returns the pairs as they are stored (also in a
+//       mapped file). most n-grams of a large corpus have a single follower, so most lookups stay in the table
+// a cache loaded from a file maps the file as is, it is copied to memory only when it is updated
+struct common_ngram_cache {
+public:
+    common_ngram_cache() = default;
+    ~common_ngram_cache();
+
+    common_ngram_cache(const common_ngram_cache & other);
+    common_ngram_cache(common_ngram_cache && other) noexcept;
+
+    common_ngram_cache & operator=(common_ngram_cache other) noexcept;
+
+    size_t size()  const { return n_used; }
+    bool   empty() const { return n_used == 0; }
+
+    void clear();
+
+    // the entry of an n-gram, nullptr if the n-gram has not been seen
+    const common_ngram_cache_entry * find(const common_ngram & ngram) const;
+
+    // false if the list of an entry is out of the pool, i.e. the entry comes from a corrupted file
+    // (the entries of a mapped file are only checked when they are used)
+    bool in_pool(const common_ngram_cache_entry & entry) const;
+
+    // the tokens that follow the n-gram of an entry, sorted by token, nullptr if the entry is not in_pool
+    const common_ngram_token_count * get_tokens(const common_ngram_cache_entry & entry) const;
+
+    // the number of times a token has followed the n-gram of an entry, 0 if the entry is not in_pool
+    int32_t get_count(const common_ngram_cache_entry & entry, llama_token token) const;
+
+    // count token count more times after ngram
+    void add(const common_ngram & ngram, llama_token token, int32_t count);
+
+    // all the entries of the table, including the empty ones
+    const common_ngram_cache_entry * entries()   const { return map_table ? map_table : table.data(); }
+    size_t                           n_entries() const { return n_table; }
+
+private:
+    friend common_ngram_cache common_ngram_cache_load(std::string & filename);
+
+    size_t n_table = 0; // power of 2
+    size_t n_used  = 0;
+
+    // the owned table and pool
+    std::vector<common_ngram_cache_entry> table;
+    std::vector<common_ngram_token_count> pool;
+
+    size_t n_pool_free = 0; // the entries of the pool left behind by lists that have grown
+
+    // the table and pool of a mapped file - the lists in the pool have no room to grow
+    void * map_addr = nullptr;
+    size_t map_size = 0;
+
+    const common_ngram_cache_entry * map_table  = nullptr;
+    const common_ngram_token_count * map_pool   = nullptr;
+    size_t                           map_n_pool = 0;
+
+    const common_ngram_token_count * pool_data() const { return map_pool ? map_pool : pool.data(); }
+
+    void swap(common_ngram_cache & other) noexcept;
+    void unmap();
+
+    // copy the table and the lists to a new pool, with room for each list to grow, and drop the entries whose list is
+    // out of the n_src_pool tokens of src_pool
+    void relayout(const common_ngram_cache_entry * src_table, const common_ngram_token_count * src_pool, size_t n_src_pool);
+
+    // the index of the entry of an n-gram, or of the empty entry where it would go
+    // n_table if the table is full (only for a corrupted file)
+    size_t find_pos(const common_ngram & ngram) const;
+
+    void resize(size_t n_table_new);
+
+    uint32_t pool_alloc(size_t n);
+};
 
 
 // Update an ngram cache with tokens.
@@ -88,11 +181,17 @@ void common_ngram_cache_draft(
 // Save an ngram cache to a file.
 // ngram_cache: the ngram cache to save.
 // filename:    the path under which to save the ngram cache.
+//
+// The file holds the table and the pool of the cache as they are in memory, so that it can be mapped when loaded.
 void common_ngram_cache_save(common_ngram_cache & ngram_cache, std::string & filename);
 
 // Load an ngram cache saved with common_ngram_cache_save.
 // filename: the path from which to load the ngram cache.
 // returns:  an ngram cache containing the information saved to filename.
+//
+// The file is memory-mapped, files in the older format of a list of n-grams are read into memory.
+// Throws std::ifstream::failure if the file cannot be opened, is not an ngram cache or its header is corrupted.
+// The entries are not read when the file is loaded, the corrupted ones are ignored when they are looked up.
 common_ngram_cache common_ngram_cache_load(std::string & filename);
 
 // Merge two ngram caches.
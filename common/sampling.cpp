@@ -127,6 +127,22 @@ struct common_sampler {
 
         cur_p = { cur.data(), cur.size(), -1, false };
     }
+
+    // apply the sampling chain directly to the logits - only the candidates that are left are written to cur
+    void apply_chain(struct llama_context * ctx, int idx) {
+        const auto * logits = llama_get_logits_ith(ctx, idx);
+
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        cur.resize(n_vocab);
+
+        cur_p = { cur.data(), cur.size(), -1, false };
+
+        llama_sampler_apply_logits(chain, logits, n_vocab, &cur_p);
+    }
 };
 
 std::string common_params_sampling::print() const {
@@ -319,8 +335,8 @@ struct common_sampler * common_sampler_clone(common_sampler * gsmpl) {
         /* .grmr   = */ llama_sampler_clone(gsmpl->grmr),
         /* .chain  = */ llama_sampler_clone(gsmpl->chain),
         /* .prev   = */ gsmpl->prev,
-        /* .cur    = */ gsmpl->cur,
-        /* .cur_p  = */ gsmpl->cur_p,
+        /* .cur    = */ {}, // the candidates are set again before each sampling, no need to copy them
+        /* .cur_p  = */ {},
     };
 }
 
@@ -336,17 +352,19 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
-
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
-    auto & cur_p = gsmpl->cur_p; // initialized by set_logits
+    auto & cur_p = gsmpl->cur_p; // initialized by set_logits or apply_chain
 
     if (grammar_first) {
-        llama_sampler_apply(grmr, &cur_p);
-    }
+        gsmpl->set_logits(ctx, idx);
 
-    llama_sampler_apply(chain, &cur_p);
+        llama_sampler_apply(grmr,  &cur_p);
+        llama_sampler_apply(chain, &cur_p);
+    } else {
+        // the grammar only checks the sampled token, so the chain does not need all the candidates
+        gsmpl->apply_chain(ctx, idx);
+    }
 
     GGML_ASSERT(cur_p.selected != -1 && "no selected token during sampling - check your sampling configuration");
 
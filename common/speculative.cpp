@@ -10,21 +10,26 @@
 #define SPEC_VOCAB_MAX_SIZE_DIFFERENCE  128
 #define SPEC_VOCAB_CHECK_START_TOKEN_ID 5
 
+struct common_speculative_seq {
+    struct common_sampler * smpl = nullptr;
+
+    llama_tokens prompt; // the tokens in the KV cache of the sequence
+};
+
 struct common_speculative {
     struct llama_context * ctx;
-    struct common_sampler * smpl;
 
     llama_batch batch;
-    llama_tokens prompt;
+
+    std::vector<common_speculative_seq> seqs;
 };
 
 struct common_speculative * common_speculative_init(
         struct llama_context * ctx_dft) {
     auto * result = new common_speculative {
         /* .ctx    = */ ctx_dft,
-        /* .smpl   = */ nullptr,
         /* .batch  = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
-        /* .prompt = */ {},
+        /* .seqs   = */ std::vector<common_speculative_seq>(llama_n_seq_max(ctx_dft)),
     };
 
     // TODO: optimize or pass from outside?
@@ -42,7 +47,9 @@ struct common_speculative * common_speculative_init(
             COMMON_SAMPLER_TYPE_INFILL,
         };
 
-        result->smpl = common_sampler_init(llama_get_model(ctx_dft), params);
+        for (auto & seq : result->seqs) {
+            seq.smpl = common_sampler_init(llama_get_model(ctx_dft), params);
+        }
     }
 #else
     {
@@ -55,7 +62,9 @@ struct common_speculative * common_speculative_init(
             COMMON_SAMPLER_TYPE_TOP_K,
         };
 
-        result->smpl = common_sampler_init(llama_get_model(ctx_dft), params);
+        for (auto & seq : result->seqs) {
+            seq.smpl = common_sampler_init(llama_get_model(ctx_dft), params);
+        }
     }
 #endif
 
@@ -67,7 +76,9 @@ void common_speculative_free(struct common_speculative * spec) {
         return;
     }
 
-    common_sampler_free(spec->smpl);
+    for (auto & seq : spec->seqs) {
+        common_sampler_free(seq.smpl);
+    }
 
     llama_batch_free(spec->batch);
 
@@ -134,20 +145,23 @@ bool common_speculative_are_compatible(
     return true;
 }
 
-llama_tokens common_speculative_gen_draft(
+// bring sequence 0 of the draft context up to date with prompt_tgt and evaluate id_last
+// returns false if the target agreed with the previous draft - it is then passed back in result
+static bool common_speculative_begin(
         struct common_speculative * spec,
-        struct common_speculative_params params,
+        const struct common_speculative_params & params,
         const llama_tokens & prompt_tgt,
-        llama_token id_last) {
+        llama_token id_last,
+        llama_tokens & result) {
     auto & batch  = spec->batch;
     auto & ctx    = spec->ctx;
-    auto & smpl   = spec->smpl;
-    auto & prompt = spec->prompt;
+    auto & prompt = spec->seqs[0].prompt;
 
     int reuse_i = 0;
     int reuse_n = 0;
 
-    const int n_ctx = llama_n_ctx(ctx) - params.n_draft;
+    // leave room for all the branches of a tree
+    const int n_ctx = llama_n_ctx(ctx) - params.n_draft*std::max(1, params.n_branch);
 
     const int i_start = std::max<int>(0, (int) prompt_tgt.size() - n_ctx);
 
@@ -169,9 +183,6 @@ llama_tokens common_speculative_gen_draft(
 
     LOG_DBG("%s: reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, reuse_i, reuse_n, (int) prompt.size());
 
-    llama_tokens result;
-    result.reserve(params.n_draft);
-
     if (reuse_n == 0) {
         llama_kv_self_clear(ctx);
 
@@ -188,7 +199,7 @@ llama_tokens common_speculative_gen_draft(
                 }
             }
 
-            return result;
+            return false;
         }
 
         if (reuse_i > 0) {
@@ -235,6 +246,31 @@ llama_tokens common_speculative_gen_draft(
 
     llama_decode(ctx, batch);
 
+    return true;
+}
+
+llama_tokens common_speculative_gen_draft(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last) {
+    auto & batch  = spec->batch;
+    auto & ctx    = spec->ctx;
+    auto & smpl   = spec->seqs[0].smpl;
+    auto & prompt = spec->seqs[0].prompt;
+
+    params.n_branch = 1;
+
+    llama_tokens result;
+    result.reserve(params.n_draft);
+
+    if (!common_speculative_begin(spec, params, prompt_tgt, id_last, result)) {
+        return result;
+    }
+
+    // the position of id_last
+    const llama_pos n_past = prompt.size() - 1;
+
     common_sampler_reset(smpl);
 
     // sample n_draft tokens from the draft model
@@ -276,3 +312,298 @@ llama_tokens common_speculative_gen_draft(
 
     return result;
 }
+
+void common_speculative_gen_drafts(
+        struct common_speculative * spec,
+        std::vector<common_speculative_draft> & drafts) {
+    auto & batch = spec->batch;
+    auto & ctx   = spec->ctx;
+
+    const int n_ctx_seq = llama_n_ctx(ctx) / llama_n_seq_max(ctx);
+
+    // index of the last token of each draft in the batch, -1 once the draft is complete
+    std::vector<int> i_batch(drafts.size(), -1);
+
+    // bring the sequences up to date with the target and evaluate the last tokens
+    common_batch_clear(batch);
+
+    for (size_t k = 0; k < drafts.size(); ++k) {
+        auto & draft = drafts[k];
+        auto & seq   = spec->seqs[draft.seq_id];
+
+        const llama_tokens & prompt_tgt = *draft.prompt_tgt;
+
+        draft.result.clear();
+
+        if ((int) prompt_tgt.size() + 1 + draft.params.n_draft > n_ctx_seq ||
+            batch.n_tokens + (int) prompt_tgt.size() + 1 > (int) llama_n_batch(ctx)) {
+            continue;
+        }
+
+        const size_t n_reuse = common_lcp(seq.prompt, prompt_tgt);
+
+        llama_kv_self_seq_rm(ctx, draft.seq_id, n_reuse, -1);
+        seq.prompt.resize(n_reuse);
+
+        for (size_t i = n_reuse; i < prompt_tgt.size(); ++i) {
+            common_batch_add(batch, prompt_tgt[i], i, { draft.seq_id }, false);
+
+            seq.prompt.push_back(prompt_tgt[i]);
+        }
+
+        common_batch_add(batch, draft.id_last, seq.prompt.size(), { draft.seq_id }, true);
+
+        seq.prompt.push_back(draft.id_last);
+
+        i_batch[k] = batch.n_tokens - 1;
+
+        common_sampler_reset(seq.smpl);
+    }
+
+    // sample the drafts one token at a time, all the sequences in one decode per step
+    while (batch.n_tokens > 0) {
+        if (llama_decode(ctx, batch) != 0) {
+            LOG_WRN("%s: failed to decode the draft batch, n_tokens = %d\n", __func__, batch.n_tokens);
+
+            // the state of the sequences in the batch is unknown, start over next time
+            for (size_t k = 0; k < drafts.size(); ++k) {
+                if (i_batch[k] >= 0) {
+                    llama_kv_self_seq_rm(ctx, drafts[k].seq_id, -1, -1);
+                    spec->seqs[drafts[k].seq_id].prompt.clear();
+                }
+            }
+            break;
+        }
+
+        std::vector<int> i_next(drafts.size(), -1);
+
+        common_batch_clear(batch);
+
+        for (size_t k = 0; k < drafts.size(); ++k) {
+            if (i_batch[k] < 0) {
+                continue;
+            }
+
+            auto & draft = drafts[k];
+            auto & seq   = spec->seqs[draft.seq_id];
+
+            common_sampler_sample(seq.smpl, ctx, i_batch[k], true);
+
+            const auto * cur_p = common_sampler_get_candidates(seq.smpl);
+
+            const llama_token id = cur_p->data[0].id;
+
+            common_sampler_accept(seq.smpl, id, true);
+
+            draft.result.push_back(id);
+
+            // only collect very high-confidence draft tokens
+            if (draft.params.n_draft <= (int) draft.result.size() || cur_p->data[0].p < draft.params.p_min) {
+                continue;
+            }
+
+            common_batch_add(batch, id, seq.prompt.size(), { draft.seq_id }, true);
+
+            seq.prompt.push_back(id);
+
+            i_next[k] = batch.n_tokens - 1;
+        }
+
+        i_batch = std::move(i_next);
+    }
+}
+
+common_speculative_tree common_speculative_gen_tree(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last) {
+    auto & batch  = spec->batch;
+    auto & ctx    = spec->ctx;
+    auto & smpl   = spec->seqs[0].smpl;
+    auto & prompt = spec->seqs[0].prompt;
+
+    params.n_branch = std::max(1, params.n_branch);
+
+    common_speculative_tree tree;
+
+    {
+        llama_tokens draft;
+
+        if (!common_speculative_begin(spec, params, prompt_tgt, id_last, draft)) {
+            // the greedy branch of the previous tree
+            for (size_t i = 0; i < draft.size(); ++i) {
+                tree.tokens  .push_back(draft[i]);
+                tree.parents .push_back((int) i - 1);
+                tree.depths  .push_back((int) i);
+                tree.branches.push_back({ 0 });
+            }
+
+            return tree;
+        }
+    }
+
+    // the position of id_last
+    const llama_pos n_past = prompt.size() - 1;
+
+    // the branches that are still drafting - branch b is sequence b of the draft context
+    struct branch {
+        llama_seq_id seq_id;
+
+        int node;    // the last node of the branch, -1 for id_last
+        int i_batch; // the index of the logits of the last node
+    };
+
+    std::vector<branch> active = { { 0, -1, 0 } };
+
+    // the draft sampler has no state, so it is shared by all branches
+    common_sampler_reset(smpl);
+
+    for (int i = 0; i < params.n_draft && !active.empty(); ++i) {
+        std::vector<branch> next;
+
+        common_batch_clear(batch);
+
+        for (const auto & br : active) {
+            common_sampler_sample(smpl, ctx, br.i_batch, true);
+
+            const auto * cur_p = common_sampler_get_candidates(smpl);
+
+            for (int k = 0; k < (int) cur_p->size; ++k) {
+                const llama_token id = cur_p->data[k].id;
+                const float       p  = cur_p->data[k].p;
+
+                llama_seq_id seq_id = br.seq_id;
+
+                if (k > 0) {
+                    if (tree.n_branch >= params.n_branch || p < params.p_split) {
+                        break;
+                    }
+
+                    LOG_DBG("%s: splitting branch %d into %d at pos %d, p = %.3f\n", __func__, br.seq_id, tree.n_branch, i, p);
+
+                    seq_id = tree.n_branch++;
+
+                    // the new branch shares the KV cache and the nodes of the branch up to here
+                    llama_kv_self_seq_rm(ctx,            seq_id, -1, -1);
+                    llama_kv_self_seq_cp(ctx, br.seq_id, seq_id, -1, -1);
+
+                    for (int j = br.node; j >= 0; j = tree.parents[j]) {
+                        tree.branches[j].push_back(seq_id);
+                    }
+                }
+
+                const int node = tree.tokens.size();
+
+                tree.tokens  .push_back(id);
+                tree.parents .push_back(br.node);
+                tree.depths  .push_back(i);
+                tree.branches.push_back({ seq_id });
+
+                // only continue the branches with very high-confidence draft tokens
+                // a new branch starts with a less likely token by construction, so it only needs p_split
+                if (i + 1 >= params.n_draft || p < (k == 0 ? params.p_min : params.p_split)) {
+                    continue;
+                }
+
+                common_batch_add(batch, id, n_past + i + 1, { seq_id }, true);
+
+                if (seq_id == 0) {
+                    prompt.push_back(id);
+                }
+
+                next.push_back({ seq_id, node, batch.n_tokens - 1 });
+            }
+        }
+
+        if (batch.n_tokens > 0) {
+            // evaluate the next token of all branches on the draft model
+            llama_decode(ctx, batch);
+        }
+
+        active = std::move(next);
+    }
+
+    // only the greedy branch is kept, like a linear draft
+    for (llama_seq_id s = 1; s < tree.n_branch; ++s) {
+        llama_kv_self_seq_rm(ctx, s, -1, -1);
+    }
+
+    return tree;
+}
+
+void common_speculative_tree_prepare(
+        struct llama_context * ctx,
+        llama_batch & batch,
+        const common_speculative_tree & tree,
+        llama_token id_last,
+        llama_pos n_past,
+        const std::vector<llama_seq_id> & seq_ids) {
+    GGML_ASSERT((int) seq_ids.size() >= tree.n_branch);
+
+    for (int b = 1; b < tree.n_branch; ++b) {
+        llama_kv_self_seq_rm(ctx,             seq_ids[b], -1, -1);
+        llama_kv_self_seq_cp(ctx, seq_ids[0], seq_ids[b], -1, n_past);
+    }
+
+    std::vector<llama_seq_id> seq_ids_cur(seq_ids.begin(), seq_ids.begin() + tree.n_branch);
+
+    common_batch_add(batch, id_last, n_past, seq_ids_cur, true);
+
+    for (size_t i = 0; i < tree.tokens.size(); ++i) {
+        seq_ids_cur.clear();
+        for (const int b : tree.branches[i]) {
+            seq_ids_cur.push_back(seq_ids[b]);
+        }
+
+        common_batch_add(batch, tree.tokens[i], n_past + 1 + tree.depths[i], seq_ids_cur, true);
+    }
+}
+
+llama_tokens common_speculative_tree_accept(
+        struct common_sampler * smpl,
+        struct llama_context * ctx,
+        const common_speculative_tree & tree,
+        int idx,
+        llama_pos n_past,
+        const std::vector<llama_seq_id> & seq_ids) {
+    llama_tokens result;
+
+    // the last accepted node, -1 for id_last
+    int node = -1;
+
+    while (true) {
+        const llama_token id = common_sampler_sample(smpl, ctx, node < 0 ? idx : idx + 1 + node);
+
+        common_sampler_accept(smpl, id, true);
+
+        result.push_back(id);
+
+        // the children of a node come after it
+        int child = -1;
+        for (int i = node + 1; i < (int) tree.tokens.size(); ++i) {
+            if (tree.parents[i] == node && tree.tokens[i] == id) {
+                child = i;
+                break;
+            }
+        }
+
+        if (child < 0) {
+            break;
+        }
+
+        node = child;
+    }
+
+    // move the accepted path to seq_ids[0] if it is not on the greedy branch
+    if (node >= 0 && tree.branches[node][0] != 0) {
+        llama_kv_self_seq_rm(ctx, seq_ids[0], n_past + 1, -1);
+        llama_kv_self_seq_cp(ctx, seq_ids[tree.branches[node][0]], seq_ids[0], n_past + 1, n_past + 2 + tree.depths[node]);
+    }
+
+    for (int b = 1; b < tree.n_branch; ++b) {
+        llama_kv_self_seq_rm(ctx, seq_ids[b], -1, -1);
+    }
+
+    return result;
+}
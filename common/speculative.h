@@ -6,10 +6,36 @@
 struct common_speculative;
 
 struct common_speculative_params {
-    int n_draft = 16;  // max drafted tokens
-    int n_reuse = 256;
+    int n_draft  = 16; // max drafted tokens
+    int n_reuse  = 256;
+    int n_branch = 1;  // max branches of a draft tree
 
-    float p_min = 0.75f; // min probability required to accept a token in the draft
+    float p_min   = 0.75f; // min probability required to accept a token in the draft
+    float p_split = 0.1f;  // min probability of a draft candidate to start a new branch of the tree
+};
+
+// the draft of one sequence in a batched draft
+struct common_speculative_draft {
+    llama_seq_id seq_id; // sequence of the draft context, must be < n_seq_max
+
+    struct common_speculative_params params;
+
+    const llama_tokens * prompt_tgt; // the tokens of the target sequence
+    llama_token          id_last;
+
+    llama_tokens result;
+};
+
+// a draft with several branches - node i continues node parents[i], or id_last if parents[i] < 0
+// the nodes are ordered by depth and branch 0 is the greedy draft
+struct common_speculative_tree {
+    int n_branch = 1;
+
+    llama_tokens     tokens;
+    std::vector<int> parents;
+    std::vector<int> depths;
+
+    std::vector<std::vector<int>> branches; // the branches that pass through each node, in increasing order
 };
 
 struct common_speculative * common_speculative_init(struct llama_context * ctx_dft);
@@ -26,3 +52,37 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+// draft for several sequences of the draft context at once - each step decodes the next token of all of them together
+// the KV cache of each sequence is reused across calls, the sequences that do not fit in n_ctx / n_seq_max get no draft
+void common_speculative_gen_drafts(
+               struct common_speculative * spec,
+   std::vector<common_speculative_draft> & drafts);
+
+// draft a tree of up to n_branch branches - the draft candidates with p >= p_split start a new branch
+common_speculative_tree common_speculative_gen_tree(
+               struct common_speculative * spec,
+        struct common_speculative_params   params,
+                      const llama_tokens & prompt,
+                             llama_token   id_last);
+
+// add id_last at n_past and the nodes of the tree after it to the target batch, branch b uses seq_ids[b]
+// the KV cache of seq_ids[0] before n_past is shared with the other branches, so that all of them are verified in one decode
+void common_speculative_tree_prepare(
+                    struct llama_context * ctx,
+                             llama_batch & batch,
+           const common_speculative_tree & tree,
+                             llama_token   id_last,
+                               llama_pos   n_past,
+       const std::vector<llama_seq_id> & seq_ids);
+
+// sample the target along the tree, starting with the logits of id_last at batch index idx
+// returns the accepted tokens, the last one is not in the tree - like common_sampler_sample_and_accept_n()
+// the accepted path is moved to seq_ids[0] and the other branches are removed from the KV cache
+llama_tokens common_speculative_tree_accept(
+                  struct common_sampler * smpl,
+                    struct llama_context * ctx,
+           const common_speculative_tree & tree,
+                                     int   idx,
+                               llama_pos   n_past,
+       const std::vector<llama_seq_id> & seq_ids);
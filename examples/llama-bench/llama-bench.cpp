@@ -168,6 +168,7 @@ struct cmd_params {
     std::vector<std::string>         cpu_mask;
     std::vector<bool>                cpu_strict;
     std::vector<int>                 poll;
+    std::vector<bool>                cpu_dep_sched;
     std::vector<int>                 n_gpu_layers;
     std::vector<std::string>         rpc_servers;
     std::vector<llama_split_mode>    split_mode;
@@ -200,6 +201,7 @@ static const cmd_params cmd_params_defaults = {
     /* cpu_mask             */ { "0x0" },
     /* cpu_strict           */ { false },
     /* poll                 */ { 50 },
+    /* cpu_dep_sched        */ { false },
     /* n_gpu_layers         */ { 99 },
     /* rpc_servers          */ { "" },
     /* split_mode           */ { LLAMA_SPLIT_MODE_LAYER },
@@ -245,6 +247,8 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  --cpu-strict <0|1>                        (default: %s)\n",
            join(cmd_params_defaults.cpu_strict, ",").c_str());
     printf("  --poll <0...100>                          (default: %s)\n", join(cmd_params_defaults.poll, ",").c_str());
+    printf("  --cpu-dep-sched <0|1>                     (default: %s)\n",
+           join(cmd_params_defaults.cpu_dep_sched, ",").c_str());
     printf("  -ngl, --n-gpu-layers <n>                  (default: %s)\n",
            join(cmd_params_defaults.n_gpu_layers, ",").c_str());
     if (llama_supports_rpc()) {
@@ -261,7 +265,7 @@ static void print_usage(int /* argc */, char ** argv) {
            join(cmd_params_defaults.flash_attn, ",").c_str());
     printf("  -mmp, --mmap <0|1>                        (default: %s)\n",
            join(cmd_params_defaults.use_mmap, ",").c_str());
-    printf("  --numa <distribute|isolate|numactl>       (default: disabled)\n");
+    printf("  --numa <distribute|isolate|numactl|partition> (default: disabled)\n");
     printf("  -embd, --embeddings <0|1>                 (default: %s)\n",
            join(cmd_params_defaults.embeddings, ",").c_str());
     printf("  -ts, --tensor-split <ts0/ts1/..>          (default: 0)\n");
@@ -446,6 +450,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
             auto p = string_split<int>(argv[i], split_delim);
             params.poll.insert(params.poll.end(), p.begin(), p.end());
+        } else if (arg == "--cpu-dep-sched") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = string_split<bool>(argv[i], split_delim);
+            params.cpu_dep_sched.insert(params.cpu_dep_sched.end(), p.begin(), p.end());
         } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -509,6 +520,8 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                     params.numa = GGML_NUMA_STRATEGY_ISOLATE;
                 } else if (value == "numactl") {
                     params.numa = GGML_NUMA_STRATEGY_NUMACTL;
+                } else if (value == "partition") {
+                    params.numa = GGML_NUMA_STRATEGY_PARTITION;
                 } else {
                     invalid_param = true;
                     break;
@@ -666,6 +679,9 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.poll.empty()) {
         params.poll = cmd_params_defaults.poll;
     }
+    if (params.cpu_dep_sched.empty()) {
+        params.cpu_dep_sched = cmd_params_defaults.cpu_dep_sched;
+    }
 
     return params;
 }
@@ -682,6 +698,7 @@ struct cmd_params_instance {
     std::string        cpu_mask;
     bool               cpu_strict;
     int                poll;
+    bool               cpu_dep_sched;
     int                n_gpu_layers;
     std::string        rpc_servers_str;
     llama_split_mode   split_mode;
@@ -780,7 +797,8 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
     for (const auto & nt : params.n_threads)
     for (const auto & cm : params.cpu_mask)
     for (const auto & cs : params.cpu_strict)
-    for (const auto & pl : params.poll) {
+    for (const auto & pl : params.poll)
+    for (const auto & ds : params.cpu_dep_sched) {
         for (const auto & n_prompt : params.n_prompt) {
             if (n_prompt == 0) {
                 continue;
@@ -797,6 +815,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .cpu_mask     = */ cm,
                 /* .cpu_strict   = */ cs,
                 /* .poll         = */ pl,
+                /* .cpu_dep_sched= */ ds,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -826,6 +845,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .cpu_mask     = */ cm,
                 /* .cpu_strict   = */ cs,
                 /* .poll         = */ pl,
+                /* .cpu_dep_sched= */ ds,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -855,6 +875,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .cpu_mask     = */ cm,
                 /* .cpu_strict   = */ cs,
                 /* .poll         = */ pl,
+                /* .cpu_dep_sched= */ ds,
                 /* .n_gpu_layers = */ nl,
                 /* .rpc_servers  = */ rpc,
                 /* .split_mode   = */ sm,
@@ -888,6 +909,7 @@ struct test {
     std::string              cpu_mask;
     bool                     cpu_strict;
     int                      poll;
+    bool                     cpu_dep_sched;
     ggml_type                type_k;
     ggml_type                type_v;
     int                      n_gpu_layers;
@@ -919,6 +941,7 @@ struct test {
         cpu_mask       = inst.cpu_mask;
         cpu_strict     = inst.cpu_strict;
         poll           = inst.poll;
+        cpu_dep_sched  = inst.cpu_dep_sched;
         type_k         = inst.type_k;
         type_v         = inst.type_v;
         n_gpu_layers   = inst.n_gpu_layers;
@@ -971,10 +994,10 @@ struct test {
         static const std::vector<std::string> fields = {
             "build_commit", "build_number", "cpu_info",       "gpu_info",   "backends",     "model_filename",
             "model_type",   "model_size",   "model_n_params", "n_batch",    "n_ubatch",     "n_threads",
-            "cpu_mask",     "cpu_strict",   "poll",           "type_k",     "type_v",       "n_gpu_layers",
-            "split_mode",   "main_gpu",     "no_kv_offload",  "flash_attn", "tensor_split", "use_mmap",
-            "embeddings",   "n_prompt",     "n_gen",          "test_time",  "avg_ns",       "stddev_ns",
-            "avg_ts",       "stddev_ts",
+            "cpu_mask",     "cpu_strict",   "poll",           "cpu_dep_sched", "type_k",    "type_v",
+            "n_gpu_layers", "split_mode",   "main_gpu",       "no_kv_offload", "flash_attn", "tensor_split",
+            "use_mmap",     "embeddings",   "n_prompt",       "n_gen",         "test_time",  "avg_ns",
+            "stddev_ns",    "avg_ts",       "stddev_ts",
         };
         return fields;
     }
@@ -988,8 +1011,8 @@ struct test {
             field == "stddev_ns") {
             return INT;
         }
-        if (field == "f16_kv" || field == "no_kv_offload" || field == "cpu_strict" || field == "flash_attn" ||
-            field == "use_mmap" || field == "embeddings") {
+        if (field == "f16_kv" || field == "no_kv_offload" || field == "cpu_strict" || field == "cpu_dep_sched" ||
+            field == "flash_attn" || field == "use_mmap" || field == "embeddings") {
             return BOOL;
         }
         if (field == "avg_ts" || field == "stddev_ts") {
@@ -1029,6 +1052,7 @@ struct test {
                                             cpu_mask,
                                             std::to_string(cpu_strict),
                                             std::to_string(poll),
+                                            std::to_string(cpu_dep_sched),
                                             ggml_type_name(type_k),
                                             ggml_type_name(type_v),
                                             std::to_string(n_gpu_layers),
@@ -1280,6 +1304,9 @@ struct markdown_printer : public printer {
         if (params.poll.size() > 1 || params.poll != cmd_params_defaults.poll) {
             fields.emplace_back("poll");
         }
+        if (params.cpu_dep_sched.size() > 1 || params.cpu_dep_sched != cmd_params_defaults.cpu_dep_sched) {
+            fields.emplace_back("cpu_dep_sched");
+        }
         if (params.n_batch.size() > 1 || params.n_batch != cmd_params_defaults.n_batch) {
             fields.emplace_back("n_batch");
         }
@@ -1592,6 +1619,7 @@ int main(int argc, char ** argv) {
         }
         tpp.strict_cpu = t.cpu_strict;
         tpp.poll       = t.poll;
+        tpp.dep_sched  = t.cpu_dep_sched;
         tpp.prio       = params.prio;
 
         struct ggml_threadpool * threadpool = ggml_threadpool_new_fn(&tpp);
@@ -0,0 +1,1010 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define SERVER_HTTP_EPOLL
+#endif
+
+//
+// HTTP front-end of the server
+// the part of the httplib::Server API that is used by the server, implemented either by cpp-httplib or by an event loop
+//
+
+struct server_http {
+    using Handler             = httplib::Server::Handler;
+    using HandlerWithResponse = httplib::Server::HandlerWithResponse;
+    using ExceptionHandler    = httplib::Server::ExceptionHandler;
+
+    virtual ~server_http() = default;
+
+    virtual void Get (const std::string & pattern, Handler handler) = 0;
+    virtual void Post(const std::string & pattern, Handler handler) = 0;
+
+    virtual void set_default_headers    (httplib::Headers headers)     = 0;
+    virtual void set_logger             (httplib::Logger logger)       = 0;
+    virtual void set_exception_handler  (ExceptionHandler handler)     = 0;
+    virtual void set_error_handler      (Handler handler)              = 0;
+    virtual void set_pre_routing_handler(HandlerWithResponse handler)  = 0;
+
+    virtual bool set_mount_point(const std::string & mount_point, const std::string & dir) = 0;
+
+    virtual void set_read_timeout (time_t sec) = 0;
+    virtual void set_write_timeout(time_t sec) = 0;
+
+    // number of threads that run the handlers
+    virtual void set_n_threads(int32_t n_threads) = 0;
+
+    virtual int  bind_to_any_port(const std::string & host) = 0;
+    virtual bool bind_to_port    (const std::string & host, int port) = 0;
+
+    virtual bool listen_after_bind() = 0;
+    virtual void wait_until_ready() const = 0;
+    virtual void stop() = 0;
+};
+
+// cpp-httplib: each connection is processed by a thread of the pool for as long as it is kept alive
+struct server_http_httplib : server_http {
+    std::unique_ptr<httplib::Server> svr;
+
+    explicit server_http_httplib(std::unique_ptr<httplib::Server> svr) : svr(std::move(svr)) {}
+
+    void Get (const std::string & pattern, Handler handler) override { svr->Get (pattern, std::move(handler)); }
+    void Post(const std::string & pattern, Handler handler) override { svr->Post(pattern, std::move(handler)); }
+
+    void set_default_headers    (httplib::Headers headers)    override { svr->set_default_headers(std::move(headers)); }
+    void set_logger             (httplib::Logger logger)      override { svr->set_logger(std::move(logger)); }
+    void set_exception_handler  (ExceptionHandler handler)    override { svr->set_exception_handler(std::move(handler)); }
+    void set_error_handler      (Handler handler)             override { svr->set_error_handler(std::move(handler)); }
+    void set_pre_routing_handler(HandlerWithResponse handler) override { svr->set_pre_routing_handler(std::move(handler)); }
+
+    bool set_mount_point(const std::string & mount_point, const std::string & dir) override {
+        return svr->set_mount_point(mount_point, dir);
+    }
+
+    void set_read_timeout (time_t sec) override { svr->set_read_timeout (sec); }
+    void set_write_timeout(time_t sec) override { svr->set_write_timeout(sec); }
+
+    void set_n_threads(int32_t n_threads) override {
+        svr->new_task_queue = [n_threads] { return new httplib::ThreadPool(n_threads); };
+    }
+
+    int  bind_to_any_port(const std::string & host)           override { return svr->bind_to_any_port(host); }
+    bool bind_to_port    (const std::string & host, int port) override { return svr->bind_to_port(host, port); }
+
+    bool listen_after_bind()      override { return svr->listen_after_bind(); }
+    void wait_until_ready() const override { svr->wait_until_ready(); }
+    void stop()                   override { svr->stop(); }
+};
+
+#ifdef SERVER_HTTP_EPOLL
+
+// event loop: the connections are multiplexed with epoll on a single thread, and a thread of the pool is used only
+// while a request is handled, so idle keep-alive connections do not hold a thread
+// the output is sent directly from the buffers of the handlers, it is only copied when the socket is not writable
+struct server_http_epoll : server_http {
+    static constexpr size_t MAX_HEADER_SIZE = 64*1024;
+    static constexpr size_t MAX_OUT_SIZE    = 4*1024*1024; // pending output before the handler waits for the client
+
+    static constexpr uint64_t ID_LISTEN = 0;
+    static constexpr uint64_t ID_EVENT  = 1;
+
+    struct conn {
+        uint64_t id;
+        int      fd;
+
+        std::string remote_addr;
+        int         remote_port = -1;
+        std::string local_addr;
+        int         local_port  = -1;
+
+        // used only by the loop
+        std::string in;                    // received data that is not part of a handled request yet
+        bool        sent_continue = false; // 100 Continue has been sent for the pending request
+        int64_t     t_last        = 0;     // last activity, for the idle timeout
+
+        std::mutex              mtx;
+        std::condition_variable cv;
+
+        std::string out;      // output that could not be sent yet
+        size_t      out_pos = 0;
+
+        bool busy        = false; // a request is being handled
+        bool closed      = false; // the connection is lost, nothing can be sent anymore
+        bool close_after = false; // close once the pending output is sent
+    };
+
+    using conn_ptr = std::shared_ptr<conn>;
+
+    using handlers = std::vector<std::pair<std::unique_ptr<httplib::detail::MatcherBase>, Handler>>;
+
+    handlers handlers_get;
+    handlers handlers_post;
+
+    std::vector<std::pair<std::string, std::string>> mount_points; // mount point, directory
+
+    httplib::Headers    default_headers;
+    httplib::Logger     logger;
+    ExceptionHandler    exception_handler;
+    Handler             error_handler;
+    HandlerWithResponse pre_routing_handler;
+
+    time_t  read_timeout  = 5;
+    time_t  write_timeout = 5;
+    int32_t n_threads     = 8;
+
+    int fd_listen = -1;
+    int fd_epoll  = -1;
+    int fd_event  = -1;
+
+    std::atomic<bool> running  = false;
+    std::atomic<bool> stopping = false;
+
+    // connections, owned by the loop
+    std::unordered_map<uint64_t, conn_ptr> conns;
+    uint64_t next_id = ID_EVENT + 1;
+
+    // connections whose request has been handled, resumed by the loop
+    std::mutex            mtx_done;
+    std::vector<uint64_t> done;
+
+    std::unique_ptr<httplib::TaskQueue> pool;
+
+    server_http_epoll() {
+        fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        fd_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        epoll_event ev = {};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = ID_EVENT;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_event, &ev);
+    }
+
+    ~server_http_epoll() {
+        if (fd_listen >= 0) {
+            close(fd_listen);
+        }
+        close(fd_event);
+        close(fd_epoll);
+    }
+
+    static std::unique_ptr<httplib::detail::MatcherBase> make_matcher(const std::string & pattern) {
+        // same as httplib::Server
+        if (pattern.find("/:") != std::string::npos) {
+            return std::make_unique<httplib::detail::PathParamsMatcher>(pattern);
+        }
+        return std::make_unique<httplib::detail::RegexMatcher>(pattern);
+    }
+
+    void Get (const std::string & pattern, Handler handler) override { handlers_get .emplace_back(make_matcher(pattern), std::move(handler)); }
+    void Post(const std::string & pattern, Handler handler) override { handlers_post.emplace_back(make_matcher(pattern), std::move(handler)); }
+
+    void set_default_headers    (httplib::Headers headers)    override { default_headers     = std::move(headers); }
+    void set_logger             (httplib::Logger logger)      override { this->logger        = std::move(logger); }
+    void set_exception_handler  (ExceptionHandler handler)    override { exception_handler   = std::move(handler); }
+    void set_error_handler      (Handler handler)             override { error_handler       = std::move(handler); }
+    void set_pre_routing_handler(HandlerWithResponse handler) override { pre_routing_handler = std::move(handler); }
+
+    bool set_mount_point(const std::string & mount_point, const std::string & dir) override {
+        if (!httplib::detail::FileStat(dir).is_dir() || mount_point.empty() || mount_point[0] != '/') {
+            return false;
+        }
+        mount_points.emplace_back(mount_point, dir);
+        return true;
+    }
+
+    void set_read_timeout (time_t sec) override { read_timeout  = sec; }
+    void set_write_timeout(time_t sec) override { write_timeout = sec; }
+
+    void set_n_threads(int32_t n_threads) override { this->n_threads = n_threads; }
+
+    int bind_to_any_port(const std::string & host) override {
+        if (!bind_to_port(host, 0)) {
+            return -1;
+        }
+
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        if (getsockname(fd_listen, (sockaddr *) &addr, &len) != 0) {
+            return -1;
+        }
+
+        return ntohs(addr.ss_family == AF_INET6 ? ((sockaddr_in6 *) &addr)->sin6_port : ((sockaddr_in *) &addr)->sin_port);
+    }
+
+    bool bind_to_port(const std::string & host, int port) override {
+        addrinfo hints = {};
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+
+        addrinfo * result = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+            return false;
+        }
+
+        for (addrinfo * ai = result; ai; ai = ai->ai_next) {
+            const int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+
+            // same options as httplib, so that both front-ends can take over the port from each other
+            httplib::default_socket_options(fd);
+
+            int no = 0;
+            if (ai->ai_family == AF_INET6) {
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+            }
+
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+                fd_listen = fd;
+                break;
+            }
+
+            close(fd);
+        }
+
+        freeaddrinfo(result);
+
+        if (fd_listen < 0) {
+            return false;
+        }
+
+        epoll_event ev = {};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = ID_LISTEN;
+
+        return epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_listen, &ev) == 0;
+    }
+
+    void wait_until_ready() const override {
+        while (!running && !stopping) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    void stop() override {
+        stopping = true;
+        wake();
+    }
+
+    // wake up the loop
+    void wake() {
+        const uint64_t one = 1;
+        const ssize_t  res = write(fd_event, &one, sizeof(one));
+        GGML_UNUSED(res);
+    }
+
+    static int64_t t_now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool listen_after_bind() override {
+        if (fd_listen < 0) {
+            return false;
+        }
+
+        pool.reset(new httplib::ThreadPool(n_threads));
+
+        running = true;
+
+        std::vector<epoll_event> events(256);
+
+        int64_t t_sweep = t_now();
+
+        while (!stopping) {
+            const int n = epoll_wait(fd_epoll, events.data(), events.size(), 1000);
+            if (n < 0 && errno != EINTR) {
+                SRV_ERR("epoll_wait failed: %s\n", strerror(errno));
+                break;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                const uint64_t id = events[i].data.u64;
+
+                if (id == ID_LISTEN) {
+                    accept_all();
+                } else if (id == ID_EVENT) {
+                    resume_done();
+                } else {
+                    const auto it = conns.find(id);
+                    if (it != conns.end()) {
+                        // keep the connection alive while handling its events
+                        conn_ptr c = it->second;
+                        on_event(c, events[i].events);
+                    }
+                }
+            }
+
+            // close the connections that are idle for longer than the read timeout
+            const int64_t t = t_now();
+            if (t != t_sweep) {
+                t_sweep = t;
+
+                std::vector<conn_ptr> idle;
+                for (const auto & it : conns) {
+                    conn & c = *it.second;
+
+                    std::lock_guard<std::mutex> lock(c.mtx);
+                    if (!c.busy && c.out_pos == c.out.size() && t - c.t_last > read_timeout) {
+                        idle.push_back(it.second);
+                    }
+                }
+                for (auto & c : idle) {
+                    close_conn(c);
+                }
+            }
+        }
+
+        // the handlers that are still running see their connection closed
+        for (auto & it : conns) {
+            conn & c = *it.second;
+
+            std::lock_guard<std::mutex> lock(c.mtx);
+            c.closed = true;
+            c.cv.notify_all();
+            shutdown(c.fd, SHUT_RDWR);
+        }
+
+        pool->shutdown();
+
+        for (auto & it : conns) {
+            close(it.second->fd);
+        }
+        conns.clear();
+
+        running = false;
+
+        return true;
+    }
+
+    //
+    // loop
+    //
+
+    void accept_all() {
+        while (true) {
+            const int fd = accept4(fd_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    SRV_WRN("accept failed: %s\n", strerror(errno));
+                }
+                break;
+            }
+
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+            auto c = std::make_shared<conn>();
+            c->id     = next_id++;
+            c->fd     = fd;
+            c->t_last = t_now();
+
+            httplib::detail::get_remote_ip_and_port(fd, c->remote_addr, c->remote_port);
+            httplib::detail::get_local_ip_and_port (fd, c->local_addr,  c->local_port);
+
+            epoll_event ev = {};
+            ev.events   = EPOLLIN | EPOLLRDHUP;
+            ev.data.u64 = c->id;
+
+            if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                close(fd);
+                continue;
+            }
+
+            conns[c->id] = std::move(c);
+        }
+    }
+
+    void resume_done() {
+        uint64_t val;
+        const ssize_t res = read(fd_event, &val, sizeof(val));
+        GGML_UNUSED(res);
+
+        std::vector<uint64_t> ids;
+        {
+            std::lock_guard<std::mutex> lock(mtx_done);
+            ids.swap(done);
+        }
+
+        for (const uint64_t id : ids) {
+            const auto it = conns.find(id);
+            if (it != conns.end()) {
+                conn_ptr c = it->second;
+                c->t_last = t_now();
+                update(c);
+            }
+        }
+    }
+
+    void on_event(conn_ptr & c, uint32_t events) {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            recv_all(*c);
+        }
+
+        if (events & EPOLLOUT) {
+            flush(*c);
+        }
+
+        update(c);
+    }
+
+    void recv_all(conn & c) {
+        char buf[64*1024];
+
+        while (true) {
+            const ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                c.in.append(buf, n);
+                c.t_last = t_now();
+                continue;
+            }
+
+            if (n < 0 && (errno == EINTR)) {
+                continue;
+            }
+
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                // the events of a lost connection are not needed anymore, it is closed once its handler is done
+                epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c.fd, nullptr);
+                lost(c);
+            }
+
+            break;
+        }
+    }
+
+    // send the pending output when the socket becomes writable
+    void flush(conn & c) {
+        std::lock_guard<std::mutex> lock(c.mtx);
+
+        while (!c.closed && c.out_pos < c.out.size()) {
+            const ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (n > 0) {
+                c.out_pos += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    lost_locked(c);
+                }
+                break;
+            }
+        }
+
+        if (!c.closed && c.out_pos == c.out.size()) {
+            c.out.clear();
+            c.out_pos = 0;
+            set_events(c, EPOLLIN | EPOLLRDHUP);
+        }
+
+        c.cv.notify_all();
+    }
+
+    // close the connection or start its next request, if it is not busy
+    void update(conn_ptr & c) {
+        bool close_now;
+        {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            if (c->busy) {
+                return;
+            }
+
+            close_now = c->closed || (c->close_after && c->out_pos == c->out.size());
+            if (!close_now && c->close_after) {
+                return;
+            }
+        }
+
+        if (close_now) {
+            close_conn(c);
+            return;
+        }
+
+        dispatch(c);
+    }
+
+    void close_conn(conn_ptr c) {
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+        conns.erase(c->id);
+    }
+
+    // parse the next request of the connection and hand it to the pool
+    void dispatch(conn_ptr & c) {
+        const size_t n_head = c->in.find("\r\n\r\n");
+        if (n_head == std::string::npos) {
+            if (c->in.size() > MAX_HEADER_SIZE) {
+                respond_error(c, httplib::StatusCode::RequestHeaderFieldsTooLarge_431);
+            }
+            return;
+        }
+
+        auto req = std::make_shared<httplib::Request>();
+
+        if (!parse_head(c->in.data(), n_head, *req)) {
+            respond_error(c, httplib::StatusCode::BadRequest_400);
+            return;
+        }
+
+        if (req->target.size() > CPPHTTPLIB_REQUEST_URI_MAX_LENGTH) {
+            respond_error(c, httplib::StatusCode::UriTooLong_414);
+            return;
+        }
+
+        if (req->get_header_value("Transfer-Encoding") == "chunked") {
+            respond_error(c, httplib::StatusCode::LengthRequired_411);
+            return;
+        }
+
+        const size_t n_body = req->get_header_value_u64("Content-Length");
+        const size_t n_req  = n_head + 4 + n_body;
+
+        if (c->in.size() < n_req) {
+            if (!c->sent_continue && req->get_header_value("Expect") == "100-continue") {
+                static const std::string res_continue = "HTTP/1.1 100 Continue\r\n\r\n";
+                c->sent_continue = true;
+                write_parts(*c, { { res_continue.data(), res_continue.size() } });
+            }
+            return;
+        }
+
+        req->body.assign(c->in, n_head + 4, n_body);
+        c->in.erase(0, n_req);
+        c->sent_continue = false;
+
+        req->remote_addr = c->remote_addr;
+        req->remote_port = c->remote_port;
+        req->local_addr  = c->local_addr;
+        req->local_port  = c->local_port;
+        req->set_header("REMOTE_ADDR", req->remote_addr);
+        req->set_header("REMOTE_PORT", std::to_string(req->remote_port));
+        req->set_header("LOCAL_ADDR",  req->local_addr);
+        req->set_header("LOCAL_PORT",  std::to_string(req->local_port));
+
+        {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            c->busy = true;
+        }
+
+        pool->enqueue([this, c, req]() {
+            handle(c, *req);
+        });
+    }
+
+    // request line and headers
+    static bool parse_head(const char * data, size_t size, httplib::Request & req) {
+        const char * end = data + size;
+
+        const char * eol = std::search(data, end, "\r\n", "\r\n" + 2);
+
+        {
+            const std::string line(data, eol);
+
+            const size_t p0 = line.find(' ');
+            const size_t p1 = line.rfind(' ');
+            if (p0 == std::string::npos || p1 == p0) {
+                return false;
+            }
+
+            req.method  = line.substr(0, p0);
+            req.target  = line.substr(p0 + 1, p1 - p0 - 1);
+            req.version = line.substr(p1 + 1);
+
+            if (req.version != "HTTP/1.1" && req.version != "HTTP/1.0") {
+                return false;
+            }
+
+            const size_t p_query = req.target.find('?');
+
+            req.path = httplib::detail::decode_url(req.target.substr(0, p_query), false);
+            if (p_query != std::string::npos) {
+                httplib::detail::parse_query_text(req.target.substr(p_query + 1), req.params);
+            }
+        }
+
+        while (eol < end) {
+            const char * beg = eol + 2;
+            eol = std::search(beg, end, "\r\n", "\r\n" + 2);
+
+            const char * colon = std::find(beg, eol, ':');
+            if (colon == eol || colon == beg) {
+                return false;
+            }
+
+            const char * val_beg = colon + 1;
+            const char * val_end = eol;
+            while (val_beg < val_end && (*val_beg == ' ' || *val_beg == '\t')) {
+                val_beg++;
+            }
+            while (val_end > val_beg && (val_end[-1] == ' ' || val_end[-1] == '\t')) {
+                val_end--;
+            }
+
+            req.headers.emplace(std::string(beg, colon), std::string(val_beg, val_end));
+        }
+
+        return true;
+    }
+
+    // error before the request is handled, the connection is closed after the response
+    void respond_error(conn_ptr & c, int status) {
+        httplib::Request  req;
+        httplib::Response res;
+
+        req.remote_addr = c->remote_addr;
+        req.remote_port = c->remote_port;
+
+        res.headers = default_headers;
+        res.status  = status;
+
+        c->in.clear();
+
+        write_response(*c, req, res, false);
+
+        bool close_now;
+        {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            c->close_after = true;
+            close_now = c->closed || c->out_pos == c->out.size();
+        }
+
+        if (close_now) {
+            close_conn(c);
+        }
+    }
+
+    void set_events(conn & c, uint32_t events) {
+        epoll_event ev = {};
+        ev.events   = events;
+        ev.data.u64 = c.id;
+        epoll_ctl(fd_epoll, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    void lost(conn & c) {
+        std::lock_guard<std::mutex> lock(c.mtx);
+        lost_locked(c);
+    }
+
+    static void lost_locked(conn & c) {
+        c.closed = true;
+        c.cv.notify_all();
+    }
+
+    //
+    // handlers, run by the pool
+    //
+
+    void handle(const conn_ptr & c, httplib::Request & req) {
+        httplib::Response res;
+        res.version = "HTTP/1.1";
+        res.headers = default_headers;
+
+        req.is_connection_closed = [c]() {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            return c->closed;
+        };
+
+        bool routed = false;
+        try {
+            routed = routing(req, res);
+        } catch (...) {
+            if (exception_handler) {
+                exception_handler(req, res, std::current_exception());
+                routed = true;
+            } else {
+                res.status = httplib::StatusCode::InternalServerError_500;
+            }
+        }
+
+        if (res.status == -1) {
+            res.status = routed ? httplib::StatusCode::OK_200 : httplib::StatusCode::NotFound_404;
+        }
+
+        bool keep_alive = !stopping && req.get_header_value("Connection") != "close";
+        if (req.version == "HTTP/1.0" && req.get_header_value("Connection") != "Keep-Alive") {
+            keep_alive = false;
+        }
+
+        keep_alive = write_response(*c, req, res, keep_alive) && keep_alive;
+
+        if (logger) {
+            logger(req, res);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(c->mtx);
+            c->busy = false;
+            if (!keep_alive) {
+                c->close_after = true;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx_done);
+            done.push_back(c->id);
+        }
+
+        wake();
+    }
+
+    bool routing(httplib::Request & req, httplib::Response & res) {
+        if (pre_routing_handler && pre_routing_handler(req, res) == httplib::Server::HandlerResponse::Handled) {
+            return true;
+        }
+
+        const bool is_get = req.method == "GET" || req.method == "HEAD";
+
+        if (is_get && handle_file_request(req, res)) {
+            return true;
+        }
+
+        const handlers * hs = nullptr;
+        if (is_get) {
+            hs = &handlers_get;
+        } else if (req.method == "POST") {
+            hs = &handlers_post;
+        } else if (req.method != "OPTIONS") {
+            res.status = httplib::StatusCode::BadRequest_400;
+            return false;
+        }
+
+        if (hs) {
+            for (const auto & h : *hs) {
+                if (h.first->match(req)) {
+                    h.second(req, res);
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    // static files of the mount points, as in httplib::Server
+    bool handle_file_request(const httplib::Request & req, httplib::Response & res) {
+        for (const auto & mp : mount_points) {
+            if (req.path.compare(0, mp.first.size(), mp.first) != 0) {
+                continue;
+            }
+
+            const std::string sub_path = "/" + req.path.substr(mp.first.size());
+            if (!httplib::detail::is_valid_path(sub_path)) {
+                continue;
+            }
+
+            std::string path = mp.second + sub_path;
+            if (path.back() == '/') {
+                path += "index.html";
+            }
+
+            const httplib::detail::FileStat stat(path);
+
+            if (stat.is_dir()) {
+                res.set_redirect(sub_path + "/", httplib::StatusCode::MovedPermanently_301);
+                return true;
+            }
+
+            if (stat.is_file()) {
+                auto mm = std::make_shared<httplib::detail::mmap>(path.c_str());
+                if (!mm->is_open()) {
+                    return false;
+                }
+
+                res.set_content_provider(mm->size(), httplib::detail::find_content_type(path, {}, "application/octet-stream"),
+                    [mm](size_t offset, size_t length, httplib::DataSink & sink) {
+                        return sink.write(mm->data() + offset, length);
+                    });
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // returns false if the response could not be sent completely
+    bool write_response(conn & c, const httplib::Request & req, httplib::Response & res, bool keep_alive) {
+        if (res.status >= 400 && error_handler) {
+            error_handler(req, res);
+        }
+
+        const bool has_provider = (bool) res.content_provider_;
+        const bool chunked      = has_provider && (res.is_chunked_content_provider_ || res.content_length_ == 0);
+
+        if (keep_alive) {
+            res.set_header("Keep-Alive", "timeout=" + std::to_string(read_timeout));
+        } else {
+            res.set_header("Connection", "close");
+        }
+
+        if ((!res.body.empty() || has_provider) && !res.has_header("Content-Type")) {
+            res.set_header("Content-Type", "text/plain");
+        }
+
+        if (chunked) {
+            res.set_header("Transfer-Encoding", "chunked");
+        } else if (!res.has_header("Content-Length")) {
+            res.set_header("Content-Length", std::to_string(has_provider ? res.content_length_ : res.body.size()));
+        }
+
+        std::string head = "HTTP/1.1 " + std::to_string(res.status) + " " + httplib::status_message(res.status) + "\r\n";
+        for (const auto & h : res.headers) {
+            head += h.first;
+            head += ": ";
+            head += h.second;
+            head += "\r\n";
+        }
+        head += "\r\n";
+
+        if (req.method == "HEAD" || (!has_provider && res.body.empty())) {
+            return write_parts(c, { { head.data(), head.size() } });
+        }
+
+        if (!has_provider) {
+            return write_parts(c, { { head.data(), head.size() }, { res.body.data(), res.body.size() } });
+        }
+
+        bool ok   = write_parts(c, { { head.data(), head.size() } });
+        bool more = true;
+
+        size_t offset = 0;
+
+        httplib::DataSink sink;
+
+        sink.write = [&](const char * data, size_t size) {
+            if (!ok || size == 0) {
+                return ok;
+            }
+
+            if (chunked) {
+                char size_line[32];
+                const int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", size);
+
+                ok = write_parts(c, { { size_line, (size_t) n }, { data, size }, { "\r\n", 2 } });
+            } else {
+                ok = write_parts(c, { { data, size } });
+            }
+
+            offset += size;
+
+            return ok;
+        };
+
+        sink.is_writable = [&]() {
+            std::lock_guard<std::mutex> lock(c.mtx);
+            return ok && !c.closed;
+        };
+
+        sink.done = [&]() {
+            more = false;
+            if (chunked) {
+                ok = ok && write_parts(c, { { "0\r\n\r\n", 5 } });
+            }
+        };
+
+        sink.done_with_trailer = [&](const httplib::Headers & trailer) {
+            more = false;
+            if (chunked) {
+                std::string end = "0\r\n";
+                for (const auto & h : trailer) {
+                    end += h.first + ": " + h.second + "\r\n";
+                }
+                end += "\r\n";
+
+                ok = ok && write_parts(c, { { end.data(), end.size() } });
+            }
+        };
+
+        if (chunked) {
+            // a stream is started even if the client is already gone: the provider sees that the sink is not
+            // writable and can cancel the work that was queued for it
+            do {
+                if (!res.content_provider_(offset, 0, sink)) {
+                    break;
+                }
+            } while (more && ok && !stopping);
+        } else {
+            while (offset < res.content_length_ && ok && !stopping) {
+                if (!res.content_provider_(offset, res.content_length_ - offset, sink)) {
+                    break;
+                }
+            }
+            more = offset < res.content_length_;
+        }
+
+        res.content_provider_success_ = ok && !more;
+
+        return res.content_provider_success_;
+    }
+
+    // send the parts, the rest is buffered until the socket is writable again
+    // waits while the client is too slow to read the buffered output
+    bool write_parts(conn & c, std::initializer_list<std::pair<const char *, size_t>> parts) {
+        std::unique_lock<std::mutex> lock(c.mtx);
+
+        if (c.closed) {
+            return false;
+        }
+
+        size_t n_sent = 0;
+
+        if (c.out_pos == c.out.size()) {
+            iovec iov[4];
+            size_t n_iov = 0;
+            for (const auto & p : parts) {
+                iov[n_iov++] = { const_cast<char *>(p.first), p.second };
+            }
+
+            msghdr msg = {};
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = n_iov;
+
+            ssize_t n;
+            do {
+                n = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+            } while (n < 0 && errno == EINTR);
+
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                lost_locked(c);
+                return false;
+            }
+
+            n_sent = std::max<ssize_t>(n, 0);
+        }
+
+        const bool was_empty = c.out_pos == c.out.size();
+
+        for (const auto & p : parts) {
+            if (n_sent >= p.second) {
+                n_sent -= p.second;
+                continue;
+            }
+
+            c.out.append(p.first + n_sent, p.second - n_sent);
+            n_sent = 0;
+        }
+
+        if (c.out_pos < c.out.size()) {
+            if (was_empty) {
+                set_events(c, EPOLLIN | EPOLLRDHUP | EPOLLOUT);
+            }
+
+            const auto timeout = std::chrono::seconds(write_timeout);
+
+            while (!c.closed && c.out.size() - c.out_pos > MAX_OUT_SIZE) {
+                if (c.cv.wait_for(lock, timeout) == std::cv_status::timeout) {
+                    lost_locked(c);
+                }
+            }
+        }
+
+        return !c.closed;
+    }
+};
+
+#endif // SERVER_HTTP_EPOLL
@@ -1,10 +1,12 @@
 #include "utils.hpp"
+#include "server-http.hpp"
 
 #include "arg.h"
 #include "common.h"
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "speculative.h"
 
@@ -24,8 +26,12 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <signal.h>
 #include <thread>
 #include <unordered_map>
@@ -35,6 +41,12 @@ using json = nlohmann::ordered_json;
 
 constexpr int HTTP_POLLING_SECONDS = 1;
 
+// lower bound of the prefill budget when it adapts to the inter-token latency target
+constexpr int32_t SERVER_PREFILL_MIN = 32;
+
+// granularity in tokens of the prefixes kept in the KV cache by the prefix store
+constexpr int32_t SERVER_PREFIX_STORE_BLOCK = 64;
+
 enum stop_type {
     STOP_TYPE_NONE,
     STOP_TYPE_EOS,
@@ -178,6 +190,7 @@ struct slot_params {
             {"speculative.n_max",         speculative.n_max},
             {"speculative.n_min",         speculative.n_min},
             {"speculative.p_min",         speculative.p_min},
+            {"speculative.lookup",        speculative.lookup},
             {"timings_per_token",         timings_per_token},
             {"post_sampling_probs",       post_sampling_probs},
             {"lora",                      lora},
@@ -273,6 +286,8 @@ struct server_task {
         params.speculative.n_max = json_value(data, "speculative.n_max", defaults.speculative.n_max);
         params.speculative.p_min = json_value(data, "speculative.p_min", defaults.speculative.p_min);
 
+        params.speculative.lookup = json_value(data, "speculative.lookup", defaults.speculative.lookup);
+
         params.speculative.n_min = std::min(params.speculative.n_max, params.speculative.n_min);
         params.speculative.n_min = std::max(params.speculative.n_min, 0);
         params.speculative.n_max = std::max(params.speculative.n_max, 0);
@@ -519,6 +534,17 @@ struct server_task_result {
         return -1;
     }
     virtual json to_json() = 0;
+    // append the result to a stream of server-sent events
+    virtual void to_sse(std::string & out) {
+        const json data = to_json();
+        if (data.is_array()) {
+            for (const auto & d : data) {
+                server_sent_event_append(out, "data", d);
+            }
+        } else {
+            server_sent_event_append(out, "data", data);
+        }
+    }
     virtual ~server_task_result() = default;
 };
 
@@ -874,6 +900,76 @@ struct server_task_result_cmpl_partial : server_task_result {
         }
     }
 
+    // most of the partial results only carry the new tokens: they are written directly, without building the json objects
+    // the output is the same as with to_json()
+    virtual void to_sse(std::string & out) override {
+        const bool first_chat = oaicompat == OAICOMPAT_TYPE_CHAT && n_decoded == 0;
+        if (verbose || first_chat || !prob_output.probs.empty() || timings.prompt_n >= 0) {
+            server_task_result::to_sse(out);
+            return;
+        }
+
+        out += "data: ";
+
+        switch (oaicompat) {
+            case OAICOMPAT_TYPE_NONE:
+                {
+                    out += "{\"index\":";
+                    json_append_int(out, index);
+                    out += ",\"content\":";
+                    json_append_str(out, content);
+                    out += ",\"tokens\":[";
+                    for (size_t i = 0; i < tokens.size(); ++i) {
+                        if (i > 0) {
+                            out += ',';
+                        }
+                        json_append_int(out, tokens[i]);
+                    }
+                    out += "],\"stop\":false,\"id_slot\":";
+                    json_append_int(out, id_slot);
+                    out += ",\"tokens_predicted\":";
+                    json_append_int(out, n_decoded);
+                    out += ",\"tokens_evaluated\":";
+                    json_append_int(out, n_prompt_tokens);
+                    out += '}';
+                } break;
+            case OAICOMPAT_TYPE_COMPLETION:
+                {
+                    out += "{\"choices\":[{\"text\":";
+                    json_append_str(out, content);
+                    out += ",\"index\":";
+                    json_append_int(out, index);
+                    out += ",\"logprobs\":null,\"finish_reason\":null}],\"created\":";
+                    json_append_int(out, std::time(0));
+                    out += ",\"model\":";
+                    json_append_str(out, oaicompat_model);
+                    out += ",\"system_fingerprint\":";
+                    json_append_str(out, build_info);
+                    out += ",\"object\":\"text_completion\",\"id\":";
+                    json_append_str(out, oaicompat_cmpl_id);
+                    out += '}';
+                } break;
+            case OAICOMPAT_TYPE_CHAT:
+                {
+                    out += "{\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"content\":";
+                    json_append_str(out, content);
+                    out += "}}],\"created\":";
+                    json_append_int(out, std::time(0));
+                    out += ",\"id\":";
+                    json_append_str(out, oaicompat_cmpl_id);
+                    out += ",\"model\":";
+                    json_append_str(out, oaicompat_model);
+                    out += ",\"system_fingerprint\":";
+                    json_append_str(out, build_info);
+                    out += ",\"object\":\"chat.completion.chunk\"}";
+                } break;
+            default:
+                GGML_ASSERT(false && "Invalid oaicompat_type");
+        }
+
+        out += "\n\n";
+    }
+
     json to_json_non_oaicompat() {
         // non-OAI-compat JSON
         json res = json {
@@ -1231,6 +1327,18 @@ struct server_slot {
 
     common_speculative * spec = nullptr;
 
+    // tree speculation: the target sequence of each branch of the draft tree, the first one is the slot itself
+    std::vector<llama_seq_id> spec_seq_ids;
+
+    // batched speculation: the slot drafts in the shared draft context and the draft is verified in the next batch
+    bool         spec_batched  = false;
+    llama_tokens drafted;
+    int32_t      n_draft_batch = 0; // number of drafted tokens after i_batch in the current batch
+
+    // lookup speculation: the n-grams of the cached tokens, the first n_ngram cached tokens are in the cache
+    common_ngram_cache ngram_cache;
+    size_t             n_ngram = 0;
+
     std::vector<common_adapter_lora_info> lora;
 
     // the index relative to completion multi-task request
@@ -1281,6 +1389,11 @@ struct server_slot {
 
     llama_token sampled;
 
+    // preempted slots are not scheduled until there is room in the KV cache again
+    // their KV cache is kept in swap_state, or recomputed when empty
+    bool swapped = false;
+    std::vector<uint8_t> swap_state;
+
     common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
 
     // stats
@@ -1310,15 +1423,20 @@ struct server_slot {
 
         generated_tokens.clear();
         generated_token_probs.clear();
+
+        drafted.clear();
+        n_draft_batch = 0;
+
+        n_ngram = 0;
     }
 
     bool is_non_causal() const {
         return task_type == SERVER_TASK_TYPE_EMBEDDING || task_type == SERVER_TASK_TYPE_RERANK;
     }
 
-    bool can_batch_with(server_slot & other_slot) const {
-        return is_non_causal() == other_slot.is_non_causal()
-            && are_lora_equal(lora, other_slot.lora);
+    // the adapters are applied per sequence, so slots with different adapters can share a batch
+    bool can_batch_with(const server_slot & other_slot) const {
+        return is_non_causal() == other_slot.is_non_causal();
     }
 
     bool has_budget(const common_params & global_params) {
@@ -1342,7 +1460,7 @@ struct server_slot {
     }
 
     bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+        return (ctx_dft || spec_batched || params.speculative.lookup) && params.speculative.n_max > 0 && params.cache_prompt;
     }
 
     void add_token(const completion_token_output & token) {
@@ -1360,6 +1478,14 @@ struct server_slot {
             t_last_used = ggml_time_us();
             t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
             state = SLOT_STATE_IDLE;
+
+            if (swapped) {
+                // the KV cache of the slot is gone
+                swapped = false;
+                swap_state.clear();
+                cache_tokens.clear();
+            }
+
             callback_on_release(id);
         }
     }
@@ -1500,74 +1626,185 @@ struct server_metrics {
     }
 };
 
+// multi-producer, single-consumer queue
+// producers push without taking a lock, the consumer takes everything that has been pushed so far at once
+// the mutex is only used to put the consumer to sleep when the queue is empty and is never taken by a producer
+// unless the consumer is waiting
+template <typename T>
+struct server_mpsc_queue {
+    struct node {
+        T      value;
+        node * next;
+    };
+
+    std::atomic<node *> head    = nullptr; // most recently pushed
+    std::atomic<bool>   waiting = false;
+
+    std::mutex              mutex;
+    std::condition_variable cond;
+    bool                    notified = false; // protected by mutex
+
+    server_mpsc_queue() = default;
+    server_mpsc_queue(const server_mpsc_queue &) = delete;
+    server_mpsc_queue & operator=(const server_mpsc_queue &) = delete;
+
+    ~server_mpsc_queue() {
+        node * n = head.exchange(nullptr);
+        while (n) {
+            node * next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    void push(T value) {
+        node * n = new node{std::move(value), nullptr};
+        push(n, n);
+    }
+
+    // the values are consumed in order and without other values in between
+    void push(std::vector<T> && values) {
+        if (values.empty()) {
+            return;
+        }
+
+        node * first = nullptr;
+        node * last  = nullptr;
+        for (auto & value : values) {
+            first = new node{std::move(value), first};
+            if (last == nullptr) {
+                last = first;
+            }
+        }
+
+        push(first, last);
+    }
+
+    bool empty() const {
+        return head.load() == nullptr;
+    }
+
+    // consumer only: append all pushed values to out, in the order they were pushed
+    void pop_all(std::deque<T> & out) {
+        node * n = head.exchange(nullptr, std::memory_order_acquire);
+
+        // the list is newest first
+        node * prev = nullptr;
+        while (n) {
+            node * next = n->next;
+            n->next = prev;
+            prev = n;
+            n    = next;
+        }
+
+        while (prev) {
+            node * next = prev->next;
+            out.push_back(std::move(prev->value));
+            delete prev;
+            prev = next;
+        }
+    }
+
+    // consumer only: block until a value is pushed or notify() is called
+    // returns false if the timeout (in seconds, negative for none) has expired
+    bool wait(int timeout = -1) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // pairs with the check in push(): either the producer sees waiting or we see the new head
+        waiting = true;
+
+        const auto ready = [&] { return !empty() || notified; };
+
+        bool res = true;
+        if (timeout < 0) {
+            cond.wait(lock, ready);
+        } else {
+            res = cond.wait_for(lock, std::chrono::seconds(timeout), ready);
+        }
+
+        waiting  = false;
+        notified = false;
+
+        return res;
+    }
+
+    // wake up the consumer, even if the queue is empty
+    void notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        notified = true;
+        cond.notify_all();
+    }
+
+private:
+    void push(node * first, node * last) {
+        node * old = head.load(std::memory_order_relaxed);
+        do {
+            last->next = old;
+        } while (!head.compare_exchange_weak(old, first, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+        if (waiting) {
+            std::lock_guard<std::mutex> lock(mutex);
+            cond.notify_one();
+        }
+    }
+};
+
 struct server_queue {
-    int id = 0;
-    bool running;
+    std::atomic<int> id = 0;
+    std::atomic<bool> running = false;
+
+    // new tasks, posted from any thread
+    struct pending {
+        bool front;
+        std::vector<server_task> tasks;
+    };
+
+    server_mpsc_queue<pending> queue_pending;
 
-    // queues
+    // queues, only accessed by the thread running start_loop()
     std::deque<server_task> queue_tasks;
     std::deque<server_task> queue_tasks_deferred;
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
-
     // callback functions
     std::function<void(server_task)> callback_new_task;
     std::function<void(void)>        callback_update_slots;
 
     // Add a new task to the end of the queue
     int post(server_task task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
-        }
         QUE_DBG("new task, id = %d, front = %d\n", task.id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
-        return task.id;
+        const int id_task = task.id;
+        std::vector<server_task> tasks;
+        tasks.push_back(std::move(task));
+        queue_pending.push({ front, std::move(tasks) });
+        return id_task;
     }
 
     // multi-task version of post()
+    // the tasks are moved from, but keep their ids
     int post(std::vector<server_task> & tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
+        std::vector<server_task> moved;
+        moved.reserve(tasks.size());
         for (auto & task : tasks) {
             if (task.id == -1) {
                 task.id = id++;
             }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
-            }
             QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
+            moved.push_back(std::move(task));
         }
-        condition_tasks.notify_one();
+        queue_pending.push({ front, std::move(moved) });
         return 0;
     }
 
     // Add a new task, but defer until one slot is available
     void defer(server_task task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         QUE_DBG("defer task, id = %d\n", task.id);
         queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
     }
 
     // Get the next id for creating a new task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        return id++;
     }
 
     // Register function to process a new task
@@ -1582,19 +1819,16 @@ struct server_queue {
 
     // Call when the state of one slot is changed, it will move one task from deferred to main queue
     void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         if (!queue_tasks_deferred.empty()) {
             queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
             queue_tasks_deferred.pop_front();
         }
-        condition_tasks.notify_one();
     }
 
     // end the start_loop routine
     void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         running = false;
-        condition_tasks.notify_all();
+        queue_pending.notify();
     }
 
     /**
@@ -1611,18 +1845,16 @@ struct server_queue {
             QUE_DBG("%s", "processing new tasks\n");
 
             while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
                 if (!running) {
                     QUE_DBG("%s", "terminate\n");
                     return;
                 }
+                collect_pending();
                 if (queue_tasks.empty()) {
-                    lock.unlock();
                     break;
                 }
-                server_task task = queue_tasks.front();
+                server_task task = std::move(queue_tasks.front());
                 queue_tasks.pop_front();
-                lock.unlock();
 
                 QUE_DBG("processing task, id = %d\n", task.id);
                 callback_new_task(std::move(task));
@@ -1634,24 +1866,38 @@ struct server_queue {
             callback_update_slots();
 
             QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
+            while (running && queue_tasks.empty() && queue_pending.empty()) {
+                queue_pending.wait();
+            }
+            if (!running) {
+                QUE_DBG("%s", "terminate\n");
+                return;
+            }
+        }
+    }
+
+private:
+    // move the posted tasks into the local queues
+    void collect_pending() {
+        std::deque<pending> batch;
+        queue_pending.pop_all(batch);
+
+        for (auto & p : batch) {
+            for (auto & task : p.tasks) {
+                // if this is cancel task make sure to clean up pending tasks
+                if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                    cleanup_pending_task(task.id_target);
                 }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
+                if (p.front) {
+                    queue_tasks.push_front(std::move(task));
+                } else {
+                    queue_tasks.push_back(std::move(task));
                 }
             }
         }
     }
 
-private:
     void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
         auto rm_func = [id_target](const server_task & task) {
             return task.id_target == id_target;
         };
@@ -1665,48 +1911,51 @@ private:
 };
 
 struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // the results of the tasks of one request, only read by the thread that handles the request
+    struct channel {
+        server_mpsc_queue<server_task_result_ptr> queue;
+        std::deque<server_task_result_ptr>        results; // received but not returned yet
+    };
+
+    using channel_ptr = std::shared_ptr<channel>;
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+    // for keeping track of all tasks waiting for the result
+    // the tasks of a request share one channel
+    std::unordered_map<int, channel_ptr> waiting_task_ids;
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    // only taken exclusively when a request is added or removed
+    std::shared_mutex mutex_results;
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        std::unique_lock<std::shared_mutex> lock(mutex_results);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        waiting_task_ids[id_task] = std::make_shared<channel>();
     }
 
     void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        auto ch = std::make_shared<channel>();
+
+        std::unique_lock<std::shared_mutex> lock(mutex_results);
 
         for (const auto & task : tasks) {
             SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            waiting_task_ids[task.id] = ch;
         }
     }
 
     // when the request is finished, we can remove task associated with it
+    // pending results are dropped together with the channel
     void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        std::unique_lock<std::shared_mutex> lock(mutex_results);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
         waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-                return res->id == id_task;
-            }),
-            queue_results.end());
     }
 
     void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        std::unique_lock<std::shared_mutex> lock(mutex_results);
 
         for (const auto & id_task : id_tasks) {
             SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
@@ -1716,45 +1965,32 @@ struct server_response {
 
     // This function blocks the thread until there is a response for one of the id_tasks
     server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
-
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        server_task_result_ptr res;
+        while (!(res = recv_with_timeout(id_tasks, -1))) {
         }
-
-        // should never reach here
+        return res;
     }
 
     // same as recv(), but have timeout in seconds
     // if timeout is reached, nullptr is returned
     server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        channel_ptr ch = get_channel(id_tasks);
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (cr_res == std::cv_status::timeout) {
+        if (ch->results.empty()) {
+            if (ch->queue.empty() && !ch->queue.wait(timeout)) {
                 return nullptr;
             }
+            ch->queue.pop_all(ch->results);
+        }
+
+        if (ch->results.empty()) {
+            return nullptr;
         }
 
-        // should never reach here
+        server_task_result_ptr res = std::move(ch->results.front());
+        ch->results.pop_front();
+
+        return res;
     }
 
     // single-task version of recv()
@@ -1767,141 +2003,1174 @@ struct server_response {
     void send(server_task_result_ptr && result) {
         SRV_DBG("sending result for task id = %d\n", result->id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        std::shared_lock<std::shared_mutex> lock(mutex_results);
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
-                return;
-            }
+        const auto it = waiting_task_ids.find(result->id);
+        if (it != waiting_task_ids.end()) {
+            SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+            it->second->queue.push(std::move(result));
         }
     }
-};
 
-struct server_context {
-    common_params params_base;
+private:
+    channel_ptr get_channel(const std::unordered_set<int> & id_tasks) {
+        std::shared_lock<std::shared_mutex> lock(mutex_results);
 
-    // note: keep these alive - they determine the lifetime of the model, context, etc.
-    common_init_result llama_init;
-    common_init_result llama_init_dft;
+        GGML_ASSERT(!id_tasks.empty());
+        const auto it = waiting_task_ids.find(*id_tasks.begin());
+        GGML_ASSERT(it != waiting_task_ids.end() && "the tasks must be added to the waiting list before receiving");
 
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
+        return it->second;
+    }
+};
 
-    const llama_vocab * vocab = nullptr;
+// radix tree over the token sequences in the KV cache of the slots
+// the common prefix of a prompt with every sequence is found in a single walk over the prompt
+// a sequence is updated when its tokens are settled (prompt processed, slot released, cache truncated) and removed when
+// its cache is dropped, so the tokens generated since the last update are not in the tree
+struct server_prompt_tree {
+    struct node {
+        llama_tokens     tokens; // label of the edge from the parent
+        std::vector<int> ids;    // the sequences that go through this node
 
-    llama_model * model_dft = nullptr;
+        std::unordered_map<llama_token, std::unique_ptr<node>> children;
+    };
 
-    llama_context_params cparams_dft;
+    node root;
 
-    llama_batch batch = {};
+    // replace the tokens of sequence id
+    void insert(int id, const llama_token * tokens, size_t n_tokens) {
+        remove(id);
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
-    bool has_eos_token  = false;
+        node * cur = &root;
 
-    int32_t n_ctx; // total context for all clients / slots
+        size_t i = 0;
+        while (i < n_tokens) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto leaf = std::make_unique<node>();
+                leaf->tokens.assign(tokens + i, tokens + n_tokens);
+                leaf->ids.push_back(id);
+                cur->children.emplace(tokens[i], std::move(leaf));
+                return;
+            }
 
-    // slots / clients
-    std::vector<server_slot> slots;
-    json default_generation_settings_for_props;
+            node * child = it->second.get();
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+            size_t k = 0;
+            while (k < child->tokens.size() && i + k < n_tokens && child->tokens[k] == tokens[i + k]) {
+                k++;
+            }
 
-    server_metrics metrics;
+            if (k < child->tokens.size()) {
+                split(*child, k);
+            }
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+            child->ids.push_back(id);
 
-    common_chat_templates_ptr chat_templates;
+            i  += k;
+            cur = child;
+        }
+    }
 
-    ~server_context() {
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            common_sampler_free(slot.smpl);
-            slot.smpl = nullptr;
+    void remove(int id) {
+        std::vector<node *> path;
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
+        node * cur = &root;
+        while (true) {
+            auto it = std::find_if(cur->children.begin(), cur->children.end(), [id](const auto & c) {
+                return std::find(c.second->ids.begin(), c.second->ids.end(), id) != c.second->ids.end();
+            });
+            if (it == cur->children.end()) {
+                break;
+            }
 
-            common_speculative_free(slot.spec);
-            slot.spec = nullptr;
+            node * child = it->second.get();
+            child->ids.erase(std::find(child->ids.begin(), child->ids.end(), id));
 
-            llama_batch_free(slot.batch_spec);
+            if (child->ids.empty()) {
+                // no other sequence goes through the child, so neither through its children
+                cur->children.erase(it);
+                break;
+            }
+
+            path.push_back(child);
+            cur = child;
         }
 
-        llama_batch_free(batch);
+        // merge the nodes that are left with a single child and where no sequence ends
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            node & n = **it;
+            if (n.children.size() != 1 || n.children.begin()->second->ids.size() != n.ids.size()) {
+                continue;
+            }
+
+            std::unique_ptr<node> child = std::move(n.children.begin()->second);
+
+            n.tokens.insert(n.tokens.end(), child->tokens.begin(), child->tokens.end());
+            n.children = std::move(child->children);
+        }
     }
 
-    bool load_model(const common_params & params) {
-        SRV_INF("loading model '%s'\n", params.model.c_str());
+    // length of the common prefix of the prompt with each sequence, indexed by id (0 when not in the tree)
+    std::vector<size_t> match(const llama_tokens & prompt, size_t n_ids) const {
+        std::vector<size_t> res(n_ids, 0);
 
-        params_base = params;
+        const node * cur = &root;
 
-        llama_init = common_init_from_params(params_base);
+        size_t i = 0;
+        while (i < prompt.size()) {
+            const auto it = cur->children.find(prompt[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
 
-        model = llama_init.model.get();
-        ctx   = llama_init.context.get();
+            const node * child = it->second.get();
 
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params_base.model.c_str());
-            return false;
-        }
+            size_t k = 0;
+            while (k < child->tokens.size() && i + k < prompt.size() && child->tokens[k] == prompt[i + k]) {
+                k++;
+            }
 
-        vocab = llama_model_get_vocab(model);
+            i += k;
 
-        n_ctx = llama_n_ctx(ctx);
+            for (int id : child->ids) {
+                res[id] = i;
+            }
 
-        add_bos_token = llama_vocab_get_add_bos(vocab);
-        has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+            if (k < child->tokens.size()) {
+                break;
+            }
 
-        if (!params_base.speculative.model.empty() || !params_base.speculative.hf_repo.empty()) {
-            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.c_str());
+            cur = child;
+        }
 
-            auto params_dft = params_base;
+        return res;
+    }
 
-            params_dft.devices      = params_base.speculative.devices;
-            params_dft.hf_file      = params_base.speculative.hf_file;
-            params_dft.hf_repo      = params_base.speculative.hf_repo;
-            params_dft.model        = params_base.speculative.model;
-            params_dft.model_url    = params_base.speculative.model_url;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
-            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
+private:
+    // split the edge to n after k tokens, n keeps the first part
+    static void split(node & n, size_t k) {
+        auto rest = std::make_unique<node>();
+        rest->tokens.assign(n.tokens.begin() + k, n.tokens.end());
+        rest->ids      = n.ids;
+        rest->children = std::move(n.children);
+
+        n.tokens.resize(k);
+        n.children.clear();
+        n.children.emplace(rest->tokens[0], std::move(rest));
+    }
+};
 
-            llama_init_dft = common_init_from_params(params_dft);
+// on-disk cache of the KV state of prompt prefixes, shared by the slots and kept across restarts
+// each file holds the state of one sequence in the format of llama_state_seq_save_file() and is found through the
+// hashes of the block-aligned prefixes of its tokens. the files are written in the background, off the decode loop
+struct server_prefix_cache {
+    struct entry {
+        std::vector<uint64_t> hashes; // hash of each block-aligned prefix of the stored tokens
+
+        size_t  n_tokens = 0;
+        size_t  size     = 0;
+        int32_t n_refs   = 0; // number of prefix hashes that resolve to this file
+        int64_t t_used   = 0;
+    };
 
-            model_dft = llama_init_dft.model.get();
+    struct write_task {
+        std::string          name;
+        llama_tokens         tokens;
+        std::vector<uint8_t> state;
+    };
 
-            if (model_dft == nullptr) {
-                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.c_str());
-                return false;
-            }
+    struct read_task {
+        uint64_t     id;
+        llama_seq_id seq_id;
+        std::string  name;
+    };
 
-            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
-                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params_base.speculative.model.c_str(), params_base.model.c_str());
+    // a file read for the prompt of a sequence, restored by load() once it is done
+    struct read_result {
+        uint64_t             id      = 0;
+        size_t               n_found = 0;
+        bool                 done    = false;
+        llama_tokens         tokens; // empty if the file could not be read
+        std::vector<uint8_t> state;
+    };
 
-                return false;
-            }
+    // the magic, the version and the number of tokens, followed by the seed
+    static constexpr size_t header_size = 3*sizeof(uint32_t) + sizeof(uint64_t);
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+    std::string path;
+    size_t      n_block  = 0;
+    size_t      size_max = 0; // 0 = unlimited
+    uint64_t    seed     = 0; // the key of the model and of the settings, hashed into the prefix hashes
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+    std::mutex mutex;
+    std::condition_variable cv;
 
-            // force F16 KV cache for the draft model for extra performance
-            cparams_dft.type_k = GGML_TYPE_F16;
-            cparams_dft.type_v = GGML_TYPE_F16;
+    std::unordered_map<uint64_t, std::string> index;   // prefix hash -> file with the longest stored continuation
+    std::unordered_map<std::string, entry>    entries; // file name -> entry
+    std::unordered_set<std::string>           pending; // files that are queued for writing
+    size_t size_total = 0;
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
-        }
+    std::deque<write_task> writes;
+    std::deque<read_task>  reads_queued;
+    std::thread            worker;
+    bool                   running = false;
 
-        chat_templates = common_chat_templates_init(model, params_base.chat_template);
-        try {
+    std::unordered_map<llama_seq_id, read_result> reads;
+    uint64_t n_reads = 0;
+
+    ~server_prefix_cache() {
+        if (worker.joinable()) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                running = false;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+    }
+
+    // FNV-1a
+    static uint64_t hash_bytes(uint64_t h, const void * data, size_t n) {
+        const uint8_t * p = (const uint8_t *) data;
+        for (size_t i = 0; i < n; ++i) {
+            h ^= p[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // the path, size and modification time of a file
+    static uint64_t hash_file_id(uint64_t h, const std::string & fname) {
+        h = hash_bytes(h, fname.data(), fname.size());
+
+        std::error_code ec;
+
+        const uint64_t size = std::filesystem::file_size(fname, ec);
+        if (!ec) {
+            h = hash_bytes(h, &size, sizeof(size));
+        }
+
+        const int64_t mtime = std::filesystem::last_write_time(fname, ec).time_since_epoch().count();
+        if (!ec) {
+            h = hash_bytes(h, &mtime, sizeof(mtime));
+        }
+
+        return h;
+    }
+
+    // the hash of each prefix is chained from the hash of the previous block
+    std::vector<uint64_t> prefix_hashes(const llama_tokens & tokens) const {
+        std::vector<uint64_t> res(tokens.size() / n_block);
+
+        uint64_t h = seed;
+        for (size_t i = 0; i < res.size(); ++i) {
+            h = hash_bytes(h, tokens.data() + i*n_block, n_block*sizeof(llama_token));
+            res[i] = h;
+        }
+
+        return res;
+    }
+
+    bool init(const common_params & params, const llama_model * model) {
+        n_block  = params.prefix_cache_block;
+        size_max = (size_t) params.prefix_cache_size*1024*1024;
+
+        // the KV state is only valid for the same model, the same settings that change the stored K and V and the same
+        // KV cache layout, so each of them gets its own directory. the key is also stored in the header of the files
+        {
+            seed = 0xcbf29ce484222325ULL;
+
+            // the model: its metadata (general.name, the hparams, ...) and its file, so that the fine-tunes of the same
+            // base, which share the metadata, do not share the files
+            char buf[512];
+            for (int32_t i = 0; i < llama_model_meta_count(model); ++i) {
+                if (llama_model_meta_key_by_index(model, i, buf, sizeof(buf)) >= 0) {
+                    seed = hash_bytes(seed, buf, strlen(buf));
+                }
+                if (llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf)) >= 0) {
+                    seed = hash_bytes(seed, buf, strlen(buf));
+                }
+            }
+
+            const uint64_t n_params = llama_model_n_params(model);
+            const uint64_t size     = llama_model_size(model);
+
+            seed = hash_bytes(seed, &n_params, sizeof(n_params));
+            seed = hash_bytes(seed, &size, sizeof(size));
+            seed = hash_file_id(seed, params.model);
+
+            // the RoPE and YaRN settings, as passed to the context (0 = from the model)
+            const llama_context_params cparams = common_context_params_to_llama(params);
+
+            const float rope[] = {
+                cparams.rope_freq_base, cparams.rope_freq_scale,
+                cparams.yarn_ext_factor, cparams.yarn_attn_factor, cparams.yarn_beta_fast, cparams.yarn_beta_slow,
+            };
+            const int32_t rope_i[] = { cparams.rope_scaling_type, (int32_t) cparams.yarn_orig_ctx };
+
+            seed = hash_bytes(seed, rope, sizeof(rope));
+            seed = hash_bytes(seed, rope_i, sizeof(rope_i));
+
+            // the control vectors, added to the inputs of the layers
+            for (const auto & cv : params.control_vectors) {
+                seed = hash_bytes(seed, &cv.strength, sizeof(cv.strength));
+                seed = hash_file_id(seed, cv.fname);
+            }
+
+            const int32_t layout[] = {
+                params.control_vector_layer_start, params.control_vector_layer_end,
+                params.cache_type_k, params.cache_type_v, params.flash_attn, params.kv_block_size,
+            };
+
+            seed = hash_bytes(seed, layout, sizeof(layout));
+        }
+
+        path = params.prefix_cache_path + string_format("%016" PRIx64, seed) + DIRECTORY_SEPARATOR;
+
+        if (!fs_create_directory_with_parents(path)) {
+            SRV_ERR("failed to create the prefix cache directory '%s'\n", path.c_str());
+            return false;
+        }
+
+        // rebuild the index from the headers of the stored files
+        std::error_code ec;
+        for (const auto & file : std::filesystem::directory_iterator(path, ec)) {
+            const std::string name = file.path().filename().string();
+
+            if (!file.is_regular_file(ec)) {
+                continue;
+            }
+
+            llama_tokens tokens;
+            if (file.path().extension() != ".bin" || !read_file(name, tokens, nullptr)) {
+                // interrupted writes and invalid files
+                std::filesystem::remove(file.path(), ec);
+                continue;
+            }
+
+            add(name, tokens, file.file_size(ec), 0);
+        }
+
+        evict("");
+
+        SRV_INF("prefix cache '%s': %zu files, %.2f MiB, block size = %zu\n", path.c_str(), entries.size(), size_total/1024.0/1024.0, n_block);
+
+        running = true;
+        worker  = std::thread([this]() { work_loop(); });
+
+        return true;
+    }
+
+    // read the tokens and, if state is not null, the KV state of a file. returns false if the file is invalid
+    bool read_file(const std::string & name, llama_tokens & tokens, std::vector<uint8_t> * state) const {
+        std::ifstream file(path + name, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return false;
+        }
+
+        const size_t size = file.tellg();
+        file.seekg(0);
+
+        uint32_t header[3];
+        uint64_t key;
+        if (!file.read((char *) header, sizeof(header)) || header[0] != LLAMA_STATE_SEQ_MAGIC || header[1] != LLAMA_STATE_SEQ_VERSION) {
+            return false;
+        }
+
+        // a file written for another model or other settings
+        if (!file.read((char *) &key, sizeof(key)) || key != seed) {
+            return false;
+        }
+
+        if (header[2] == 0 || size - header_size < (size_t) header[2]*sizeof(llama_token)) {
+            return false;
+        }
+
+        tokens.resize(header[2]);
+
+        if (!file.read((char *) tokens.data(), tokens.size()*sizeof(llama_token))) {
+            return false;
+        }
+
+        if (state) {
+            state->resize(size - header_size - tokens.size()*sizeof(llama_token));
+
+            if (!file.read((char *) state->data(), state->size())) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // must be called with the mutex locked
+    void add(const std::string & name, const llama_tokens & tokens, size_t size, int64_t t_used) {
+        entry & e = entries[name];
+
+        e.hashes   = prefix_hashes(tokens);
+        e.n_tokens = tokens.size();
+        e.size     = size;
+        e.t_used   = t_used;
+
+        size_total += size;
+
+        for (const uint64_t h : e.hashes) {
+            auto it = index.find(h);
+            if (it != index.end()) {
+                if (it->second == name) {
+                    continue;
+                }
+
+                // the new file holds the same prefix, the older one is dropped once none of its prefixes resolve to it
+                const std::string other = it->second;
+                it->second = name;
+                e.n_refs++;
+
+                if (--entries[other].n_refs == 0) {
+                    remove(other);
+                }
+            } else {
+                index[h] = name;
+                e.n_refs++;
+            }
+        }
+    }
+
+    // must be called with the mutex locked
+    void remove(const std::string & name) {
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            return;
+        }
+
+        for (const uint64_t h : it->second.hashes) {
+            auto ii = index.find(h);
+            if (ii != index.end() && ii->second == name) {
+                index.erase(ii);
+            }
+        }
+
+        size_total -= it->second.size;
+        entries.erase(it);
+
+        std::error_code ec;
+        std::filesystem::remove(path + name, ec);
+    }
+
+    // drop the least recently used files until the cache fits in its budget
+    // must be called with the mutex locked
+    void evict(const std::string & keep) {
+        while (size_max > 0 && size_total > size_max && entries.size() > 1) {
+            const std::string * lru = nullptr;
+            int64_t t_used = INT64_MAX;
+
+            for (const auto & it : entries) {
+                if (it.first != keep && it.second.t_used < t_used) {
+                    t_used = it.second.t_used;
+                    lru    = &it.first;
+                }
+            }
+
+            if (lru == nullptr) {
+                break;
+            }
+
+            SRV_DBG("prefix cache: evicting '%s'\n", lru->c_str());
+
+            remove(std::string(*lru));
+        }
+    }
+
+    // the reads are done before the writes, as a slot waits for them
+    void work_loop() {
+        while (true) {
+            read_task  rt;
+            write_task wt;
+            bool       is_read = false;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return !running || !writes.empty() || !reads_queued.empty(); });
+
+                if (running && !reads_queued.empty()) {
+                    rt = std::move(reads_queued.front());
+                    reads_queued.pop_front();
+                    is_read = true;
+                } else if (!writes.empty()) {
+                    wt = std::move(writes.front());
+                    writes.pop_front();
+                } else {
+                    // the queued writes are completed before exiting
+                    return;
+                }
+            }
+
+            if (is_read) {
+                read(rt);
+            } else {
+                write(wt);
+            }
+        }
+    }
+
+    void read(const read_task & task) {
+        llama_tokens         tokens;
+        std::vector<uint8_t> state;
+
+        const bool ok = read_file(task.name, tokens, &state);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (!ok) {
+            SRV_WRN("invalid prefix cache file '%s'\n", task.name.c_str());
+            remove(task.name);
+        }
+
+        // the result is dropped if the sequence has moved on to another prompt
+        auto it = reads.find(task.seq_id);
+        if (it == reads.end() || it->second.id != task.id) {
+            return;
+        }
+
+        it->second.done = true;
+
+        if (ok) {
+            it->second.tokens = std::move(tokens);
+            it->second.state  = std::move(state);
+        }
+
+        cv.notify_all();
+    }
+
+    void write(write_task & task) {
+        const std::string path_tmp = path + task.name + ".tmp";
+
+        bool ok;
+        {
+            std::ofstream file(path_tmp, std::ios::binary);
+
+            const uint32_t header[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) task.tokens.size() };
+
+            file.write((const char *) header, sizeof(header));
+            file.write((const char *) &seed, sizeof(seed));
+            file.write((const char *) task.tokens.data(), task.tokens.size()*sizeof(llama_token));
+            file.write((const char *) task.state.data(), task.state.size());
+            file.close();
+
+            ok = !file.fail();
+        }
+
+        // the file only becomes visible once it is complete
+        std::error_code ec;
+        if (ok) {
+            std::filesystem::rename(path_tmp, path + task.name, ec);
+        }
+        if (!ok || ec) {
+            SRV_WRN("failed to write the prefix cache file '%s'\n", path_tmp.c_str());
+            std::filesystem::remove(path_tmp, ec);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        pending.erase(task.name);
+
+        if (ok && !ec) {
+            add(task.name, task.tokens, header_size + task.tokens.size()*sizeof(llama_token) + task.state.size(), ggml_time_us());
+            evict(task.name);
+        }
+    }
+
+    // queue the KV state of the tokens of a sequence for writing, unless their prefix is already stored
+    void store(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens) {
+        if (tokens.size() < n_block) {
+            return;
+        }
+
+        const uint64_t h = prefix_hashes(tokens).back();
+
+        write_task task;
+        task.name = string_format("%016" PRIx64 ".bin", h);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            auto it = index.find(h);
+            if (it != index.end()) {
+                entries[it->second].t_used = ggml_time_us();
+                return;
+            }
+
+            if (!pending.insert(task.name).second) {
+                return;
+            }
+        }
+
+        // the state is copied right away, as the cells of the sequence are reused by the next task of the slot
+        task.tokens = tokens;
+        task.state.resize(llama_state_seq_get_size(ctx, seq_id));
+
+        const size_t n_state = llama_state_seq_get_data(ctx, task.state.data(), task.state.size(), seq_id);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (n_state != task.state.size()) {
+            pending.erase(task.name);
+            return;
+        }
+
+        writes.push_back(std::move(task));
+        cv.notify_one();
+    }
+
+    // find the longest stored prefix of the prompt that is longer than the n_past tokens that are already in the KV cache,
+    // and queue its file for reading in the background. the result is restored into the sequence by load()
+    void fetch(llama_seq_id seq_id, const llama_tokens & prompt, size_t n_past, size_t n_ctx) {
+        const auto hashes = prefix_hashes(prompt);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        reads.erase(seq_id);
+
+        for (size_t i = hashes.size(); i > 0 && i*n_block > n_past; --i) {
+            auto it = index.find(hashes[i - 1]);
+            if (it != index.end() && entries[it->second].n_tokens <= n_ctx) {
+                entries[it->second].t_used = ggml_time_us();
+
+                read_result & res = reads[seq_id];
+                res.id      = ++n_reads;
+                res.n_found = i*n_block;
+
+                reads_queued.push_back({ res.id, seq_id, it->second });
+                cv.notify_one();
+
+                return;
+            }
+        }
+    }
+
+    // true while the file found for the sequence is being read
+    bool reading(llama_seq_id seq_id) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        auto it = reads.find(seq_id);
+
+        return it != reads.end() && !it->second.done;
+    }
+
+    // block until the files found for the sequences have been read
+    void wait_reads() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        cv.wait(lock, [&]() {
+            for (const auto & it : reads) {
+                if (!it.second.done) {
+                    return false;
+                }
+            }
+            return true;
+        });
+    }
+
+    // restore the file read for the sequence, if it has more tokens in common with the prompt than the n_past tokens that
+    // are already in the KV cache. returns true if the sequence was modified, n_past is set to the number of tokens in it
+    bool load(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & prompt, size_t & n_past) {
+        read_result res;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            auto it = reads.find(seq_id);
+            if (it == reads.end() || !it->second.done) {
+                return false;
+            }
+
+            res = std::move(it->second);
+            reads.erase(it);
+        }
+
+        // also guards against hash collisions and prompts that were truncated after the file was found
+        const size_t n_keep = common_lcp(res.tokens, prompt);
+
+        if (n_keep <= n_past) {
+            if (!res.tokens.empty() && n_keep < res.n_found) {
+                SRV_DBG("prefix cache: %zu of the %zu found tokens match the prompt\n", n_keep, res.n_found);
+            }
+            return false;
+        }
+
+        // the stored state replaces the sequence and the part that is not common with the prompt is removed again
+        if (llama_state_seq_set_data(ctx, res.state.data(), res.state.size(), seq_id) == 0) {
+            SRV_WRN("failed to restore the prefix cache state of %zu tokens\n", res.tokens.size());
+
+            llama_kv_self_seq_rm(ctx, seq_id, -1, -1);
+
+            n_past = 0;
+            return true;
+        }
+
+        llama_kv_self_seq_rm(ctx, seq_id, n_keep, -1);
+
+        n_past = n_keep;
+
+        return true;
+    }
+};
+
+// prompt prefixes that stay in the KV cache after the slots that computed them have moved on
+// each entry keeps the cells of a prefix in a sequence of its own, after the sequences of the slots. a slot whose
+// prompt starts with the prefix attaches to the cells with seq_cp, so the cells are shared by the sequences and the
+// KV cache only copies them when a sequence diverges or is shifted (copy on write)
+// the entries are found through the hashes of the block-aligned prefixes of their tokens
+struct server_prefix_store {
+    struct entry {
+        llama_tokens     tokens; // empty if the entry is free
+        std::vector<int> slots;  // the slots attached to the entry, used as its reference count
+        int64_t          t_used = 0;
+    };
+
+    llama_seq_id seq_id_base = 0; // the sequence of entry i is seq_id_base + i
+    size_t       n_block     = 0;
+
+    std::vector<entry> entries;
+
+    std::unordered_map<uint64_t, int> index; // prefix hash -> an entry that holds the prefix
+
+    void init(llama_seq_id seq_id_base, int32_t n_entries, size_t n_block) {
+        this->seq_id_base = seq_id_base;
+        this->n_block     = n_block;
+
+        entries.assign(n_entries, entry());
+    }
+
+    bool enabled() const {
+        return !entries.empty();
+    }
+
+    // the hash of each block-aligned prefix of tokens[0, n), chained from the hash of the previous block
+    std::vector<uint64_t> prefix_hashes(const llama_token * tokens, size_t n) const {
+        std::vector<uint64_t> res(n / n_block);
+
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < res.size(); ++i) {
+            h = server_prefix_cache::hash_bytes(h, tokens + i*n_block, n_block*sizeof(llama_token));
+            res[i] = h;
+        }
+
+        return res;
+    }
+
+    void reindex() {
+        index.clear();
+
+        for (size_t id = 0; id < entries.size(); ++id) {
+            const auto & e = entries[id];
+            for (const uint64_t h : prefix_hashes(e.tokens.data(), e.tokens.size())) {
+                index[h] = id;
+            }
+        }
+    }
+
+    // the entry that holds the longest block-aligned prefix of tokens[0, n), or -1
+    // n_match is set to the length of the prefix
+    int find(const llama_token * tokens, size_t n, size_t & n_match) const {
+        const auto hashes = prefix_hashes(tokens, n);
+
+        for (size_t i = hashes.size(); i > 0; --i) {
+            const auto it = index.find(hashes[i - 1]);
+            if (it == index.end()) {
+                continue;
+            }
+
+            // guard against hash collisions
+            const auto & e = entries[it->second];
+            if (e.tokens.size() >= i*n_block && std::equal(tokens, tokens + i*n_block, e.tokens.begin())) {
+                n_match = i*n_block;
+                return it->second;
+            }
+        }
+
+        n_match = 0;
+        return -1;
+    }
+
+    // keep the cells of the block-aligned prefix of the first n tokens of a sequence, unless it is already stored
+    // an entry that holds a shorter part of the prefix is extended, otherwise a free entry or the least recently used
+    // one is taken, preferring the entries without slots attached
+    void add(llama_context * ctx, llama_seq_id seq_id, const llama_tokens & tokens, size_t n) {
+        n = std::min(n, tokens.size()) / n_block * n_block;
+        if (n == 0 || !enabled()) {
+            return;
+        }
+
+        size_t n_match = 0;
+        int id = find(tokens.data(), n, n_match);
+
+        if (id >= 0 && n_match == n) {
+            entries[id].t_used = ggml_time_us();
+            return;
+        }
+
+        if (id < 0 || entries[id].tokens.size() != n_match) {
+            id = 0;
+            for (size_t i = 1; i < entries.size(); ++i) {
+                const auto & a = entries[i];
+                const auto & b = entries[id];
+
+                if (a.tokens.empty() != b.tokens.empty()) {
+                    if (a.tokens.empty()) {
+                        id = i;
+                    }
+                } else if (a.slots.empty() != b.slots.empty()) {
+                    if (a.slots.empty()) {
+                        id = i;
+                    }
+                } else if (a.t_used < b.t_used) {
+                    id = i;
+                }
+            }
+
+            entries[id].slots.clear();
+        }
+
+        auto & e = entries[id];
+
+        SRV_DBG("prefix store: keeping %zu tokens of sequence %d in entry %d\n", n, seq_id, id);
+
+        llama_kv_self_seq_rm(ctx, seq_id_base + id, -1, -1);
+        llama_kv_self_seq_cp(ctx, seq_id, seq_id_base + id, 0, n);
+
+        e.tokens.assign(tokens.begin(), tokens.begin() + n);
+        e.t_used = ggml_time_us();
+
+        reindex();
+    }
+
+    // attach the sequence of a slot to the first n tokens of an entry, the previous cells of the slot from n_past are removed
+    void attach(llama_context * ctx, int id, int id_slot, size_t n_past, size_t n) {
+        auto & e = entries[id];
+
+        if (n > n_past) {
+            llama_kv_self_seq_rm(ctx, id_slot, n_past, -1);
+            llama_kv_self_seq_cp(ctx, seq_id_base + id, id_slot, n_past, n);
+        }
+
+        if (std::find(e.slots.begin(), e.slots.end(), id_slot) == e.slots.end()) {
+            e.slots.push_back(id_slot);
+        }
+
+        e.t_used = ggml_time_us();
+    }
+
+    // the slot does not use the prefix of any entry anymore
+    void detach(int id_slot) {
+        for (auto & e : entries) {
+            e.slots.erase(std::remove(e.slots.begin(), e.slots.end(), id_slot), e.slots.end());
+        }
+    }
+
+    // drop all entries to free their cells, returns true if there were any
+    bool clear(llama_context * ctx) {
+        bool cleared = false;
+
+        for (size_t id = 0; id < entries.size(); ++id) {
+            auto & e = entries[id];
+            if (e.tokens.empty()) {
+                continue;
+            }
+
+            llama_kv_self_seq_rm(ctx, seq_id_base + id, -1, -1);
+
+            e.tokens.clear();
+            e.slots.clear();
+
+            cleared = true;
+        }
+
+        index.clear();
+
+        return cleared;
+    }
+};
+
+// a fixed set of threads that run the iterations of a loop together with the calling thread
+// used for the work after a decode that only touches the state of each slot, such as sampling
+struct server_workers {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+
+    const std::function<void(int)> * job = nullptr;
+
+    int              n_iter = 0;
+    std::atomic<int> i_next = 0;
+    int              n_busy = 0;    // workers that have not finished the current job
+    uint64_t         n_jobs = 0;    // incremented for each job, wakes up the workers
+    bool             exiting = false;
+
+    ~server_workers() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            exiting = true;
+        }
+        cv_start.notify_all();
+
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    // n_threads includes the calling thread
+    void init(int n_threads) {
+        for (int i = 1; i < n_threads; ++i) {
+            threads.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    int n_threads() const {
+        return threads.size() + 1;
+    }
+
+    // call f(i) for each i in [0, n), returns once all the calls are done
+    void parallel_for(int n, const std::function<void(int)> & f) {
+        if (threads.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i) {
+                f(i);
+            }
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job    = &f;
+            n_iter = n;
+            i_next = 0;
+            n_busy = threads.size();
+            n_jobs++;
+        }
+        cv_start.notify_all();
+
+        run(f, n);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() { return n_busy == 0; });
+        job = nullptr;
+    }
+
+private:
+    void run(const std::function<void(int)> & f, int n) {
+        for (int i = i_next++; i < n; i = i_next++) {
+            f(i);
+        }
+    }
+
+    void worker_loop() {
+        uint64_t n_seen = 0;
+
+        while (true) {
+            const std::function<void(int)> * f;
+            int n;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_start.wait(lock, [&]() { return exiting || n_jobs != n_seen; });
+                if (exiting) {
+                    return;
+                }
+                n_seen = n_jobs;
+                f = job;
+                n = n_iter;
+            }
+
+            run(*f, n);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (--n_busy == 0) {
+                    cv_done.notify_one();
+                }
+            }
+        }
+    }
+};
+
+struct server_context {
+    common_params params_base;
+
+    // note: keep these alive - they determine the lifetime of the model, context, etc.
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
+
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+
+    const llama_vocab * vocab = nullptr;
+
+    llama_model * model_dft = nullptr;
+
+    llama_context_params cparams_dft;
+
+    // batched speculation: one draft context with a sequence for each slot
+    llama_context_ptr    ctx_dft;
+    common_speculative * spec = nullptr;
+
+    // lookup speculation: the n-grams of a large corpus, shared by all slots
+    // the lookup drafts do not use a dynamic cache - it stays empty
+    common_ngram_cache ngram_cache_static;
+    common_ngram_cache ngram_cache_dynamic;
+
+    llama_batch batch = {};
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+    bool has_eos_token  = false;
+
+    int32_t n_ctx; // total context for all clients / slots
+
+    // slots / clients
+    std::vector<server_slot> slots;
+    json default_generation_settings_for_props;
+
+    server_queue    queue_tasks;
+    server_response queue_results;
+
+    server_metrics metrics;
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    std::unique_ptr<server_prefix_cache> prefix_cache;
+
+    // prompt prefixes kept in the KV cache for the next slots that start with them
+    server_prefix_store prefix_store;
+
+    // the tokens in the KV cache of the slots, for finding the slots that share a prefix with a prompt
+    server_prompt_tree prompt_tree;
+
+    // sample the slots in parallel after each decode
+    server_workers workers_smpl;
+
+    // prompt tokens per batch that keep the batches with generating slots within the ITL target
+    int32_t n_prefill_itl = 0;
+
+    common_chat_templates_ptr chat_templates;
+
+    ~server_context() {
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            common_sampler_free(slot.smpl);
+            slot.smpl = nullptr;
+
+            llama_free(slot.ctx_dft);
+            slot.ctx_dft = nullptr;
+
+            common_speculative_free(slot.spec);
+            slot.spec = nullptr;
+
+            llama_batch_free(slot.batch_spec);
+        }
+
+        common_speculative_free(spec);
+        spec = nullptr;
+
+        llama_batch_free(batch);
+    }
+
+    bool load_model(const common_params & params) {
+        SRV_INF("loading model '%s'\n", params.model.c_str());
+
+        params_base = params;
+
+        llama_init = common_init_from_params(params_base);
+
+        model = llama_init.model.get();
+        ctx   = llama_init.context.get();
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params_base.model.c_str());
+            return false;
+        }
+
+        vocab = llama_model_get_vocab(model);
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_vocab_get_add_bos(vocab);
+        has_eos_token = llama_vocab_eos(vocab) != LLAMA_TOKEN_NULL;
+
+        if (!params_base.speculative.model.empty() || !params_base.speculative.hf_repo.empty()) {
+            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.c_str());
+
+            auto params_dft = params_base;
+
+            params_dft.devices      = params_base.speculative.devices;
+            params_dft.hf_file      = params_base.speculative.hf_file;
+            params_dft.hf_repo      = params_base.speculative.hf_repo;
+            params_dft.model        = params_base.speculative.model;
+            params_dft.model_url    = params_base.speculative.model_url;
+            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
+            params_dft.n_parallel   = 1;
+
+            llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model.get();
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.c_str());
+                return false;
+            }
+
+            if (!common_speculative_are_compatible(ctx, llama_init_dft.context.get())) {
+                SRV_ERR("the draft model '%s' is not compatible with the target model '%s'\n", params_base.speculative.model.c_str(), params_base.model.c_str());
+
+                return false;
+            }
+
+            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = n_ctx_dft;
+
+            // force F16 KV cache for the draft model for extra performance
+            cparams_dft.type_k = GGML_TYPE_F16;
+            cparams_dft.type_v = GGML_TYPE_F16;
+
+            // the context is not needed - we will create one for each slot
+            llama_init_dft.context.reset();
+
+            if (params_base.speculative.batched) {
+                // instead, a single context holds a sequence of the same size for each slot
+                cparams_dft.n_ctx     = n_ctx_dft*params_base.n_parallel;
+                cparams_dft.n_batch   = cparams_dft.n_ctx;
+                cparams_dft.n_seq_max = params_base.n_parallel;
+
+                ctx_dft.reset(llama_init_from_model(model_dft, cparams_dft));
+                if (ctx_dft == nullptr) {
+                    SRV_ERR("%s", "failed to create draft context\n");
+                    return false;
+                }
+
+                spec = common_speculative_init(ctx_dft.get());
+            }
+        }
+
+        if (!params_base.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = common_ngram_cache_load(params_base.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                SRV_ERR("failed to open static lookup cache: %s\n", params_base.lookup_cache_static.c_str());
+                return false;
+            }
+
+            SRV_INF("loaded static lookup cache '%s', %zu n-grams\n", params_base.lookup_cache_static.c_str(), ngram_cache_static.size());
+        }
+
+        chat_templates = common_chat_templates_init(model, params_base.chat_template);
+        try {
             common_chat_format_example(chat_templates.get(), params.use_jinja);
         } catch (const std::exception & e) {
             SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
@@ -1909,6 +3178,17 @@ struct server_context {
             chat_templates = common_chat_templates_init(model, "chatml");
         }
 
+        if (!params_base.prefix_cache_path.empty()) {
+            if (llama_model_is_recurrent(model)) {
+                SRV_WRN("%s", "the prefix cache is not supported by recurrent models, disabling it\n");
+            } else {
+                prefix_cache = std::make_unique<server_prefix_cache>();
+                if (!prefix_cache->init(params_base, model)) {
+                    return false;
+                }
+            }
+        }
+
         return true;
     }
 
@@ -1925,8 +3205,18 @@ struct server_context {
             slot.n_ctx = n_ctx_slot;
             slot.n_predict = params_base.n_predict;
 
-            if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+            if (spec) {
+                slot.spec_batched = true;
+            } else if (model_dft) {
+                const int32_t n_branch = params_base.speculative.n_branch;
+
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max*n_branch + 1, 0, n_branch);
+
+                // the other branches use sequences after the ones of the slots
+                slot.spec_seq_ids.push_back(slot.id);
+                for (int b = 1; b < n_branch; ++b) {
+                    slot.spec_seq_ids.push_back(params_base.n_parallel + slot.id*(n_branch - 1) + b - 1);
+                }
 
                 slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
                 if (slot.ctx_dft == nullptr) {
@@ -1945,7 +3235,10 @@ struct server_context {
 
             slot.params.sampling = params_base.sampling;
 
-            slot.callback_on_release = [this](int) {
+            slot.callback_on_release = [this](int id) {
+                prompt_tree_update(slots[id]);
+                prefix_store_add(slots[id]);
+                prefix_cache_store(slots[id]);
                 queue_tasks.pop_deferred_task();
             };
 
@@ -1956,16 +3249,358 @@ struct server_context {
 
         default_generation_settings_for_props = slots[0].to_json();
 
+        if (params_base.n_prefix_store > 0 && !llama_model_is_recurrent(model)) {
+            // the sequences of the entries follow the ones of the slots and of their draft branches
+            llama_seq_id seq_id_base = params_base.n_parallel;
+            if (model_dft && !spec) {
+                seq_id_base += params_base.n_parallel*(params_base.speculative.n_branch - 1);
+            }
+
+            prefix_store.init(seq_id_base, params_base.n_prefix_store, SERVER_PREFIX_STORE_BLOCK);
+        }
+
+        // the adapters of the requests are set on the sequences of their slots (see launch_slot_with_task)
+        llama_clear_adapter_lora(ctx);
+        llama_clear_adapter_lora_seq(ctx, -1);
+
         // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
         // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
         {
             const int32_t n_batch = llama_n_batch(ctx);
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
-        }
+            // only a single seq_id per token is needed
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+
+            n_prefill_itl = n_batch;
+        }
+
+        {
+            int32_t n_threads = params_base.n_threads_smpl;
+            if (n_threads < 0) {
+                n_threads = std::min(params_base.n_parallel, (int32_t) std::thread::hardware_concurrency());
+            }
+
+            workers_smpl.init(n_threads);
+
+            if (workers_smpl.n_threads() > 1) {
+                SRV_INF("sampling the slots with %d threads\n", workers_smpl.n_threads());
+            }
+        }
+
+        metrics.init();
+    }
+
+    // number of cached tokens of the slot that are in the KV cache
+    // the last sampled token and the tokens that are still waiting in the batch are not decoded yet
+    size_t slot_n_cached(const server_slot & slot) const {
+        // the max position is also 0 for an empty sequence, so a single cell is not counted
+        const llama_pos pos_max = llama_kv_self_seq_pos_max(ctx, slot.id);
+
+        return pos_max > 0 ? std::min<size_t>(slot.cache_tokens.size(), pos_max + 1) : 0;
+    }
+
+    // write the KV cache of the prompt and generation of a released slot to the prefix cache
+    void prefix_cache_store(const server_slot & slot) {
+        if (!prefix_cache || !slot.params.cache_prompt || slot.is_non_causal() || slot_has_lora(slot)) {
+            return;
+        }
+
+        const size_t n_cached = slot_n_cached(slot);
+
+        prefix_cache->store(ctx, slot.id, llama_tokens(slot.cache_tokens.begin(), slot.cache_tokens.begin() + n_cached));
+    }
+
+    // keep the cells of the prompt and generation of a released slot in the prefix store
+    void prefix_store_add(const server_slot & slot) {
+        if (!prefix_store.enabled() || !slot.params.cache_prompt || slot.is_non_causal() || slot_has_lora(slot)) {
+            return;
+        }
+
+        prefix_store.add(ctx, slot.id, slot.cache_tokens, slot_n_cached(slot));
+    }
+
+    // update the tokens of the slot in the prompt tree to the ones in its KV cache
+    void prompt_tree_update(const server_slot & slot) {
+        prompt_tree.insert(slot.id, slot.cache_tokens.data(), slot_n_cached(slot));
+    }
+
+    // the KV cache depends on the adapters, so it is not shared through the prefix cache
+    static bool slot_has_lora(const server_slot & slot) {
+        for (const auto & la : slot.lora) {
+            if (la.scale != 0.0f) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // max number of prompt tokens to add to a batch that already holds the n_decode tokens of the generating slots
+    // without generating slots there is no latency to protect and the prompts can use the whole batch
+    int32_t prefill_budget(int32_t n_decode, int32_t n_batch) const {
+        int32_t n_budget = n_batch - n_decode;
+
+        if (n_decode == 0) {
+            return n_budget;
+        }
+
+        if (params_base.n_prefill > 0) {
+            n_budget = std::min(n_budget, params_base.n_prefill);
+        }
+
+        if (params_base.target_itl > 0) {
+            n_budget = std::min(n_budget, n_prefill_itl);
+        }
+
+        return std::max(n_budget, 0);
+    }
+
+    // additive increase / multiplicative decrease of the prefill budget from the duration of the last batch
+    void prefill_update_itl(int64_t t_batch_us, int32_t n_decode, int32_t n_prompt, int32_t n_batch) {
+        if (params_base.target_itl <= 0 || n_decode == 0 || n_prompt == 0) {
+            return;
+        }
+
+        if (t_batch_us > 1000ll*params_base.target_itl) {
+            n_prefill_itl = std::max(SERVER_PREFILL_MIN, std::min(n_prefill_itl, n_prompt) / 2);
+        } else if (n_prompt >= n_prefill_itl) {
+            // only grow the budget when it was limiting the batch
+            n_prefill_itl = std::min(n_batch, n_prefill_itl + std::max(SERVER_PREFILL_MIN, n_prefill_itl / 8));
+        }
+
+        SRV_DBG("batch time = %.2f ms, n_decode = %d, n_prompt = %d, n_prefill_itl = %d\n", t_batch_us / 1e3, n_decode, n_prompt, n_prefill_itl);
+    }
+
+    // the cached prompts of the idle slots and the prefix store are the first to go when the KV cache is full
+    bool drop_idle_caches() {
+        bool freed = false;
+
+        for (auto & slot : slots) {
+            if (!slot.is_processing() && !slot.cache_tokens.empty()) {
+                SLT_INF(slot, "%s", "dropping the cached prompt to free the KV cache\n");
+
+                llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                slot.cache_tokens.clear();
+                prompt_tree.remove(slot.id);
+                prefix_store.detach(slot.id);
+
+                freed = true;
+            }
+        }
+
+        if (prefix_store.clear(ctx)) {
+            SRV_INF("%s", "dropping the prefix store to free the KV cache\n");
+
+            freed = true;
+        }
+
+        return freed;
+    }
+
+    // make room in the KV cache for the part of the batch that starts at i_start and failed to decode
+    // the cached prompts of the idle slots are dropped first, then the most recently started slot is preempted:
+    // its tokens are removed from the batch and its KV cache is moved to host memory, or recomputed on resume
+    bool preempt_slot(int32_t i_start) {
+        if (!params_base.preempt) {
+            return false;
+        }
+
+        if (drop_idle_caches()) {
+            return true;
+        }
+
+        size_t swap_used = 0;
+        for (const auto & slot : slots) {
+            swap_used += slot.swap_state.size();
+        }
+
+        const size_t swap_max = (size_t) params_base.swap_space*1024*1024;
+
+        server_slot * victim = nullptr;
+        size_t n_swap = 0;
+
+        int n_active = 0;
+
+        for (auto & slot : slots) {
+            if (slot.swapped || slot.state == SLOT_STATE_IDLE || slot.state == SLOT_STATE_STARTED) {
+                continue;
+            }
+
+            n_active++;
+
+            // non-causal prompts are processed at once
+            if (slot.is_non_causal()) {
+                continue;
+            }
+
+            // the token to sample is in a part of the batch that is already decoded, its logits would be lost
+            if (slot.i_batch >= 0 && slot.i_batch < i_start) {
+                continue;
+            }
+
+            if (victim && slot.t_start_process_prompt < victim->t_start_process_prompt) {
+                continue;
+            }
+
+            const size_t n_state = slot.n_past > 0 ? llama_state_seq_get_size(ctx, slot.id) : 0;
+
+            // the KV cache of a generating slot can only be recomputed from its cached tokens
+            const bool can_swap      = swap_used + n_state <= swap_max;
+            const bool can_recompute = slot.state != SLOT_STATE_GENERATING || slot.params.cache_prompt;
+
+            if (can_swap || can_recompute) {
+                victim = &slot;
+                n_swap = can_swap ? n_state : 0;
+            }
+        }
+
+        if (victim == nullptr || n_active < 2) {
+            return false;
+        }
+
+        server_slot & slot = *victim;
+
+        // remove the tokens of the slot from the part of the batch that is not decoded yet
+        for (auto & other : slots) {
+            if (other.id != slot.id && other.i_batch >= i_start) {
+                int32_t n_rm = 0;
+                for (int32_t j = i_start; j < other.i_batch; ++j) {
+                    n_rm += batch.seq_id[j][0] == slot.id;
+                }
+                other.i_batch -= n_rm;
+            }
+        }
+
+        int32_t n_rm = 0;
+        for (int32_t j = i_start; j < batch.n_tokens; ++j) {
+            if (batch.seq_id[j][0] == slot.id) {
+                n_rm++;
+                continue;
+            }
+
+            batch.token    [j - n_rm]    = batch.token   [j];
+            batch.pos      [j - n_rm]    = batch.pos     [j];
+            batch.n_seq_id [j - n_rm]    = batch.n_seq_id[j];
+            batch.seq_id   [j - n_rm][0] = batch.seq_id  [j][0];
+            batch.logits   [j - n_rm]    = batch.logits  [j];
+        }
+        batch.n_tokens -= n_rm;
+
+        // the drafted tokens that follow the sampled token are not counted in n_past
+        // if the token was already sampled in a previous part of the batch, only the rest of its draft is removed
+        int32_t n_rm_draft = 0;
+        if (slot.n_draft_batch > 0) {
+            n_rm_draft = slot.i_batch >= i_start ? n_rm - 1 : n_rm;
+        }
+
+        slot.n_past -= n_rm - n_rm_draft;
+        slot.i_batch = -1;
+
+        // the decoded part of a split draft is not kept in the saved state
+        llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+        slot.drafted.clear();
+        slot.n_draft_batch = 0;
+
+        if (slot.params.cache_prompt) {
+            slot.cache_tokens.resize(slot.n_past);
+        }
+
+        if (slot.state == SLOT_STATE_DONE_PROMPT) {
+            slot.state = SLOT_STATE_PROCESSING_PROMPT;
+        }
+
+        if (slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+            slot.n_prompt_tokens_processed -= n_rm;
+        }
+
+        if (n_swap > 0) {
+            slot.swap_state.resize(n_swap);
+            if (llama_state_seq_get_data(ctx, slot.swap_state.data(), n_swap, slot.id) != n_swap) {
+                slot.swap_state.clear();
+            }
+        }
+
+        if (slot.swap_state.empty() && slot.state == SLOT_STATE_PROCESSING_PROMPT) {
+            // the prompt is processed again on resume
+            slot.n_past = 0;
+            slot.n_prompt_tokens_processed = 0;
+            slot.cache_tokens.clear();
+        }
+
+        SLT_WRN(slot, "preempted, n_past = %d, %s\n", slot.n_past, slot.swap_state.empty() ? "recompute on resume" : string_format("swapped %.2f MiB to host memory", slot.swap_state.size()/1024.0/1024.0).c_str());
+
+        llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+        prompt_tree.remove(slot.id);
+        prefix_store.detach(slot.id);
+
+        slot.swapped = true;
+
+        return true;
+    }
+
+    // resume the preempted slots in the order they were started, as long as the KV cache has room for them
+    void resume_slots() {
+        std::vector<server_slot *> swapped;
+        for (auto & slot : slots) {
+            if (slot.swapped) {
+                swapped.push_back(&slot);
+            }
+        }
+
+        std::sort(swapped.begin(), swapped.end(), [](const server_slot * a, const server_slot * b) {
+            return a->t_start_process_prompt < b->t_start_process_prompt;
+        });
+
+        const int32_t n_batch = llama_n_batch(ctx);
+
+        for (auto * pslot : swapped) {
+            server_slot & slot = *pslot;
+
+            // leave room for a batch when other slots are running, so that the slot is not preempted again right away
+            bool running = false;
+            for (const auto & other : slots) {
+                running = running || (other.is_processing() && !other.swapped);
+            }
+
+            const int32_t n_need = slot.n_past + (running ? (int32_t) llama_n_ubatch(ctx) : 0);
+
+            auto n_free = [&]() {
+                return (int32_t) llama_n_ctx(ctx) - llama_kv_self_used_cells(ctx);
+            };
+
+            if (n_free() < n_need && (!drop_idle_caches() || n_free() < n_need)) {
+                break;
+            }
+
+            if (!slot.swap_state.empty()) {
+                if (llama_state_seq_set_data(ctx, slot.swap_state.data(), slot.swap_state.size(), slot.id) == 0) {
+                    break;
+                }
+            } else if (slot.state == SLOT_STATE_GENERATING) {
+                // recompute the KV cache of the tokens that were processed so far
+                llama_set_embeddings(ctx, false);
+
+                bool ok = true;
+                for (int32_t i = 0; i < slot.n_past && ok; i += n_batch) {
+                    common_batch_clear(batch);
+                    for (int32_t j = i; j < std::min(slot.n_past, i + n_batch); ++j) {
+                        common_batch_add(batch, slot.cache_tokens[j], j, { slot.id }, false);
+                    }
+
+                    ok = llama_decode(ctx, batch) == 0;
+                }
+
+                if (!ok) {
+                    llama_kv_self_seq_rm(ctx, slot.id, -1, -1);
+                    break;
+                }
+            }
+
+            SLT_INF(slot, "resumed, n_past = %d\n", slot.n_past);
 
-        metrics.init();
+            slot.swapped = false;
+            slot.swap_state.clear();
+        }
     }
 
     server_slot * get_slot_by_id(int id) {
@@ -1983,9 +3618,12 @@ struct server_context {
 
         // find the slot that has at least n% prompt similarity
         if (ret == nullptr && slot_prompt_similarity != 0.0f) {
-            int lcs_len = 0;
+            size_t lcp_len = 0;
             float similarity = 0;
 
+            // the tokens of the idle slots in the prompt tree are up to date
+            const auto n_match = prompt_tree.match(task.prompt_tokens, slots.size());
+
             for (server_slot & slot : slots) {
                 // skip the slot if it is not available
                 if (slot.is_processing()) {
@@ -1997,22 +3635,22 @@ struct server_context {
                     continue;
                 }
 
-                // length of the Longest Common Subsequence between the current slot's prompt and the input prompt
-                int cur_lcs_len = common_lcs(slot.cache_tokens, task.prompt_tokens);
+                // length of the common prefix of the current slot's cached tokens and the input prompt
+                const size_t cur_lcp_len = n_match[slot.id];
 
-                // fraction of the common subsequence length compared to the current slot's prompt length
-                float cur_similarity = static_cast<float>(cur_lcs_len) / static_cast<int>(slot.cache_tokens.size());
+                // fraction of the common prefix length compared to the current slot's prompt length
+                float cur_similarity = static_cast<float>(cur_lcp_len) / static_cast<int>(slot.cache_tokens.size());
 
                 // select the current slot if the criteria match
-                if (cur_lcs_len > lcs_len && cur_similarity > slot_prompt_similarity) {
-                    lcs_len = cur_lcs_len;
+                if (cur_lcp_len > lcp_len && cur_similarity > slot_prompt_similarity) {
+                    lcp_len = cur_lcp_len;
                     similarity = cur_similarity;
                     ret = &slot;
                 }
             }
 
             if (ret != nullptr) {
-                SLT_DBG(*ret, "selected slot by lcs similarity, lcs_len = %d, similarity = %f\n", lcs_len, similarity);
+                SLT_DBG(*ret, "selected slot by lcp similarity, lcp_len = %zu, similarity = %f\n", lcp_len, similarity);
             }
         }
 
@@ -2060,10 +3698,14 @@ struct server_context {
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
 
-        if (!are_lora_equal(task.params.lora, slot.lora)) {
+        if (!are_lora_equal(slot.params.lora, slot.lora)) {
             // if lora is changed, we cannot reuse cached tokens
             slot.cache_tokens.clear();
-            slot.lora = task.params.lora;
+            prompt_tree.remove(slot.id);
+            prefix_store.detach(slot.id);
+            slot.lora = slot.params.lora;
+
+            common_set_adapter_lora_seq(ctx, slot.id, slot.lora);
         }
 
         bool can_detokenize = can_be_detokenized(ctx, slot.prompt_tokens);
@@ -2099,7 +3741,12 @@ struct server_context {
         if (slot.ctx_dft) {
             llama_batch_free(slot.batch_spec);
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max*params_base.speculative.n_branch + 1, 0, params_base.speculative.n_branch);
+        }
+
+        // start reading a stored prefix of the prompt, so that it is ready when the prompt is processed
+        if (prefix_cache && slot.params.cache_prompt && !slot.is_non_causal() && !slot_has_lora(slot)) {
+            prefix_cache->fetch(slot.id, slot.prompt_tokens, common_lcp(slot.cache_tokens, slot.prompt_tokens), slot.n_ctx);
         }
 
         slot.state = SLOT_STATE_STARTED;
@@ -2732,6 +4379,9 @@ struct server_context {
                     std::string filename = task.slot_action.filename;
                     std::string filepath = task.slot_action.filepath;
 
+                    // the sequence of the slot is replaced, it no longer shares the cells of a stored prefix
+                    prefix_store.detach(slot->id);
+
                     slot->cache_tokens.resize(slot->n_ctx);
                     size_t token_count = 0;
                     size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, slot->cache_tokens.data(), slot->cache_tokens.size(), &token_count);
@@ -2741,6 +4391,7 @@ struct server_context {
                         break;
                     }
                     slot->cache_tokens.resize(token_count);
+                    prompt_tree_update(*slot);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_restore_ms = (t_end - t_start) / 1000.0;
@@ -2774,6 +4425,8 @@ struct server_context {
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_kv_self_seq_rm(ctx, slot->id, -1, -1);
                     slot->cache_tokens.clear();
+                    prompt_tree.remove(slot->id);
+                    prefix_store.detach(slot->id);
 
                     auto res = std::make_unique<server_task_result_slot_erase>();
                     res->id       = task.id;
@@ -2791,6 +4444,109 @@ struct server_context {
         }
     }
 
+    // draft from the n-grams of the cached tokens, the draft is verified in the next batch
+    void gen_draft_lookup(server_slot & slot, int n_draft_max) {
+        auto & tokens = slot.cache_tokens;
+
+        // the n-gram cache can only be appended to, changes in the middle of the tokens need a rebuild
+        if (slot.n_ngram == 0 || slot.n_ngram > tokens.size()) {
+            slot.ngram_cache.clear();
+            slot.n_ngram = 0;
+        }
+
+        common_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, tokens, tokens.size() - slot.n_ngram, false);
+        slot.n_ngram = tokens.size();
+
+        // only the last n-gram is looked up, followed by the sampled token
+        llama_tokens inp(tokens.end() - std::min<size_t>(tokens.size(), LLAMA_NGRAM_MAX), tokens.end());
+        inp.push_back(slot.sampled);
+
+        llama_tokens draft = { slot.sampled };
+
+        common_ngram_cache_draft(inp, draft, n_draft_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+        draft.erase(draft.begin());
+
+        // ignore small drafts
+        if (slot.params.speculative.n_min > (int) draft.size()) {
+            SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+            return;
+        }
+
+        slot.drafted = std::move(draft);
+    }
+
+    // draft for all the generating slots at once, the drafts are verified in the next batch
+    void gen_drafts() {
+        std::vector<common_speculative_draft> drafts;
+
+        for (auto & slot : slots) {
+            if (slot.n_draft_batch > 0) {
+                // the batch was split in the middle of the draft of the slot, drop the draft
+                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+            }
+
+            slot.drafted.clear();
+            slot.n_draft_batch = 0;
+
+            if (slot.state != SLOT_STATE_GENERATING || slot.swapped || !slot.can_speculate()) {
+                continue;
+            }
+
+            // determine the max draft that fits the current slot state
+            int n_draft_max = slot.params.speculative.n_max;
+
+            // note: n_past is not yet increased for the sampled token
+            //       also, need to leave space for 1 extra token to allow context shifts
+            n_draft_max = std::min(n_draft_max, slot.n_ctx - slot.n_past - 2);
+
+            if (slot.n_remaining > 0) {
+                n_draft_max = std::min(n_draft_max, slot.n_remaining - 1);
+            }
+
+            if (n_draft_max < slot.params.speculative.n_min) {
+                SLT_DBG(slot, "the max possible draft is too small: %d < %d - skipping speculative decoding\n", n_draft_max, slot.params.speculative.n_min);
+                continue;
+            }
+
+            if (slot.params.speculative.lookup) {
+                gen_draft_lookup(slot, n_draft_max);
+                continue;
+            }
+
+            if (!slot.spec_batched) {
+                continue;
+            }
+
+            common_speculative_draft draft;
+            draft.seq_id         = slot.id;
+            draft.params.n_draft = n_draft_max;
+            draft.params.p_min   = slot.params.speculative.p_min;
+            draft.prompt_tgt     = &slot.cache_tokens;
+            draft.id_last        = slot.sampled;
+
+            drafts.push_back(std::move(draft));
+        }
+
+        if (drafts.empty()) {
+            return;
+        }
+
+        common_speculative_gen_drafts(spec, drafts);
+
+        for (auto & draft : drafts) {
+            server_slot & slot = slots[draft.seq_id];
+
+            // ignore small drafts
+            if (slot.params.speculative.n_min > (int) draft.result.size()) {
+                SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.result.size(), slot.params.speculative.n_min);
+                continue;
+            }
+
+            slot.drafted = std::move(draft.result);
+        }
+    }
+
     void update_slots() {
         // check if all slots are idle
         {
@@ -2824,7 +4580,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+            if (slot.is_processing() && !slot.swapped && slot.n_past + 1 >= slot.n_ctx) {
                 if (!params_base.ctx_shift) {
                     // this check is redundant (for good)
                     // we should never get here, because generation should already stopped in process_token()
@@ -2854,9 +4610,16 @@ struct server_context {
                 slot.n_past -= n_discard;
 
                 slot.truncated = true;
+
+                // the n-grams are rebuilt from the shifted tokens
+                slot.n_ngram = 0;
+
+                prompt_tree_update(slot);
             }
         }
 
+        resume_slots();
+
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
@@ -2869,7 +4632,7 @@ struct server_context {
 
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
-            if (slot.state != SLOT_STATE_GENERATING) {
+            if (slot.state != SLOT_STATE_GENERATING || slot.swapped) {
                 continue;
             }
 
@@ -2884,6 +4647,15 @@ struct server_context {
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
 
+            // the draft is verified in the same batch, the drafted tokens are added to n_past once accepted
+            if (!slot.drafted.empty() && batch.n_tokens + (int32_t) slot.drafted.size() <= (int32_t) llama_n_batch(ctx)) {
+                for (size_t i = 0; i < slot.drafted.size(); ++i) {
+                    common_batch_add(batch, slot.drafted[i], slot.n_past + 1 + i, { slot.id }, true);
+                }
+
+                slot.n_draft_batch = slot.drafted.size();
+            }
+
             slot.n_past += 1;
 
             if (slot.params.cache_prompt) {
@@ -2898,9 +4670,21 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // the prompts share a budget of tokens so that long prompts do not stall the generating slots
+        const int32_t n_decode = batch.n_tokens;
+
+        int32_t n_prefill_left = prefill_budget(n_decode, n_batch);
+
+        // set if a prompt waits for its prefix cache file
+        bool slot_reading = false;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
+                if (slot.swapped) {
+                    continue;
+                }
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -2916,6 +4700,12 @@ struct server_context {
 
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
+                        // wait for the prefix cache file of the prompt, which is read in the background
+                        if (prefix_cache && prefix_cache->reading(slot.id)) {
+                            slot_reading = true;
+                            continue;
+                        }
+
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
 
@@ -3006,6 +4796,9 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_lcp(slot.cache_tokens, prompt_tokens);
 
+                                // the references to the prefix store are taken again below for the new prompt
+                                prefix_store.detach(slot.id);
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3049,6 +4842,83 @@ struct server_context {
 
                                     SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
                                 }
+
+                                // attach to a longer common prefix that is kept in the prefix store
+                                if (prefix_store.enabled() && !slot_has_lora(slot)) {
+                                    size_t n_match = 0;
+
+                                    const int id = prefix_store.find(prompt_tokens.data(), prompt_tokens.size(), n_match);
+                                    if (id >= 0) {
+                                        if (n_match > (size_t) slot.n_past) {
+                                            SLT_INF(slot, "sharing the KV cache of prompt tokens [%d, %zu) with the prefix store\n", slot.n_past, n_match);
+
+                                            slot.cache_tokens.resize(slot.n_past);
+                                            slot.cache_tokens.insert(slot.cache_tokens.end(), prompt_tokens.begin() + slot.n_past, prompt_tokens.begin() + n_match);
+                                        }
+
+                                        prefix_store.attach(ctx, id, slot.id, slot.n_past, n_match);
+
+                                        slot.n_past = std::max<size_t>(slot.n_past, n_match);
+                                    }
+                                }
+
+                                // attach to a longer common prefix that is already in the KV cache of another slot
+                                // the cells of the prefix are shared by the sequences, new cells are used only after the prompts diverge
+                                if (!llama_model_is_recurrent(model)) {
+                                    const server_slot * slot_src = nullptr;
+
+                                    size_t n_share = slot.n_past;
+
+                                    // the slot with the longest common prefix according to the prompt tree
+                                    const auto n_match = prompt_tree.match(prompt_tokens, slots.size());
+
+                                    for (const auto & other : slots) {
+                                        // the KV cache depends on the adapters of the sequence
+                                        if (other.id == slot.id || other.cache_tokens.empty() || !are_lora_equal(other.lora, slot.lora)) {
+                                            continue;
+                                        }
+
+                                        if (n_match[other.id] > n_share && (slot_src == nullptr || n_match[other.id] > n_match[slot_src->id])) {
+                                            slot_src = &other;
+                                        }
+                                    }
+
+                                    if (slot_src) {
+                                        // the tree lags behind the tokens generated by the other slot since its last update, and the
+                                        // tokens that are still waiting in the batch are not in the KV cache yet
+                                        n_share = std::min(common_lcp(slot_src->cache_tokens, prompt_tokens), slot_n_cached(*slot_src));
+                                        if (n_share <= (size_t) slot.n_past) {
+                                            slot_src = nullptr;
+                                        }
+                                    }
+
+                                    if (slot_src) {
+                                        SLT_INF(slot, "sharing the KV cache of prompt tokens [%d, %zu) with slot %d\n", slot.n_past, n_share, slot_src->id);
+
+                                        llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+                                        llama_kv_self_seq_cp(ctx, slot_src->id, slot.id, slot.n_past, n_share);
+
+                                        slot.cache_tokens.resize(slot.n_past);
+                                        slot.cache_tokens.insert(slot.cache_tokens.end(), prompt_tokens.begin() + slot.n_past, prompt_tokens.begin() + n_share);
+
+                                        slot.n_past = n_share;
+                                    }
+                                }
+
+                                // restore a longer prefix from the on-disk prefix cache
+                                if (prefix_cache && !slot_has_lora(slot)) {
+                                    size_t n_past = slot.n_past;
+
+                                    if (prefix_cache->load(ctx, slot.id, prompt_tokens, n_past)) {
+                                        SLT_INF(slot, "restored %zu prompt tokens from the prefix cache\n", n_past);
+
+                                        // the sequence no longer holds the cells of the prefix store
+                                        prefix_store.detach(slot.id);
+
+                                        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + n_past);
+                                        slot.n_past = n_past;
+                                    }
+                                }
                             }
                         }
 
@@ -3084,8 +4954,38 @@ struct server_context {
                     // remove the non-common part from the cache
                     slot.cache_tokens.resize(slot.n_past);
 
+                    if (slot.n_prompt_tokens_processed == 0) {
+                        prompt_tree_update(slot);
+                    }
+
+                    // the share of the prefill budget of this slot, the part that is not used goes to the next prompts
+                    // non-causal prompts are processed at once, and prompts that are waiting past the TTFT target are not limited
+                    int32_t n_share = n_batch;
+
+                    if (!slot.is_non_causal()) {
+                        const bool late = params_base.target_ttft > 0 && ggml_time_us() - slot.t_start_process_prompt > 1000ll*params_base.target_ttft;
+
+                        if (!late) {
+                            // this slot and the next ones that will add prompt tokens to the same batch
+                            int32_t n_prefill_slots = 1;
+
+                            for (size_t i = &slot - slots.data() + 1; i < slots.size(); ++i) {
+                                const auto & other = slots[i];
+
+                                if ((other.state == SLOT_STATE_PROCESSING_PROMPT || other.state == SLOT_STATE_STARTED) &&
+                                    !other.is_non_causal() && !other.swapped && slot_batched->can_batch_with(other)) {
+                                    n_prefill_slots++;
+                                }
+                            }
+
+                            n_share = (n_prefill_left + n_prefill_slots - 1) / n_prefill_slots;
+                        }
+                    }
+
+                    const int32_t n_tokens_prev = batch.n_tokens;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch && batch.n_tokens - n_tokens_prev < n_share) {
                         // without pooling, we want to output the embeddings for all the tokens in the batch
                         const bool need_embd = slot.task_type == SERVER_TASK_TYPE_EMBEDDING && llama_pooling_type(slot.ctx) == LLAMA_POOLING_TYPE_NONE;
 
@@ -3099,6 +4999,10 @@ struct server_context {
                         slot.n_past++;
                     }
 
+                    if (!slot.is_non_causal()) {
+                        n_prefill_left = std::max(0, n_prefill_left - (batch.n_tokens - n_tokens_prev));
+                    }
+
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
 
                     // entire prompt has been processed
@@ -3131,6 +5035,12 @@ struct server_context {
         }
 
         if (batch.n_tokens == 0) {
+            // nothing else to do until the prefix cache files of the waiting prompts are read
+            if (slot_reading) {
+                prefix_cache->wait_reads();
+                return;
+            }
+
             SRV_WRN("%s", "no tokens to decode\n");
             return;
         }
@@ -3140,10 +5050,10 @@ struct server_context {
         if (slot_batched) {
             // make sure we're in the right embedding mode
             llama_set_embeddings(ctx, slot_batched->is_non_causal());
-            // apply lora, only need to do it once per batch
-            common_set_adapter_lora(ctx, slot_batched->lora);
         }
 
+        const int64_t t_batch_start = ggml_time_us();
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -3162,6 +5072,21 @@ struct server_context {
             metrics.on_decoded(slots);
 
             if (ret != 0) {
+                if (ret > 0 && prefix_store.clear(ctx)) {
+                    SRV_WRN("%s", "dropped the prefix store to free the KV cache, retrying the batch\n");
+
+                    i -= n_batch;
+
+                    continue; // continue loop of n_batch
+                }
+
+                if (ret > 0 && preempt_slot(i)) {
+                    // retry the rest of the batch, without the tokens of the preempted slot
+                    i -= n_batch;
+
+                    continue; // continue loop of n_batch
+                }
+
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
                     SRV_ERR("failed to decode the batch: KV cache is full - try increasing it via the context size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
@@ -3181,6 +5106,9 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // the slots with a token to sample in this batch
+            std::vector<server_slot *> slots_smpl;
+
             for (auto & slot : slots) {
                 if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -3204,12 +5132,81 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    prompt_tree_update(slot);
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
+                slots_smpl.push_back(&slot);
+            }
+
+            // what is left to do for each slot once it is sampled
+            struct slot_smpl_result {
+                bool first   = false; // the first generated token - the prompt evaluation is done
+                bool draft   = false; // a draft was verified - the rejected tokens are still in the KV cache
+                bool stopped = false;
+            };
+
+            std::vector<slot_smpl_result> res_smpl(slots_smpl.size());
+
+            // sample each slot and process its tokens, including the detokenization, the stop strings and the
+            // partial responses - this only touches the state of the slot, so the slots are processed in parallel
+            const auto sample_slot = [&](int j) {
+                server_slot & slot = *slots_smpl[j];
+
+                slot_smpl_result & res = res_smpl[j];
+
                 const int tok_idx = slot.i_batch - i;
 
+                // verify the draft that was decoded together with the sampled token
+                // if the batch was split in the middle of the draft, the draft is dropped after the batch
+                if (slot.n_draft_batch > 0 && slot.i_batch + slot.n_draft_batch < (int) (i + n_tokens)) {
+                    std::vector<int> idxs(slot.n_draft_batch + 1);
+                    for (size_t k = 0; k < idxs.size(); ++k) {
+                        idxs[k] = tok_idx + k;
+                    }
+
+                    const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, idxs, slot.drafted);
+
+                    SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, slot.n_draft_batch, slot.n_past + (int) ids.size() - 1);
+
+                    slot.i_batch = -1;
+
+                    // the sampled token is already in n_past and in the cached tokens
+                    slot.n_past += ids.size() - 1;
+
+                    slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
+
+                    res.draft = true;
+
+                    slot.drafted.clear();
+                    slot.n_draft_batch = 0;
+
+                    slot.t_token_generation = (ggml_time_us() - slot.t_start_generation) / 1e3;
+
+                    for (size_t k = 0; k < ids.size(); ++k) {
+                        // counted one at a time, so that the budget check in process_token() sees the tokens before it
+                        slot.n_decoded += 1;
+
+                        completion_token_output result;
+                        result.tok          = ids[k];
+                        result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                        result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+
+                        if (slot.params.sampling.n_probs > 0) {
+                            populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx + k);
+                        }
+
+                        if (!process_token(result, slot)) {
+                            res.stopped = true;
+                            break;
+                        }
+                    }
+
+                    return;
+                }
+
                 llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
 
                 slot.i_batch = -1;
@@ -3223,7 +5220,7 @@ struct server_context {
                 if (slot.n_decoded == 1) {
                     slot.t_start_generation = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+                    res.first = true;
                 }
 
                 slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
@@ -3238,18 +5235,73 @@ struct server_context {
                 }
 
                 if (!process_token(result, slot)) {
+                    res.stopped = true;
+                }
+            };
+
+            if (!slots_smpl.empty()) {
+                // wait for the logits here, so that the threads only read them
+                llama_synchronize(ctx);
+
+                workers_smpl.parallel_for(slots_smpl.size(), sample_slot);
+            }
+
+            // update the shared state in the order of the slots
+            for (size_t k = 0; k < slots_smpl.size(); ++k) {
+                server_slot & slot = *slots_smpl[k];
+
+                if (res_smpl[k].first) {
+                    metrics.on_prompt_eval(slot);
+                }
+
+                if (res_smpl[k].draft) {
+                    llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+                }
+
+                if (res_smpl[k].stopped) {
                     // release slot because of stop condition
                     slot.release();
                     slot.print_timings();
                     send_final_response(slot);
                     metrics.on_prediction(slot);
-                    continue;
                 }
             }
 
+            // process the tokens accepted from a draft that was verified after the sampled token id
+            auto process_draft = [&](server_slot & slot, llama_token id, const llama_tokens & ids) {
+                slot.n_past += ids.size();
+
+                slot.cache_tokens.push_back(id);
+                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
+
+                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
+
+                for (size_t i = 0; i < ids.size(); ++i) {
+                    slot.n_decoded += 1;
+
+                    completion_token_output result;
+
+                    result.tok          = ids[i];
+                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                    result.prob         = 1.0f; // set later
+
+                    // TODO: set result.probs
+
+                    if (!process_token(result, slot)) {
+                        // release slot because of stop condition
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        metrics.on_prediction(slot);
+                        break;
+                    }
+                }
+            };
+
             // do speculative decoding
             for (auto & slot : slots) {
-                if (!slot.is_processing() || !slot.can_speculate()) {
+                // batched and lookup speculation are done once the whole batch is decoded
+                if (!slot.is_processing() || slot.swapped || !slot.can_speculate() || slot.spec_batched || slot.params.speculative.lookup) {
                     continue;
                 }
 
@@ -3282,6 +5334,36 @@ struct server_context {
                 params_spec.n_draft   = n_draft_max;
                 params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
                 params_spec.p_min     = slot.params.speculative.p_min;
+                params_spec.n_branch  = params_base.speculative.n_branch;
+                params_spec.p_split   = params_base.speculative.p_split;
+
+                if (params_spec.n_branch > 1) {
+                    common_speculative_tree tree = common_speculative_gen_tree(slot.spec, params_spec, slot.cache_tokens, id);
+
+                    // ignore small drafts
+                    if (slot.params.speculative.n_min > (int) tree.tokens.size()) {
+                        SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) tree.tokens.size(), slot.params.speculative.n_min);
+
+                        continue;
+                    }
+
+                    // all branches of the tree are verified in one decode
+                    common_batch_clear(slot.batch_spec);
+                    common_speculative_tree_prepare(ctx, slot.batch_spec, tree, id, slot.n_past, slot.spec_seq_ids);
+
+                    SLT_DBG(slot, "decoding speculative tree, size = %d, branches = %d\n", slot.batch_spec.n_tokens, tree.n_branch);
+
+                    llama_decode(ctx, slot.batch_spec);
+
+                    // the accepted tokens from the tree, the accepted branch is moved to the sequence of the slot
+                    const auto ids = common_speculative_tree_accept(slot.smpl, ctx, tree, 0, slot.n_past, slot.spec_seq_ids);
+
+                    process_draft(slot, id, ids);
+
+                    SLT_DBG(slot, "accepted %d/%d tree tokens, new n_past = %d\n", (int) ids.size() - 1, (int) tree.tokens.size(), slot.n_past);
+
+                    continue;
+                }
 
                 llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, slot.cache_tokens, id);
 
@@ -3307,37 +5389,16 @@ struct server_context {
                 // the accepted tokens from the speculation
                 const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
 
-                slot.n_past    += ids.size();
-                slot.n_decoded += ids.size();
-
-                slot.cache_tokens.push_back(id);
-                slot.cache_tokens.insert(slot.cache_tokens.end(), ids.begin(), ids.end() - 1);
-
-                llama_kv_self_seq_rm(ctx, slot.id, slot.n_past, -1);
-
-                for (size_t i = 0; i < ids.size(); ++i) {
-                    completion_token_output result;
-
-                    result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                    result.prob         = 1.0f; // set later
-
-                    // TODO: set result.probs
-
-                    if (!process_token(result, slot)) {
-                        // release slot because of stop condition
-                        slot.release();
-                        slot.print_timings();
-                        send_final_response(slot);
-                        metrics.on_prediction(slot);
-                        break;
-                    }
-                }
+                process_draft(slot, id, ids);
 
                 SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
             }
         }
 
+        gen_drafts();
+
+        prefill_update_itl(ggml_time_us() - t_batch_start, n_decode, batch.n_tokens - n_decode, llama_n_batch(ctx));
+
         SRV_DBG("%s", "run slots completed\n");
     }
 
@@ -3402,24 +5463,30 @@ int main(int argc, char ** argv) {
     LOG_INF("%s\n", common_params_get_system_info(params).c_str());
     LOG_INF("\n");
 
-    std::unique_ptr<httplib::Server> svr;
+    std::unique_ptr<server_http> svr;
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
     if (params.ssl_file_key != "" && params.ssl_file_cert != "") {
         LOG_INF("Running with SSL: key = %s, cert = %s\n", params.ssl_file_key.c_str(), params.ssl_file_cert.c_str());
-        svr.reset(
-            new httplib::SSLServer(params.ssl_file_cert.c_str(), params.ssl_file_key.c_str())
-        );
+        svr.reset(new server_http_httplib(std::make_unique<httplib::SSLServer>(params.ssl_file_cert.c_str(), params.ssl_file_key.c_str())));
     } else {
         LOG_INF("Running without SSL\n");
-        svr.reset(new httplib::Server());
     }
 #else
     if (params.ssl_file_key != "" && params.ssl_file_cert != "") {
         LOG_ERR("Server is built without SSL support\n");
         return 1;
     }
-    svr.reset(new httplib::Server());
 #endif
+    if (!svr && params.http_epoll) {
+#ifdef SERVER_HTTP_EPOLL
+        svr.reset(new server_http_epoll());
+#else
+        LOG_WRN("%s: the epoll HTTP front-end is not supported on this platform\n", __func__);
+#endif
+    }
+    if (!svr) {
+        svr.reset(new server_http_httplib(std::make_unique<httplib::Server>()));
+    }
 
     std::atomic<server_state> state{SERVER_STATE_LOADING_MODEL};
 
@@ -3924,19 +5991,17 @@ int main(int argc, char ** argv) {
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
             const auto chunked_content_provider = [task_ids, &ctx_server, oaicompat](size_t, httplib::DataSink & sink) {
+                // the buffer of the events is reused for the whole stream
+                std::string events;
+
                 ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
-                    json res_json = result->to_json();
-                    if (res_json.is_array()) {
-                        for (const auto & res : res_json) {
-                            if (!server_sent_event(sink, "data", res)) {
-                                // sending failed (HTTP connection closed), cancel the generation
-                                return false;
-                            }
-                        }
-                        return true;
-                    } else {
-                        return server_sent_event(sink, "data", res_json);
-                    }
+                    events.clear();
+                    result->to_sse(events);
+
+                    LOG_DBG("data stream, to_send: %s", events.c_str());
+
+                    // sending failed (HTTP connection closed), cancel the generation
+                    return sink.write(events.data(), events.size());
                 }, [&](const json & error_data) {
                     server_sent_event(sink, "error", error_data);
                 }, [&sink]() {
@@ -4445,7 +6510,7 @@ int main(int argc, char ** argv) {
         params.n_threads_http = std::max(params.n_parallel + 2, (int32_t) std::thread::hardware_concurrency() - 1);
     }
     log_data["n_threads_http"] =  std::to_string(params.n_threads_http);
-    svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
+    svr->set_n_threads(params.n_threads_http);
 
     // clean up function, to be called before exit
     auto clean_up = [&svr]() {
@@ -16,6 +16,7 @@
 #include "json.hpp"
 #include "chat.h"
 
+#include <charconv>
 #include <random>
 #include <sstream>
 #include <string>
@@ -490,17 +491,121 @@ static std::string tokens_to_output_formatted_string(const llama_context * ctx,
     return out;
 }
 
+static void server_sent_event_append(std::string & out, const char * event, const json & data) {
+    out += event;
+    out += ": ";
+    out += data.dump(-1, ' ', false, json::error_handler_t::replace);
+    out += "\n\n"; // required by RFC 8895 - A message is terminated by a blank line (two line terminators in a row).
+}
+
 static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
-    const std::string str =
-        std::string(event) + ": " +
-        data.dump(-1, ' ', false, json::error_handler_t::replace) +
-        "\n\n"; // required by RFC 8895 - A message is terminated by a blank line (two line terminators in a row).
+    std::string str;
+    server_sent_event_append(str, event, data);
 
     LOG_DBG("data stream, to_send: %s", str.c_str());
 
     return sink.write(str.c_str(), str.size());
 }
 
+//
+// hand-written JSON for the hot paths, same output as json::dump(-1, ' ', false, json::error_handler_t::replace)
+//
+
+static void json_append_int(std::string & out, int64_t val) {
+    char buf[24];
+    const auto res = std::to_chars(buf, buf + sizeof(buf), val);
+    out.append(buf, res.ptr);
+}
+
+// UTF-8 decoder of Bjoern Hoehrmann, same table as nlohmann::detail::serializer::decode
+static uint8_t json_utf8_decode(uint8_t & state, uint8_t byte) {
+    static const uint8_t utf8d[400] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00..1F
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 20..3F
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 40..5F
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 60..7F
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, 9, // 80..9F
+        7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, // A0..BF
+        8, 8, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // C0..DF
+        0xA, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x3, 0x4, 0x3, 0x3, // E0..EF
+        0xB, 0x6, 0x6, 0x6, 0x5, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, 0x8, // F0..FF
+        0x0, 0x1, 0x2, 0x3, 0x5, 0x8, 0x7, 0x1, 0x1, 0x1, 0x4, 0x6, 0x1, 0x1, 0x1, 0x1, // s0..s0
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 0, 1, 0, 1, 1, 1, 1, 1, 1, // s1..s2
+        1, 2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, // s3..s4
+        1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 3, 1, 3, 1, 1, 1, 1, 1, 1, // s5..s6
+        1, 3, 1, 1, 1, 1, 1, 3, 1, 3, 1, 1, 1, 1, 1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // s7..s8
+    };
+
+    state = utf8d[256u + state*16u + utf8d[byte]];
+    return state;
+}
+
+static void json_append_str(std::string & out, const std::string & str) {
+    static const char * hex = "0123456789abcdef";
+
+    constexpr uint8_t UTF8_ACCEPT = 0;
+    constexpr uint8_t UTF8_REJECT = 1;
+
+    out += '"';
+
+    uint8_t state = UTF8_ACCEPT;
+    size_t  start = 0; // first byte of the pending multi-byte sequence
+
+    const size_t n = str.size();
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t c = str[i];
+
+        switch (json_utf8_decode(state, c)) {
+            case UTF8_ACCEPT:
+                if (c >= 0x80) {
+                    // last byte of a valid multi-byte sequence
+                    out.append(str, start, i + 1 - start);
+                    break;
+                }
+                switch (c) {
+                    case '"':  out += "\\\""; break;
+                    case '\\': out += "\\\\"; break;
+                    case '\b': out += "\\b";  break;
+                    case '\f': out += "\\f";  break;
+                    case '\n': out += "\\n";  break;
+                    case '\r': out += "\\r";  break;
+                    case '\t': out += "\\t";  break;
+                    default:
+                        if (c < 0x20) {
+                            out += "\\u00";
+                            out += hex[c >> 4];
+                            out += hex[c & 0xf];
+                        } else {
+                            out += (char) c;
+                        }
+                }
+                break;
+            case UTF8_REJECT:
+                // the byte may be valid on its own but not as part of the pending sequence - read it again
+                if (i > start) {
+                    --i;
+                }
+                out += "\xef\xbf\xbd";
+                state = UTF8_ACCEPT;
+                break;
+            default:
+                // incomplete multi-byte sequence
+                break;
+        }
+
+        if (state == UTF8_ACCEPT) {
+            start = i + 1;
+        }
+    }
+
+    if (state != UTF8_ACCEPT) {
+        // truncated sequence at the end of the string
+        out += "\xef\xbf\xbd";
+    }
+
+    out += '"';
+}
+
 //
 // OAI utils
 //
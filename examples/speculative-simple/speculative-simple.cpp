@@ -96,6 +96,9 @@ int main(int argc, char ** argv) {
 
     float p_min = params.speculative.p_min;
 
+    // draft a tree with several branches instead of a single sequence of tokens
+    int n_branch = params.speculative.n_branch;
+
     int n_predict = 0;
     int n_drafted = 0;
     int n_accept  = 0;
@@ -126,19 +129,33 @@ int main(int argc, char ** argv) {
 
     // init the speculator
     struct common_speculative_params params_spec;
-    params_spec.n_draft = n_draft;
-    params_spec.n_reuse = llama_n_ctx(ctx_dft) - n_draft;
-    params_spec.p_min   = p_min;
+    params_spec.n_draft  = n_draft;
+    params_spec.n_reuse  = llama_n_ctx(ctx_dft) - n_draft;
+    params_spec.p_min    = p_min;
+    params_spec.n_branch = n_branch;
+    params_spec.p_split  = params.speculative.p_split;
+
+    // the target sequence of each branch of the tree, the accepted branch is always moved to sequence 0
+    std::vector<llama_seq_id> seq_ids(n_branch);
+    for (int b = 0; b < n_branch; ++b) {
+        seq_ids[b] = b;
+    }
 
     struct common_speculative * spec = common_speculative_init(ctx_dft);
 
-    llama_batch batch_tgt = llama_batch_init(llama_n_batch(ctx_tgt), 0, 1);
+    llama_batch batch_tgt = llama_batch_init(llama_n_batch(ctx_tgt), 0, n_branch);
 
     const auto t_enc_end = ggml_time_us();
 
     const auto t_dec_start = ggml_time_us();
 
     while (true) {
+        // the tokens accepted by the target in this step
+        llama_tokens ids;
+
+        // the number of drafted tokens that were evaluated by the target
+        int n_draft_cur = 0;
+
         // optionally, generate draft tokens that can be appended to the target batch
         //
         // this is the most important part of the speculation. the more probable tokens that are provided here
@@ -146,45 +163,70 @@ int main(int argc, char ** argv) {
         // offloaded to a remote device. it doesn't even have to be based on an LLM. instead, it can provide tokens
         // from a cache or lookup tables.
         //
-        llama_tokens draft = common_speculative_gen_draft(spec, params_spec, prompt_tgt, id_last);
-
-        //LOG_DBG("draft: %s\n", string_from(ctx_dft, draft).c_str());
-
-        // always have a token to evaluate from before - id_last
-        common_batch_clear(batch_tgt);
-        common_batch_add  (batch_tgt, id_last, n_past++, { 0 }, true);
+        if (n_branch > 1) {
+            // draft several alternatives where the draft model is not sure - the tokens shared by several branches
+            // are added to the batch once, with the sequences of all of them, so each branch only attends to its path
+            common_speculative_tree tree = common_speculative_gen_tree(spec, params_spec, prompt_tgt, id_last);
 
-        // evaluate the target model on [id_last, draft0, draft1, ..., draftN-1]
-        {
             // do not waste time on small drafts
-            if (draft.size() < (size_t) n_draft_min) {
-                draft.clear();
+            if (tree.tokens.size() < (size_t) n_draft_min) {
+                tree = common_speculative_tree();
             }
 
-            for (size_t i = 0; i < draft.size(); ++i) {
-                common_batch_add(batch_tgt, draft[i], n_past + i, { 0 }, true);
+            // evaluate the target model on id_last and all the branches of the tree
+            common_batch_clear(batch_tgt);
+            common_speculative_tree_prepare(ctx_tgt, batch_tgt, tree, id_last, n_past++, seq_ids);
+
+            llama_decode(ctx_tgt, batch_tgt);
+
+            // follow the tree as long as the target sampler agrees with one of the branches
+            // the accepted branch ends up in sequence 0, the other branches are removed
+            ids = common_speculative_tree_accept(smpl, ctx_tgt, tree, 0, n_past - 1, seq_ids);
+
+            n_draft_cur = tree.tokens.size();
+        } else {
+            llama_tokens draft = common_speculative_gen_draft(spec, params_spec, prompt_tgt, id_last);
+
+            //LOG_DBG("draft: %s\n", string_from(ctx_dft, draft).c_str());
+
+            // always have a token to evaluate from before - id_last
+            common_batch_clear(batch_tgt);
+            common_batch_add  (batch_tgt, id_last, n_past++, { 0 }, true);
+
+            // evaluate the target model on [id_last, draft0, draft1, ..., draftN-1]
+            {
+                // do not waste time on small drafts
+                if (draft.size() < (size_t) n_draft_min) {
+                    draft.clear();
+                }
+
+                for (size_t i = 0; i < draft.size(); ++i) {
+                    common_batch_add(batch_tgt, draft[i], n_past + i, { 0 }, true);
+                }
+
+                //LOG_DBG("target batch: %s\n", string_from(ctx_tgt, batch_tgt).c_str());
+
+                llama_decode(ctx_tgt, batch_tgt);
             }
 
-            //LOG_DBG("target batch: %s\n", string_from(ctx_tgt, batch_tgt).c_str());
+            // sample from the full target batch and return the accepted tokens based on the target sampler
+            //
+            // for each token to be accepted, the sampler would have to sample that same token
+            // in such cases, instead of decoding the sampled token as we normally do, we simply continue with the
+            // available logits from the batch and sample the next token until we run out of logits or the sampler
+            // disagrees with the draft
+            //
+            ids = common_sampler_sample_and_accept_n(smpl, ctx_tgt, draft);
 
-            llama_decode(ctx_tgt, batch_tgt);
+            n_draft_cur = draft.size();
         }
 
-        // sample from the full target batch and return the accepted tokens based on the target sampler
-        //
-        // for each token to be accepted, the sampler would have to sample that same token
-        // in such cases, instead of decoding the sampled token as we normally do, we simply continue with the
-        // available logits from the batch and sample the next token until we run out of logits or the sampler
-        // disagrees with the draft
-        //
-        const auto ids = common_sampler_sample_and_accept_n(smpl, ctx_tgt, draft);
-
         //LOG_DBG("ids: %s\n", string_from(ctx_tgt, ids).c_str());
 
         GGML_ASSERT(ids.size() > 0); // there will always be at least one accepted token
 
         n_past    += ids.size() - 1;
-        n_drafted += draft.size(); // note: we ignore the discarded small drafts
+        n_drafted += n_draft_cur; // note: we ignore the discarded small drafts
         n_accept  += ids.size() - 1;
         n_predict += ids.size();
 
@@ -212,7 +254,7 @@ int main(int argc, char ** argv) {
             }
         }
 
-        LOG_DBG("accepted %d/%d draft tokens, the last target token is: (%d)\n", (int) ids.size() - 1, (int) draft.size(), id_last);
+        LOG_DBG("accepted %d/%d draft tokens, the last target token is: (%d)\n", (int) ids.size() - 1, n_draft_cur, id_last);
 
         {
             LOG_DBG("clear kv cache from any extra tokens, n_past = %d\n", n_past);
@@ -236,6 +278,7 @@ int main(int argc, char ** argv) {
 
     LOG_INF("\n");
     LOG_INF("n_draft   = %d\n", n_draft);
+    LOG_INF("n_branch  = %d\n", n_branch);
     LOG_INF("n_predict = %d\n", n_predict);
     LOG_INF("n_drafted = %d\n", n_drafted);
     LOG_INF("n_accept  = %d\n", n_accept);
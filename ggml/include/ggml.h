@@ -2206,6 +2206,7 @@ extern "C" {
         uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling)
         bool                strict_cpu;                  // strict cpu placement
         bool                paused;                      // start in paused state
+        bool                dep_sched;                   // run independent nodes between the same barriers (default: false)
     };
 
     struct ggml_threadpool;     // forward declaration, see ggml.c
@@ -95,6 +95,10 @@ typedef double ggml_float;
 #define GGML_VEC_DOT_UNROLL  2
 #define GGML_VEC_MAD_UNROLL  32
 
+// tile sizes of the flash attention kernel: rows of Q (tokens x heads sharing a KV head) and rows of K/V
+#define GGML_FA_TILE_Q  32
+#define GGML_FA_TILE_KV 64
+
 //
 // global data
 //
@@ -1361,6 +1365,14 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+#define GGML_NUMA_MAX_NODES 8
+#define GGML_NUMA_MAX_CPUS 512
+
+// chunk counter of the threads of a NUMA node
+struct ggml_numa_chunk {
+    atomic_int GGML_CACHE_ALIGN n;
+};
+
 // Threadpool def
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
@@ -1375,6 +1387,22 @@ struct ggml_threadpool {
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
     atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
 
+    struct ggml_numa_chunk numa_chunk[GGML_NUMA_MAX_NODES]; // per node chunks during Mat_Mul with NUMA partitioned weights
+
+    // dependency-aware scheduling: the nodes of the graph are grouped in levels of independent nodes
+    // and the threads only synchronize between levels
+    bool   dep_sched;
+    int  * sched_nodes;    // node indices, ordered by level
+    int  * sched_levels;   // start of each level in sched_nodes [n_levels + 1]
+    int  * sched_work;     // scratch for building the levels
+    int    sched_n_levels; // 0 - run the nodes in lockstep
+    int    sched_size;     // number of nodes the buffers can hold
+
+    // the levels are reused while the graph, its nodes and their memory do not change
+    const struct ggml_cgraph * sched_graph;
+    int                        sched_n_nodes;
+    uint64_t                   sched_hash;
+
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
@@ -2417,9 +2445,6 @@ static inline void ggml_thread_cpu_relax(void) {;}
 // NUMA support
 //
 
-#define GGML_NUMA_MAX_NODES 8
-#define GGML_NUMA_MAX_CPUS 512
-
 struct ggml_numa_node {
     uint32_t cpus[GGML_NUMA_MAX_CPUS]; // hardware threads on this node
     uint32_t n_cpus;
@@ -2593,6 +2618,86 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// with the partition strategy, the rows of each weight matrix are split evenly across the nodes and
+// the threads of a node (ith % n_nodes, see set_numa_thread_affinity) only compute the rows of their node
+static bool ggml_numa_partitioned(const struct ggml_tensor * tensor) {
+    if (!ggml_is_numa() || g_state.numa.numa_strategy != GGML_NUMA_STRATEGY_PARTITION) {
+        return false;
+    }
+
+    return tensor->buffer && ggml_backend_buffer_is_host(tensor->buffer) &&
+        ggml_backend_buffer_get_usage(tensor->buffer) == GGML_BACKEND_BUFFER_USAGE_WEIGHTS &&
+        tensor->ne[1] >= (int64_t) g_state.numa.n_nodes;
+}
+
+static void ggml_numa_node_rows(int64_t nr, int node, int64_t * ir0, int64_t * ir1) {
+    const int n_nodes = g_state.numa.n_nodes;
+
+    *ir0 = nr*node/n_nodes;
+    *ir1 = nr*(node + 1)/n_nodes;
+}
+
+#if defined(__gnu_linux__)
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+#endif
+
+bool ggml_numa_place_tensor(const struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    if (!ggml_numa_partitioned(tensor) || !ggml_is_contiguous(tensor)) {
+        return false;
+    }
+
+    static atomic_bool warned = false;
+
+    const uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uint32_t  n_nodes   = g_state.numa.n_nodes;
+
+    for (int64_t i3 = 0; i3 < tensor->ne[3]; ++i3) {
+        for (int64_t i2 = 0; i2 < tensor->ne[2]; ++i2) {
+            const uintptr_t base = (uintptr_t) tensor->data + i2*tensor->nb[2] + i3*tensor->nb[3];
+
+            for (uint32_t n = 0; n < n_nodes; ++n) {
+                int64_t ir0, ir1;
+                ggml_numa_node_rows(tensor->ne[1], n, &ir0, &ir1);
+
+                // whole pages: a page shared by two nodes goes to the node that starts in it
+                const uintptr_t p0 = (base + ir0*tensor->nb[1]) & ~(page_size - 1);
+                const uintptr_t p1 = n + 1 < n_nodes
+                    ? (base + ir1*tensor->nb[1]) & ~(page_size - 1)
+                    : (base + ir1*tensor->nb[1] + page_size - 1) & ~(page_size - 1);
+
+                if (p1 <= p0) {
+                    continue;
+                }
+
+                // fault the pages in, so that they can be moved
+                for (uintptr_t p = p0; p < p1; p += page_size) {
+                    (void) *(volatile const char *) p;
+                }
+
+                unsigned long mask = 1ul << n;
+                if (syscall(SYS_mbind, (void *) p0, p1 - p0, MPOL_PREFERRED, &mask, sizeof(mask)*8, MPOL_MF_MOVE) != 0) {
+                    if (!atomic_exchange(&warned, true)) {
+                        GGML_LOG_WARN("%s: mbind() failed: %s\n", __func__, strerror(errno));
+                    }
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -8802,9 +8907,19 @@ UseGgmlGemm1:;
     #endif
     }
 
+    // NUMA partitioned weights: the threads of a node only compute the rows of src0 that are placed on the node
+    const bool numa_partitioned = nth >= (int) g_state.numa.n_nodes && ggml_numa_partitioned(src0);
+
     if (ith == 0) {
         // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
         atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
+
+        if (numa_partitioned) {
+            for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+                const int nth_node = (nth - n + g_state.numa.n_nodes - 1)/g_state.numa.n_nodes;
+                atomic_store_explicit(&params->threadpool->numa_chunk[n].n, nth_node, memory_order_relaxed);
+            }
+        }
     }
 
     ggml_barrier(params->threadpool);
@@ -8834,11 +8949,30 @@ UseGgmlGemm2:;
 #endif
 
     // This is the size of the first dimension of the result, so we can iterate that way. (see the ASSERT above, these are the same numbers)
-    const int64_t nr0 = ne0;
+    int64_t nr0 = ne0;
 
     // This is the size of the rest of the dimensions of the result
     const int64_t nr1 = ne1 * ne2 * ne3;
 
+    // the rows, threads and chunk counter that this thread shares the work with
+    int64_t      ir0_base  = 0;
+    int          ith_chunk = ith;
+    int          nth_chunk = nth;
+    atomic_int * chunk_ctr = &params->threadpool->current_chunk;
+
+    if (numa_partitioned) {
+        const int n_nodes = g_state.numa.n_nodes;
+        const int node    = ith % n_nodes;
+
+        int64_t ir1_base;
+        ggml_numa_node_rows(ne0, node, &ir0_base, &ir1_base);
+
+        nr0       = ir1_base - ir0_base;
+        ith_chunk = ith / n_nodes;
+        nth_chunk = (nth - node + n_nodes - 1)/n_nodes;
+        chunk_ctr = &params->threadpool->numa_chunk[node].n;
+    }
+
     // Now select a reasonable chunk size.
     int chunk_size = 16;
 
@@ -8856,10 +8990,11 @@ UseGgmlGemm2:;
     // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
     //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
     //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
+    //   With NUMA partitioned weights the chunks stay within the rows of the node.
+    if (nchunk0 * nchunk1 < nth_chunk * 4 || (ggml_is_numa() && !numa_partitioned)) {
         // distribute the thread work across the inner or outer loop based on which one is larger
-        nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-        nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+        nchunk0 = nr0 > nr1 ? nth_chunk : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : nth_chunk; // parallelize by src1 rows
     }
 
     // The number of elements in each chunk
@@ -8867,14 +9002,14 @@ UseGgmlGemm2:;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
     // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
+    int current_chunk = ith_chunk;
 
     while (current_chunk < nchunk0 * nchunk1) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
-        const int64_t ir0_start = dr0 * ith0;
-        const int64_t ir0_end = MIN(ir0_start + dr0, nr0);
+        const int64_t ir0_start = ir0_base + dr0 * ith0;
+        const int64_t ir0_end = MIN(ir0_start + dr0, ir0_base + nr0);
 
         const int64_t ir1_start = dr1 * ith1;
         const int64_t ir1_end = MIN(ir1_start + dr1, nr1);
@@ -8884,12 +9019,122 @@ UseGgmlGemm2:;
 
         // these checks are needed to avoid crossing dim1 boundaries
         // can be optimized, but the logic would become more complicated, so keeping it like this for simplicity
-        if ((nr0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
+        if ((ne0 % 2 != 0) || (ne11 % 2 != 0) || ((ir0_end - ir0_start) % 2 != 0) || ((ir1_end - ir1_start) % 2 != 0)) {
             num_rows_per_vec_dot = 1;
         }
         ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
 
-        if (nth >= nchunk0 * nchunk1) {
+        if (nth_chunk >= nchunk0 * nchunk1) {
+            break;
+        }
+
+        current_chunk = atomic_fetch_add_explicit(chunk_ctr, 1, memory_order_relaxed);
+    }
+}
+
+// a group of matrix-vector products that share src1 (e.g. the Q/K/V or gate/up projections of a decoded token)
+// src1 is converted once and the threads steal chunks across all of the products instead of waiting at a barrier
+// after each of them
+
+static bool ggml_compute_forward_mul_mat_groupable(const struct ggml_tensor * dst) {
+    if (dst->op != GGML_OP_MUL_MAT) {
+        return false;
+    }
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    // matrix-vector only: llamafile_sgemm is never used for these
+    if (ggml_nrows(src1) != 1 || src0->ne[2] != 1 || src0->ne[3] != 1) {
+        return false;
+    }
+
+    // the rows of NUMA partitioned weights are computed by the threads of their node
+    if (ggml_numa_partitioned(src0)) {
+        return false;
+    }
+
+    // the extra buffer types have their own kernels
+    size_t size = 0;
+    return !ggml_cpu_extra_work_size(1, dst, &size);
+}
+
+static bool ggml_compute_forward_mul_mat_same_group(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    return a->src[1] == b->src[1] &&
+        type_traits_cpu[a->src[0]->type].vec_dot_type == type_traits_cpu[b->src[0]->type].vec_dot_type;
+}
+
+static void ggml_compute_forward_mul_mat_group(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor ** dsts,
+                             int    n_dst) {
+
+    const struct ggml_tensor * src1 = dsts[0]->src[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    enum ggml_type    const vec_dot_type = type_traits_cpu[dsts[0]->src[0]->type].vec_dot_type;
+    ggml_from_float_t const from_float   = type_traits_cpu[vec_dot_type].from_float;
+
+    const int64_t ne10 = src1->ne[0];
+
+    if (src1->type != vec_dot_type) {
+        GGML_ASSERT(src1->type == GGML_TYPE_F32);
+        assert(params->wsize >= ggml_row_size(vec_dot_type, ne10));
+
+        const size_t  bs = ggml_blck_size(vec_dot_type);
+        const int64_t ne10_block_start = (ith * ne10/bs) / nth;
+        const int64_t ne10_block_end   = ((ith + 1) * ne10/bs) / nth;
+
+        from_float((const float *) src1->data + ne10_block_start*bs,
+                   (char *) params->wdata + ne10_block_start*ggml_type_size(vec_dot_type),
+                   (ne10_block_end - ne10_block_start) * bs);
+    }
+
+    if (ith == 0) {
+        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // same chunking as ggml_compute_forward_mul_mat for a single src1 row
+    int64_t nchunk = 0;
+    for (int i = 0; i < n_dst; ++i) {
+        nchunk += (dsts[i]->ne[0] + 63) / 64;
+    }
+
+    const bool by_thread = nchunk < nth * 4 || ggml_is_numa();
+    if (by_thread) {
+        nchunk = (int64_t) nth * n_dst;
+    }
+
+    int64_t current_chunk = ith;
+
+    while (current_chunk < nchunk) {
+        // find the product that the chunk belongs to
+        int64_t ic = current_chunk;
+        int     id = 0;
+        int64_t nchunk0 = 0;
+        for (; id < n_dst; ++id) {
+            nchunk0 = by_thread ? nth : (dsts[id]->ne[0] + 63) / 64;
+            if (ic < nchunk0) {
+                break;
+            }
+            ic -= nchunk0;
+        }
+
+        struct ggml_tensor * dst = dsts[id];
+
+        const int64_t nr0 = dst->ne[0];
+        const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
+
+        const int64_t ir0_start = dr0 * ic;
+        const int64_t ir0_end   = MIN(ir0_start + dr0, nr0);
+
+        ggml_compute_forward_mul_mat_one_chunk(params, dst, dst->src[0]->type, 1, ir0_start, ir0_end, 0, 1);
+
+        if (nth >= nchunk) {
             break;
         }
 
@@ -12431,6 +12676,255 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     }
 }
 
+// per-thread work buffer of the tiled kernel, in floats
+static size_t ggml_flash_attn_ext_tiled_wsize(int64_t D) {
+    return (2*GGML_FA_TILE_Q + GGML_FA_TILE_KV)*D + GGML_FA_TILE_Q*GGML_FA_TILE_KV + 2*GGML_FA_TILE_Q + CACHE_LINE_SIZE_F32;
+}
+
+// the tiled kernel needs more than one row of Q per KV head, and enough tiles to keep all the threads busy
+static bool ggml_flash_attn_ext_use_tiled(const struct ggml_tensor * q, const struct ggml_tensor * k, const struct ggml_tensor * v, int nth) {
+    if (k->ne[2] != v->ne[2] || k->ne[3] != v->ne[3]) {
+        return false;
+    }
+
+    const int64_t n_rows  = q->ne[1]*(q->ne[2]/k->ne[2]);
+    const int64_t n_tiles = q->ne[3]*k->ne[2]*((n_rows + GGML_FA_TILE_Q - 1)/GGML_FA_TILE_Q);
+
+    return n_rows > 1 && n_tiles >= nth;
+}
+
+// the rows of Q that share a KV head (the tokens of a batch and, with GQA, the heads of a group) are processed in tiles
+// of GGML_FA_TILE_Q rows, against tiles of GGML_FA_TILE_KV rows of K and V
+// each tile of K and V is loaded once for all the rows of the Q tile instead of once per row, and V is converted to F32
+// once per tile
+static void ggml_compute_forward_flash_attn_ext_f16_tiled(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = neq0;
+    const int64_t N = neq1;
+
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == D);
+    GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev0 == D);
+
+    GGML_ASSERT(neq1 == N);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    // broadcast factors
+    const int64_t rk2 = neq2/nek2;
+    const int64_t rk3 = neq3/nek3;
+
+    const int64_t rv2 = neq2/nev2;
+    const int64_t rv3 = neq3/nev3;
+
+    GGML_ASSERT(rk2 == rv2 && rk3 == rv3);
+
+    float scale         = 1.0f;
+    float max_bias      = 0.0f;
+    float logit_softcap = 0.0f;
+
+    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+
+    if (logit_softcap != 0) {
+        scale /= logit_softcap;
+    }
+
+    const uint32_t n_head      = neq2;
+    const uint32_t n_head_log2 = 1u << (uint32_t) floor(log2(n_head));
+
+    const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
+    const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
+
+    enum ggml_type    const k_vec_dot_type = type_traits_cpu[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot   = type_traits_cpu[k_vec_dot_type].from_float;
+    ggml_vec_dot_t    const kq_vec_dot     = type_traits_cpu[k->type].vec_dot;
+    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+
+    GGML_ASSERT(q_to_vec_dot && "fattn: unsupported K-type");
+    GGML_ASSERT(v_to_float   && "fattn: unsupported V-type");
+
+    const size_t q_row_size = ggml_row_size(k_vec_dot_type, D);
+
+    // the rows of a KV head are r = iq1*rk2 + j, for the query head iq2 = ik2*rk2 + j
+    const int64_t n_rows  = N*rk2;
+    const int64_t n_tiles = (n_rows + GGML_FA_TILE_Q - 1)/GGML_FA_TILE_Q;
+
+    // total number of tiles: for each q batch and KV head
+    const int64_t nt = neq3*nek2*n_tiles;
+
+    float * wdata = (float *) params->wdata + ith*ggml_flash_attn_ext_tiled_wsize(D);
+
+    char  * Q_q  = (char  *) wdata;                        // [GGML_FA_TILE_Q][D] Q converted to the vec dot type of K
+    float * VKQ  = wdata + 1*GGML_FA_TILE_Q*D;             // [GGML_FA_TILE_Q][D] FP32 VKQ accumulators
+    float * V32  = wdata + 2*GGML_FA_TILE_Q*D;             // [GGML_FA_TILE_KV][D] the tile of V in FP32
+    float * KQ   = V32 + GGML_FA_TILE_KV*D;                // [GGML_FA_TILE_Q][GGML_FA_TILE_KV] the tile of KQ values
+    float * Mrow = KQ + GGML_FA_TILE_Q*GGML_FA_TILE_KV;    // [GGML_FA_TILE_Q] maximum KQ value of each row
+    float * Srow = Mrow + GGML_FA_TILE_Q;                  // [GGML_FA_TILE_Q] sum of each row
+
+    int64_t iq1s [GGML_FA_TILE_Q];
+    int64_t iq2s [GGML_FA_TILE_Q];
+    float   slope[GGML_FA_TILE_Q];
+
+    const ggml_fp16_t * mps[GGML_FA_TILE_Q];
+
+    // the tiles of the causal mask get more work with the position, so they are interleaved between the threads
+    for (int64_t it = ith; it < nt; it += nth) {
+        const int64_t iq3 = it/(nek2*n_tiles);
+        const int64_t ik2 = (it - iq3*nek2*n_tiles)/n_tiles;
+        const int64_t ir0 = (it - iq3*nek2*n_tiles - ik2*n_tiles)*GGML_FA_TILE_Q;
+        const int64_t nr  = MIN(GGML_FA_TILE_Q, n_rows - ir0);
+
+        const int64_t ik3 = iq3/rk3;
+        const int64_t iv3 = iq3/rv3;
+        const int64_t iv2 = ik2; // rk2 == rv2
+
+        for (int64_t r = 0; r < nr; ++r) {
+            iq1s[r] = (ir0 + r)/rk2;
+            iq2s[r] = ik2*rk2 + (ir0 + r)%rk2;
+
+            const uint32_t h = iq2s[r]; // head index
+            slope[r] = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+            mps[r] = mask ? (const ggml_fp16_t *)((const char *) mask->data + iq1s[r]*mask->nb[1]) : NULL;
+
+            const float * pq = (const float *) ((const char *) q->data + (iq1s[r]*nbq1 + iq2s[r]*nbq2 + iq3*nbq3));
+            q_to_vec_dot(pq, Q_q + r*q_row_size, D);
+
+            Mrow[r] = -INFINITY;
+            Srow[r] = 0.0f;
+        }
+
+        memset(VKQ, 0, nr*D*sizeof(float));
+
+        // online softmax / attention, one tile of K and V at a time
+        // ref: https://arxiv.org/pdf/2112.05682.pdf
+        for (int64_t ic0 = 0; ic0 < nek1; ic0 += GGML_FA_TILE_KV) {
+            const int64_t nc = MIN(GGML_FA_TILE_KV, nek1 - ic0);
+
+            bool any = false;
+
+            // KQ values of the tile, each row of K is loaded once for all the rows of Q
+            for (int64_t c = 0; c < nc; ++c) {
+                const char * k_data = (const char *) k->data + ((ic0 + c)*nbk1 + ik2*nbk2 + ik3*nbk3);
+
+                for (int64_t r = 0; r < nr; ++r) {
+                    const float mv = mps[r] ? slope[r]*GGML_FP16_TO_FP32(mps[r][ic0 + c]) : 0.0f;
+                    if (mv == -INFINITY) {
+                        KQ[r*GGML_FA_TILE_KV + c] = -INFINITY;
+                        continue;
+                    }
+
+                    float s; // KQ value
+
+                    kq_vec_dot(D, &s, 0, k_data, 0, Q_q + r*q_row_size, 0, 1);
+
+                    s = s*scale; // scale KQ value
+
+                    if (logit_softcap != 0.0f) {
+                        s = logit_softcap*tanhf(s);
+                    }
+
+                    KQ[r*GGML_FA_TILE_KV + c] = s + mv; // apply mask
+
+                    any = true;
+                }
+            }
+
+            if (!any) {
+                // the whole tile is masked
+                continue;
+            }
+
+            for (int64_t c = 0; c < nc; ++c) {
+                const char * v_data = (const char *) v->data + ((ic0 + c)*nbv1 + iv2*nbv2 + iv3*nbv3);
+                v_to_float(v_data, V32 + c*D, D);
+            }
+
+            for (int64_t r = 0; r < nr; ++r) {
+                const float * kq = KQ + r*GGML_FA_TILE_KV;
+
+                float Mtile = -INFINITY;
+                for (int64_t c = 0; c < nc; ++c) {
+                    Mtile = MAX(Mtile, kq[c]);
+                }
+
+                if (Mtile == -INFINITY) {
+                    continue;
+                }
+
+                float * vkq = VKQ + r*D;
+
+                if (Mtile > Mrow[r]) {
+                    // new maximum: VKQ = VKQ*expf(Mold - M)
+                    const float ms = expf(Mrow[r] - Mtile);
+
+                    ggml_vec_scale_f32(D, vkq, ms);
+
+                    Srow[r] *= ms;
+                    Mrow[r]  = Mtile;
+                }
+
+                const float M = Mrow[r];
+
+                for (int64_t c = 0; c < nc; ++c) {
+                    if (kq[c] == -INFINITY) {
+                        continue;
+                    }
+
+                    const float vs = expf(kq[c] - M);
+
+                    // V += v*expf(s - M)
+                    ggml_vec_mad_f32(D, vkq, V32 + c*D, vs);
+
+                    Srow[r] += vs;
+                }
+            }
+        }
+
+        for (int64_t r = 0; r < nr; ++r) {
+            float * vkq = VKQ + r*D;
+
+            // V /= S
+            ggml_vec_scale_f32(D, vkq, 1.0f/Srow[r]);
+
+            // permute(0, 2, 1, 3)
+            memcpy((char *) dst->data + (iq3*ne2*ne1 + iq2s[r] + iq1s[r]*ne1)*nb1, vkq, nb1);
+        }
+    }
+}
+
 static void ggml_compute_forward_flash_attn_ext(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
@@ -12443,7 +12937,11 @@ static void ggml_compute_forward_flash_attn_ext(
         case GGML_PREC_F32:
             {
                 // uses F32 accumulators
-                ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                if (ggml_flash_attn_ext_use_tiled(q, k, v, params->nth)) {
+                    ggml_compute_forward_flash_attn_ext_f16_tiled(params, q, k, v, mask, dst);
+                } else {
+                    ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+                }
             } break;
         default:
             {
@@ -14695,6 +15193,7 @@ static void set_numa_thread_affinity(int thread_n) {
 
     switch(g_state.numa.numa_strategy) {
         case GGML_NUMA_STRATEGY_DISTRIBUTE:
+        case GGML_NUMA_STRATEGY_PARTITION:
             // run thread on node_num thread_n / (threads per node)
             node_num = thread_n % g_state.numa.n_nodes;
             break;
@@ -15199,6 +15698,10 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
     ggml_cond_destroy(&threadpool->cond);
 #endif // GGML_USE_OPENMP
 
+    free(threadpool->sched_nodes);
+    free(threadpool->sched_levels);
+    free(threadpool->sched_work);
+
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
     ggml_aligned_free(threadpool->workers, workers_size);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
@@ -15384,7 +15887,8 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         const int64_t ne00 = node->src[0]->ne[0]; // D
 
-                        cur = 3*sizeof(float)*ne00*n_tasks; // 3x head size/thread
+                        // 3x head size/thread, or the tiles of the tiled kernel
+                        cur = sizeof(float)*MAX(3*ne00, (int64_t) ggml_flash_attn_ext_tiled_wsize(ne00))*n_tasks;
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -15431,6 +15935,354 @@ struct ggml_cplan ggml_graph_plan(
     return cplan;
 }
 
+// dependency-aware scheduling
+//
+// the nodes are assigned to levels such that a node comes after every node it depends on through memory:
+// it reads the output of (RAW), overwrites the inputs of (WAR) or overwrites the output of (WAW) an earlier node.
+// the dependencies are found by comparing the memory ranges of the tensors, which also covers views and the
+// buffers reused by the graph allocator. the nodes of a level run without a barrier in between
+
+// number of preceding nodes that are checked for dependencies - older nodes are assumed to be in earlier levels
+#define GGML_SCHED_WINDOW 32
+
+// max number of matrix multiplications that share a src1 conversion
+#define GGML_SCHED_MAX_GROUP 16
+
+enum ggml_sched_kind {
+    GGML_SCHED_NOOP,  // does not compute anything
+    GGML_SCHED_PLAIN, // splits the work by ith/nth, without barriers or shared work data
+    GGML_SCHED_SYNC,  // uses barriers and the shared work data - runs with all threads after a barrier
+    GGML_SCHED_FENCE, // unknown memory accesses - runs in a level of its own
+};
+
+static enum ggml_sched_kind ggml_sched_node_kind(const struct ggml_tensor * node) {
+    if (ggml_is_empty(node)) {
+        return GGML_SCHED_NOOP;
+    }
+
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return GGML_SCHED_NOOP;
+        case GGML_OP_DUP:
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_SCALE:
+        case GGML_OP_CLAMP:
+        case GGML_OP_CONCAT:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_L2_NORM:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+        case GGML_OP_FLASH_ATTN_EXT:
+        case GGML_OP_UNARY:
+            return GGML_SCHED_PLAIN;
+        case GGML_OP_MUL_MAT:
+        case GGML_OP_MUL_MAT_ID:
+            return GGML_SCHED_SYNC;
+        default:
+            return GGML_SCHED_FENCE;
+    }
+}
+
+static bool ggml_sched_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_is_empty(a) || ggml_is_empty(b)) {
+        return false;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// true if node b has to run after node a
+static bool ggml_sched_depends(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_sched_overlap(a, b)) {
+        return true;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (b->src[i] && ggml_sched_overlap(a, b->src[i])) {
+            return true;
+        }
+        if (a->src[i] && ggml_sched_overlap(a->src[i], b)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// hash of the memory ranges of a tensor
+static uint64_t ggml_sched_hash_tensor(uint64_t h, const struct ggml_tensor * t) {
+    const uint64_t v[2 + 2*GGML_MAX_DIMS] = {
+        (uint64_t) (uintptr_t) t, (uint64_t) (uintptr_t) t->data,
+        (uint64_t) t->ne[0], (uint64_t) t->ne[1], (uint64_t) t->ne[2], (uint64_t) t->ne[3],
+        (uint64_t) t->nb[0], (uint64_t) t->nb[1], (uint64_t) t->nb[2], (uint64_t) t->nb[3],
+    };
+
+    // FNV-1a over the words
+    for (size_t i = 0; i < sizeof(v)/sizeof(v[0]); ++i) {
+        h ^= v[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+// hash of the nodes of the graph and of the memory they use, which determine the levels
+static uint64_t ggml_graph_sched_hash(const struct ggml_cgraph * cgraph) {
+    uint64_t h = 14695981039346656037ULL;
+
+    for (int i = 0; i < cgraph->n_nodes; ++i) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        h ^= (uint64_t) node->op;
+        h *= 1099511628211ULL;
+
+        h = ggml_sched_hash_tensor(h, node);
+
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            if (node->src[j]) {
+                h = ggml_sched_hash_tensor(h, node->src[j]);
+            }
+        }
+    }
+
+    return h;
+}
+
+// returns false if the buffers could not be allocated, the nodes are then run in lockstep
+static bool ggml_graph_sched_build(struct ggml_threadpool * tp, const struct ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+
+    const uint64_t hash = ggml_graph_sched_hash(cgraph);
+
+    if (tp->sched_graph == cgraph && tp->sched_n_nodes == n_nodes && tp->sched_hash == hash) {
+        return true;
+    }
+
+    tp->sched_graph    = NULL;
+    tp->sched_n_levels = 0;
+
+    if (tp->sched_size < n_nodes) {
+        free(tp->sched_nodes);
+        free(tp->sched_levels);
+        free(tp->sched_work);
+
+        tp->sched_nodes  = malloc(sizeof(int) * n_nodes);
+        tp->sched_levels = malloc(sizeof(int) * (n_nodes + 1));
+        tp->sched_work   = malloc(sizeof(int) * 2 * n_nodes);
+
+        if (tp->sched_nodes == NULL || tp->sched_levels == NULL || tp->sched_work == NULL) {
+            free(tp->sched_nodes);
+            free(tp->sched_levels);
+            free(tp->sched_work);
+
+            tp->sched_nodes  = NULL;
+            tp->sched_levels = NULL;
+            tp->sched_work   = NULL;
+            tp->sched_size   = 0;
+
+            return false;
+        }
+
+        tp->sched_size = n_nodes;
+    }
+
+    int * level = tp->sched_work;           // level of each node, -1 for no-ops
+    int * lmax  = tp->sched_work + n_nodes; // max level of the nodes [0, i]
+
+    int n_levels = 0;
+    int fence    = -1; // level of the last fence
+
+    for (int i = 0; i < n_nodes; ++i) {
+        const struct ggml_tensor * node = cgraph->nodes[i];
+
+        const int lmax_prev = i > 0 ? lmax[i - 1] : -1;
+
+        switch (ggml_sched_node_kind(node)) {
+            case GGML_SCHED_NOOP:
+                {
+                    level[i] = -1;
+                } break;
+            case GGML_SCHED_FENCE:
+                {
+                    level[i] = lmax_prev + 1;
+                    fence    = level[i];
+                } break;
+            default:
+                {
+                    int l = fence + 1;
+                    int n_checked = 0;
+                    int j = i - 1;
+
+                    for (; j >= 0 && n_checked < GGML_SCHED_WINDOW; --j) {
+                        if (level[j] < 0) {
+                            continue;
+                        }
+                        if (level[j] >= l && ggml_sched_depends(cgraph->nodes[j], node)) {
+                            l = level[j] + 1;
+                        }
+                        n_checked++;
+                    }
+
+                    // the nodes before the window
+                    if (j >= 0) {
+                        l = MAX(l, lmax[j] + 1);
+                    }
+
+                    level[i] = l;
+                } break;
+        }
+
+        lmax[i] = MAX(lmax_prev, level[i]);
+        n_levels = lmax[i] + 1;
+    }
+
+    // bucket the nodes by level, keeping the graph order within a level
+    int * levels = tp->sched_levels;
+
+    memset(levels, 0, sizeof(int) * (n_levels + 1));
+    for (int i = 0; i < n_nodes; ++i) {
+        if (level[i] >= 0) {
+            levels[level[i] + 1]++;
+        }
+    }
+    for (int l = 0; l < n_levels; ++l) {
+        levels[l + 1] += levels[l];
+    }
+
+    // lmax is reused as the fill position of each level
+    int * pos = lmax;
+    memcpy(pos, levels, sizeof(int) * n_levels);
+
+    int * nodes = tp->sched_nodes;
+    for (int i = 0; i < n_nodes; ++i) {
+        if (level[i] >= 0) {
+            nodes[pos[level[i]]++] = i;
+        }
+    }
+
+    // within a level: the plain nodes first, then the matrix multiplications with the same src1 next to each other
+    for (int l = 0; l < n_levels; ++l) {
+        const int l0 = levels[l];
+        const int l1 = levels[l + 1];
+
+        int n_plain = 0;
+        for (int k = l0; k < l1; ++k) {
+            if (ggml_sched_node_kind(cgraph->nodes[nodes[k]]) == GGML_SCHED_PLAIN) {
+                // stable: the skipped nodes are shifted up by one
+                const int id = nodes[k];
+                memmove(nodes + l0 + n_plain + 1, nodes + l0 + n_plain, sizeof(int) * (k - l0 - n_plain));
+                nodes[l0 + n_plain++] = id;
+            }
+        }
+
+        for (int k = l0 + n_plain; k < l1; ++k) {
+            const struct ggml_tensor * node = cgraph->nodes[nodes[k]];
+            if (!ggml_compute_forward_mul_mat_groupable(node)) {
+                continue;
+            }
+            for (int m = k + 1; m < l1; ++m) {
+                const struct ggml_tensor * other = cgraph->nodes[nodes[m]];
+                if (ggml_compute_forward_mul_mat_groupable(other) && ggml_compute_forward_mul_mat_same_group(node, other)) {
+                    const int id = nodes[m];
+                    memmove(nodes + k + 2, nodes + k + 1, sizeof(int) * (m - k - 1));
+                    nodes[++k] = id;
+                }
+            }
+        }
+    }
+
+    tp->sched_n_levels = n_levels;
+    tp->sched_graph    = cgraph;
+    tp->sched_n_nodes  = n_nodes;
+    tp->sched_hash     = hash;
+
+    return true;
+}
+
+static void ggml_graph_compute_levels(struct ggml_compute_state * state, struct ggml_compute_params * params) {
+    struct ggml_threadpool * tp = state->threadpool;
+
+    const struct ggml_cgraph * cgraph = tp->cgraph;
+    const struct ggml_cplan  * cplan  = tp->cplan;
+
+    const int * nodes  = tp->sched_nodes;
+    const int * levels = tp->sched_levels;
+
+    struct ggml_tensor * group[GGML_SCHED_MAX_GROUP];
+
+    for (int l = 0; l < tp->sched_n_levels && atomic_load_explicit(&tp->abort, memory_order_relaxed) != l; l++) {
+        const int l0 = levels[l];
+        const int l1 = levels[l + 1];
+
+        int k = l0;
+
+        for (; k < l1; ++k) {
+            struct ggml_tensor * node = cgraph->nodes[nodes[k]];
+            if (ggml_sched_node_kind(node) != GGML_SCHED_PLAIN) {
+                break;
+            }
+            ggml_compute_forward(params, node);
+        }
+
+        // the remaining nodes use the shared work data, one after the other
+        while (k < l1) {
+            struct ggml_tensor * node = cgraph->nodes[nodes[k]];
+
+            int n_group = 1;
+            group[0] = node;
+
+            if (ggml_compute_forward_mul_mat_groupable(node)) {
+                while (k + n_group < l1 && n_group < GGML_SCHED_MAX_GROUP) {
+                    struct ggml_tensor * other = cgraph->nodes[nodes[k + n_group]];
+                    if (!ggml_compute_forward_mul_mat_groupable(other) || !ggml_compute_forward_mul_mat_same_group(node, other)) {
+                        break;
+                    }
+                    group[n_group++] = other;
+                }
+            }
+
+            if (k > l0) {
+                ggml_barrier(tp);
+            }
+
+            if (n_group > 1) {
+                ggml_compute_forward_mul_mat_group(params, group, n_group);
+            } else {
+                ggml_compute_forward(params, node);
+            }
+
+            k += n_group;
+        }
+
+        if (state->ith == 0 && cplan->abort_callback &&
+                cplan->abort_callback(cplan->abort_callback_data)) {
+            atomic_store_explicit(&tp->abort, l + 1, memory_order_relaxed);
+            tp->ec    = GGML_STATUS_ABORTED;
+        }
+
+        if (l + 1 < tp->sched_n_levels) {
+            ggml_barrier(tp);
+        }
+    }
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
     struct ggml_threadpool    * tp    = state->threadpool;
@@ -15448,6 +16300,12 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
+    if (tp->sched_n_levels > 0) {
+        ggml_graph_compute_levels(state, &params);
+        ggml_barrier(state->threadpool);
+        return 0;
+    }
+
     for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
@@ -15630,6 +16488,15 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_barrier        = 0;
         threadpool->n_barrier_passed = 0;
         threadpool->current_chunk    = 0;
+        threadpool->dep_sched        = tpp->dep_sched;
+        threadpool->sched_nodes      = NULL;
+        threadpool->sched_levels     = NULL;
+        threadpool->sched_work       = NULL;
+        threadpool->sched_n_levels   = 0;
+        threadpool->sched_size       = 0;
+        threadpool->sched_graph      = NULL;
+        threadpool->sched_n_nodes    = 0;
+        threadpool->sched_hash       = 0;
         threadpool->stop             = false;
         threadpool->pause            = tpp->paused;
         threadpool->abort            = -1;
@@ -15715,6 +16582,13 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    if (threadpool->dep_sched && n_threads > 1) {
+        ggml_graph_sched_build(threadpool, cgraph);
+    } else {
+        threadpool->sched_graph    = NULL;
+        threadpool->sched_n_levels = 0;
+    }
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
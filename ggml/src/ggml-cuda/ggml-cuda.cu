@@ -3231,6 +3231,10 @@ static bool ggml_backend_cuda_device_supports_op(ggml_backend_dev_t dev, const g
             if (op->src[1]->type == GGML_TYPE_BF16 || op->src[2]->type == GGML_TYPE_BF16) {
                 return false;
             }
+            // the kernels iterate over the KV in chunks of FATTN_KQ_STRIDE without a tail
+            if (op->src[1]->ne[1] % 256 != 0) {
+                return false;
+            }
             if (op->src[0]->ne[0] ==  64 && op->src[1]->type == GGML_TYPE_F16) {
                 return true;
             }
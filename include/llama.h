@@ -331,6 +331,9 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t kv_block_size;    // number of cells in a block of the paged KV cache, power of 2, 0 = contiguous KV cache (default) [EXPERIMENTAL]
+        uint32_t n_grammar_cache;  // number of grammars kept compiled for the grammar samplers of the model, 0 = disabled
+        uint32_t n_grammar_masks;  // number of grammar states with a token mask kept per compiled grammar, least recently used dropped first
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -570,6 +573,22 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Add a loaded LoRA adapter to a sequence, it is applied to the tokens of the sequence on top of the adapters of the context
+    // Sequences with different adapters can be decoded in the same batch
+    // A token that belongs to several sequences uses the adapters of its first sequence
+    // Returns -1 if seq_id is not in [0, n_seq_max)
+    LLAMA_API int32_t llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+            struct llama_adapter_lora * adapter,
+                           float   scale);
+
+    // Remove all LoRA adapters from a sequence
+    // seq_id < 0 : all sequences
+    LLAMA_API void llama_clear_adapter_lora_seq(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -1354,6 +1373,13 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    // Apply the sampler to the logits of n_vocab tokens and write the candidates that are left to cur_p
+    // cur_p->data must have room for n_vocab candidates
+    // When a sampler chain starts with top-k or min-p (after samplers that have no effect), only the candidates that
+    // pass them are written to cur_p, and the rest of the chain is applied to these. The result is the same as
+    // initializing cur_p from the logits and calling llama_sampler_apply.
+    LLAMA_API void llama_sampler_apply_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
@@ -1392,6 +1418,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of ubatches that reused the compute graph of the previous ubatch
     };
 
     struct llama_perf_sampler_data {
@@ -1,5 +1,6 @@
 #include "llama-adapter.h"
 
+#include "llama-batch.h"
 #include "llama-impl.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
@@ -145,6 +146,67 @@ llama_adapter_lora_weight * llama_adapter_lora::get_weight(ggml_tensor * w) {
     return nullptr;
 }
 
+std::vector<llama_adapter_lora_group> llama_adapter_lora_route(const llama_adapter_loras_seq & loras_seq, const llama_ubatch & ubatch, int32_t n_outputs) {
+    std::vector<llama_adapter_lora_group> groups;
+
+    // the worst-case graphs are reserved without sequences
+    if (loras_seq.empty() || ubatch.seq_id == nullptr) {
+        return groups;
+    }
+
+    std::vector<int32_t> group_of(ubatch.n_tokens, -1);
+
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        const llama_seq_id seq_id = ubatch.seq_id[i / ubatch.n_seq_tokens][0];
+
+        const auto it = loras_seq.find(seq_id);
+        if (it == loras_seq.end() || it->second.empty()) {
+            continue;
+        }
+
+        // the sequences with the same adapters share a group
+        llama_adapter_lora_group * group = nullptr;
+        for (auto & g : groups) {
+            if (g.loras == &it->second || *g.loras == it->second) {
+                group = &g;
+                break;
+            }
+        }
+
+        if (group == nullptr) {
+            groups.push_back({ &it->second, {}, {} });
+            group = &groups.back();
+        }
+
+        group->idxs.push_back(i);
+        group_of[i] = group - groups.data();
+    }
+
+    // the outputs are selected as in llm_graph_input_out_ids
+    const auto add_output = [&](int32_t i, int32_t i_out) {
+        if (group_of[i] >= 0) {
+            groups[group_of[i]].idxs_out.push_back(i_out);
+        }
+    };
+
+    if (n_outputs == (int32_t) ubatch.n_tokens) {
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            add_output(i, i);
+        }
+    } else if (ubatch.output) {
+        int32_t i_out = 0;
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            if (ubatch.output[i]) {
+                add_output(i, i_out++);
+            }
+        }
+    } else if (n_outputs == 1) {
+        add_output(ubatch.n_tokens - 1, 0);
+    }
+
+    return groups;
+}
+
 static void llama_adapter_lora_init_impl(llama_model & model, const char * path_lora, llama_adapter_lora & adapter) {
     LLAMA_LOG_INFO("%s: loading lora adapter from '%s' ...\n", __func__, path_lora);
 
@@ -4,10 +4,13 @@
 
 #include "ggml-cpp.h"
 
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+struct llama_ubatch;
+
 // TODO: pimpl
 
 //
@@ -74,3 +77,18 @@ struct llama_adapter_lora {
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+// adapters of the sequences, applied to their tokens on top of the adapters of the context
+using llama_adapter_loras_seq = std::map<llama_seq_id, llama_adapter_loras>;
+
+// tokens of a ubatch that go through the same sequence adapters
+struct llama_adapter_lora_group {
+    const llama_adapter_loras * loras;
+
+    std::vector<int32_t> idxs;     // index of the tokens in the ubatch
+    std::vector<int32_t> idxs_out; // index of the tokens in the outputs of the ubatch
+};
+
+// group the tokens of the ubatch by the adapters of their sequence, in order of first appearance
+// the tokens of the sequences without adapters are not in any group
+std::vector<llama_adapter_lora_group> llama_adapter_lora_route(const llama_adapter_loras_seq & loras_seq, const llama_ubatch & ubatch, int32_t n_outputs);
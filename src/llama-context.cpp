@@ -1,6 +1,7 @@
 #include "llama-context.h"
 
 #include "llama-impl.h"
+#include "llama-grammar.h"
 #include "llama-io.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
@@ -34,6 +35,8 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.fattn_kv_pad     = model.devices.empty() ? 1 : LLAMA_FATTN_KV_PAD;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -52,6 +55,14 @@ llama_context::llama_context(
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
 
+    // the compiled grammars are shared by the contexts of the model
+    {
+        llama_grammar_cache & grammar_cache = model.vocab.get_grammar_cache();
+
+        grammar_cache.max_size  = params.n_grammar_cache;
+        grammar_cache.max_masks = params.n_grammar_masks;
+    }
+
     auto rope_scaling_type = params.rope_scaling_type;
     if (rope_scaling_type == LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED) {
         rope_scaling_type = hparams.rope_scaling_type_train;
@@ -178,7 +189,11 @@ llama_context::llama_context(
     // init the memory module
     // TODO: for now, always create a unified KV cache
     if (!hparams.vocab_only) {
-        kv_self.reset(static_cast<llama_kv_cache_unified *>(model.create_memory()));
+        llama_memory_params params_mem = {
+            /*.kv_block_size =*/ cparams.kv_block_size,
+        };
+
+        kv_self.reset(static_cast<llama_kv_cache_unified *>(model.create_memory(params_mem)));
 
         LLAMA_LOG_DEBUG("%s: n_ctx = %u\n", __func__, cparams.n_ctx);
 
@@ -281,6 +296,9 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // with pipeline parallelism, the scheduler rotates between copies of the split inputs on each compute
+        graph_reuse = !pipeline_parallel && getenv("LLAMA_GRAPH_REUSE_DISABLE") == nullptr;
     }
 
     // reserve worst-case graph
@@ -375,8 +393,16 @@ llama_context::llama_context(
 llama_context::~llama_context() = default;
 
 void llama_context::synchronize() {
+    // nothing was queued since the last synchronization
+    // note: this also keeps the calls from several threads that read the same outputs free of writes
+    if (n_queued_tokens == 0 && !graph_queued) {
+        return;
+    }
+
     ggml_backend_sched_synchronize(sched.get());
 
+    graph_queued = false;
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -516,7 +542,7 @@ void llm_graph_input_k_shift::set_input(const llama_ubatch * ubatch) {
         int32_t * data = (int32_t *) k_shift->data;
 
         for (uint32_t i = 0; i < kv_self->size; ++i) {
-            data[i] = kv_self->cells[i].delta;
+            data[i] = kv_self->cells.delta[i];
         }
     }
 }
@@ -680,8 +706,8 @@ llm_graph_result_ptr llama_context::build_kv_self_defrag(
             ggml_tensor * view_v_src;
             ggml_tensor * view_v_dst;
 
-            if (cparams.flash_attn) {
-                // NOTE: the V cache is not transposed when using flash attention
+            if (!kv_self->v_trans) {
+                // NOTE: the V cache is not transposed when using flash attention or a paged cache
                 view_v_src = ggml_view_2d(ctx0, kv_self->v_l[il],
                         n_embd_v_gqa, nm,
                         ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
@@ -749,7 +775,7 @@ void llama_context::kv_self_update() {
             kv->has_shift = false;
 
             for (uint32_t i = 0; i < kv->size; ++i) {
-                kv->cells[i].delta = 0;
+                kv->cells.delta[i] = 0;
             }
         }
     }
@@ -947,18 +973,24 @@ void llama_context::set_embeddings(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.embeddings = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.causal_attn = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.warmup = value;
+
+    graph_reuse_reset();
 }
 
 void llama_context::set_adapter_lora(
@@ -967,6 +999,8 @@ void llama_context::set_adapter_lora(
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
     loras[adapter] = scale;
+
+    graph_reuse_reset();
 }
 
 bool llama_context::rm_adapter_lora(
@@ -976,6 +1010,7 @@ bool llama_context::rm_adapter_lora(
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
         loras.erase(pos);
+        graph_reuse_reset();
         return true;
     }
 
@@ -986,6 +1021,31 @@ void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
     loras.clear();
+
+    graph_reuse_reset();
+}
+
+void llama_context::set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, adapter = %p, scale = %f\n", __func__, seq_id, (void *) adapter, scale);
+
+    loras_seq[seq_id][adapter] = scale;
+
+    graph_reuse_reset();
+}
+
+void llama_context::clear_adapter_lora_seq(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    if (seq_id < 0) {
+        loras_seq.clear();
+    } else {
+        loras_seq.erase(seq_id);
+    }
+
+    graph_reuse_reset();
 }
 
 bool llama_context::apply_adapter_cvec(
@@ -996,6 +1056,8 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    graph_reuse_reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
@@ -1182,6 +1244,7 @@ int llama_context::decode(llama_batch & inp_batch) {
             if (!is_done) {
                 kv_slot_restorer.restore();
             }
+            kv_slot_restorer.cache.commit();
         }
 
         void done() {
@@ -1300,32 +1363,55 @@ int llama_context::decode(llama_batch & inp_batch) {
 
             const auto slot_info = kv_self->find_slot(ubatch);
             if (!slot_info) {
-                LLAMA_LOG_ERROR("%s: failed to prepare ubatch\n", __func__);
-                return -3;
+                // the cells of the previous ubatches are restored by the guard
+                LLAMA_LOG_WARN("%s: failed to find a KV cache slot for the ubatch\n", __func__);
+                return 1;
             }
 
             bg.save(slot_info);
 
             if (!kv_self->recurrent) {
-                // a heuristic, to avoid attending the full cache if it is not yet utilized
-                // after enough generations, the benefit from this heuristic disappears
-                // if we start defragmenting the cache, the benefit from this will be more important
-                const uint32_t pad = kv_self->get_padding(cparams);
-                kv_self->n = std::min(kv_self->size, std::max(pad, GGML_PAD(kv_self->cell_max(), pad)));
+                kv_self->n = kv_self->get_n_kv(cparams);
             }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self->n, kv_self->used, kv_self->head);
 
-        ggml_backend_sched_reset(sched.get());
-        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        // the state of recurrent models and the eval callback are tied to the graph being built
+        const bool can_reuse = graph_reuse && !kv_self->recurrent && cparams.cb_eval == nullptr;
 
-        auto * gf = graph_init();
-        auto res = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+        const graph_key key = can_reuse ? graph_get_key(ubatch, LLM_GRAPH_TYPE_DECODER) : graph_key {};
+
+        ggml_cgraph * gf = nullptr;
 
-        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+        if (can_reuse && gf_reuse && key == key_reuse) {
+            // same topology: the graph is still allocated, only the KV cache stores have to be moved
+            gf = gf_reuse;
 
-        ggml_backend_sched_alloc_graph(sched.get(), gf);
+            if (hparams.causal_attn) {
+                res_reuse->set_kv_ranges(kv_self->get_slot_ranges(ubatch.n_tokens));
+                res_reuse->set_kv_runs  (kv_self->get_kv_runs());
+            }
+
+            n_graph_reuse++;
+        } else {
+            ggml_backend_sched_reset(sched.get());
+            ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+
+            gf = graph_init();
+            res_reuse = graph_build(ctx_compute.get(), gf, ubatch, LLM_GRAPH_TYPE_DECODER);
+
+            // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+            ggml_backend_sched_alloc_graph(sched.get(), gf);
+
+            if (can_reuse) {
+                gf_reuse  = gf;
+                key_reuse = key;
+            }
+        }
+
+        auto & res = res_reuse;
 
         res->set_inputs(&ubatch);
 
@@ -1481,7 +1567,10 @@ int llama_context::decode(llama_batch & inp_batch) {
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // a graph kept for reuse has to stay allocated
+    if (!gf_reuse) {
+        ggml_backend_sched_reset(sched.get());
+    }
 
     return 0;
 }
@@ -1611,6 +1700,8 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 ggml_cgraph * llama_context::graph_init() {
+    graph_reuse_reset();
+
     ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1638,6 +1729,7 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.backend_cpu =*/ backend_cpu,
                 /*.cvec        =*/ &cvec,
                 /*.loras       =*/ &loras,
+                /*.loras_seq   =*/ &loras_seq,
                 /*.memory      =*/ kv_self.get(),
                 /*.cross       =*/ &cross,
                 /*.n_outputs   =*/ n_outputs,
@@ -1663,6 +1755,7 @@ ggml_status llama_context::graph_compute(
     }
 
     auto status = ggml_backend_sched_graph_compute_async(sched.get(), gf);
+    graph_queued = true;
     if (status != GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: ggml_backend_sched_graph_compute_async failed with error %d\n", __func__, status);
     }
@@ -1672,6 +1765,42 @@ ggml_status llama_context::graph_compute(
     return status;
 }
 
+llama_context::graph_key llama_context::graph_get_key(const llama_ubatch & ubatch, llm_graph_type gtype) const {
+    graph_key key = {
+        /*.gtype       =*/ gtype,
+        /*.n_tokens    =*/ ubatch.n_tokens,
+        /*.n_seqs      =*/ ubatch.n_seqs,
+        /*.n_outputs   =*/ n_outputs,
+        /*.n_kv        =*/ kv_self->n,
+        /*.embd        =*/ ubatch.embd != nullptr,
+        /*.kv_ranges   =*/ {},
+        /*.kv_runs     =*/ {},
+        /*.lora_groups =*/ {},
+    };
+
+    for (const auto & group : llama_adapter_lora_route(loras_seq, ubatch, n_outputs)) {
+        key.lora_groups.push_back({ group.loras, { group.idxs.size(), group.idxs_out.size() } });
+    }
+
+    // the KV cache is only written when the model uses it (see decode())
+    if (model.hparams.causal_attn) {
+        for (const auto & range : kv_self->get_slot_ranges(ubatch.n_tokens)) {
+            key.kv_ranges.push_back(range.second - range.first);
+        }
+
+        for (const auto & run : kv_self->get_kv_runs()) {
+            key.kv_runs.push_back(run.second - run.first);
+        }
+    }
+
+    return key;
+}
+
+void llama_context::graph_reuse_reset() {
+    gf_reuse = nullptr;
+    res_reuse.reset();
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -2215,6 +2344,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = n_graph_reuse;
 
     return data;
 }
@@ -2223,6 +2353,7 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    n_graph_reuse = 0;
 }
 
 //
@@ -2248,6 +2379,9 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.kv_block_size               =*/ 0,
+        /*.n_grammar_cache             =*/ 4,
+        /*.n_grammar_masks             =*/ 256,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
@@ -2297,6 +2431,11 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    if ((params.kv_block_size & (params.kv_block_size - 1)) != 0) {
+        LLAMA_LOG_ERROR("%s: kv_block_size must be a power of 2\n", __func__);
+        return nullptr;
+    }
+
     try {
         auto * ctx = new llama_context(*model, params);
         return ctx;
@@ -2446,6 +2585,25 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+int32_t llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    if (seq_id < 0 || seq_id >= (llama_seq_id) ctx->n_seq_max()) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d, n_seq_max = %u\n", __func__, seq_id, ctx->n_seq_max());
+        return -1;
+    }
+
+    ctx->set_adapter_lora_seq(seq_id, adapter, scale);
+
+    return 0;
+}
+
+void llama_clear_adapter_lora_seq(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->clear_adapter_lora_seq(seq_id);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2787,6 +2945,7 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
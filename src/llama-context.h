@@ -75,6 +75,13 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    void set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale);
+
+    void clear_adapter_lora_seq(llama_seq_id seq_id);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -148,6 +155,7 @@ private:
     int32_t graph_max_nodes() const;
 
     // zero-out inputs and create the ctx_compute for the compute graph
+    // this also drops the graph kept for reuse, since it lives in ctx_compute
     ggml_cgraph * graph_init();
 
     llm_graph_result_ptr graph_build(
@@ -163,6 +171,40 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // the graph of a ubatch can be reused for the next ubatch if it builds a graph with the same topology
+    struct graph_key {
+        llm_graph_type gtype;
+
+        uint32_t n_tokens;
+        uint32_t n_seqs;
+        int32_t  n_outputs;
+        uint32_t n_kv;
+        bool     embd; // embeddings instead of tokens as input
+
+        std::vector<uint32_t> kv_ranges; // number of cells of each range written to the KV cache
+        std::vector<uint32_t> kv_runs;   // number of cells of each run read from the KV cache
+
+        // adapters of the sequences and number of tokens and outputs of each group (see llama_adapter_lora_route)
+        std::vector<std::pair<const llama_adapter_loras *, std::pair<size_t, size_t>>> lora_groups;
+
+        bool operator==(const graph_key & other) const {
+            return gtype     == other.gtype    &&
+                   n_tokens  == other.n_tokens &&
+                   n_seqs    == other.n_seqs   &&
+                   n_outputs == other.n_outputs &&
+                   n_kv      == other.n_kv     &&
+                   embd      == other.embd     &&
+                   kv_ranges == other.kv_ranges &&
+                   kv_runs   == other.kv_runs   &&
+                   lora_groups == other.lora_groups;
+        }
+    };
+
+    graph_key graph_get_key(const llama_ubatch & ubatch, llm_graph_type gtype) const;
+
+    // drop the graph kept for reuse, e.g. when the adapters or the compute parameters change
+    void graph_reuse_reset();
+
     // used by kv_self_update()
     ggml_tensor * build_rope_shift(
         ggml_context * ctx0,
@@ -199,6 +241,8 @@ private:
     llama_adapter_loras loras;
     llama_sbatch        sbatch;
 
+    llama_adapter_loras_seq loras_seq;
+
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
 
     std::unique_ptr<llama_kv_cache_unified> kv_self;
@@ -250,6 +294,14 @@ private:
     ggml_backend_buffer_ptr buf_output;
 
     bool has_evaluated_once = false;
+    bool graph_queued       = false; // a graph was computed since the last synchronization, also without tokens (K-shift, defrag)
+
+    // graph reuse
+    bool graph_reuse = false; // disabled with pipeline parallelism and with LLAMA_GRAPH_REUSE_DISABLE
+
+    ggml_cgraph *        gf_reuse  = nullptr; // the last graph, still allocated in the scheduler
+    llm_graph_result_ptr res_reuse;
+    graph_key            key_reuse = {};
 
     // perf
     mutable int64_t t_start_us  = 0;
@@ -262,4 +314,6 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+
+    mutable int32_t n_graph_reuse = 0; // number of ubatches that reused the previous graph
 };
@@ -4,6 +4,9 @@
 
 #include <cstdint>
 
+// with flash attention, the number of KV entries is padded to a multiple of this for the GPU kernels
+#define LLAMA_FATTN_KV_PAD 256
+
 struct llama_cparams {
     uint32_t n_ctx;           // context size used during inference
     uint32_t n_batch;
@@ -24,6 +27,12 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t kv_block_size;
+
+    // with flash attention, the K and V of the attention without KV cache are padded to a multiple of this
+    // (LLAMA_FATTN_KV_PAD for the GPU kernels, 1 when the CPU kernels, which handle any n_kv, run the graph)
+    uint32_t fattn_kv_pad;
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
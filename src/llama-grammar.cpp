@@ -6,6 +6,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <functional>
 #include <stdexcept>
 
 //
@@ -820,14 +821,22 @@ const llama_grammar_rules & llama_grammar_get_rules(const struct llama_grammar *
 }
 
 llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar) {
-    return grammar->stacks;
+    // the caller can modify the stacks, so they cannot remain shared with the clones
+    if (grammar->stacks.use_count() > 1) {
+        grammar->stacks = std::make_shared<llama_grammar_stacks>(*grammar->stacks);
+    }
+
+    return *grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
-    llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
+static void llama_grammar_accept_chr(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        const uint32_t               chr,
+              llama_grammar_stacks & stacks_new) {
+    stacks_new.reserve(stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,11 +850,21 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
         }
     }
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    llama_grammar_stacks stacks_new;
+    llama_grammar_accept_chr(grammar->rules, *grammar->stacks, chr, stacks_new);
 
-    grammar->stacks = std::move(stacks_new);
+    // replace the stacks in place, unless they are shared with a clone
+    if (grammar->stacks.use_count() == 1) {
+        *grammar->stacks = std::move(stacks_new);
+    } else {
+        grammar->stacks = std::make_shared<llama_grammar_stacks>(std::move(stacks_new));
+    }
 }
 
 llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
@@ -905,46 +924,25 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
 
 ////////////////////
 
-struct llama_grammar * llama_grammar_init_impl(
-        const struct llama_vocab * vocab,
-        const llama_grammar_element ** rules,
-        size_t n_rules,
-        size_t start_rule_index) {
-    const llama_grammar_element * pos;
+// the number of grammars kept compiled for each vocab
+#define LLAMA_GRAMMAR_CACHE_SIZE 4
 
-    // copy rule definitions into vectors
-    llama_grammar_rules vec_rules(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        for (pos = rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
-            vec_rules[i].push_back(*pos);
-        }
-        vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
-    }
+// the number of states of a compiled grammar with a token mask, n_vocab/8 bytes each, before the least recently used
+// are dropped and recomputed on demand
+#define LLAMA_GRAMMAR_MAX_MASKS 256
 
-    // Check for left recursion
-    std::vector<bool> rules_visited(n_rules);
-    std::vector<bool> rules_in_progress(n_rules);
-    std::vector<bool> rules_may_be_empty(n_rules);
-    for (size_t i = 0; i < n_rules; i++) {
-        if (rules_visited[i]) {
-            continue;
-        }
-        if (llama_grammar_detect_left_recursion(vec_rules, i, &rules_visited, &rules_in_progress, &rules_may_be_empty)) {
-            LLAMA_LOG_ERROR("unsupported grammar, left recursion detected for nonterminal at index %zu", i);
-            return nullptr;
-        }
-    }
+static llama_grammar_stacks llama_grammar_init_stacks(const llama_grammar_rules & rules, size_t start_rule_index) {
+    llama_grammar_stacks stacks;
 
     // loop over alternates of start rule to build initial stacks
-    llama_grammar_stacks stacks;
-    pos = vec_rules[start_rule_index].data();
+    const llama_grammar_element * pos = rules[start_rule_index].data();
     do {
         llama_grammar_stack stack;
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(rules, stack, stacks);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -957,31 +955,336 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     } while (true);
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
-    // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar {
-        vocab,
-        std::move(vec_rules),
-        std::move(stacks),
-        /* .partial_utf8 = */     {},
-        /* .lazy =*/              false,
-        /* .awaiting_trigger = */ false,
-        /* .trigger_buffer = */   "",
-        /* .trigger_tokens   = */ {},
-        /* .trigger_patterns    = */ {},
-    };
+    return stacks;
 }
 
-struct llama_grammar * llama_grammar_init_impl(
+static bool llama_grammar_has_left_recursion(const llama_grammar_rules & rules) {
+    const size_t n_rules = rules.size();
+
+    std::vector<bool> rules_visited(n_rules);
+    std::vector<bool> rules_in_progress(n_rules);
+    std::vector<bool> rules_may_be_empty(n_rules);
+    for (size_t i = 0; i < n_rules; i++) {
+        if (rules_visited[i]) {
+            continue;
+        }
+        if (llama_grammar_detect_left_recursion(rules, i, &rules_visited, &rules_in_progress, &rules_may_be_empty)) {
+            LLAMA_LOG_ERROR("unsupported grammar, left recursion detected for nonterminal at index %zu", i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the stacks are sorted, because their order depends on the path that led to the state
+llama_grammar_state llama_grammar_get_state(const llama_grammar_stacks & stacks, llama_partial_utf8 partial_utf8) {
+    std::vector<const llama_grammar_stack *> sorted;
+    sorted.reserve(stacks.size());
+
+    size_t n_elements = 0;
+    for (const auto & stack : stacks) {
+        sorted.push_back(&stack);
+        n_elements += stack.size() + 1;
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const llama_grammar_stack * a, const llama_grammar_stack * b) {
+        return std::lexicographical_compare(a->begin(), a->end(), b->begin(), b->end(), std::less<const llama_grammar_element *>());
+    });
+
+    llama_grammar_state state;
+    state.elements.reserve(n_elements);
+    for (const auto * stack : sorted) {
+        state.elements.insert(state.elements.end(), stack->begin(), stack->end());
+        state.elements.push_back(nullptr);
+    }
+    state.partial_utf8 = partial_utf8;
+
+    return state;
+}
+
+bool llama_grammar_state::operator==(const llama_grammar_state & other) const {
+    return partial_utf8.value    == other.partial_utf8.value &&
+           partial_utf8.n_remain == other.partial_utf8.n_remain &&
+           elements == other.elements;
+}
+
+size_t llama_grammar_state_hash::operator()(const llama_grammar_state & state) const {
+    size_t res = std::hash<uint32_t>{}(state.partial_utf8.value) ^ (std::hash<int>{}(state.partial_utf8.n_remain) << 1);
+    for (const auto * elem : state.elements) {
+        res ^= std::hash<const llama_grammar_element *>{}(elem) + 0x9e3779b9 + (res << 6) + (res >> 2);
+    }
+    return res;
+}
+
+llama_grammar_compiled::llama_grammar_compiled(const llama_vocab * vocab, llama_grammar_rules && rules, size_t start_rule_index) :
+    vocab(vocab),
+    rules(std::move(rules)),
+    stacks_start(llama_grammar_init_stacks(this->rules, start_rule_index)),
+    max_masks(LLAMA_GRAMMAR_MAX_MASKS) {
+}
+
+size_t llama_grammar_compiled::n_masks() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return masks.size();
+}
+
+std::shared_ptr<const llama_grammar_mask> llama_grammar_compiled::get_mask(const llama_grammar_state & state) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const auto it = masks.find(state);
+    if (it == masks.end()) {
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, it->second.lru);
+
+    return it->second.mask;
+}
+
+// computes the tokens allowed by a set of stacks by walking the trie of the pieces of the vocab. the pieces are
+// decoded like decode_utf8, but the subtree of a prefix that is rejected by all the stacks is skipped at once.
+// the sets of stacks reached by the prefixes are interned, so that the prefixes that lead to the same stacks
+// (e.g. the characters of a string) advance them only once
+struct llama_grammar_trie_walk {
+    llama_grammar_trie_walk(const llama_grammar_rules & rules, const llama_vocab_trie & trie, llama_grammar_mask & mask) :
+        rules(rules), trie(trie), mask(mask) {}
+
+    const llama_grammar_rules & rules;
+    const llama_vocab_trie    & trie;
+
+    llama_grammar_mask & mask;
+
+    // the tokens with a 0 code point, which ends the decoded piece early - left to decode_utf8
+    std::vector<llama_token> tokens_fallback;
+
+    std::vector<llama_grammar_stacks> stacks;
+    std::unordered_map<llama_grammar_state, int32_t, llama_grammar_state_hash> ids;
+
+    // (id of the stacks, code point) -> id of the stacks after accepting the code point, -1 if there are none
+    std::unordered_map<uint64_t, int32_t> transitions;
+
+    int32_t add(llama_grammar_stacks && stacks_new) {
+        auto res = ids.emplace(llama_grammar_get_state(stacks_new, {}), (int32_t) stacks.size());
+        if (res.second) {
+            stacks.push_back(std::move(stacks_new));
+        }
+
+        return res.first->second;
+    }
+
+    int32_t accept(int32_t id, uint32_t chr) {
+        const uint64_t key = ((uint64_t) id << 32) | chr;
+
+        const auto it = transitions.find(key);
+        if (it != transitions.end()) {
+            return it->second;
+        }
+
+        llama_grammar_stacks stacks_new;
+        llama_grammar_accept_chr(rules, stacks[id], chr, stacks_new);
+
+        const int32_t id_new = stacks_new.empty() ? -1 : add(std::move(stacks_new));
+        transitions.emplace(key, id_new);
+
+        return id_new;
+    }
+
+    // the stacks of the complete code points of the prefix of the node, and the partial UTF-8 sequence after them
+    void walk(uint32_t i_node, int32_t id, llama_partial_utf8 partial_utf8, bool is_continued) {
+        static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+
+        const auto & node = trie.nodes[i_node];
+
+        // the tokens whose piece ends here
+        if (node.tok_begin < node.tok_mid) {
+            bool allow = partial_utf8.n_remain == 0;
+            if (!allow) {
+                for (const auto & stack : stacks[id]) {
+                    if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial_utf8)) {
+                        allow = true;
+                        break;
+                    }
+                }
+            }
+
+            if (allow) {
+                for (uint32_t i = node.tok_begin; i < node.tok_mid; ++i) {
+                    const llama_token token = trie.tokens[i];
+                    mask[token/32] |= 1u << (token%32);
+                }
+            }
+        }
+
+        for (uint32_t i_child = i_node + 1; i_child < node.end; i_child = trie.nodes[i_child].end) {
+            const auto &  child = trie.nodes[i_child];
+            const uint8_t byte  = child.byte;
+
+            uint32_t value;
+            int      n_remain;
+            bool     is_continued_child = is_continued;
+
+            if (partial_utf8.n_remain > 0) {
+                if (is_continued && (byte >> 6) != 2) {
+                    // invalid sequence, all the subtree is rejected
+                    continue;
+                }
+                value    = (partial_utf8.value << 6) + (byte & 0x3F);
+                n_remain = partial_utf8.n_remain - 1;
+            } else {
+                n_remain = lookup[byte >> 4] - 1;
+                if (n_remain < 0) {
+                    // invalid sequence, all the subtree is rejected
+                    continue;
+                }
+                value = byte & ((1 << (7 - n_remain)) - 1);
+                is_continued_child = false;
+            }
+
+            if (n_remain > 0) {
+                walk(i_child, id, { value, n_remain }, is_continued_child);
+                continue;
+            }
+
+            if (value == 0) {
+                tokens_fallback.insert(tokens_fallback.end(), trie.tokens.begin() + child.tok_begin, trie.tokens.begin() + child.tok_end);
+                continue;
+            }
+
+            const int32_t id_child = accept(id, value);
+            if (id_child >= 0) {
+                walk(i_child, id_child, {}, false);
+            }
+        }
+    }
+};
+
+std::shared_ptr<const llama_grammar_mask> llama_grammar_compiled::compute_mask(
+        const llama_grammar_state  & state,
+        const llama_grammar_stacks & stacks) {
+    GGML_ASSERT(vocab != nullptr);
+
+    const uint32_t n_vocab = vocab->n_tokens();
+
+    std::call_once(eog_once, [&]() {
+        for (uint32_t id = 0; id < n_vocab; ++id) {
+            if (vocab->is_eog(id)) {
+                eog_tokens.push_back(id);
+            }
+        }
+    });
+
+    auto mask = std::make_shared<llama_grammar_mask>((n_vocab + 31)/32, 0);
+
+    // the empty pieces and the pieces starting with 0 are not in the trie, so they are never allowed
+    const auto & trie = vocab->get_piece_trie();
+
+    llama_partial_utf8 partial_utf8 = state.partial_utf8;
+    if (partial_utf8.n_remain < 0) {
+        partial_utf8 = {};
+    }
+
+    llama_grammar_trie_walk walk(rules, trie, *mask);
+    if (!stacks.empty()) {
+        walk.walk(0, walk.add(llama_grammar_stacks(stacks)), partial_utf8, partial_utf8.n_remain > 0);
+    }
+
+    const auto & tokens_fallback = walk.tokens_fallback;
+    if (!tokens_fallback.empty()) {
+        std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
+        candidates_decoded.reserve(tokens_fallback.size());
+
+        llama_grammar_candidates candidates;
+        candidates.reserve(tokens_fallback.size());
+
+        for (const llama_token id : tokens_fallback) {
+            candidates_decoded.push_back(decode_utf8(vocab->token_to_piece(id), state.partial_utf8));
+            candidates.push_back({ (size_t) id, candidates_decoded.back().first.data(), candidates_decoded.back().second });
+            (*mask)[id/32] |= 1u << (id%32);
+        }
+
+        const auto rejects = llama_grammar_reject_candidates(rules, stacks, candidates);
+        for (const auto & reject : rejects) {
+            (*mask)[reject.index/32] &= ~(1u << (reject.index%32));
+        }
+    }
+
+    bool allow_eog = false;
+    for (const auto & stack : stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+            break;
+        }
+    }
+
+    for (const llama_token id : eog_tokens) {
+        if (allow_eog) {
+            (*mask)[id/32] |=   1u << (id%32);
+        } else {
+            (*mask)[id/32] &= ~(1u << (id%32));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // another sampler might have computed the same state meanwhile
+    const auto res = masks.emplace(state, llama_grammar_mask_entry { std::move(mask), {} });
+    if (!res.second) {
+        lru.splice(lru.begin(), lru, res.first->second.lru);
+        return res.first->second.mask;
+    }
+
+    // the keys of the map do not move on rehash
+    lru.push_front(&res.first->first);
+    res.first->second.lru = lru.begin();
+
+    while (masks.size() > std::max<size_t>(1, max_masks)) {
+        const auto it = masks.find(*lru.back());
+        lru.pop_back();
+        masks.erase(it);
+    }
+
+    return res.first->second.mask;
+}
+
+llama_grammar_cache::llama_grammar_cache() :
+    max_size(LLAMA_GRAMMAR_CACHE_SIZE),
+    max_masks(LLAMA_GRAMMAR_MAX_MASKS) {
+}
+
+size_t llama_grammar_cache::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return entries.size();
+}
+
+std::shared_ptr<llama_grammar_compiled> llama_grammar_cache::get(const std::string & key) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->first == key) {
+            entries.splice(entries.begin(), entries, it);
+            return entries.front().second;
+        }
+    }
+
+    return nullptr;
+}
+
+void llama_grammar_cache::put(const std::string & key, const std::shared_ptr<llama_grammar_compiled> & compiled) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    entries.emplace_front(key, compiled);
+    while (entries.size() > max_size) {
+        entries.pop_back();
+    }
+}
+
+static std::shared_ptr<llama_grammar_compiled> llama_grammar_compile(
         const struct llama_vocab * vocab,
                       const char * grammar_str,
-                      const char * grammar_root,
-                              bool lazy,
-                     const char ** trigger_patterns,
-                            size_t num_trigger_patterns,
-               const llama_token * trigger_tokens,
-                            size_t num_trigger_tokens) {
+                      const char * grammar_root) {
     llama_grammar_parser parser;
 
     // if there is a grammar, parse it
@@ -1014,40 +1317,80 @@ struct llama_grammar * llama_grammar_init_impl(
     }
 
     // Check for left recursion
-    std::vector<bool> rules_visited(n_rules);
-    std::vector<bool> rules_in_progress(n_rules);
-    std::vector<bool> rules_may_be_empty(n_rules);
+    if (llama_grammar_has_left_recursion(vec_rules)) {
+        return nullptr;
+    }
+
+    return std::make_shared<llama_grammar_compiled>(vocab, std::move(vec_rules), start_rule_index);
+}
+
+struct llama_grammar * llama_grammar_init_impl(
+        const struct llama_vocab * vocab,
+        const llama_grammar_element ** rules,
+        size_t n_rules,
+        size_t start_rule_index) {
+    const llama_grammar_element * pos;
+
+    // copy rule definitions into vectors
+    llama_grammar_rules vec_rules(n_rules);
     for (size_t i = 0; i < n_rules; i++) {
-        if (rules_visited[i]) {
-            continue;
-        }
-        if (llama_grammar_detect_left_recursion(vec_rules, i, &rules_visited, &rules_in_progress, &rules_may_be_empty)) {
-            LLAMA_LOG_ERROR("unsupported grammar, left recursion detected for nonterminal at index %zu", i);
-            return nullptr;
+        for (pos = rules[i]; pos->type != LLAMA_GRETYPE_END; pos++) {
+            vec_rules[i].push_back(*pos);
         }
+        vec_rules[i].push_back({LLAMA_GRETYPE_END, 0});
     }
 
-    // loop over alternates of start rule to build initial stacks
-    llama_grammar_stacks stacks;
-    pos = vec_rules[start_rule_index].data();
-    do {
-        llama_grammar_stack stack;
-        if (!llama_grammar_is_end_of_sequence(pos)) {
-            // if alternate is nonempty, add to stack
-            stack.push_back(pos);
-        }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
-        while (!llama_grammar_is_end_of_sequence(pos)) {
-            // scan to end of alternate def
-            pos++;
+    // Check for left recursion
+    if (llama_grammar_has_left_recursion(vec_rules)) {
+        return nullptr;
+    }
+
+    // Important: the stacks contain pointers to elements of the rules, so the rules are owned by the compiled grammar
+    // that is shared with the clones, instead of being copied into each llama_grammar
+    auto compiled = std::make_shared<llama_grammar_compiled>(vocab, std::move(vec_rules), start_rule_index);
+
+    return new llama_grammar {
+        vocab,
+        compiled,
+        compiled->rules,
+        std::make_shared<llama_grammar_stacks>(compiled->stacks_start),
+        /* .partial_utf8 = */     {},
+        /* .lazy =*/              false,
+        /* .awaiting_trigger = */ false,
+        /* .trigger_buffer = */   "",
+        /* .trigger_tokens   = */ {},
+        /* .trigger_patterns    = */ {},
+    };
+}
+
+struct llama_grammar * llama_grammar_init_impl(
+        const struct llama_vocab * vocab,
+                      const char * grammar_str,
+                      const char * grammar_root,
+                              bool lazy,
+                     const char ** trigger_patterns,
+                            size_t num_trigger_patterns,
+               const llama_token * trigger_tokens,
+                            size_t num_trigger_tokens) {
+    // the grammars initialized from the same string share the rules and the token masks computed so far
+    const std::string key = std::string(grammar_root) + '\n' + grammar_str;
+
+    std::shared_ptr<llama_grammar_compiled> compiled;
+    if (vocab) {
+        compiled = vocab->get_grammar_cache().get(key);
+    }
+
+    if (!compiled) {
+        compiled = llama_grammar_compile(vocab, grammar_str, grammar_root);
+        if (!compiled) {
+            return nullptr;
         }
-        if (pos->type == LLAMA_GRETYPE_ALT) {
-            // there's another alternate def of this rule to process
-            pos++;
-        } else {
-            break;
+
+        if (vocab) {
+            compiled->max_masks = vocab->get_grammar_cache().max_masks;
+            vocab->get_grammar_cache().put(key, compiled);
         }
-    } while (true);
+    }
 
     std::vector<llama_token>    vec_trigger_tokens;
     std::vector<llama_grammar_trigger_pattern> vec_trigger_patterns;
@@ -1062,13 +1405,11 @@ struct llama_grammar * llama_grammar_init_impl(
         trigger.regex = std::regex(trigger.pattern);
     }
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
-    // then the pointers would be invalidated when the local vec_rules goes out of scope.
     return new llama_grammar {
         vocab,
-        std::move(vec_rules),
-        std::move(stacks),
+        compiled,
+        compiled->rules,
+        std::make_shared<llama_grammar_stacks>(compiled->stacks_start),
         /* .partial_utf8 = */     {},
         /* .lazy = */             lazy,
         /* .awaiting_trigger = */ lazy,
@@ -1087,8 +1428,11 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & grammar) {
+    // the rules are shared, so the elements in the stacks remain valid, and the stacks themselves are shared until
+    // one of the grammars accepts a character - cloning a grammar to check a draft and rolling back are cheap
     auto * result = new llama_grammar {
         grammar.vocab,
+        grammar.compiled,
         grammar.rules,
         grammar.stacks,
         grammar.partial_utf8,
@@ -1099,19 +1443,6 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_patterns,
     };
 
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar.rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar.rules[ir0].size(); ir1++) {
-                    if (grammar.stacks[is][ie] == &grammar.rules[ir0][ir1]) {
-                        result->stacks[is][ie] =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
-        }
-    }
-
     return result;
 }
 
@@ -1122,8 +1453,28 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         return;
     }
 
+    // whether a token is allowed does not depend on the other candidates, so when most of the vocab is checked the
+    // allowed tokens are computed for all of it, and reused each time a grammar with the same rules is in this state
+    const llama_grammar_state state = llama_grammar_get_state(*grammar.stacks, grammar.partial_utf8);
+
+    auto mask = grammar.compiled->get_mask(state);
+    if (!mask && 4*cur_p->size >= (size_t) grammar.vocab->n_tokens()) {
+        mask = grammar.compiled->compute_mask(state, *grammar.stacks);
+    }
+
+    if (mask) {
+        const auto & bits = *mask;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token id = cur_p->data[i].id;
+            if (!(bits[id/32] & (1u << (id%32)))) {
+                cur_p->data[i].logit = -INFINITY;
+            }
+        }
+        return;
+    }
+
     bool allow_eog = false;
-    for (const auto & stack : grammar.stacks) {
+    for (const auto & stack : *grammar.stacks) {
         if (stack.empty()) {
             allow_eog = true;
             break;
@@ -1152,7 +1503,7 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         }
     }
 
-    const auto rejects = llama_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = llama_grammar_reject_candidates(grammar.rules, *grammar.stacks, candidates_grammar);
     for (const auto & reject : rejects) {
         cur_p->data[reject.index].logit = -INFINITY;
     }
@@ -1192,7 +1543,7 @@ void llama_grammar_accept_impl(struct llama_grammar & grammar, llama_token token
     }
 
     if (grammar.vocab->is_eog(token)) {
-        for (const auto & stack : grammar.stacks) {
+        for (const auto & stack : *grammar.stacks) {
             if (stack.empty()) {
                 return;
             }
@@ -1213,7 +1564,7 @@ void llama_grammar_accept_str(struct llama_grammar & grammar, const std::string
     }
 
     grammar.partial_utf8 = decoded.second;
-    if (grammar.stacks.empty()) {
+    if (grammar.stacks->empty()) {
         throw std::runtime_error("Unexpected empty grammar stack after accepting piece: " + piece);
     }
 }
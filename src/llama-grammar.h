@@ -2,9 +2,13 @@
 
 #include "llama.h"
 
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct llama_vocab;
@@ -111,12 +115,102 @@ struct llama_grammar_trigger_pattern {
     std::regex  regex;
 };
 
+// a state of the pushdown automaton of a grammar: its set of stacks, in a canonical order, and the partial UTF-8
+// sequence of the accepted tokens. the elements of the stacks point into the rules, so the states are only
+// comparable between the grammars that share the same llama_grammar_compiled
+struct llama_grammar_state {
+    std::vector<const llama_grammar_element *> elements; // each stack is terminated by a nullptr
+
+    llama_partial_utf8 partial_utf8;
+
+    bool operator==(const llama_grammar_state & other) const;
+};
+
+struct llama_grammar_state_hash {
+    size_t operator()(const llama_grammar_state & state) const;
+};
+
+llama_grammar_state llama_grammar_get_state(const llama_grammar_stacks & stacks, llama_partial_utf8 partial_utf8);
+
+// one bit per token of the vocab
+using llama_grammar_mask = std::vector<uint32_t>;
+
+// the rules of a grammar compiled against a vocab, together with the tokens that are allowed in each of the states
+// of the grammar seen so far. shared by the clones of a grammar and by the grammars initialized from the same string
+struct llama_grammar_compiled {
+    llama_grammar_compiled(const llama_vocab * vocab, llama_grammar_rules && rules, size_t start_rule_index);
+
+    // note: allow null vocab for testing (not great)
+    const llama_vocab * vocab;
+
+    const llama_grammar_rules  rules;
+    const llama_grammar_stacks stacks_start; // the stacks of the alternates of the start rule
+
+    // the number of states with a mask kept, the least recently used are dropped first
+    size_t max_masks;
+
+    // the number of states with a mask
+    size_t n_masks();
+
+    std::shared_ptr<const llama_grammar_mask> get_mask(const llama_grammar_state & state);
+
+    // compute the tokens allowed by the stacks over all the vocab, walking the trie of its pieces, and cache them
+    std::shared_ptr<const llama_grammar_mask> compute_mask(
+            const llama_grammar_state  & state,
+            const llama_grammar_stacks & stacks);
+
+private:
+    std::once_flag           eog_once;
+    std::vector<llama_token> eog_tokens;
+
+    std::mutex mutex;
+
+    struct llama_grammar_mask_entry {
+        std::shared_ptr<const llama_grammar_mask> mask;
+
+        std::list<const llama_grammar_state *>::iterator lru;
+    };
+
+    std::unordered_map<llama_grammar_state, llama_grammar_mask_entry, llama_grammar_state_hash> masks;
+
+    // the keys of masks, most recently used first
+    std::list<const llama_grammar_state *> lru;
+};
+
+// the grammars compiled recently against a vocab, so that the samplers initialized with the same grammar (e.g. the
+// requests of a server that use the same JSON schema) reuse the rules and the token masks instead of starting over
+struct llama_grammar_cache {
+    llama_grammar_cache();
+
+    // the number of grammars kept, 0 disables the cache
+    size_t max_size;
+
+    // llama_grammar_compiled::max_masks of the grammars compiled from now on
+    size_t max_masks;
+
+    size_t size();
+
+    std::shared_ptr<llama_grammar_compiled> get(const std::string & key);
+
+    void put(const std::string & key, const std::shared_ptr<llama_grammar_compiled> & compiled);
+
+private:
+    std::mutex mutex;
+
+    // most recently used first
+    std::list<std::pair<std::string, std::shared_ptr<llama_grammar_compiled>>> entries;
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
 
-    const llama_grammar_rules  rules;  // TODO: shared ptr
-          llama_grammar_stacks stacks;
+    std::shared_ptr<llama_grammar_compiled> compiled;
+
+    const llama_grammar_rules & rules; // owned by compiled
+
+    // shared with the clones until they accept a character (copy on write)
+    std::shared_ptr<llama_grammar_stacks> stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
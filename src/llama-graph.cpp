@@ -89,10 +89,16 @@ void llm_graph_input_pos_bucket_kv::set_input(const llama_ubatch * ubatch) {
 
         const int64_t n_kv = kv_self->n;
 
+        // with a paged cache, the i-th KV entry is the cell kv_idxs[i]
+        const uint32_t * kv_idxs   = kv_paged ? kv_paged->get_kv_idxs().data() : nullptr;
+        const int64_t    n_kv_idxs = kv_paged ? kv_paged->get_kv_idxs().size() : n_kv;
+
         for (int h = 0; h < 1; ++h) {
             for (int j = 0; j < n_tokens; ++j) {
                 for (int i = 0; i < n_kv; ++i) {
-                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(kv_self->cells[i].pos, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
+                    const llama_pos pos_kv = i < n_kv_idxs ? kv_self->cells.pos[kv_idxs ? kv_idxs[i] : i] : -1;
+
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = llama_relative_position_bucket(pos_kv, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
                 }
             }
         }
@@ -258,19 +264,19 @@ void llm_graph_input_s_copy::set_input(const llama_ubatch * ubatch) {
 
             //////////////////////////////////////////////
             // TODO: this should not mutate the KV cache !
-            llama_kv_cell & kv_cell = const_cast<class llama_kv_cache_unified *>(kv_self)->cells[i];
+            int32_t & src = const_cast<class llama_kv_cache_unified *>(kv_self)->cells.src[i];
 
             // prevent out-of-bound sources
-            if (kv_cell.src < 0 || (uint32_t) kv_cell.src >= kv_self->size) {
-                kv_cell.src = cell_id;
+            if (src < 0 || (uint32_t) src >= kv_self->size) {
+                src = cell_id;
             }
 
-            data[i] = kv_cell.src;
+            data[i] = src;
 
             // TODO: do not mutate the KV cache
             // ensure copy only happens once
-            if (kv_cell.src != (int32_t) cell_id) {
-                kv_cell.src = cell_id;
+            if (src != (int32_t) cell_id) {
+                src = cell_id;
             }
         }
     }
@@ -291,13 +297,13 @@ void llm_graph_input_s_mask::set_input(const llama_ubatch * ubatch) {
 
             //////////////////////////////////////////////
             // TODO: this should not mutate the KV cache !
-            llama_kv_cell & kv_cell = const_cast<class llama_kv_cache_unified *>(kv_self)->cells[i];
+            int32_t & src = const_cast<class llama_kv_cache_unified *>(kv_self)->cells.src[i];
 
-            data[i] = (float) (kv_cell.src >= 0);
+            data[i] = (float) (src >= 0);
 
             // only clear once
-            if (kv_cell.src < 0) {
-                kv_cell.src = cell_id;
+            if (src < 0) {
+                src = cell_id;
             }
         }
     }
@@ -313,10 +319,118 @@ void llm_graph_input_cross_embd::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_lora::set_input(const llama_ubatch * ubatch) {
+    // a reused graph has groups with the same adapters and sizes (see llama_context::graph_get_key)
+    groups = llama_adapter_lora_route(*loras_seq, *ubatch, n_outputs);
+    GGML_ASSERT(groups.size() == routes[0].idxs.size());
+
+    for (int i_route = 0; i_route < 2; ++i_route) {
+        const bool    out = i_route == 1;
+        const int64_t n   = out ? n_outputs : ubatch->n_tokens;
+
+        const route & r = routes[i_route];
+
+        for (size_t ig = 0; ig < groups.size(); ++ig) {
+            const auto & group = get_group(ig, out);
+
+            if (r.idxs[ig]) {
+                GGML_ASSERT(r.idxs[ig]->ne[0] == (int64_t) group.size());
+
+                ggml_backend_tensor_set(r.idxs[ig], group.data(), 0, group.size()*ggml_element_size(r.idxs[ig]));
+            }
+
+            if (r.mask[ig]) {
+                std::vector<float> data(n, 0.0f);
+                for (const int32_t i : group) {
+                    data[i] = 1.0f;
+                }
+
+                ggml_backend_tensor_set(r.mask[ig], data.data(), 0, n*ggml_element_size(r.mask[ig]));
+            }
+        }
+
+        for (const auto & sc : r.scatters) {
+            std::vector<int32_t> data (n, 0);
+            std::vector<float>   cover(n, 0.0f);
+
+            int32_t offs = 0;
+            for (const size_t ig : sc.groups) {
+                const auto & group = get_group(ig, out);
+
+                for (size_t k = 0; k < group.size(); ++k) {
+                    data [group[k]] = offs + k;
+                    cover[group[k]] = 1.0f;
+                }
+
+                offs += group.size();
+            }
+
+            ggml_backend_tensor_set(sc.idxs, data.data(), 0, n*ggml_element_size(sc.idxs));
+
+            if (sc.cover) {
+                ggml_backend_tensor_set(sc.cover, cover.data(), 0, n*ggml_element_size(sc.cover));
+            }
+        }
+    }
+}
+
+ggml_tensor * llm_graph_input_lora::get_idxs(ggml_context * ctx, size_t ig, bool out) {
+    ggml_tensor *& t = routes[out].idxs[ig];
+
+    if (!t) {
+        t = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, get_group(ig, out).size());
+        ggml_set_input(t);
+    }
+
+    return t;
+}
+
+ggml_tensor * llm_graph_input_lora::get_mask(ggml_context * ctx, size_t ig, bool out, int64_t n) {
+    ggml_tensor *& t = routes[out].mask[ig];
+
+    if (!t) {
+        t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n);
+        ggml_set_input(t);
+    }
+
+    return t;
+}
+
+const llm_graph_input_lora::scatter & llm_graph_input_lora::get_scatter(ggml_context * ctx, const std::vector<size_t> & groups, bool out, int64_t n) {
+    auto & scatters = routes[out].scatters;
+
+    for (const auto & sc : scatters) {
+        if (sc.groups == groups) {
+            return sc;
+        }
+    }
+
+    scatter sc;
+    sc.groups = groups;
+
+    sc.idxs = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n);
+    ggml_set_input(sc.idxs);
+
+    int64_t n_covered = 0;
+    for (const size_t ig : groups) {
+        n_covered += get_group(ig, out).size();
+    }
+
+    if (n_covered < n) {
+        sc.cover = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n);
+        ggml_set_input(sc.cover);
+    }
+
+    scatters.push_back(std::move(sc));
+
+    return scatters.back();
+}
+
 void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
     if (kq_mask) {
+        // note: with flash attention, the mask has more columns than tokens for the padding of K and V
         if (cparams.causal_attn) {
-            const int64_t n_kv         = ubatch->n_tokens;
+            const int64_t n_kv         = kq_mask->ne[0];
             const int64_t n_tokens     = ubatch->n_tokens;
             const int64_t n_seq_tokens = ubatch->n_seq_tokens;
             const int64_t n_seqs       = ubatch->n_seqs;
@@ -350,6 +464,10 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
                                 data[h*(n_kv*n_tokens) + tj*n_kv + ti] = f;
                             }
                         }
+
+                        for (int i = n_tokens; i < n_kv; ++i) {
+                            data[h*(n_kv*n_tokens) + tj*n_kv + i] = -INFINITY;
+                        }
                     }
                 }
             }
@@ -357,7 +475,7 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
             const int64_t n_tokens     = ubatch->n_tokens;
             const int64_t n_seq_tokens = ubatch->n_seq_tokens;
             const int64_t n_seqs       = ubatch->n_seqs;
-            const int64_t n_stride     = ubatch->n_tokens;
+            const int64_t n_stride     = kq_mask->ne[0];
 
             GGML_ASSERT(ggml_backend_buffer_is_host(kq_mask->buffer));
 
@@ -386,12 +504,12 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
                                     }
                                 }
 
-                                data[h*(n_tokens*n_tokens) + tj*n_stride + ti] = f;
+                                data[h*(n_stride*n_tokens) + tj*n_stride + ti] = f;
                             }
                         }
 
                         for (int i = n_tokens; i < n_stride; ++i) {
-                            data[h*(n_tokens*n_tokens) + tj*n_stride + i] = -INFINITY;
+                            data[h*(n_stride*n_tokens) + tj*n_stride + i] = -INFINITY;
                         }
                     }
                 }
@@ -422,6 +540,100 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                 data_swa = (float *) self_kq_mask_swa->data;
             }
 
+            // with a paged cache, the i-th KV entry is the cell kv_idxs[i]
+            const uint32_t * kv_idxs   = kv_paged ? kv_paged->get_kv_idxs().data() : nullptr;
+            const int64_t    n_kv_idxs = kv_paged ? kv_paged->get_kv_idxs().size() : n_kv;
+
+            const bool     use_alibi = hparams.use_alibi;
+            const int32_t  n_swa     = hparams.n_swa;
+
+            // the positions of the KV cells in the sequence of the current token, -1 for cells of other sequences
+            // and for the padding - rebuilt only when the sequence changes, so that the rows below are branch-free
+            std::vector<llama_pos> seq_pos;
+            llama_seq_id seq_id_cur = -1;
+
+            // without ALiBi and sliding window, the row of a token only depends on the cells of its sequence up to its
+            // position: reuse the rows of the previous ubatches and only add the cells of the new tokens
+            const bool incremental = !use_alibi && !data_swa;
+
+            auto & mask_rows = kv_self->mask_rows;
+
+            // the cells of the tokens of the ubatch, in ubatch order
+            std::vector<uint32_t> ubatch_cells;
+
+            // the sequences whose rows have been updated with the cells of this ubatch
+            std::vector<bool> seq_done;
+
+            // the range of the cells of the ubatch
+            uint32_t ubatch_c0 = kv_self->size;
+            uint32_t ubatch_c1 = 0;
+
+            if (incremental) {
+                for (const auto & range : kv_self->get_slot_ranges(n_tokens)) {
+                    for (uint32_t c = range.first; c < range.second; ++c) {
+                        ubatch_cells.push_back(c);
+                    }
+
+                    ubatch_c0 = std::min(ubatch_c0, range.first);
+                    ubatch_c1 = std::max(ubatch_c1, range.second);
+                }
+            } else {
+                mask_rows.invalidate();
+            }
+
+            // the row of seq_id for a token at position pos, over all the cells of the cache
+            auto get_mask_row = [&](llama_seq_id seq_id, llama_pos pos) -> const float * {
+                if ((size_t) seq_id >= mask_rows.pos.size()) {
+                    mask_rows.rows .resize(seq_id + 1);
+                    mask_rows.pos  .resize(seq_id + 1, -1);
+                    mask_rows.dirty.resize(seq_id + 1, { 0, 0 });
+                }
+                if (seq_done.size() < mask_rows.pos.size()) {
+                    seq_done.resize(mask_rows.pos.size(), false);
+                }
+
+                auto & row       = mask_rows.rows [seq_id];
+                auto & row_pos   = mask_rows.pos  [seq_id];
+                auto & row_dirty = mask_rows.dirty[seq_id];
+
+                const auto & cells = kv_self->cells;
+
+                if (row_pos < 0 || pos < row_pos) {
+                    // full rebuild - the cells of the ubatch are already in the cache
+                    const uint32_t size = kv_self->size;
+
+                    seq_pos.resize(size);
+                    cells.seq_pos(seq_id, nullptr, size, seq_pos.data());
+
+                    row.resize(size);
+                    for (uint32_t i = 0; i < size; ++i) {
+                        row[i] = (seq_pos[i] >= 0 && seq_pos[i] <= pos) ? 0.0f : -INFINITY;
+                    }
+                } else {
+                    // the cells changed by the edits of the cache since the last ubatch
+                    for (uint32_t c = row_dirty.first; c < row_dirty.second; ++c) {
+                        row[c] = (cells.has_seq_id(c, seq_id) && cells.pos[c] <= pos) ? 0.0f : -INFINITY;
+                    }
+
+                    for (const uint32_t c : ubatch_cells) {
+                        if (cells.pos[c] <= pos && cells.has_seq_id(c, seq_id)) {
+                            row[c] = 0.0f;
+                        }
+                    }
+                }
+
+                row_pos   = pos;
+                row_dirty = { 0, 0 };
+
+                seq_done[seq_id] = true;
+
+                return row.data();
+            };
+
+            if (!incremental) {
+                seq_pos.resize(n_kv, -1);
+            }
+
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the ubatch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
@@ -429,31 +641,71 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
                 for (int s = 0; s < n_seqs; ++s) {
                     const llama_seq_id seq_id = ubatch->seq_id[s][0];
 
+                    if (incremental) {
+                        for (int j = 0; j < n_seq_tokens; ++j) {
+                            const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
+
+                            const float * src = get_mask_row(seq_id, pos);
+
+                            float * row = data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+                            if (kv_idxs) {
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = i < n_kv_idxs ? src[kv_idxs[i]] : -INFINITY;
+                                }
+                            } else {
+                                memcpy(row, src, n_kv*sizeof(float));
+                            }
+                        }
+
+                        continue;
+                    }
+
+                    if (seq_id != seq_id_cur) {
+                        kv_self->cells.seq_pos(seq_id, kv_idxs, n_kv_idxs, seq_pos.data());
+                        seq_id_cur = seq_id;
+                    }
+
+                    const llama_pos * sp = seq_pos.data();
+
                     for (int j = 0; j < n_seq_tokens; ++j) {
                         const llama_pos pos = ubatch->pos[s*n_seq_tokens + j];
 
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            if (!kv_self->cells[i].has_seq_id(seq_id) || kv_self->cells[i].pos > pos) {
-                                f = -INFINITY;
+                        if (data) {
+                            float * row = data + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+                            if (use_alibi) {
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = (sp[i] >= 0 && sp[i] <= pos) ? -(float) std::abs(sp[i] - pos) : -INFINITY;
+                                }
                             } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self->cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = (sp[i] >= 0 && sp[i] <= pos) ? 0.0f : -INFINITY;
                                 }
                             }
+                        }
 
-                            if (data) {
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                        // may need to cut off old tokens for sliding window
+                        if (data_swa) {
+                            float * row = data_swa + h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+                            if (use_alibi) {
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = (sp[i] >= 0 && sp[i] <= pos && pos - sp[i] < n_swa) ? -(float) std::abs(sp[i] - pos) : -INFINITY;
+                                }
+                            } else {
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = (sp[i] >= 0 && sp[i] <= pos && pos - sp[i] < n_swa) ? 0.0f : -INFINITY;
+                                }
                             }
+                        }
+                    }
+                }
 
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self->cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                if (incremental) {
+                    // the other sequences of the ubatch tokens did not get the new cells in their rows
+                    for (int s = 0; s < n_seqs; ++s) {
+                        for (int j = 1; j < ubatch->n_seq_id[s]; ++j) {
+                            const llama_seq_id seq_id = ubatch->seq_id[s][j];
+                            if ((size_t) seq_id >= seq_done.size() || !seq_done[seq_id]) {
+                                mask_rows.invalidate(ubatch_c0, ubatch_c1);
                             }
                         }
                     }
@@ -525,7 +777,9 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
 
 void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
     if (cross_kq_mask) {
-        const int64_t n_enc    = cross_kq_mask->ne[0];
+        // note: with flash attention, the mask has more columns than encoder outputs for the padding of K and V
+        const int64_t n_kv     = cross_kq_mask->ne[0];
+        const int64_t n_enc    = std::min<int64_t>(n_kv, cross->seq_ids_enc.size());
         const int64_t n_tokens = ubatch->n_tokens;
 
         GGML_ASSERT(ggml_backend_buffer_is_host(cross_kq_mask->buffer));
@@ -543,13 +797,17 @@ void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
                             f = 0.0f;
                         }
                     }
-                    data[h*(n_enc*n_tokens) + j*n_enc + i] = f;
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
+                }
+
+                for (int i = n_enc; i < n_kv; ++i) {
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
                 }
             }
 
             for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                for (int j = 0; j < n_enc; ++j) {
-                    data[h*(n_enc*n_tokens) + i*n_enc + j] = -INFINITY;
+                for (int j = 0; j < n_kv; ++j) {
+                    data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
                 }
             }
         }
@@ -596,10 +854,17 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     backend_cpu      (params.backend_cpu),
     cvec             (params.cvec),
     loras            (params.loras),
+    loras_seq        (params.loras_seq),
     memory           (params.memory),
     cross            (params.cross),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
+        if (loras_seq) {
+            auto groups = llama_adapter_lora_route(*loras_seq, ubatch, n_outputs);
+            if (!groups.empty()) {
+                inp_lora = static_cast<llm_graph_input_lora *>(res->add_input(std::make_unique<llm_graph_input_lora>(loras_seq, n_outputs, std::move(groups))));
+            }
+        }
     }
 
 int64_t llm_graph_context::n_pos_per_token() const {
@@ -641,6 +906,100 @@ ggml_tensor * llm_graph_context::build_lora_mm(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    if (inp_lora) {
+        ggml_tensor * ab_seq = build_lora_mm_seq(w, cur);
+        if (ab_seq) {
+            res = ggml_add(ctx0, res, ab_seq);
+        }
+    }
+
+    return res;
+}
+
+// the tokens of each group are gathered and go through the adapters of the group,
+// then the concatenated outputs of the groups are scattered back to the tokens
+ggml_tensor * llm_graph_context::build_lora_mm_seq(
+          ggml_tensor * w,
+          ggml_tensor * cur) const {
+    // the tokens of the recurrent models are split by sequence in the higher dimensions, in the order of the ubatch
+    if (cur->ne[2] != 1 || cur->ne[3] != 1) {
+        if (!ggml_is_contiguous(cur)) {
+            cur = ggml_cont(ctx0, cur);
+        }
+
+        ggml_tensor * res = build_lora_mm_seq(w, ggml_reshape_2d(ctx0, cur, cur->ne[0], ggml_nrows(cur)));
+
+        return res ? ggml_reshape_4d(ctx0, res, res->ne[0], cur->ne[1], cur->ne[2], cur->ne[3]) : nullptr;
+    }
+
+    // the last layers may only process the outputs of the ubatch
+    const int64_t n   = cur->ne[1];
+    const bool    out = n != n_tokens;
+
+    GGML_ASSERT(n == n_tokens || n == n_outputs);
+
+    std::vector<size_t> groups;
+
+    ggml_tensor * ab_cat = nullptr;
+
+    for (size_t ig = 0; ig < inp_lora->groups.size(); ++ig) {
+        const auto & group = inp_lora->get_group(ig, out);
+        if (group.empty()) {
+            continue;
+        }
+
+        // all the tokens are in the group
+        const bool all = (int64_t) group.size() == n;
+
+        ggml_tensor * x  = nullptr;
+        ggml_tensor * ab = nullptr;
+
+        for (const auto & lora : *inp_lora->groups[ig].loras) {
+            llama_adapter_lora_weight * lw = lora.first->get_weight(w);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            if (x == nullptr) {
+                x = all ? cur : ggml_get_rows(ctx0, cur, inp_lora->get_idxs(ctx0, ig, out));
+            }
+
+            const float scale = lw->get_scale(lora.first->alpha, lora.second);
+
+            ggml_tensor * ab_cur = ggml_mul_mat(
+                    ctx0, lw->b,
+                    ggml_mul_mat(ctx0, lw->a, x)
+                    );
+
+            ab_cur = ggml_scale(ctx0, ab_cur, scale);
+            ab = ab ? ggml_add(ctx0, ab, ab_cur) : ab_cur;
+        }
+
+        if (ab == nullptr) {
+            continue;
+        }
+
+        if (all) {
+            return ab;
+        }
+
+        groups.push_back(ig);
+
+        ab_cat = ab_cat ? ggml_concat(ctx0, ab_cat, ab, 1) : ab;
+    }
+
+    if (ab_cat == nullptr) {
+        return nullptr;
+    }
+
+    const auto & sc = inp_lora->get_scatter(ctx0, groups, out, n);
+
+    ggml_tensor * res = ggml_get_rows(ctx0, ab_cat, sc.idxs);
+
+    if (sc.cover) {
+        res = ggml_mul(ctx0, res, sc.cover);
+    }
+
     return res;
 }
 
@@ -669,6 +1028,38 @@ ggml_tensor * llm_graph_context::build_lora_mm_id(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    // the experts of the tokens are not gathered per group, the outputs of the adapters are masked instead
+    if (inp_lora) {
+        GGML_ASSERT(cur->ne[2] == n_tokens || cur->ne[2] == n_outputs);
+
+        for (size_t ig = 0; ig < inp_lora->groups.size(); ++ig) {
+            for (const auto & lora : *inp_lora->groups[ig].loras) {
+                llama_adapter_lora_weight * lw = lora.first->get_weight(w);
+                if (lw == nullptr) {
+                    continue;
+                }
+
+                const float alpha = lora.first->alpha;
+                const float rank  = (float) lw->b->ne[0];
+                const float scale = alpha ? lora.second * alpha / rank : lora.second;
+
+                ggml_tensor * ab_cur = ggml_mul_mat_id(
+                        ctx0, lw->b,
+                        ggml_mul_mat_id(ctx0, lw->a, cur, ids),
+                        ids
+                        );
+
+                const int64_t n   = cur->ne[2];
+                const bool    out = n != n_tokens;
+
+                ggml_tensor * mask = ggml_reshape_3d(ctx0, inp_lora->get_mask(ctx0, ig, out, n), 1, 1, n);
+
+                ab_cur = ggml_mul(ctx0, ab_cur, ggml_scale(ctx0, mask, scale));
+                res = ggml_add(ctx0, res, ab_cur);
+            }
+        }
+    }
+
     return res;
 }
 
@@ -983,6 +1374,27 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
 
             cur = ggml_add(ctx0, cur, inpL_delta);
         }
+
+        // the adapters of the sequences, masked to the tokens of each group
+        if (inp_lora) {
+            for (size_t ig = 0; ig < inp_lora->groups.size(); ++ig) {
+                for (const auto & lora : *inp_lora->groups[ig].loras) {
+                    llama_adapter_lora_weight * lw = lora.first->get_weight(tok_embd);
+                    if (lw == nullptr) {
+                        continue;
+                    }
+
+                    const float scale = lw->get_scale(lora.first->alpha, lora.second);
+
+                    ggml_tensor * inpL_delta = ggml_mul(ctx0, ggml_mul_mat(
+                                ctx0, lw->b, // non-transposed lora_b
+                                ggml_get_rows(ctx0, lw->a, inp->tokens)
+                                ), ggml_scale(ctx0, inp_lora->get_mask(ctx0, ig, false, n_tokens), scale));
+
+                    cur = ggml_add(ctx0, cur, inpL_delta);
+                }
+            }
+        }
     } else {
         inp->embd = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, ubatch.n_tokens);
         ggml_set_input(inp->embd);
@@ -1130,6 +1542,8 @@ ggml_tensor * llm_graph_context::build_inp_pos_bucket_dec() const {
 
     auto inp = std::make_unique<llm_graph_input_pos_bucket_kv>(hparams, kv_self);
 
+    inp->kv_paged = dynamic_cast<const llama_kv_cache_paged *>(kv_self);
+
     const auto n_kv = kv_self->n;
 
     auto & cur = inp->pos_bucket;
@@ -1179,18 +1593,27 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
     const auto n_tokens = q->ne[1];
     const auto n_head   = q->ne[2];
-    const auto n_kv     = k->ne[1];
 
     ggml_tensor * cur;
 
-    // TODO: replace hardcoded padding with ggml-provided padding
-    if (cparams.flash_attn && (n_kv % 256 == 0) && kq_b == nullptr) {
+    // note: with GPU devices, the number of KV entries is a multiple of LLAMA_FATTN_KV_PAD (the KV cache pads its views
+    //       and the attention without KV cache pads K and V), as required by their kernels
+    if (cparams.flash_attn && kq_b == nullptr) {
         GGML_ASSERT(kq_b == nullptr && "Flash attention does not support KQ bias yet");
 
         if (v_trans) {
             v = ggml_transpose(ctx0, v);
         }
 
+        // the K and V of the attention without KV cache are F32, which the kernels do not support
+        if (k->type == GGML_TYPE_F32) {
+            k = ggml_cast(ctx0, k, GGML_TYPE_F16);
+        }
+
+        if (v->type == GGML_TYPE_F32) {
+            v = ggml_cast(ctx0, v, GGML_TYPE_F16);
+        }
+
         cur = ggml_flash_attn_ext(ctx0, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
                                   hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
 
@@ -1249,11 +1672,29 @@ ggml_tensor * llm_graph_context::build_attn_mha(
     return cur;
 }
 
+ggml_tensor * llm_graph_context::build_attn_pad_kv(ggml_tensor * cur, int64_t n_kv) const {
+    if (cur->ne[2] == n_kv) {
+        return cur;
+    }
+
+    GGML_ASSERT(cur->ne[2] < n_kv);
+
+    // the pad kernels of the GPU backends expect a contiguous tensor
+    if (!ggml_is_contiguous(cur)) {
+        cur = ggml_cont(ctx0, cur);
+    }
+
+    return ggml_pad(ctx0, cur, 0, 0, n_kv - cur->ne[2], 0);
+}
+
 llm_graph_input_attn_no_cache * llm_graph_context::build_attn_inp_no_cache() const {
     auto inp = std::make_unique<llm_graph_input_attn_no_cache>(hparams, cparams);
 
     // note: there is no KV cache, so the number of KV values is equal to the number of tokens in the batch
-    inp->kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+    // (with flash attention, K and V are padded for the GPU kernels and the padding is masked)
+    const int64_t n_kv = cparams.flash_attn ? GGML_PAD(n_tokens, cparams.fattn_kv_pad) : n_tokens;
+
+    inp->kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
     //cb(inp_kq_mask, "KQ_mask", -1);
     ggml_set_input(inp->kq_mask);
 
@@ -1283,6 +1724,9 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const auto & kq_mask = inp->get_kq_mask();
 
+    k_cur = build_attn_pad_kv(k_cur, kq_mask->ne[0]);
+    v_cur = build_attn_pad_kv(v_cur, kq_mask->ne[0]);
+
     ggml_tensor * q = ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
     //cb(q, "q", il);
 
@@ -1311,11 +1755,82 @@ ggml_tensor * llm_graph_context::build_attn(
     return cur;
 }
 
+ggml_tensor * llm_graph_context::build_kv_gather(
+         ggml_cgraph * gf,
+         ggml_tensor * kv,
+         std::vector<std::pair<ggml_backend_buffer_t, ggml_tensor *>> & scratch,
+             int64_t   n_embd_head,
+             int64_t   n_head_kv,
+        const std::vector<std::pair<uint32_t, uint32_t>> & runs) const {
+    const int64_t n_embd_gqa = n_embd_head*n_head_kv;
+
+    const size_t nb_cell = ggml_row_size(kv->type, n_embd_gqa);
+    const size_t nb_head = ggml_row_size(kv->type, n_embd_head);
+
+    if (runs.size() == 1) {
+        ggml_tensor * view = ggml_view_3d(ctx0, kv,
+                n_embd_head, runs[0].second - runs[0].first, n_head_kv,
+                nb_cell, nb_head, runs[0].first*nb_cell);
+
+        res->kv_loads.push_back({ 0, nb_cell, view });
+
+        return view;
+    }
+
+    int64_t n_kv = 0;
+    for (const auto & run : runs) {
+        n_kv += run.second - run.first;
+    }
+
+    // the scratch tensor is shared by the layers: the copies of a layer are added to the graph after the attention
+    // of the previous layer, which they depend on through the KV cache stores
+    ggml_tensor * cur = nullptr;
+
+    for (const auto & s : scratch) {
+        if (s.first == kv->buffer && s.second->type == kv->type && s.second->ne[0] == n_embd_gqa) {
+            cur = s.second;
+        }
+    }
+
+    if (cur == nullptr) {
+        cur = ggml_new_tensor_2d(ctx0, kv->type, n_embd_gqa, n_kv);
+
+        // no op assigns the scratch tensor to a backend: keep it next to the KV cache
+        for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
+            ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
+            if (ggml_backend_supports_buft(backend, ggml_backend_buffer_get_type(kv->buffer))) {
+                ggml_backend_sched_set_tensor_backend(sched, cur, backend);
+                break;
+            }
+        }
+
+        scratch.emplace_back(kv->buffer, cur);
+    }
+
+    int64_t i0 = 0;
+
+    for (const auto & run : runs) {
+        const int64_t n_run = run.second - run.first;
+
+        ggml_tensor * src = ggml_view_2d(ctx0, kv, n_embd_gqa, n_run, nb_cell, run.first*nb_cell);
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, src, ggml_view_2d(ctx0, cur, n_embd_gqa, n_run, nb_cell, i0*nb_cell)));
+
+        res->kv_loads.push_back({ (uint32_t) (&run - runs.data()), nb_cell, src });
+
+        i0 += n_run;
+    }
+
+    return ggml_view_3d(ctx0, cur, n_embd_head, n_kv, n_head_kv, nb_cell, nb_head, 0);
+}
+
 llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified() const {
     const llama_kv_cache_unified * kv_self = static_cast<const llama_kv_cache_unified *>(memory);
 
     auto inp = std::make_unique<llm_graph_input_attn_kv_unified>(hparams, cparams, kv_self);
 
+    inp->kv_paged = dynamic_cast<const llama_kv_cache_paged *>(kv_self);
+
     const auto n_kv = kv_self->n;
 
     inp->self_kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
@@ -1362,39 +1877,65 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const auto n_tokens = q_cur->ne[2];
 
-    const bool v_trans = !cparams.flash_attn;
+    const bool v_trans = kv_self->v_trans;
 
     // store to KV cache
     {
         GGML_ASSERT(!kv_self->recurrent);
 
-        const auto kv_head = kv_self->head;
-
         GGML_ASSERT(kv_self->size == n_ctx);
 
-        ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa)*kv_head);
-        //cb(k_cache_view, "k_cache_view", il);
+        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
 
-        // note: storing RoPE-ed version of K in the KV cache
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, k_cur, k_cache_view));
+        // the tokens of the ubatch are stored in one or more ranges of consecutive cells
+        const auto ranges = kv_self->get_slot_ranges(n_tokens);
 
-        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+        int64_t i0 = 0; // first token of the range
 
-        ggml_tensor * v_cache_view = nullptr;
+        for (const auto & range : ranges) {
+            const int64_t kv_head  = range.first;
+            const int64_t n_range  = range.second - range.first;
 
-        if (!v_trans) {
-            v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_tokens*n_embd_v_gqa, ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa)*kv_head);
-        } else {
-            // note: the V cache is transposed when not using flash attention
-            v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_tokens, n_embd_v_gqa,
-                    (  n_ctx)*ggml_element_size(kv_self->v_l[il]),
-                    (kv_head)*ggml_element_size(kv_self->v_l[il]));
+            ggml_tensor * k_src = ranges.size() == 1 ? k_cur :
+                ggml_view_3d(ctx0, k_cur, k_cur->ne[0], k_cur->ne[1], n_range, k_cur->nb[1], k_cur->nb[2], i0*k_cur->nb[2]);
 
-            v_cur = ggml_transpose(ctx0, v_cur);
-        }
-        //cb(v_cache_view, "v_cache_view", il);
+            ggml_tensor * v_src = ranges.size() == 1 ? v_cur :
+                ggml_view_2d(ctx0, v_cur, v_cur->ne[0], n_range, v_cur->nb[1], i0*v_cur->nb[1]);
+
+            const size_t nb_k_cell = ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa);
+            const size_t nb_v_cell = v_trans ? ggml_element_size(kv_self->v_l[il]) : ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa);
+
+            ggml_tensor * k_cache_view = ggml_view_1d(ctx0, kv_self->k_l[il], n_range*n_embd_k_gqa, nb_k_cell*kv_head);
+            //cb(k_cache_view, "k_cache_view", il);
+
+            // note: storing RoPE-ed version of K in the KV cache
+            ggml_tensor * k_cpy = ggml_cpy(ctx0, k_src, k_cache_view);
+            ggml_build_forward_expand(gf, k_cpy);
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, v_cur, v_cache_view));
+            ggml_tensor * v_cache_view = nullptr;
+
+            if (!v_trans) {
+                v_cache_view = ggml_view_1d(ctx0, kv_self->v_l[il], n_range*n_embd_v_gqa, nb_v_cell*kv_head);
+            } else {
+                // note: the V cache is transposed when not using flash attention
+                v_cache_view = ggml_view_2d(ctx0, kv_self->v_l[il], n_range, n_embd_v_gqa,
+                        (  n_ctx)*ggml_element_size(kv_self->v_l[il]),
+                        (kv_head)*nb_v_cell);
+
+                v_src = ggml_transpose(ctx0, v_src);
+            }
+            //cb(v_cache_view, "v_cache_view", il);
+
+            ggml_tensor * v_cpy = ggml_cpy(ctx0, v_src, v_cache_view);
+            ggml_build_forward_expand(gf, v_cpy);
+
+            const uint32_t i_range = &range - ranges.data();
+
+            res->kv_stores.push_back({ i_range, nb_k_cell, k_cache_view, k_cpy });
+            res->kv_stores.push_back({ i_range, nb_v_cell, v_cache_view, v_cpy });
+
+            i0 += n_range;
+        }
     }
 
     const bool is_swa = hparams.is_swa(il);
@@ -1411,25 +1952,37 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * q = ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
     //cb(q, "q", il);
 
-    ggml_tensor * k =
-        ggml_view_3d(ctx0, kv_self->k_l[il],
+    ggml_tensor * k = nullptr;
+    ggml_tensor * v = nullptr;
+
+    if (inp->kv_paged) {
+        GGML_ASSERT(!v_trans);
+
+        // paged cache: the cells of the blocks of the sequences in the ubatch
+        const auto runs = kv_self->get_kv_runs();
+
+        k = build_kv_gather(gf, kv_self->k_l[il], inp->self_k_gather, n_embd_head_k, n_head_kv, runs);
+        v = build_kv_gather(gf, kv_self->v_l[il], inp->self_v_gather, n_embd_head_v, n_head_kv, runs);
+    } else {
+        k = ggml_view_3d(ctx0, kv_self->k_l[il],
                 n_embd_head_k, n_kv, n_head_kv,
                 ggml_row_size(kv_self->k_l[il]->type, n_embd_k_gqa),
                 ggml_row_size(kv_self->k_l[il]->type, n_embd_head_k),
                 0);
-    //cb(k, "k", il);
 
-    ggml_tensor * v = !v_trans ?
-        ggml_view_3d(ctx0, kv_self->v_l[il],
-                n_embd_head_v, n_kv, n_head_kv,
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
-                ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
-                0) :
-        ggml_view_3d(ctx0, kv_self->v_l[il],
-                n_kv, n_embd_head_v, n_head_kv,
-                ggml_element_size(kv_self->v_l[il])*n_ctx,
-                ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
-                0);
+        v = !v_trans ?
+            ggml_view_3d(ctx0, kv_self->v_l[il],
+                    n_embd_head_v, n_kv, n_head_kv,
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_v_gqa),
+                    ggml_row_size(kv_self->v_l[il]->type, n_embd_head_v),
+                    0) :
+            ggml_view_3d(ctx0, kv_self->v_l[il],
+                    n_kv, n_embd_head_v, n_head_kv,
+                    ggml_element_size(kv_self->v_l[il])*n_ctx,
+                    ggml_element_size(kv_self->v_l[il])*n_ctx*n_embd_head_v,
+                    0);
+    }
+    //cb(k, "k", il);
 
     ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_trans, kq_scale);
     cb(cur, "kqv_out", il);
@@ -1454,7 +2007,10 @@ llm_graph_input_attn_cross * llm_graph_context::build_attn_inp_cross() const {
 
     const int32_t n_enc = !cross->v_embd.empty() ? cross->n_enc : hparams.n_ctx_train;
 
-    inp->cross_kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_enc, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
+    // with flash attention, K and V are padded for the GPU kernels and the padding is masked
+    const int64_t n_kv = cparams.flash_attn ? GGML_PAD(n_enc, cparams.fattn_kv_pad) : n_enc;
+
+    inp->cross_kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
     ggml_set_input(inp->cross_kq_mask);
 
     inp->cross_kq_mask_cnv = cparams.flash_attn ? ggml_cast(ctx0, inp->cross_kq_mask, GGML_TYPE_F16) : inp->cross_kq_mask;
@@ -1481,6 +2037,9 @@ ggml_tensor * llm_graph_context::build_attn(
 
     const auto & kq_mask = inp->get_kq_mask_cross();
 
+    k_cur = build_attn_pad_kv(k_cur, kq_mask->ne[0]);
+    v_cur = build_attn_pad_kv(v_cur, kq_mask->ne[0]);
+
     ggml_tensor * q = ggml_permute(ctx0, q_cur, 0, 2, 1, 3);
     //cb(q, "q", il);
 
@@ -19,6 +19,7 @@ struct llama_cparams;
 
 class llama_memory_i;
 class llama_kv_cache_unified;
+class llama_kv_cache_paged;
 
 // certain models (typically multi-modal) can produce different types of graphs
 enum llm_graph_type {
@@ -125,6 +126,7 @@ public:
 
     const llama_hparams & hparams;
     const llama_kv_cache_unified * kv_self;
+    const llama_kv_cache_paged   * kv_paged = nullptr;
 };
 
 class llm_graph_input_out_ids : public llm_graph_input_i {
@@ -206,6 +208,56 @@ public:
     const llama_cross * cross;
 };
 
+// routing of the tokens through the adapters of their sequences (see llama_adapter_lora_route)
+// the tensors are created by the graph when they are first needed, for the tokens of the ubatch or for its outputs
+class llm_graph_input_lora : public llm_graph_input_i {
+public:
+    llm_graph_input_lora(
+            const llama_adapter_loras_seq * loras_seq,
+            int32_t n_outputs,
+            std::vector<llama_adapter_lora_group> groups) : groups(std::move(groups)), loras_seq(loras_seq), n_outputs(n_outputs) {
+        for (auto & r : routes) {
+            r.idxs.resize(this->groups.size(), nullptr);
+            r.mask.resize(this->groups.size(), nullptr);
+        }
+    }
+    virtual ~llm_graph_input_lora() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    // tokens of the group
+    const std::vector<int32_t> & get_group(size_t ig, bool out) const {
+        return out ? groups[ig].idxs_out : groups[ig].idxs;
+    }
+
+    ggml_tensor * get_idxs(ggml_context * ctx, size_t ig, bool out);
+    ggml_tensor * get_mask(ggml_context * ctx, size_t ig, bool out, int64_t n);
+
+    // the concatenated outputs of a subset of the groups are scattered back to the tokens
+    struct scatter {
+        std::vector<size_t> groups;
+
+        ggml_tensor * idxs  = nullptr; // I32 [n]    column of each token in the concatenated outputs
+        ggml_tensor * cover = nullptr; // F32 [1, n] 0 for the tokens that are not in the groups, if any
+    };
+
+    const scatter & get_scatter(ggml_context * ctx, const std::vector<size_t> & groups, bool out, int64_t n);
+
+    std::vector<llama_adapter_lora_group> groups;
+
+    struct route {
+        std::vector<ggml_tensor *> idxs; // I32 [n_group_tokens] tokens of each group
+        std::vector<ggml_tensor *> mask; // F32 [1, n]           1 for the tokens of each group
+        std::vector<scatter>   scatters;
+    };
+
+    route routes[2]; // tokens, outputs
+
+    const llama_adapter_loras_seq * loras_seq;
+
+    const int32_t n_outputs;
+};
+
 class llm_graph_input_attn_no_cache : public llm_graph_input_i {
 public:
     llm_graph_input_attn_no_cache(const llama_hparams & hparams, const llama_cparams & cparams) :
@@ -247,10 +299,16 @@ public:
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
 
+    // paged cache only: the K and V of the runs of cells that are not read in place are copied next to each other
+    // into scratch tensors, shared by the layers with the same KV cache buffer (see llm_graph_context::build_kv_gather)
+    std::vector<std::pair<ggml_backend_buffer_t, ggml_tensor *>> self_k_gather; // [n_embd_k_gqa, n_kv]
+    std::vector<std::pair<ggml_backend_buffer_t, ggml_tensor *>> self_v_gather; // [n_embd_v_gqa, n_kv]
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
     const llama_kv_cache_unified * kv_self;
+    const llama_kv_cache_paged   * kv_paged = nullptr;
 };
 
 class llm_graph_input_attn_cross : public llm_graph_input_i {
@@ -277,6 +335,8 @@ public:
 //   specific data, by calling the set_inputs() method
 // along with the input tensors, the object also provides commonly used outputs tensors, such as logits, embeddings, etc.
 //   these are used by the llama_context to extact the relevant data, based on the compute parameters
+// when the graph is reused for another ubatch, set_kv_ranges() moves the KV cache stores to the cells of the new ubatch
+//   and set_kv_runs() moves the KV cache loads to the cells read by its attention
 
 class llm_graph_result_i {
 public:
@@ -287,6 +347,9 @@ public:
     virtual ggml_tensor * get_embd_pooled() = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    virtual void set_kv_ranges(const std::vector<std::pair<uint32_t, uint32_t>> & ranges) = 0;
+    virtual void set_kv_runs  (const std::vector<std::pair<uint32_t, uint32_t>> & runs)   = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -306,17 +369,61 @@ public:
         }
     }
 
+    // update the destinations of the KV cache stores (see llama_kv_cache_unified::get_slot_ranges)
+    void set_kv_ranges(const std::vector<std::pair<uint32_t, uint32_t>> & ranges) override {
+        for (const auto & store : kv_stores) {
+            GGML_ASSERT(store.i_range < ranges.size());
+
+            const size_t offs = ranges[store.i_range].first*store.nb_cell;
+
+            for (ggml_tensor * t : { store.view, store.cpy }) {
+                t->view_offs = offs;
+                t->data      = (char *) t->view_src->data + offs;
+            }
+        }
+    }
+
+    // update the sources of the KV cache loads (see llama_kv_cache_unified::get_kv_runs)
+    void set_kv_runs(const std::vector<std::pair<uint32_t, uint32_t>> & runs) override {
+        for (const auto & load : kv_loads) {
+            GGML_ASSERT(load.i_run < runs.size());
+
+            const size_t offs = runs[load.i_run].first*load.nb_cell;
+
+            load.view->view_offs = offs;
+            load.view->data      = (char *) load.view->view_src->data + offs;
+        }
+    }
+
     llm_graph_input_i * add_input(llm_graph_input_ptr input) {
         inputs.emplace_back(std::move(input));
         return inputs.back().get();
     }
 
+    // a copy of the K or V of the tokens of a cell range into a view of the KV cache
+    struct kv_store {
+        uint32_t      i_range; // index of the cell range
+        size_t        nb_cell; // offset of the view per cell
+        ggml_tensor * view;
+        ggml_tensor * cpy;     // the result of the copy is a view of the same cells
+    };
+
+    // a view of the KV cache at the start of a run of cells read by the attention
+    struct kv_load {
+        uint32_t      i_run;   // index of the run
+        size_t        nb_cell; // offset of the view per cell
+        ggml_tensor * view;
+    };
+
     // important graph nodes
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
 
     std::vector<llm_graph_input_ptr> inputs;
+
+    std::vector<kv_store> kv_stores;
+    std::vector<kv_load>  kv_loads;
 };
 
 //
@@ -338,10 +445,11 @@ struct llm_graph_params {
     ggml_backend_sched * sched;
     ggml_backend * backend_cpu;
 
-    const llama_adapter_cvec  * cvec;
-    const llama_adapter_loras * loras;
-    const llama_memory_i      * memory;
-    const llama_cross         * cross;
+    const llama_adapter_cvec      * cvec;
+    const llama_adapter_loras     * loras;
+    const llama_adapter_loras_seq * loras_seq;
+    const llama_memory_i          * memory;
+    const llama_cross             * cross;
 
     int32_t n_outputs;
 
@@ -391,15 +499,19 @@ struct llm_graph_context {
 
     ggml_backend * backend_cpu; // TODO: needed by build_attn_mha, figure out a way to remove?
 
-    const llama_adapter_cvec  * cvec;
-    const llama_adapter_loras * loras;
-    const llama_memory_i      * memory;
-    const llama_cross         * cross;
+    const llama_adapter_cvec      * cvec;
+    const llama_adapter_loras     * loras;
+    const llama_adapter_loras_seq * loras_seq;
+    const llama_memory_i          * memory;
+    const llama_cross             * cross;
 
     const llm_graph_cb & cb_func;
 
     std::unique_ptr<llm_graph_result> res;
 
+    // set when some tokens of the ubatch belong to sequences with adapters
+    llm_graph_input_lora * inp_lora = nullptr;
+
     llm_graph_context(const llm_graph_params & params);
 
     int64_t n_pos_per_token() const;
@@ -425,6 +537,11 @@ struct llm_graph_context {
               ggml_tensor * cur, // ggml_tensor * b
               ggml_tensor * ids) const;
 
+    // the output of the adapters of the sequences for w, nullptr if none of them applies to w
+    ggml_tensor * build_lora_mm_seq(
+              ggml_tensor * w,
+              ggml_tensor * cur) const;
+
     ggml_tensor * build_norm(
              ggml_tensor * cur,
              ggml_tensor * mw,
@@ -495,6 +612,10 @@ struct llm_graph_context {
                     bool   v_trans,
                    float   kq_scale) const;
 
+    // with flash attention, pad the K or V [n_embd_head, n_head_kv, n_tokens] of an attention without KV cache to the
+    // n_kv entries of its mask
+    ggml_tensor * build_attn_pad_kv(ggml_tensor * cur, int64_t n_kv) const;
+
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
     ggml_tensor * build_attn(
@@ -511,6 +632,16 @@ struct llm_graph_context {
 
     llm_graph_input_attn_kv_unified * build_attn_inp_kv_unified() const;
 
+    // the K or V of the cells read by the attention from a paged cache, in the type of the cache
+    // a single run of cells is read in place, otherwise the runs are copied into a scratch tensor of the buffer of kv
+    ggml_tensor * build_kv_gather(
+             ggml_cgraph * gf,
+             ggml_tensor * kv,
+             std::vector<std::pair<ggml_backend_buffer_t, ggml_tensor *>> & scratch,
+                 int64_t   n_embd_head,
+                 int64_t   n_head_kv,
+            const std::vector<std::pair<uint32_t, uint32_t>> & runs) const;
+
     ggml_tensor * build_attn(
             llm_graph_input_attn_kv_unified * inp,
             ggml_cgraph * gf,
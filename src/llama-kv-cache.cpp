@@ -6,13 +6,135 @@
 #include "llama-model.h"
 
 #include <algorithm>
+#include <bitset>
 #include <cassert>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
 
 static const llama_kv_cache_slot_info llama_kv_cache_slot_info_failed{false};
 
+//
+// llama_kv_cells
+//
+
+void llama_kv_cells::resize(uint32_t n, uint32_t n_seq_max) {
+    n_seq_words = std::max<uint32_t>(1, (n_seq_max + 63)/64);
+
+    pos  .assign(n, -1);
+    delta.assign(n,  0);
+    src  .assign(n, -1);
+    tail .assign(n, -1);
+
+    seq.assign((size_t) n*n_seq_words, 0);
+}
+
+void llama_kv_cells::reset(uint32_t i) {
+    pos  [i] = -1;
+    delta[i] =  0;
+    src  [i] = -1;
+
+    seq_clear(i);
+}
+
+void llama_kv_cells::copy(uint32_t idst, uint32_t isrc) {
+    pos  [idst] = pos  [isrc];
+    delta[idst] = delta[isrc];
+    src  [idst] = src  [isrc];
+
+    std::copy_n(&seq[isrc*n_seq_words], n_seq_words, &seq[idst*n_seq_words]);
+}
+
+void llama_kv_cells::swap(uint32_t i, uint32_t j) {
+    std::swap(pos  [i], pos  [j]);
+    std::swap(delta[i], delta[j]);
+    std::swap(src  [i], src  [j]);
+
+    std::swap_ranges(&seq[i*n_seq_words], &seq[i*n_seq_words] + n_seq_words, &seq[j*n_seq_words]);
+}
+
+bool llama_kv_cells::is_same_seq(uint32_t i, uint32_t j) const {
+    return std::equal(&seq[i*n_seq_words], &seq[i*n_seq_words] + n_seq_words, &seq[j*n_seq_words]);
+}
+
+uint32_t llama_kv_cells::seq_count(uint32_t i) const {
+    uint32_t res = 0;
+    for (uint32_t w = 0; w < n_seq_words; ++w) {
+        res += std::bitset<64>(seq[i*n_seq_words + w]).count();
+    }
+    return res;
+}
+
+void llama_kv_cells::seq_add(uint32_t i, llama_seq_id seq_id) {
+    GGML_ASSERT(seq_id >= 0);
+    if ((uint32_t) seq_id >= 64*n_seq_words) {
+        grow(seq_id);
+    }
+    seq[i*n_seq_words + seq_id/64] |= uint64_t(1) << (seq_id%64);
+}
+
+void llama_kv_cells::seq_rm(uint32_t i, llama_seq_id seq_id) {
+    if (seq_id < 0 || (uint32_t) seq_id >= 64*n_seq_words) {
+        return;
+    }
+    seq[i*n_seq_words + seq_id/64] &= ~(uint64_t(1) << (seq_id%64));
+}
+
+void llama_kv_cells::seq_clear(uint32_t i) {
+    std::fill_n(&seq[i*n_seq_words], n_seq_words, 0);
+}
+
+std::vector<llama_seq_id> llama_kv_cells::seq_ids(uint32_t i) const {
+    std::vector<llama_seq_id> res;
+    for (uint32_t w = 0; w < n_seq_words; ++w) {
+        uint64_t mask = seq[i*n_seq_words + w];
+        for (uint32_t b = 0; mask; ++b, mask >>= 1) {
+            if (mask & 1) {
+                res.push_back(64*w + b);
+            }
+        }
+    }
+    return res;
+}
+
+void llama_kv_cells::seq_pos(llama_seq_id seq_id, const uint32_t * idxs, uint32_t n, llama_pos * dst) const {
+    if (seq_id < 0 || (uint32_t) seq_id >= 64*n_seq_words) {
+        std::fill_n(dst, n, -1);
+        return;
+    }
+
+    // branch-free, so that the compiler can vectorize the common case of a single mask word
+    const uint64_t * mask  = seq.data() + seq_id/64;
+    const uint32_t   shift = seq_id%64;
+    const uint32_t   nw    = n_seq_words;
+
+    if (idxs) {
+        for (uint32_t k = 0; k < n; ++k) {
+            const uint32_t i = idxs[k];
+            dst[k] = ((mask[i*nw] >> shift) & 1) ? pos[i] : -1;
+        }
+    } else {
+        for (uint32_t i = 0; i < n; ++i) {
+            dst[i] = ((mask[i*nw] >> shift) & 1) ? pos[i] : -1;
+        }
+    }
+}
+
+void llama_kv_cells::grow(llama_seq_id seq_id) {
+    const uint32_t n     = size();
+    const uint32_t n_old = n_seq_words;
+    const uint32_t n_new = seq_id/64 + 1;
+
+    std::vector<uint64_t> seq_new((size_t) n*n_new, 0);
+    for (uint32_t i = 0; i < n; ++i) {
+        std::copy_n(&seq[i*n_old], n_old, &seq_new[i*n_new]);
+    }
+
+    seq         = std::move(seq_new);
+    n_seq_words = n_new;
+}
+
 llama_kv_cache_unified::llama_kv_cache_unified(const llama_hparams & hparams, callbacks cbs) : hparams(hparams), cbs(std::move(cbs)) {
 }
 
@@ -41,8 +163,7 @@ bool llama_kv_cache_unified::init(
     this->type_k = type_k;
     this->type_v = type_v;
 
-    cells.clear();
-    cells.resize(kv_size);
+    cells.resize(kv_size, cparams.n_seq_max);
 
     // create a context for each buffer type
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
@@ -127,7 +248,7 @@ int32_t llama_kv_cache_unified::get_n_tokens() const {
     int32_t result = 0;
 
     for (uint32_t i = 0; i < size; i++) {
-        result += cells[i].seq_id.size();
+        result += cells.seq_count(i);
     }
 
     return result;
@@ -148,8 +269,8 @@ size_t llama_kv_cache_unified::total_size() const {
 
 llama_pos llama_kv_cache_unified::pos_max() const {
     llama_pos pos_max = -1;
-    for (const auto & cell : cells) {
-        pos_max = std::max(pos_max, cell.pos);
+    for (uint32_t i = 0; i < size; ++i) {
+        pos_max = std::max(pos_max, cells.pos[i]);
     }
 
     return pos_max;
@@ -157,14 +278,16 @@ llama_pos llama_kv_cache_unified::pos_max() const {
 
 void llama_kv_cache_unified::clear() {
     for (int32_t i = 0; i < (int32_t) size; ++i) {
-        cells[i].pos = -1;
-        cells[i].seq_id.clear();
-        cells[i].src = -1;
-        cells[i].tail = -1;
+        cells.pos[i] = -1;
+        cells.seq_clear(i);
+        cells.src[i] = -1;
+        cells.tail[i] = -1;
     }
     head = 0;
     used = 0;
 
+    mask_rows.invalidate();
+
     for (auto & buf : bufs) {
         ggml_backend_buffer_clear(buf.get(), 0);
     }
@@ -173,6 +296,10 @@ void llama_kv_cache_unified::clear() {
 bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
     uint32_t new_head = size;
 
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -188,15 +315,15 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
             return false;
         }
         if (0 <= seq_id) {
-            int32_t & tail_id = cells[seq_id].tail;
+            int32_t & tail_id = cells.tail[seq_id];
             if (tail_id >= 0) {
-                const llama_kv_cell & cell = cells[tail_id];
+                const llama_pos pos = cells.pos[tail_id];
                 // partial intersection is invalid
-                if ((0 < p0 && p0 <= cell.pos) || (0 < p1 && p1 <= cell.pos)) {
+                if ((0 < p0 && p0 <= pos) || (0 < p1 && p1 <= pos)) {
                     return false;
                 }
                 // invalidate tails which will be cleared
-                if (p0 <= cell.pos && cell.pos < p1) {
+                if (p0 <= pos && pos < p1) {
                     tail_id = -1;
                 }
             }
@@ -209,22 +336,26 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
     }
 
     for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].pos >= p0 && cells[i].pos < p1) {
+        if (cells.pos[i] >= p0 && cells.pos[i] < p1) {
             if (seq_id < 0) {
-                cells[i].seq_id.clear();
-            } else if (cells[i].has_seq_id(seq_id)) {
-                cells[i].seq_id.erase(seq_id);
+                cells.seq_clear(i);
+            } else if (cells.has_seq_id(i, seq_id)) {
+                cells.seq_rm(i, seq_id);
             } else {
                 continue;
             }
-            if (cells[i].is_empty()) {
+
+            c0 = std::min(c0, i);
+            c1 = std::max(c1, i + 1);
+
+            if (cells.is_empty(i)) {
                 // keep count of the number of used cells
-                if (cells[i].pos >= 0) {
+                if (cells.pos[i] >= 0) {
                     used--;
                 }
 
-                cells[i].pos = -1;
-                cells[i].src = -1;
+                cells.pos[i] = -1;
+                cells.src[i] = -1;
 
                 if (new_head == size) {
                     new_head = i;
@@ -238,6 +369,8 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         head = new_head;
     }
 
+    mask_rows.invalidate(c0, c1);
+
     return true;
 }
 
@@ -256,26 +389,24 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
 
     if (recurrent) {
         if ((uint32_t) seq_id_dst < size && (uint32_t) seq_id_src < size) {
-            llama_kv_cell & tail_src = cells[seq_id_src];
-            llama_kv_cell & tail_dst = cells[seq_id_dst];
-            if (tail_dst.tail >= 0) {
+            int32_t & tail_src = cells.tail[seq_id_src];
+            int32_t & tail_dst = cells.tail[seq_id_dst];
+            if (tail_dst >= 0) {
                 // clear destination seq_id if it wasn't empty
-                llama_kv_cell & cell_dst = cells[tail_dst.tail];
-
-                cell_dst.seq_id.erase(seq_id_dst);
-                tail_dst.tail = -1;
-                if (cell_dst.seq_id.empty()) {
-                    cell_dst.pos = -1;
-                    cell_dst.delta = -1;
-                    cell_dst.src = -1;
+                const int32_t cell_dst = tail_dst;
+
+                cells.seq_rm(cell_dst, seq_id_dst);
+                tail_dst = -1;
+                if (cells.is_empty(cell_dst)) {
+                    cells.pos  [cell_dst] = -1;
+                    cells.delta[cell_dst] = -1;
+                    cells.src  [cell_dst] = -1;
                     used -= 1;
                 }
             }
-            if (tail_src.tail >= 0) {
-                llama_kv_cell & cell_src = cells[tail_src.tail];
-
-                cell_src.seq_id.insert(seq_id_dst);
-                tail_dst.tail = tail_src.tail;
+            if (tail_src >= 0) {
+                cells.seq_add(tail_src, seq_id_dst);
+                tail_dst = tail_src;
             }
         }
 
@@ -285,36 +416,52 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
     // otherwise, this is the KV of a Transformer-like model
     head = 0;
 
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
     for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id_src) && cells[i].pos >= p0 && cells[i].pos < p1) {
-            cells[i].seq_id.insert(seq_id_dst);
+        if (cells.has_seq_id(i, seq_id_src) && cells.pos[i] >= p0 && cells.pos[i] < p1 && !cells.has_seq_id(i, seq_id_dst)) {
+            cells.seq_add(i, seq_id_dst);
+
+            c0 = std::min(c0, i);
+            c1 = std::max(c1, i + 1);
         }
     }
+
+    mask_rows.invalidate(c0, c1);
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = size;
 
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
     for (uint32_t i = 0; i < size; ++i) {
         if (recurrent && (llama_seq_id) i != seq_id) {
-            cells[i].tail = -1;
+            cells.tail[i] = -1;
+        }
+
+        if (!cells.is_empty(i) && (!cells.has_seq_id(i, seq_id) || cells.seq_count(i) > 1)) {
+            c0 = std::min(c0, i);
+            c1 = std::max(c1, i + 1);
         }
 
-        if (!cells[i].has_seq_id(seq_id)) {
-            if (cells[i].pos >= 0) {
+        if (!cells.has_seq_id(i, seq_id)) {
+            if (cells.pos[i] >= 0) {
                 used--;
             }
 
-            cells[i].pos = -1;
-            cells[i].src = -1;
-            cells[i].seq_id.clear();
+            cells.pos[i] = -1;
+            cells.src[i] = -1;
+            cells.seq_clear(i);
 
             if (new_head == size){
                 new_head = i;
             }
         } else {
-            cells[i].seq_id.clear();
-            cells[i].seq_id.insert(seq_id);
+            cells.seq_clear(i);
+            cells.seq_add(i, seq_id);
         }
     }
 
@@ -322,6 +469,8 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != size && new_head < head) {
         head = new_head;
     }
+
+    mask_rows.invalidate(c0, c1);
 }
 
 void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
@@ -347,29 +496,36 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
     if (recurrent) {
         // for Mamba-like or RWKV models, only the pos needs to be shifted
         if (0 <= seq_id && seq_id < (int64_t) size) {
-            const int32_t tail_id = cells[seq_id].tail;
+            const int32_t tail_id = cells.tail[seq_id];
             if (tail_id >= 0) {
-                llama_kv_cell & cell = cells[tail_id];
-                if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos += delta;
+                if (cells.has_seq_id(tail_id, seq_id) && p0 <= cells.pos[tail_id] && cells.pos[tail_id] < p1) {
+                    cells.pos[tail_id] += delta;
                 }
             }
         }
         return;
     }
 
+    seq_unshare(seq_id, p0, p1, delta);
+
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
     for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
+        if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
             has_shift = true;
-            cells[i].pos   += delta;
-            cells[i].delta += delta;
+            cells.pos[i]   += delta;
+            cells.delta[i] += delta;
 
-            if (cells[i].pos < 0) {
-                if (!cells[i].is_empty()) {
+            c0 = std::min(c0, i);
+            c1 = std::max(c1, i + 1);
+
+            if (cells.pos[i] < 0) {
+                if (!cells.is_empty(i)) {
                     used--;
                 }
-                cells[i].pos = -1;
-                cells[i].seq_id.clear();
+                cells.pos[i] = -1;
+                cells.seq_clear(i);
                 if (new_head == size) {
                     new_head = i;
                 }
@@ -380,6 +536,8 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != size ? new_head : 0;
+
+    mask_rows.invalidate(c0, c1);
 }
 
 void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
@@ -403,11 +561,10 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
     if (recurrent) {
         // for Mamba-like or RWKV models, only the pos needs to be changed
         if (0 <= seq_id && seq_id < (int64_t) size) {
-            const int32_t tail_id = cells[seq_id].tail;
+            const int32_t tail_id = cells.tail[seq_id];
             if (tail_id >= 0) {
-                llama_kv_cell & cell = cells[tail_id];
-                if (cell.has_seq_id(seq_id) && p0 <= cell.pos && cell.pos < p1) {
-                    cell.pos /= d;
+                if (cells.has_seq_id(tail_id, seq_id) && p0 <= cells.pos[tail_id] && cells.pos[tail_id] < p1) {
+                    cells.pos[tail_id] /= d;
                 }
             }
         }
@@ -415,14 +572,128 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    seq_unshare(seq_id, p0, p1, 0);
+
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
     for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id) && cells[i].pos >= p0 && cells[i].pos < p1) {
+        if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
             has_shift = true;
 
             {
-                llama_pos p_old = cells[i].pos;
-                cells[i].pos   /= d;
-                cells[i].delta += cells[i].pos - p_old;
+                llama_pos p_old = cells.pos[i];
+                cells.pos[i]   /= d;
+                cells.delta[i] += cells.pos[i] - p_old;
+            }
+
+            c0 = std::min(c0, i);
+            c1 = std::max(c1, i + 1);
+        }
+    }
+
+    mask_rows.invalidate(c0, c1);
+}
+
+void llama_kv_cache_unified::seq_unshare(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    // the shared cells and their private copies
+    std::vector<std::pair<uint32_t, uint32_t>> ids;
+
+    // the next cell that may be empty
+    uint32_t j = 0;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (!cells.has_seq_id(i, seq_id) || cells.pos[i] < p0 || cells.pos[i] >= p1 || cells.seq_count(i) < 2) {
+            continue;
+        }
+
+        cells.seq_rm(i, seq_id);
+
+        c0 = std::min(c0, i);
+        c1 = std::max(c1, i + 1);
+
+        if (cells.pos[i] + delta < 0) {
+            continue;
+        }
+
+        while (j < size && !cells.is_empty(j)) {
+            j++;
+        }
+
+        if (j == size) {
+            LLAMA_LOG_WARN("%s: no free cell to copy the cell %u shared by sequence %d, dropping it from the sequence\n", __func__, i, seq_id);
+            continue;
+        }
+
+        cells.pos  [j] = cells.pos  [i];
+        cells.delta[j] = cells.delta[i];
+        cells.seq_add(j, seq_id);
+
+        used++;
+
+        ids.emplace_back(i, j);
+
+        c0 = std::min(c0, j);
+        c1 = std::max(c1, j + 1);
+    }
+
+    copy_cells(ids);
+
+    mask_rows.invalidate(c0, c1);
+}
+
+void llama_kv_cache_unified::copy_cells(const std::vector<std::pair<uint32_t, uint32_t>> & ids) {
+    if (ids.empty()) {
+        return;
+    }
+
+    std::vector<uint8_t> buf;
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
+        const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
+
+        const size_t k_size_row = ggml_row_size(k_l[il]->type, n_embd_k_gqa);
+
+        buf.resize(k_size_row);
+        for (const auto & id : ids) {
+            ggml_backend_tensor_get(k_l[il], buf.data(), id.first *k_size_row, k_size_row);
+            ggml_backend_tensor_set(k_l[il], buf.data(), id.second*k_size_row, k_size_row);
+        }
+
+        if (!v_trans) {
+            const size_t v_size_row = ggml_row_size(v_l[il]->type, n_embd_v_gqa);
+
+            buf.resize(v_size_row);
+            for (const auto & id : ids) {
+                ggml_backend_tensor_get(v_l[il], buf.data(), id.first *v_size_row, v_size_row);
+                ggml_backend_tensor_set(v_l[il], buf.data(), id.second*v_size_row, v_size_row);
+            }
+        } else {
+            // each of the n_embd_v_gqa rows of the transposed V holds one element per cell
+            // the span of the cells is read and written once per row instead of once per element
+            const size_t v_size_el = ggml_type_size(v_l[il]->type);
+
+            uint32_t c0 = size;
+            uint32_t c1 = 0;
+            for (const auto & id : ids) {
+                c0 = std::min({c0, id.first, id.second});
+                c1 = std::max({c1, id.first + 1, id.second + 1});
+            }
+
+            buf.resize((c1 - c0)*v_size_el);
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                const size_t offs = ((size_t) j*size + c0)*v_size_el;
+
+                ggml_backend_tensor_get(v_l[il], buf.data(), offs, buf.size());
+                for (const auto & id : ids) {
+                    memcpy(buf.data() + (id.second - c0)*v_size_el, buf.data() + (id.first - c0)*v_size_el, v_size_el);
+                }
+                ggml_backend_tensor_set(v_l[il], buf.data(), offs, buf.size());
             }
         }
     }
@@ -432,8 +703,8 @@ llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) {
     llama_pos result = 0;
 
     for (uint32_t i = 0; i < size; ++i) {
-        if (cells[i].has_seq_id(seq_id)) {
-            result = std::max(result, cells[i].pos);
+        if (cells.has_seq_id(i, seq_id)) {
+            result = std::max(result, cells.pos[i]);
         }
     }
 
@@ -480,16 +751,16 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
                     return llama_kv_cache_slot_info_failed;
                 }
                 if (j > 0) {
-                    llama_kv_cell & seq = cells[seq_id];
-                    if (seq.tail >= 0) {
-                        llama_kv_cell & cell = cells[seq.tail];
+                    int32_t & tail = cells.tail[seq_id];
+                    if (tail >= 0) {
+                        const int32_t cell = tail;
                         // clear cells from seq_ids that become shared
                         // (should not normally happen, but let's handle it anyway)
-                        cell.seq_id.erase(seq_id);
-                        seq.tail = -1;
-                        if (cell.seq_id.empty()) {
-                            cell.pos = -1;
-                            cell.src = -1;
+                        cells.seq_rm(cell, seq_id);
+                        tail = -1;
+                        if (cells.is_empty(cell)) {
+                            cells.pos[cell] = -1;
+                            cells.src[cell] = -1;
                             used -= 1;
                         }
                     }
@@ -502,8 +773,7 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
             std::vector<int32_t> tails_verif;
             tails_verif.assign(size, -1);
             for (uint32_t i = 0; i < size; ++i) {
-                llama_kv_cell & cell = cells[i];
-                for (llama_seq_id seq_id : cell.seq_id) {
+                for (llama_seq_id seq_id : cells.seq_ids(i)) {
                     if (tails_verif[seq_id] != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tails_verif[seq_id]);
                     }
@@ -511,8 +781,8 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
                 }
             }
             for (uint32_t i = 0; i < size; ++i) {
-                if (tails_verif[i] != cells[i].tail) {
-                    LLAMA_LOG_ERROR("%s: wrong tail for seq_id %d, (%d instead of %d)\n", __func__, i, cells[i].tail, tails_verif[i]);
+                if (tails_verif[i] != cells.tail[i]) {
+                    LLAMA_LOG_ERROR("%s: wrong tail for seq_id %d, (%d instead of %d)\n", __func__, i, cells.tail[i], tails_verif[i]);
                 }
             }
         }
@@ -523,67 +793,59 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
 
         for (uint32_t i = 0; i < size; ++i) {
             if (next_empty_cell >= size) { next_empty_cell -= size; }
-            llama_kv_cell & cell = cells[next_empty_cell];
-            if (cell.is_empty()) { break; }
+            if (cells.is_empty(next_empty_cell)) { break; }
             next_empty_cell += 1;
         }
 
         // find usable cell range
         for (uint32_t s = 0; s < n_seqs; ++s) {
             const llama_seq_id seq_id = ubatch.seq_id[s][0];
-            llama_kv_cell & seq_meta = cells[seq_id];
+            int32_t & tail = cells.tail[seq_id];
             bool has_cell = false;
-            if (seq_meta.tail >= 0) {
-                llama_kv_cell & cell = cells[seq_meta.tail];
-                GGML_ASSERT(cell.has_seq_id(seq_id));
+            if (tail >= 0) {
+                GGML_ASSERT(cells.has_seq_id(tail, seq_id));
                 // does this seq_id "own" the cell?
-                if (cell.seq_id.size() == 1) { has_cell = true; }
+                if (cells.seq_count(tail) == 1) { has_cell = true; }
             }
             if (!has_cell) {
-                llama_kv_cell & empty_cell = cells[next_empty_cell];
-                GGML_ASSERT(empty_cell.is_empty());
+                const uint32_t empty_cell = next_empty_cell;
+                GGML_ASSERT(cells.is_empty(empty_cell));
                 // copy old tail into the empty cell
-                if (seq_meta.tail >= 0) {
-                    llama_kv_cell & orig_cell = cells[seq_meta.tail];
-                    empty_cell.pos = orig_cell.pos;
-                    empty_cell.src = orig_cell.src;
-                    orig_cell.seq_id.erase(seq_id);
-                    empty_cell.seq_id.insert(seq_id); // will be overwritten
+                if (tail >= 0) {
+                    const int32_t orig_cell = tail;
+                    cells.pos[empty_cell] = cells.pos[orig_cell];
+                    cells.src[empty_cell] = cells.src[orig_cell];
+                    cells.seq_rm(orig_cell, seq_id);
+                    cells.seq_add(empty_cell, seq_id); // will be overwritten
                 }
-                seq_meta.tail = next_empty_cell;
+                tail = next_empty_cell;
                 // find next empty cell
                 if (s + 1 < n_seqs) {
                     next_empty_cell += 1;
                     for (uint32_t i = 0; i < size; ++i) {
                         if (next_empty_cell >= size) { next_empty_cell -= size; }
-                        llama_kv_cell & cell = cells[next_empty_cell];
-                        if (cell.is_empty()) { break; }
+                        if (cells.is_empty(next_empty_cell)) { break; }
                         next_empty_cell += 1;
                     }
                 }
             }
-            if (min > seq_meta.tail) { min = seq_meta.tail; }
-            if (max < seq_meta.tail) { max = seq_meta.tail; }
+            if (min > tail) { min = tail; }
+            if (max < tail) { max = tail; }
         }
 
         // gather and re-order
         for (uint32_t s = 0; s < n_seqs; ++s) {
             int32_t dst_id = s + min;
-            int32_t src_id = cells[ubatch.seq_id[s][0]].tail;
+            int32_t src_id = cells.tail[ubatch.seq_id[s][0]];
             if (dst_id != src_id) {
-                llama_kv_cell & dst_cell = cells[dst_id];
-                llama_kv_cell & src_cell = cells[src_id];
-
-                std::swap(dst_cell.pos, src_cell.pos);
-                std::swap(dst_cell.src, src_cell.src);
-                std::swap(dst_cell.seq_id, src_cell.seq_id);
+                cells.swap(dst_id, src_id);
 
                 // swap tails (assuming they NEVER overlap)
-                for (const llama_seq_id seq_id : src_cell.seq_id) {
-                    cells[seq_id].tail = src_id;
+                for (const llama_seq_id seq_id : cells.seq_ids(src_id)) {
+                    cells.tail[seq_id] = src_id;
                 }
-                for (const llama_seq_id seq_id : dst_cell.seq_id) {
-                    cells[seq_id].tail = dst_id;
+                for (const llama_seq_id seq_id : cells.seq_ids(dst_id)) {
+                    cells.tail[seq_id] = dst_id;
                 }
             }
         }
@@ -592,28 +854,29 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
         for (uint32_t s = 0; s < n_seqs; ++s) {
             const llama_pos last_pos = ubatch.pos[n_seq_tokens * s + n_seq_tokens - 1];
             int32_t cell_id = s + min;
-            llama_kv_cell & cell = cells[cell_id];
 
-            if (cell.pos >= 0 && last_pos != cell.pos + (llama_pos) n_seq_tokens) {
+            if (cells.pos[cell_id] >= 0 && last_pos != cells.pos[cell_id] + (llama_pos) n_seq_tokens) {
                 // What should happen when the pos backtracks or skips a value?
                 // Clearing the state mid-batch would require special-casing which isn't done.
                 LLAMA_LOG_WARN("%s: non-consecutive token position %d after %d for sequence %d with %u new tokens\n",
-                    __func__, last_pos, cell.pos, ubatch.seq_id[s][0], n_seq_tokens);
+                    __func__, last_pos, cells.pos[cell_id], ubatch.seq_id[s][0], n_seq_tokens);
             }
-            cell.pos = last_pos;
-            cell.seq_id.clear();
+            cells.pos[cell_id] = last_pos;
+            cells.seq_clear(cell_id);
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
                 const llama_seq_id seq_id = ubatch.seq_id[s][j];
-                cell.seq_id.insert(seq_id);
-                cells[seq_id].tail = cell_id;
+                cells.seq_add(cell_id, seq_id);
+                cells.tail[seq_id] = cell_id;
             }
         }
 
         // allow getting the range of used cells, from head to head + n
         head = min;
         n    = max - min + 1;
-        used = std::count_if(cells.begin(), cells.end(),
-            [](const llama_kv_cell& cell){ return !cell.is_empty(); });
+        used = 0;
+        for (uint32_t i = 0; i < size; ++i) {
+            used += !cells.is_empty(i);
+        }
 
         // sanity check
         return llama_kv_cache_slot_info(n >= n_seqs);
@@ -637,7 +900,7 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
 
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cells[head + i].pos >= 0) {
+            if (cells.pos[head + i] >= 0) {
                 found = false;
                 head     += i + 1;
                 n_tested += i + 1;
@@ -658,10 +921,10 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
-            cells[head + k].pos = ubatch.pos[k];
+            cells.pos[head + k] = ubatch.pos[k];
 
             for (int32_t j = 0; j < ubatch.n_seq_id[s]; j++) {
-                cells[head + k].seq_id.insert(ubatch.seq_id[s][j]);
+                cells.seq_add(head + k, ubatch.seq_id[s][j]);
             }
         }
     }
@@ -671,16 +934,35 @@ llama_kv_cache_slot_info llama_kv_cache_unified::find_slot(
     return llama_kv_cache_slot_info(head, head + n_tokens);
 }
 
+std::vector<std::pair<uint32_t, uint32_t>> llama_kv_cache_unified::get_slot_ranges(uint32_t n_tokens) const {
+    // the slot is always contiguous, starting at head
+    return { { head, head + n_tokens } };
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> llama_kv_cache_unified::get_kv_runs() const {
+    return { { 0, n } };
+}
+
+void llama_kv_cache_unified::restore_slot(uint32_t c0, uint32_t c1) {
+    seq_rm(-1, c0, c1);
+}
+
+uint32_t llama_kv_cache_unified::get_n_kv(const llama_cparams & cparams) const {
+    // a heuristic, to avoid attending the full cache if it is not yet utilized
+    // after enough generations, the benefit from this heuristic disappears
+    // if we start defragmenting the cache, the benefit from this will be more important
+    const uint32_t pad = get_padding(cparams);
+    return std::min(size, std::max(pad, GGML_PAD(cell_max(), pad)));
+}
+
 uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) const {
     // the FA kernels require padding to avoid extra runtime boundary checks
-    return cparams.flash_attn ? 256u : 32u;
+    return cparams.flash_attn ? LLAMA_FATTN_KV_PAD : 32u;
 }
 
 uint32_t llama_kv_cache_unified::cell_max() const {
     for (uint32_t i = size; i > 0; --i) {
-        const llama_kv_cell & cell = cells[i - 1];
-
-        if (cell.pos >= 0 && !cell.is_empty()) {
+        if (cells.pos[i - 1] >= 0 && !cells.is_empty(i - 1)) {
             return i;
         }
     }
@@ -739,10 +1021,12 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
     ids.clear();
     ids.resize(n_kv, n_kv);
 
-    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = cells[i0];
+    // the cells that have moved
+    uint32_t c0 = n_kv;
+    uint32_t c1 = 0;
 
-        if (!cell0.is_empty()) {
+    for (uint32_t i0 = 0; i0 < n_used; ++i0) {
+        if (!cells.is_empty(i0)) {
             ids[i0] = i0;
 
             continue;
@@ -753,7 +1037,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && cells.is_empty(i0 + nh)) {
             nh++;
         }
 
@@ -762,9 +1046,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = cells[is];
-
-            if (cell1.is_empty() || ids[is] != n_kv) {
+            if (cells.is_empty(is) || ids[is] != n_kv) {
                 continue;
             }
 
@@ -791,9 +1073,7 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
 
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = cells[i1];
-
-            if (cell1.is_empty() || ids[i1] != n_kv) {
+            if (cells.is_empty(i1) || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
                     stop = true;
                     break;
@@ -807,10 +1087,13 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
             ids[i1] = i0 + nf;
 
             // move the cell meta data
-            cells[i0 + nf] = cell1;
+            cells.copy(i0 + nf, i1);
+
+            c0 = std::min(c0, i0 + nf);
+            c1 = std::max(c1, i1 + 1);
 
             // clear the old cell and move the head there
-            cell1 = llama_kv_cell();
+            cells.reset(i1);
             head = n_used;
 
             if (!cont) {
@@ -838,6 +1121,8 @@ bool llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) {
         return false;
     }
 
+    mask_rows.invalidate(c0, c1);
+
     LLAMA_LOG_DEBUG("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     LLAMA_LOG_DEBUG("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -853,8 +1138,7 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
     // Find all the ranges of cells with this seq id (or all, when -1)
     uint32_t cell_range_begin = size;
     for (uint32_t i = 0; i < size; ++i) {
-        const auto & cell = cells[i];
-        if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
+        if ((seq_id == -1 && !cells.is_empty(i)) || cells.has_seq_id(i, seq_id)) {
             ++cell_count;
             if (cell_range_begin == size) {
                 cell_range_begin = i;
@@ -887,9 +1171,19 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
+    std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
+
     bool res = true;
-    res = res && state_read_meta(io, cell_count, seq_id);
-    res = res && state_read_data(io, cell_count);
+    res = res && state_read_meta(io, cell_count, cell_ranges, seq_id);
+
+    if (seq_id != -1 && cell_count > 0) {
+        // the cells of the sequence are restored through find_slot, but not as part of a ubatch
+        // (the whole cache is restored after a clear, which rebuilds all rows)
+        for (const auto & range : get_slot_ranges(cell_count)) {
+            mask_rows.invalidate(range.first, range.second);
+        }
+    }
+    res = res && state_read_data(io, cell_count, cell_ranges);
 
     if (!res) {
         if (seq_id == -1) {
@@ -904,15 +1198,14 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id) const {
     for (const auto & range : cell_ranges) {
         for (uint32_t i = range.first; i < range.second; ++i) {
-            const auto & cell = cells[i];
-            const llama_pos pos      = cell.pos;
-            const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+            const llama_pos pos      = cells.pos[i];
+            const uint32_t  n_seq_id = seq_id == -1 ? cells.seq_count(i) : 0;
 
             io.write(&pos,      sizeof(pos));
             io.write(&n_seq_id, sizeof(n_seq_id));
 
             if (n_seq_id) {
-                for (auto seq_id : cell.seq_id) {
+                for (auto seq_id : cells.seq_ids(i)) {
                     io.write(&seq_id, sizeof(seq_id));
                 }
             }
@@ -1000,7 +1293,7 @@ void llama_kv_cache_unified::state_write_data(llama_io_write_i & io, const std::
     }
 }
 
-bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id) {
+bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell_count, std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id dest_seq_id) {
     if (dest_seq_id != -1) {
         // single sequence
 
@@ -1034,13 +1327,18 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
             return false;
         }
 
-        // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
-        // Assume that this is one contiguous block of cells
-        GGML_ASSERT(head + cell_count <= size);
-        GGML_ASSERT(cells[head].pos == batch.pos[0]);
-        GGML_ASSERT(cells[head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-        GGML_ASSERT(cells[head].has_seq_id(dest_seq_id));
-        GGML_ASSERT(cells[head + cell_count - 1].has_seq_id(dest_seq_id));
+        cell_ranges = get_slot_ranges(cell_count);
+
+        // DEBUG CHECK: the first and the last cell of the slot should hold our first and last token (verify seq_id and pos values)
+        if (cell_count > 0) {
+            const uint32_t cell_first = cell_ranges.front().first;
+            const uint32_t cell_last  = cell_ranges.back().second - 1;
+            GGML_ASSERT(cell_last < size);
+            GGML_ASSERT(cells.pos[cell_first] == batch.pos[0]);
+            GGML_ASSERT(cells.pos[cell_last]  == batch.pos[cell_count - 1]);
+            GGML_ASSERT(cells.has_seq_id(cell_first, dest_seq_id));
+            GGML_ASSERT(cells.has_seq_id(cell_last, dest_seq_id));
+        }
     } else {
         // whole KV cache restore
 
@@ -1052,15 +1350,13 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
         clear();
 
         for (uint32_t i = 0; i < cell_count; ++i) {
-            llama_kv_cell & cell = cells[i];
-
             llama_pos pos;
             uint32_t  n_seq_id;
 
             io.read_to(&pos,      sizeof(pos));
             io.read_to(&n_seq_id, sizeof(n_seq_id));
 
-            cell.pos = pos;
+            cells.pos[i] = pos;
 
             for (uint32_t j = 0; j < n_seq_id; ++j) {
                 llama_seq_id seq_id;
@@ -1074,10 +1370,10 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
                     return false;
                 }
 
-                cell.seq_id.insert(seq_id);
+                cells.seq_add(i, seq_id);
 
                 if (recurrent) {
-                    int32_t & tail = cells[seq_id].tail;
+                    int32_t & tail = cells.tail[seq_id];
                     if (tail != -1) {
                         LLAMA_LOG_ERROR("%s: duplicate tail for seq_id %d in cell %d and %d\n", __func__, seq_id, i, tail);
                         return false;
@@ -1089,20 +1385,25 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
 
         head = 0;
         used = cell_count;
+
+        if (cell_count > 0) {
+            cell_ranges = { { 0, cell_count } };
+        }
     }
 
     if (recurrent) {
-        for (uint32_t i = 0; i < cell_count; ++i) {
-            uint32_t cell_id = head + i;
-            // make sure the recurrent states will keep their restored state
-            cells[cell_id].src = cell_id;
+        for (const auto & range : cell_ranges) {
+            for (uint32_t cell_id = range.first; cell_id < range.second; ++cell_id) {
+                // make sure the recurrent states will keep their restored state
+                cells.src[cell_id] = cell_id;
+            }
         }
     }
 
     return true;
 }
 
-bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count) {
+bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell_count, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
     uint32_t v_trans;
     uint32_t n_layer;
     io.read_to(&v_trans, sizeof(v_trans));
@@ -1143,9 +1444,10 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
             return false;
         }
 
-        if (cell_count) {
-            // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(k_l[il], io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+        // Read and set the keys for each range of cells
+        for (const auto & range : cell_ranges) {
+            const size_t range_size = range.second - range.first;
+            ggml_backend_tensor_set(k_l[il], io.read(range_size * k_size_row), range.first * k_size_row, range_size * k_size_row);
         }
     }
 
@@ -1171,9 +1473,10 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+            // Read and set the values for each range of cells
+            for (const auto & range : cell_ranges) {
+                const size_t range_size = range.second - range.first;
+                ggml_backend_tensor_set(v_l[il], io.read(range_size * v_size_row), range.first * v_size_row, range_size * v_size_row);
             }
         }
     } else {
@@ -1207,19 +1510,763 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 return false;
             }
 
-            if (cell_count) {
-                // For each row in the transposed matrix, read the values for the whole cell range
-                for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                    const size_t dst_offset = (head + j * size) * v_size_el;
-                    ggml_backend_tensor_set(v_l[il], io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+            // For each row in the transposed matrix, read the values for each range of cells
+            for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
+                for (const auto & range : cell_ranges) {
+                    const size_t range_size = range.second - range.first;
+                    const size_t dst_offset = (range.first + j * size) * v_size_el;
+                    ggml_backend_tensor_set(v_l[il], io.read(range_size * v_size_el), dst_offset, range_size * v_size_el);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+//
+// llama_kv_cache_paged
+//
+
+llama_kv_cache_paged::llama_kv_cache_paged(
+        const llama_hparams & hparams,
+        callbacks             cbs,
+        uint32_t              block_size) : llama_kv_cache_unified(hparams, std::move(cbs)), block_size(block_size) {
+    GGML_ASSERT(block_size > 0 && (block_size & (block_size - 1)) == 0 && "block_size must be a power of 2");
+}
+
+bool llama_kv_cache_paged::init(
+        const llama_model & model,
+      const llama_cparams & cparams,
+                ggml_type   type_k,
+                ggml_type   type_v,
+                 uint32_t   kv_size,
+                     bool   offload) {
+    if (kv_size % block_size != 0) {
+        LLAMA_LOG_ERROR("%s: kv_size = %u is not a multiple of block_size = %u\n", __func__, kv_size, block_size);
+        return false;
+    }
+
+    if (!llama_kv_cache_unified::init(model, cparams, type_k, type_v, kv_size, offload)) {
+        return false;
+    }
+
+    GGML_ASSERT(!recurrent);
+
+    // the cells of a ubatch are gathered row by row, so the V cache is never transposed
+    v_trans = false;
+
+    n_blocks = size/block_size;
+
+    blk_used.assign(n_blocks, 0);
+    blk_refs.assign(n_blocks, 0);
+    blk_fill.assign(n_blocks, 0);
+    blk_mark.assign(n_blocks, 0);
+
+    LLAMA_LOG_INFO("%s: block_size = %u, n_blocks = %u\n", __func__, block_size, n_blocks);
+
+    update_blocks();
+
+    return true;
+}
+
+void llama_kv_cache_paged::clear() {
+    llama_kv_cache_unified::clear();
+
+    slot_cells.clear();
+
+    update_blocks();
+}
+
+void llama_kv_cache_paged::defrag() {
+    // the blocks of a sequence do not have to be contiguous, so there is nothing to defragment
+}
+
+bool llama_kv_cache_paged::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    if (seq_id < 0) {
+        // all sequences: go over the blocks in use
+        for (uint32_t blk_id = 0; blk_id < n_blocks; ++blk_id) {
+            for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+                if (!cells.is_empty(i) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                    cell_clear(i);
+                    c0 = std::min(c0, i);
+                    c1 = std::max(c1, i + 1);
+                }
+            }
+        }
+
+        if (c0 < c1) {
+            for (llama_seq_id s = 0; s < (llama_seq_id) seq_blocks.size(); ++s) {
+                prune_blocks(s);
+            }
+        }
+    } else if ((size_t) seq_id < seq_blocks.size()) {
+        for (const uint32_t blk_id : seq_blocks[seq_id]) {
+            for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+                if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                    cells.seq_rm(i, seq_id);
+                    if (cells.is_empty(i)) {
+                        cell_clear(i);
+                    }
+                    c0 = std::min(c0, i);
+                    c1 = std::max(c1, i + 1);
                 }
             }
         }
+
+        if (c0 < c1) {
+            prune_blocks(seq_id);
+        }
     }
 
+    mask_rows.invalidate(c0, c1);
+
     return true;
 }
 
+void llama_kv_cache_paged::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    if (seq_id_src == seq_id_dst || seq_id_src < 0 || (size_t) seq_id_src >= seq_blocks.size()) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    auto & blocks_dst = seq_table(seq_id_dst);
+
+    for (const uint32_t blk_id : blocks_dst) {
+        blk_mark[blk_id] = 1;
+    }
+
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    // the shared blocks are appended to the table of the destination in the order of the source
+    for (const uint32_t blk_id : seq_blocks[seq_id_src]) {
+        bool any = false;
+        for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+            if (cells.has_seq_id(i, seq_id_src) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                if (!cells.has_seq_id(i, seq_id_dst)) {
+                    cells.seq_add(i, seq_id_dst);
+                    c0 = std::min(c0, i);
+                    c1 = std::max(c1, i + 1);
+                }
+                any = true;
+            }
+        }
+
+        if (any && !blk_mark[blk_id]) {
+            blk_mark[blk_id] = 1;
+            blocks_dst.push_back(blk_id);
+            blk_refs[blk_id]++;
+        }
+    }
+
+    for (const uint32_t blk_id : blocks_dst) {
+        blk_mark[blk_id] = 0;
+    }
+
+    mask_rows.invalidate(c0, c1);
+}
+
+void llama_kv_cache_paged::seq_keep(llama_seq_id seq_id) {
+    static const std::vector<uint32_t> empty;
+
+    const auto & blocks = seq_id >= 0 && (size_t) seq_id < seq_blocks.size() ? seq_blocks[seq_id] : empty;
+
+    for (const uint32_t blk_id : blocks) {
+        blk_mark[blk_id] = 1;
+    }
+
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    for (uint32_t blk_id = 0; blk_id < n_blocks; ++blk_id) {
+        for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+            if (cells.is_empty(i)) {
+                continue;
+            }
+
+            if (blk_mark[blk_id] && cells.has_seq_id(i, seq_id)) {
+                if (cells.seq_count(i) > 1) {
+                    cells.seq_clear(i);
+                    cells.seq_add(i, seq_id);
+                    c0 = std::min(c0, i);
+                    c1 = std::max(c1, i + 1);
+                }
+            } else {
+                cell_clear(i);
+                c0 = std::min(c0, i);
+                c1 = std::max(c1, i + 1);
+            }
+        }
+    }
+
+    for (llama_seq_id s = 0; s < (llama_seq_id) seq_blocks.size(); ++s) {
+        if (s == seq_id) {
+            continue;
+        }
+
+        for (const uint32_t blk_id : seq_blocks[s]) {
+            blk_refs[blk_id]--;
+            blk_update(blk_id);
+        }
+
+        seq_blocks[s].clear();
+    }
+
+    for (const uint32_t blk_id : blocks) {
+        blk_mark[blk_id] = 0;
+    }
+
+    mask_rows.invalidate(c0, c1);
+}
+
+void llama_kv_cache_paged::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    if (delta == 0 || seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    if (p0 == p1) {
+        return;
+    }
+
+    // the shifted cells are not shared with other sequences after this
+    seq_unshare(seq_id, p0, p1, delta);
+
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    for (const uint32_t blk_id : seq_blocks[seq_id]) {
+        for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+            if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                has_shift = true;
+                cells.pos[i]   += delta;
+                cells.delta[i] += delta;
+
+                if (cells.pos[i] < 0) {
+                    cell_clear(i);
+                }
+
+                c0 = std::min(c0, i);
+                c1 = std::max(c1, i + 1);
+            }
+        }
+    }
+
+    if (c0 < c1) {
+        prune_blocks(seq_id);
+
+        mask_rows.invalidate(c0, c1);
+    }
+}
+
+void llama_kv_cache_paged::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    if (d == 1 || seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return;
+    }
+
+    if (p0 < 0) {
+        p0 = 0;
+    }
+
+    if (p1 < 0) {
+        p1 = std::numeric_limits<llama_pos>::max();
+    }
+
+    seq_unshare(seq_id, p0, p1, 0);
+
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    for (const uint32_t blk_id : seq_blocks[seq_id]) {
+        for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+            if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1) {
+                has_shift = true;
+
+                const llama_pos p_old = cells.pos[i];
+                cells.pos[i]   /= d;
+                cells.delta[i] += cells.pos[i] - p_old;
+
+                c0 = std::min(c0, i);
+                c1 = std::max(c1, i + 1);
+            }
+        }
+    }
+
+    mask_rows.invalidate(c0, c1);
+}
+
+llama_kv_cache_slot_info llama_kv_cache_paged::find_slot(const llama_ubatch & ubatch) {
+    const uint32_t n_tokens     = ubatch.n_tokens;
+    const uint32_t n_seqs       = ubatch.n_seqs;
+    const uint32_t n_seq_tokens = ubatch.n_seq_tokens;
+
+    const uint32_t slot_begin = slot_cells.size();
+
+    ubatch_cells.resize(n_tokens);
+
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            const int32_t cell_id = alloc_cell(ubatch.seq_id[s], ubatch.n_seq_id[s]);
+            if (cell_id < 0) {
+                //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+                restore_slot(slot_begin, slot_cells.size());
+                slot_cells.resize(slot_begin);
+                return llama_kv_cache_slot_info(false);
+            }
+
+            const uint32_t blk_id = cell_id/block_size;
+
+            cells.pos[cell_id] = ubatch.pos[k];
+
+            for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+                const llama_seq_id seq_id = ubatch.seq_id[s][j];
+
+                cells.seq_add(cell_id, seq_id);
+
+                auto & blocks = seq_table(seq_id);
+                if (std::find(blocks.rbegin(), blocks.rend(), blk_id) == blocks.rend()) {
+                    blocks.push_back(blk_id);
+                    blk_refs[blk_id]++;
+                }
+            }
+
+            blk_used[blk_id]++;
+            used++;
+
+            ubatch_cells[k] = cell_id;
+            slot_cells.push_back(cell_id);
+        }
+    }
+
+    // gather the blocks of all sequences in the ubatch, in increasing order
+    std::vector<uint32_t> blks;
+    for (uint32_t s = 0; s < n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            for (const uint32_t blk_id : seq_blocks[ubatch.seq_id[s][j]]) {
+                if (!blk_mark[blk_id]) {
+                    blk_mark[blk_id] = 1;
+                    blks.push_back(blk_id);
+                }
+            }
+        }
+    }
+
+    std::sort(blks.begin(), blks.end());
+
+    kv_idxs.clear();
+    for (const uint32_t blk_id : blks) {
+        blk_mark[blk_id] = 0;
+        for (uint32_t i = 0; i < block_size; ++i) {
+            kv_idxs.push_back(blk_id*block_size + i);
+        }
+    }
+
+    head = n_tokens > 0 ? ubatch_cells[0] : 0;
+
+    return llama_kv_cache_slot_info(slot_begin, slot_cells.size());
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> llama_kv_cache_paged::get_slot_ranges(uint32_t n_tokens) const {
+    if (ubatch_cells.size() != n_tokens) {
+        // no slot has been found for these tokens (e.g. when reserving the worst-case graph)
+        return { { 0, n_tokens } };
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> res;
+
+    for (const uint32_t cell_id : ubatch_cells) {
+        if (!res.empty() && res.back().second == cell_id) {
+            res.back().second++;
+        } else {
+            res.emplace_back(cell_id, cell_id + 1);
+        }
+    }
+
+    return res;
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> llama_kv_cache_paged::get_kv_runs() const {
+    if (kv_idxs.empty() || kv_idxs.size() > n) {
+        // no slot has been found for the current ubatch (e.g. when reserving the worst-case graph)
+        return { { 0, n } };
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t>> res;
+
+    for (const uint32_t cell_id : kv_idxs) {
+        if (!res.empty() && res.back().second == cell_id) {
+            res.back().second++;
+        } else {
+            res.emplace_back(cell_id, cell_id + 1);
+        }
+    }
+
+    // the padding is masked, it only has to be finite: prefer extending the last run
+    const uint32_t n_pad = n - kv_idxs.size();
+    if (n_pad > 0) {
+        if (res.back().second + n_pad <= size) {
+            res.back().second += n_pad;
+        } else {
+            res.emplace_back(0, n_pad);
+        }
+    }
+
+    return res;
+}
+
+void llama_kv_cache_paged::restore_slot(uint32_t c0, uint32_t c1) {
+    // the slot boundaries index into the list of cells allocated since the last commit
+    GGML_ASSERT(c0 <= c1 && c1 <= slot_cells.size());
+
+    // the sequences of the cleared cells, their tables are pruned afterwards
+    std::vector<llama_seq_id> seq_ids_rm;
+
+    // the cells that have changed
+    uint32_t i_min = size;
+    uint32_t i_max = 0;
+
+    // in reverse order, so that the fill of the blocks goes back to where it was
+    for (uint32_t i = c1; i > c0; --i) {
+        const uint32_t cell_id = slot_cells[i - 1];
+        if (cells.is_empty(cell_id)) {
+            continue;
+        }
+
+        for (const llama_seq_id seq_id : cells.seq_ids(cell_id)) {
+            if (std::find(seq_ids_rm.begin(), seq_ids_rm.end(), seq_id) == seq_ids_rm.end()) {
+                seq_ids_rm.push_back(seq_id);
+            }
+        }
+
+        cell_clear(cell_id);
+
+        i_min = std::min(i_min, cell_id);
+        i_max = std::max(i_max, cell_id + 1);
+    }
+
+    for (const llama_seq_id seq_id : seq_ids_rm) {
+        prune_blocks(seq_id);
+    }
+
+    mask_rows.invalidate(i_min, i_max);
+}
+
+void llama_kv_cache_paged::commit() {
+    slot_cells.clear();
+}
+
+uint32_t llama_kv_cache_paged::get_n_kv(const llama_cparams & cparams) const {
+    const uint32_t pad = get_padding(cparams);
+    return std::min(size, std::max(pad, GGML_PAD((uint32_t) kv_idxs.size(), pad)));
+}
+
+uint32_t llama_kv_cache_paged::get_padding(const llama_cparams & cparams) const {
+    // the number of cells must be a multiple of the block size
+    return std::max(llama_kv_cache_unified::get_padding(cparams), block_size);
+}
+
+void llama_kv_cache_paged::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    llama_kv_cache_unified::state_read(io, seq_id);
+
+    if (seq_id == -1) {
+        // the whole cache is restored into the first cells
+        update_blocks();
+    }
+
+    commit();
+}
+
+uint32_t llama_kv_cache_paged::get_block_size() const {
+    return block_size;
+}
+
+uint32_t llama_kv_cache_paged::get_n_free_blocks() const {
+    return blk_free.size();
+}
+
+uint32_t llama_kv_cache_paged::get_block_refs(uint32_t blk_id) const {
+    GGML_ASSERT(blk_id < n_blocks);
+
+    return blk_refs[blk_id];
+}
+
+const std::vector<uint32_t> & llama_kv_cache_paged::get_seq_blocks(llama_seq_id seq_id) const {
+    static const std::vector<uint32_t> empty;
+
+    if (seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return empty;
+    }
+
+    return seq_blocks[seq_id];
+}
+
+const std::vector<uint32_t> & llama_kv_cache_paged::get_kv_idxs() const {
+    return kv_idxs;
+}
+
+std::vector<uint32_t> & llama_kv_cache_paged::seq_table(llama_seq_id seq_id) {
+    GGML_ASSERT(seq_id >= 0);
+
+    if ((size_t) seq_id >= seq_blocks.size()) {
+        seq_blocks.resize(seq_id + 1);
+    }
+
+    return seq_blocks[seq_id];
+}
+
+void llama_kv_cache_paged::seq_unshare(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    // the shared cells of the sequence, collected first as the table of the sequence grows with the copies
+    std::vector<uint32_t> shared;
+
+    for (const uint32_t blk_id : seq_blocks[seq_id]) {
+        if (blk_refs[blk_id] < 2) {
+            continue;
+        }
+
+        for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id]; ++i) {
+            if (cells.has_seq_id(i, seq_id) && cells.pos[i] >= p0 && cells.pos[i] < p1 && cells.seq_count(i) > 1) {
+                shared.push_back(i);
+            }
+        }
+    }
+
+    if (shared.empty()) {
+        return;
+    }
+
+    // the cells that have changed
+    uint32_t c0 = size;
+    uint32_t c1 = 0;
+
+    // the shared cells and their private copies
+    std::vector<std::pair<uint32_t, uint32_t>> ids;
+
+    for (const uint32_t i : shared) {
+        cells.seq_rm(i, seq_id);
+
+        c0 = std::min(c0, i);
+        c1 = std::max(c1, i + 1);
+
+        if (cells.pos[i] + delta < 0) {
+            continue;
+        }
+
+        // the copies go to blocks owned by the sequence
+        const int32_t cell_id = alloc_cell(&seq_id, 1);
+        if (cell_id < 0) {
+            LLAMA_LOG_WARN("%s: no free block to copy the cell %u shared by sequence %d, dropping it from the sequence\n", __func__, i, seq_id);
+            continue;
+        }
+
+        const uint32_t j = cell_id;
+
+        cells.pos  [j] = cells.pos  [i];
+        cells.delta[j] = cells.delta[i];
+        cells.seq_add(j, seq_id);
+
+        blk_used[j/block_size]++;
+        used++;
+
+        ids.emplace_back(i, j);
+
+        c0 = std::min(c0, j);
+        c1 = std::max(c1, j + 1);
+    }
+
+    copy_cells(ids);
+
+    // the shared blocks that do not hold cells of the sequence anymore leave its table
+    prune_blocks(seq_id);
+
+    mask_rows.invalidate(c0, c1);
+}
+
+int32_t llama_kv_cache_paged::alloc_cell(const llama_seq_id * seq_ids, int32_t n_seq_id) {
+    // make sure that the tables exist before taking references to them
+    for (int32_t j = 0; j < n_seq_id; ++j) {
+        seq_table(seq_ids[j]);
+    }
+
+    auto & blocks = seq_blocks[seq_ids[0]];
+
+    // continue filling the last block of the sequences, unless it is shared with other sequences
+    // in that case the sequences diverge from the others here, so they get a block of their own
+    if (!blocks.empty()) {
+        const uint32_t blk_id = blocks.back();
+
+        bool owned = blk_refs[blk_id] == (uint32_t) n_seq_id;
+        for (int32_t j = 1; j < n_seq_id && owned; ++j) {
+            const auto & blocks_j = seq_blocks[seq_ids[j]];
+            owned = !blocks_j.empty() && blocks_j.back() == blk_id;
+        }
+
+        if (owned && blk_fill[blk_id] < block_size) {
+            return blk_id*block_size + blk_fill[blk_id]++;
+        }
+    }
+
+    if (blk_free.empty()) {
+        return -1;
+    }
+
+    const uint32_t blk_id = blk_free.back();
+    blk_free.pop_back();
+
+    blocks.push_back(blk_id);
+
+    blk_refs[blk_id] = 1;
+    blk_fill[blk_id] = 1;
+
+    return blk_id*block_size;
+}
+
+void llama_kv_cache_paged::cell_clear(uint32_t i) {
+    const uint32_t blk_id = i/block_size;
+
+    cells.reset(i);
+
+    blk_used[blk_id]--;
+    used--;
+
+    blk_update(blk_id);
+}
+
+void llama_kv_cache_paged::prune_blocks(llama_seq_id seq_id) {
+    if (seq_id < 0 || (size_t) seq_id >= seq_blocks.size()) {
+        return;
+    }
+
+    auto & blocks = seq_blocks[seq_id];
+
+    // keep the remaining blocks in the order of the sequence
+    size_t n = 0;
+    for (const uint32_t blk_id : blocks) {
+        bool has_seq = false;
+        for (uint32_t i = blk_id*block_size; i < blk_id*block_size + blk_fill[blk_id] && !has_seq; ++i) {
+            has_seq = cells.has_seq_id(i, seq_id);
+        }
+
+        if (has_seq) {
+            blocks[n++] = blk_id;
+        } else {
+            blk_refs[blk_id]--;
+            blk_update(blk_id);
+        }
+    }
+
+    blocks.resize(n);
+}
+
+void llama_kv_cache_paged::blk_update(uint32_t blk_id) {
+    // the trailing empty cells can be handed out again
+    while (blk_fill[blk_id] > 0 && cells.is_empty(blk_id*block_size + blk_fill[blk_id] - 1)) {
+        blk_fill[blk_id]--;
+    }
+
+    if (blk_used[blk_id] == 0 && blk_refs[blk_id] == 0) {
+        // keep the free list sorted, so that the blocks with the lowest ids are handed out first
+        blk_free.insert(std::upper_bound(blk_free.begin(), blk_free.end(), blk_id, std::greater<uint32_t>()), blk_id);
+    }
+}
+
+void llama_kv_cache_paged::update_blocks() {
+    std::fill(blk_used.begin(), blk_used.end(), 0);
+    std::fill(blk_refs.begin(), blk_refs.end(), 0);
+    std::fill(blk_fill.begin(), blk_fill.end(), 0);
+
+    for (auto & blocks : seq_blocks) {
+        blocks.clear();
+    }
+
+    used = 0;
+
+    // the blocks of each sequence with the last position of the sequence in each of them
+    std::vector<std::vector<std::pair<llama_pos, uint32_t>>> seq_pos_blocks;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (cells.is_empty(i)) {
+            continue;
+        }
+
+        const uint32_t blk_id = i/block_size;
+
+        blk_used[blk_id]++;
+        blk_fill[blk_id] = i%block_size + 1;
+
+        for (const llama_seq_id seq_id : cells.seq_ids(i)) {
+            if ((size_t) seq_id >= seq_pos_blocks.size()) {
+                seq_pos_blocks.resize(seq_id + 1);
+            }
+
+            auto & blocks = seq_pos_blocks[seq_id];
+            if (blocks.empty() || blocks.back().second != blk_id) {
+                blocks.emplace_back(cells.pos[i], blk_id);
+            } else {
+                blocks.back().first = std::max(blocks.back().first, cells.pos[i]);
+            }
+        }
+
+        used++;
+    }
+
+    // the tables are in the order of the positions of the sequences, the next tokens go to their last block
+    for (llama_seq_id seq_id = 0; seq_id < (llama_seq_id) seq_pos_blocks.size(); ++seq_id) {
+        auto & blocks = seq_pos_blocks[seq_id];
+
+        std::sort(blocks.begin(), blocks.end());
+
+        auto & table = seq_table(seq_id);
+        for (const auto & blk : blocks) {
+            table.push_back(blk.second);
+            blk_refs[blk.second]++;
+        }
+    }
+
+    // hand out the blocks with the lowest ids first
+    blk_free.clear();
+    for (uint32_t blk_id = n_blocks; blk_id > 0; --blk_id) {
+        if (blk_used[blk_id - 1] == 0) {
+            blk_free.push_back(blk_id - 1);
+        }
+    }
+
+    ubatch_cells.clear();
+    kv_idxs.clear();
+}
+
 //
 // interface implementation
 //
@@ -1379,7 +2426,7 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
         view->cells_sequences = (llama_seq_id *)p;
     }
 
-    const std::vector<llama_kv_cell> & kv_cells = kvu->cells;
+    const llama_kv_cells & kv_cells = kvu->cells;
     llama_kv_cache_view_cell * c_curr = view->cells;
     llama_seq_id * cs_curr = view->cells_sequences;
     int32_t used_cells = 0;
@@ -1389,9 +2436,9 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(kvu->size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells.seq_count(i);
         token_count += curr_size;
-        c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
+        c_curr->pos = kv_cells.pos[i] + kv_cells.delta[i];
 
         if (curr_size > 0) {
             if (curr_contig_idx >= 0 && uint32_t(i - curr_contig_idx) > max_contig) {
@@ -1404,7 +2451,7 @@ void llama_kv_cache_view_update(llama_kv_cache_view * view, const llama_kv_cache
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
+        for (const llama_seq_id it : kv_cells.seq_ids(i)) {
             if (seq_idx >= view->n_seq_max) {
                 break;
             }
@@ -6,8 +6,8 @@
 
 #include "ggml-cpp.h"
 
+#include <algorithm>
 #include <functional>
-#include <set>
 #include <vector>
 
 struct llama_cparams;
@@ -25,24 +25,101 @@ struct llama_kv_cache : public llama_memory_i {
     bool get_can_edit() const override { return get_can_shift(); }
 };
 
-struct llama_kv_cell {
-    llama_pos pos   = -1;
-    llama_pos delta = 0;
-    int32_t   src   = -1; // used by recurrent state models to copy states
-    int32_t   tail  = -1;
+// the cells of a KV cache, stored as a structure of arrays
+// the sequences of each cell are kept in a bit mask of n_seq_words 64-bit words, sized by the max number of sequences
+class llama_kv_cells {
+public:
+    void resize(uint32_t n, uint32_t n_seq_max);
+
+    uint32_t size() const {
+        return pos.size();
+    }
 
-    std::set<llama_seq_id> seq_id;
+    // reset cell i to an empty cell
+    void reset(uint32_t i);
 
-    bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+    // copy the cell isrc to the cell idst
+    void copy(uint32_t idst, uint32_t isrc);
+
+    void swap(uint32_t i, uint32_t j);
+
+    bool is_empty(uint32_t i) const {
+        const uint64_t * mask = &seq[i*n_seq_words];
+        for (uint32_t w = 0; w < n_seq_words; ++w) {
+            if (mask[w]) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    bool is_empty() const {
-        return seq_id.empty();
+    bool has_seq_id(uint32_t i, llama_seq_id seq_id) const {
+        if ((uint32_t) seq_id >= 64*n_seq_words) {
+            return false;
+        }
+        return (seq[i*n_seq_words + seq_id/64] >> (seq_id%64)) & 1;
+    }
+
+    bool is_same_seq(uint32_t i, uint32_t j) const;
+
+    uint32_t seq_count(uint32_t i) const;
+
+    void seq_add  (uint32_t i, llama_seq_id seq_id);
+    void seq_rm   (uint32_t i, llama_seq_id seq_id);
+    void seq_clear(uint32_t i);
+
+    // the sequences of cell i, in increasing order
+    std::vector<llama_seq_id> seq_ids(uint32_t i) const;
+
+    // for each of the cells idxs[0, n) (or [0, n) when idxs is null): its pos if it belongs to seq_id, -1 otherwise
+    void seq_pos(llama_seq_id seq_id, const uint32_t * idxs, uint32_t n, llama_pos * dst) const;
+
+    std::vector<llama_pos> pos;
+    std::vector<llama_pos> delta;
+    std::vector<int32_t>   src;  // used by recurrent state models to copy states
+    std::vector<int32_t>   tail;
+
+private:
+    uint32_t n_seq_words = 1;
+
+    std::vector<uint64_t> seq; // [size*n_seq_words]
+
+    // make room for seq_id in the bit masks
+    void grow(llama_seq_id seq_id);
+};
+
+// per-sequence rows of the causal KQ mask over all cells of the cache, kept between ubatches so that the mask of
+// a new ubatch only has to add the cells of its tokens instead of being rebuilt from the cells
+// the cells added through find_slot are picked up from the ubatch, any other edit of the cells (seq_rm, seq_add,
+// defrag, state restore, ...) marks the range of cells it changed as dirty and the next ubatch re-derives only those
+struct llama_kv_mask_rows {
+    std::vector<std::vector<float>> rows; // [seq_id][kv_size], 0.0f for the visible cells, -INFINITY otherwise
+    std::vector<llama_pos>          pos;  // [seq_id], the last position visible in each row, -1 if the row is invalid
+
+    std::vector<std::pair<uint32_t, uint32_t>> dirty; // [seq_id], the cells [c0, c1) of the row that are out of date
+
+    // all rows have to be rebuilt
+    void invalidate() {
+        std::fill(pos.begin(), pos.end(), -1);
     }
 
-    bool is_same_seq(const llama_kv_cell & other) const {
-        return seq_id == other.seq_id;
+    // the cells [c0, c1) have changed
+    void invalidate(uint32_t c0, uint32_t c1) {
+        if (c0 >= c1) {
+            return;
+        }
+
+        for (size_t s = 0; s < dirty.size(); ++s) {
+            auto & d = dirty[s];
+            if (pos[s] < 0) {
+                continue;
+            }
+            if (d.first >= d.second) {
+                d = { c0, c1 };
+            } else {
+                d = { std::min(d.first, c0), std::max(d.second, c1) };
+            }
+        }
     }
 };
 
@@ -74,7 +151,7 @@ public:
     virtual ~llama_kv_cache_unified() = default;
 
     // TODO: become constructor
-    bool init(
+    virtual bool init(
             const llama_model & model,   // TODO: do not reference the model
           const llama_cparams & cparams,
                     ggml_type   type_k,
@@ -108,10 +185,25 @@ public:
     // returns a structure holding information about the slot found
     // Note: On success, it's important that cache.head points
     // to the first cell of the slot.
-    llama_kv_cache_slot_info find_slot(const llama_ubatch & batch);
+    virtual llama_kv_cache_slot_info find_slot(const llama_ubatch & batch);
+
+    // cell ranges [c0, c1) holding the tokens of the last slot found by find_slot, in ubatch order
+    virtual std::vector<std::pair<uint32_t, uint32_t>> get_slot_ranges(uint32_t n_tokens) const;
+
+    // cell ranges [c0, c1) read by the attention of the current ubatch, n cells in total
+    virtual std::vector<std::pair<uint32_t, uint32_t>> get_kv_runs() const;
+
+    // undo the allocation of a slot (see llama_kv_slot_restorer)
+    virtual void restore_slot(uint32_t c0, uint32_t c1);
+
+    // the slots found since the last commit will not be restored anymore
+    virtual void commit() {}
+
+    // number of cells that the attention has to consider for the current ubatch
+    virtual uint32_t get_n_kv(const llama_cparams & cparams) const;
 
     // TODO: maybe not needed
-    uint32_t get_padding(const llama_cparams & cparams) const;
+    virtual uint32_t get_padding(const llama_cparams & cparams) const;
 
     // find how many cells are currently in use
     uint32_t cell_max() const;
@@ -131,7 +223,8 @@ public:
     // state save/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const;
-    void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1);
+
+    virtual void state_read(llama_io_read_i & io, llama_seq_id seq_id = -1);
 
     // members
 
@@ -158,11 +251,23 @@ public:
     // computed before each graph build
     uint32_t n = 0;
 
-    std::vector<llama_kv_cell> cells;
+    llama_kv_cells cells;
+
+    // updated by the graph inputs when the KQ mask is set
+    mutable llama_kv_mask_rows mask_rows;
 
     std::vector<ggml_tensor *> k_l; // per layer
     std::vector<ggml_tensor *> v_l;
 
+protected:
+    // give seq_id private copies of its cells in [p0, p1) that are shared with other sequences, so that seq_add and
+    // seq_div can change their positions without moving the other sequences (copy on write)
+    // the cells with pos + delta < 0 are about to be shifted out of the context, the sequence only leaves them
+    virtual void seq_unshare(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta);
+
+    // copy the K and V data of the cells ids[k].first to the cells ids[k].second
+    void copy_cells(const std::vector<std::pair<uint32_t, uint32_t>> & ids);
+
 private:
     ggml_type type_k = GGML_TYPE_F16;
     ggml_type type_v = GGML_TYPE_F16;
@@ -173,8 +278,119 @@ private:
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
-    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, llama_seq_id dest_seq_id = -1);
-    bool state_read_data(llama_io_read_i & io, uint32_t cell_count);
+    bool state_read_meta(llama_io_read_i & io, uint32_t cell_count, std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id dest_seq_id = -1);
+    bool state_read_data(llama_io_read_i & io, uint32_t cell_count, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges);
+};
+
+// paged KV cache
+//
+// the cells are grouped in blocks of block_size cells, which are handed out to the sequences from a free list
+// each sequence keeps a block table with the blocks that hold its tokens, so the tokens of a ubatch do not
+// have to be stored in contiguous cells and the cache does not need to be defragmented
+// the attention gathers only the blocks of the sequences in the current ubatch (see get_kv_idxs())
+//
+// blocks shared by several sequences (e.g. a common prompt prefix added with seq_cp) are copy-on-write:
+// the shared cells are never modified, a sequence that diverges continues in a block of its own, and a sequence
+// whose positions are shifted gets private copies of the shared cells first
+class llama_kv_cache_paged : public llama_kv_cache_unified {
+public:
+    llama_kv_cache_paged(
+            const llama_hparams & hparams,
+            callbacks             cbs,
+            uint32_t              block_size);
+
+    virtual ~llama_kv_cache_paged() = default;
+
+    bool init(
+            const llama_model & model,
+          const llama_cparams & cparams,
+                    ggml_type   type_k,
+                    ggml_type   type_v,
+                     uint32_t   kv_size,
+                         bool   offload) override;
+
+    void clear()  override;
+    void defrag() override;
+
+    bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
+    void seq_cp  (llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) override;
+    void seq_keep(llama_seq_id seq_id) override;
+    void seq_add (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, llama_pos delta) override;
+    void seq_div (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1, int d) override;
+
+    llama_kv_cache_slot_info find_slot(const llama_ubatch & batch) override;
+
+    std::vector<std::pair<uint32_t, uint32_t>> get_slot_ranges(uint32_t n_tokens) const override;
+
+    // the cells of get_kv_idxs() coalesced into runs, followed by the padding
+    std::vector<std::pair<uint32_t, uint32_t>> get_kv_runs() const override;
+
+    void restore_slot(uint32_t c0, uint32_t c1) override;
+    void commit() override;
+
+    uint32_t get_n_kv(const llama_cparams & cparams) const override;
+
+    uint32_t get_padding(const llama_cparams & cparams) const override;
+
+    void state_read(llama_io_read_i & io, llama_seq_id seq_id = -1) override;
+
+    uint32_t get_block_size() const;
+    uint32_t get_n_free_blocks() const;
+
+    // number of sequences that reference a block
+    uint32_t get_block_refs(uint32_t blk_id) const;
+
+    // block table of a sequence
+    const std::vector<uint32_t> & get_seq_blocks(llama_seq_id seq_id) const;
+
+    // cells gathered by the attention of the current ubatch: the blocks of all sequences in the ubatch
+    // the attention is computed over n >= get_kv_idxs().size() cells, the rest must be masked
+    const std::vector<uint32_t> & get_kv_idxs() const;
+
+private:
+    const uint32_t block_size;
+
+    uint32_t n_blocks = 0;
+
+    std::vector<uint32_t> blk_used; // number of non-empty cells in each block
+    std::vector<uint32_t> blk_refs; // number of block tables that contain each block
+    std::vector<uint32_t> blk_fill; // the next cell to hand out in each block, the cells after it are empty
+    std::vector<uint8_t>  blk_mark; // scratch used to de-duplicate blocks
+
+    // free blocks in decreasing order, the last one is handed out first
+    std::vector<uint32_t> blk_free;
+
+    // block table of each sequence
+    std::vector<std::vector<uint32_t>> seq_blocks;
+
+    // cells of the current ubatch, in ubatch order
+    std::vector<uint32_t> ubatch_cells;
+
+    // cells allocated since the last commit, the slots returned by find_slot index into it
+    std::vector<uint32_t> slot_cells;
+
+    std::vector<uint32_t> kv_idxs;
+
+    std::vector<uint32_t> & seq_table(llama_seq_id seq_id);
+
+    void seq_unshare(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) override;
+
+    // hand out an empty cell for a new token of the sequences, returns -1 if the cache is full
+    int32_t alloc_cell(const llama_seq_id * seq_ids, int32_t n_seq_id);
+
+    // the sequence edits only walk the blocks of the affected sequences and update the tables in place:
+
+    // empty a cell, the block tables of its sequences are not updated
+    void cell_clear(uint32_t i);
+
+    // drop the blocks without any cell of the sequence from its table
+    void prune_blocks(llama_seq_id seq_id);
+
+    // shrink the fill of a block to its trailing empty cells and return it to the free list once it is unused
+    void blk_update(uint32_t blk_id);
+
+    // rebuild the block tables and the free list from the cells (after a state restore or a clear)
+    void update_blocks();
 };
 
 // TODO: temporary reusing llama_kv_cache_unified -- implement recurrent cache and simplify llama_kv_cache_unified
@@ -229,7 +445,7 @@ struct llama_kv_slot_restorer {
                 cache.seq_rm(-1, -1, -1);
             } else {
                 for (auto & slot : slot_boundaries) {
-                    cache.seq_rm(-1, slot.first, slot.second);
+                    cache.restore_slot(slot.first, slot.second);
                 }
             }
         }
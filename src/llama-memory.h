@@ -2,6 +2,13 @@
 
 #include "llama.h"
 
+#include <cstdint>
+
+struct llama_memory_params {
+    // number of cells in a block of a paged KV cache (0 = contiguous KV cache)
+    uint32_t kv_block_size;
+};
+
 // general concept of LLM memory
 // the KV cache is a type of LLM memory, but there can be other types
 class llama_memory_i {
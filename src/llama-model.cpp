@@ -3806,6 +3806,31 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    // move the rows of the CPU weights to the NUMA nodes whose threads compute them (--numa partition)
+    if (ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU)) {
+        auto * reg = ggml_backend_dev_backend_reg(cpu_dev);
+        auto * is_numa_fn      = (decltype(ggml_is_numa)           *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_is_numa");
+        auto * place_tensor_fn = (decltype(ggml_numa_place_tensor) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_numa_place_tensor");
+
+        if (is_numa_fn && place_tensor_fn && is_numa_fn()) {
+            size_t n_placed = 0;
+            size_t n_bytes  = 0;
+
+            for (auto & it : ctx_bufs) {
+                for (auto * cur = ggml_get_first_tensor(it.first); cur != NULL; cur = ggml_get_next_tensor(it.first, cur)) {
+                    if (place_tensor_fn(cur)) {
+                        n_placed += 1;
+                        n_bytes  += ggml_nbytes(cur);
+                    }
+                }
+            }
+
+            if (n_placed > 0) {
+                LLAMA_LOG_INFO("%s: partitioned %zu weights (%.2f MiB) across the NUMA nodes\n", __func__, n_placed, n_bytes/1024.0/1024.0);
+            }
+        }
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
@@ -11414,7 +11439,7 @@ struct llm_build_wavtokenizer_dec : public llm_graph_context {
     }
 };
 
-llama_memory_i * llama_model::create_memory() const {
+llama_memory_i * llama_model::create_memory(const llama_memory_params & params) const {
     llama_memory_i * res;
 
     switch (arch) {
@@ -11430,7 +11455,7 @@ llama_memory_i * llama_model::create_memory() const {
             } break;
         default:
             {
-                res = new llama_kv_cache_unified(hparams, {
+                llama_kv_cache_unified::callbacks cbs = {
                     /*.get_rope_factors =*/ [this](uint32_t n_ctx_per_seq, int il) {
                         // choose long/short freq factors based on the context size
                         if (layers[il].rope_freqs != nullptr) {
@@ -11443,7 +11468,13 @@ llama_memory_i * llama_model::create_memory() const {
 
                         return layers[il].rope_short;
                     }
-                });
+                };
+
+                if (params.kv_block_size > 0) {
+                    res = new llama_kv_cache_paged(hparams, std::move(cbs), params.kv_block_size);
+                } else {
+                    res = new llama_kv_cache_unified(hparams, std::move(cbs));
+                }
             }
     }
 
@@ -12,6 +12,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <memory>
 #include <numeric>
 #include <random>
 #include <unordered_map>
@@ -384,20 +385,17 @@ llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_conte
     const int n_vocab = llama_vocab_n_tokens(vocab);
 
     // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
+    // note: only the candidates that are left after the first samplers of a chain are written to the buffer
+    std::unique_ptr<llama_token_data[]> cur(new llama_token_data[n_vocab]);
 
     llama_token_data_array cur_p = {
-        /* .data       = */ cur.data(),
-        /* .size       = */ cur.size(),
+        /* .data       = */ cur.get(),
+        /* .size       = */ (size_t) n_vocab,
         /* .selected   = */ -1,
         /* .sorted     = */ false,
     };
 
-    llama_sampler_apply(smpl, &cur_p);
+    llama_sampler_apply_logits(smpl, logits, n_vocab, &cur_p);
 
     GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
 
@@ -2522,6 +2520,229 @@ uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
     return LLAMA_DEFAULT_SEED;
 }
 
+// sampling from the logits
+
+// the samplers that leave the candidates as they are with their current parameters
+static bool llama_sampler_is_noop(const struct llama_sampler * smpl) {
+    if (smpl->iface == &llama_sampler_logit_bias_i) {
+        return ((const llama_sampler_logit_bias *) smpl->ctx)->logit_bias.empty();
+    }
+
+    if (smpl->iface == &llama_sampler_penalties_i) {
+        const auto * ctx = (const llama_sampler_penalties *) smpl->ctx;
+        return ctx->penalty_last_n == 0 || (ctx->penalty_repeat == 1.0f && ctx->penalty_freq == 0.0f && ctx->penalty_present == 0.0f);
+    }
+
+    if (smpl->iface == &llama_sampler_dry_i) {
+        const auto * ctx = (const llama_sampler_dry *) smpl->ctx;
+        return ctx->dry_multiplier == 0.0f || ctx->dry_base < 1.0f || ctx->dry_penalty_last_n == 0;
+    }
+
+    if (smpl->iface == &llama_sampler_typical_i) {
+        return ((const llama_sampler_typical *) smpl->ctx)->p >= 1.0f;
+    }
+
+    if (smpl->iface == &llama_sampler_top_p_i) {
+        return ((const llama_sampler_top_p *) smpl->ctx)->p >= 1.0f;
+    }
+
+    if (smpl->iface == &llama_sampler_min_p_i) {
+        return ((const llama_sampler_min_p *) smpl->ctx)->p <= 0.0f;
+    }
+
+    if (smpl->iface == &llama_sampler_xtc_i) {
+        const auto * ctx = (const llama_sampler_xtc *) smpl->ctx;
+        return ctx->probability <= 0.0f || ctx->threshold > 0.5f;
+    }
+
+    return false;
+}
+
+static void llama_token_data_array_from_logits(const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        cur_p->data[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+
+    cur_p->size   = n_vocab;
+    cur_p->sorted = false;
+}
+
+static float llama_logits_max(const float * logits, int32_t n_vocab) {
+    // independent lanes, so that the compiler can vectorize the reduction
+    constexpr int n_lanes = 8;
+
+    float max_l[n_lanes];
+    std::fill(max_l, max_l + n_lanes, -FLT_MAX);
+
+    int32_t i = 0;
+    for (; i + n_lanes <= n_vocab; i += n_lanes) {
+        for (int j = 0; j < n_lanes; ++j) {
+            max_l[j] = logits[i + j] > max_l[j] ? logits[i + j] : max_l[j];
+        }
+    }
+    for (; i < n_vocab; ++i) {
+        max_l[0] = logits[i] > max_l[0] ? logits[i] : max_l[0];
+    }
+
+    return *std::max_element(max_l, max_l + n_lanes);
+}
+
+// write the k candidates with the highest logits to cur_p, sorted - same as llama_sampler_top_k_impl on all the logits
+static void llama_sampler_top_k_logits(const float * logits, int32_t n_vocab, int32_t k, llama_token_data_array * cur_p) {
+    k = std::min(k, n_vocab);
+
+    const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    // min-heap of the k highest logits so far, its top is the logit to beat
+    llama_token_data * heap = cur_p->data;
+
+    for (int32_t i = 0; i < k; ++i) {
+        heap[i] = llama_token_data{i, logits[i], 0.0f};
+    }
+    std::make_heap(heap, heap + k, comp);
+
+    const auto push = [&](int32_t i) {
+        std::pop_heap(heap, heap + k, comp);
+        heap[k - 1] = llama_token_data{i, logits[i], 0.0f};
+        std::push_heap(heap, heap + k, comp);
+    };
+
+    // most of the logits are below the threshold - check them a block at a time, the compare and or are vectorized
+    constexpr int32_t n_block = 16;
+
+    int32_t i = k;
+    for (; i + n_block <= n_vocab; i += n_block) {
+        const float * block = logits + i;
+        const float   thold = heap[0].logit;
+
+        int any = 0;
+        for (int32_t j = 0; j < n_block; ++j) {
+            any |= block[j] > thold;
+        }
+
+        if (!any) {
+            continue;
+        }
+
+        for (int32_t j = 0; j < n_block; ++j) {
+            if (block[j] > heap[0].logit) {
+                push(i + j);
+            }
+        }
+    }
+    for (; i < n_vocab; ++i) {
+        if (logits[i] > heap[0].logit) {
+            push(i);
+        }
+    }
+
+    std::sort_heap(heap, heap + k, comp);
+
+    cur_p->size   = k;
+    cur_p->sorted = true;
+}
+
+// write the candidates with p_i >= p * p_max to cur_p, in the order of the vocab - same as the unsorted min-p
+static void llama_sampler_min_p_logits(const float * logits, int32_t n_vocab, float p, llama_token_data_array * cur_p) {
+    const float min_logit = llama_logits_max(logits, n_vocab) + logf(p);
+
+    size_t n = 0;
+    for (int32_t i = 0; i < n_vocab; ++i) {
+        if (logits[i] >= min_logit) {
+            cur_p->data[n++] = llama_token_data{i, logits[i], 0.0f};
+        }
+    }
+
+    cur_p->size   = n;
+    cur_p->sorted = false;
+}
+
+// apply the top-k or min-p that a chain starts with to the logits, returns the index of the next sampler to apply,
+// or 0 if the chain does not start with one of them
+static size_t llama_sampler_chain_apply_logits_head(const llama_sampler_chain * chain, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    const auto & samplers = chain->samplers;
+
+    size_t i = 0;
+    while (i < samplers.size() && llama_sampler_is_noop(samplers[i])) {
+        ++i;
+    }
+
+    if (i == samplers.size()) {
+        return 0;
+    }
+
+    if (samplers[i]->iface == &llama_sampler_top_k_i) {
+        const int32_t k = ((const llama_sampler_top_k *) samplers[i]->ctx)->k;
+
+        if (k > 0) {
+            llama_sampler_top_k_logits(logits, n_vocab, k, cur_p);
+            return i + 1;
+        }
+
+        // a top-k that keeps all the candidates only sorts them, which is cheap after a min-p
+        do {
+            ++i;
+        } while (i < samplers.size() && llama_sampler_is_noop(samplers[i]));
+
+        if (i == samplers.size() || samplers[i]->iface != &llama_sampler_min_p_i) {
+            return 0;
+        }
+
+        const auto * ctx = (const llama_sampler_min_p *) samplers[i]->ctx;
+
+        llama_sampler_min_p_logits(logits, n_vocab, ctx->p, cur_p);
+        if (cur_p->size < std::max<size_t>(ctx->min_keep, 1)) {
+            return 0;
+        }
+
+        std::sort(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        cur_p->sorted = true;
+
+        return i + 1;
+    }
+
+    if (samplers[i]->iface == &llama_sampler_min_p_i) {
+        const auto * ctx = (const llama_sampler_min_p *) samplers[i]->ctx;
+
+        // with fewer than min_keep candidates, min-p falls back to sorting all of them
+        llama_sampler_min_p_logits(logits, n_vocab, ctx->p, cur_p);
+        if (cur_p->size < ctx->min_keep) {
+            return 0;
+        }
+
+        return i + 1;
+    }
+
+    return 0;
+}
+
+void llama_sampler_apply_logits(struct llama_sampler * smpl, const float * logits, int32_t n_vocab, llama_token_data_array * cur_p) {
+    cur_p->selected = -1;
+
+    if (smpl->iface != &llama_sampler_chain_i) {
+        llama_token_data_array_from_logits(logits, n_vocab, cur_p);
+        llama_sampler_apply(smpl, cur_p);
+        return;
+    }
+
+    auto * chain = (llama_sampler_chain *) smpl->ctx;
+
+    time_meas tm(chain->t_sample_us, chain->params.no_perf);
+
+    size_t i = llama_sampler_chain_apply_logits_head(chain, logits, n_vocab, cur_p);
+    if (i == 0) {
+        llama_token_data_array_from_logits(logits, n_vocab, cur_p);
+    }
+
+    for (; i < chain->samplers.size(); ++i) {
+        llama_sampler_apply(chain->samplers[i], cur_p);
+    }
+}
+
 // perf
 
 struct llama_perf_sampler_data llama_perf_sampler(const struct llama_sampler * chain) {
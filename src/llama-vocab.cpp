@@ -1,6 +1,7 @@
 #include "llama-vocab.h"
 
 #include "llama-impl.h"
+#include "llama-grammar.h"
 #include "llama-model-loader.h"
 
 #include "unicode.h"
@@ -13,6 +14,7 @@
 #include <cstring>
 #include <forward_list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <unordered_map>
@@ -1253,6 +1255,12 @@ struct llama_vocab::impl {
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    std::once_flag   piece_trie_once;
+    llama_vocab_trie piece_trie;
+
+    llama_grammar_cache grammar_cache;
+
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -3027,6 +3035,77 @@ void llama_vocab::print_info() const {
     pimpl->print_info();
 }
 
+const llama_vocab_trie & llama_vocab::get_piece_trie() const {
+    std::call_once(pimpl->piece_trie_once, [this]() {
+        const auto & pieces = pimpl->cache_token_to_piece;
+
+        // sorting the pieces puts the nodes of the trie in pre-order
+        std::vector<std::pair<const char *, llama_token>> sorted;
+        sorted.reserve(pieces.size());
+        for (size_t id = 0; id < pieces.size(); ++id) {
+            if (pieces[id][0] != 0) {
+                sorted.emplace_back(pieces[id].c_str(), id);
+            }
+        }
+
+        std::stable_sort(sorted.begin(), sorted.end(), [](const auto & a, const auto & b) {
+            return strcmp(a.first, b.first) < 0;
+        });
+
+        auto & trie = pimpl->piece_trie;
+
+        trie.nodes.clear();
+        trie.tokens.clear();
+        trie.tokens.reserve(sorted.size());
+
+        trie.nodes.push_back({ 0, 0, 0, 0, 0 });
+
+        // the nodes of the last piece, by depth
+        std::vector<uint32_t> path = { 0 };
+
+        const char * prev = "";
+        for (const auto & [piece, id] : sorted) {
+            size_t n_prefix = 0;
+            while (prev[n_prefix] != 0 && prev[n_prefix] == piece[n_prefix]) {
+                n_prefix++;
+            }
+
+            // close the subtrees of the last piece that do not contain this one
+            while (path.size() > n_prefix + 1) {
+                auto & node = trie.nodes[path.back()];
+                node.end     = trie.nodes.size();
+                node.tok_end = trie.tokens.size();
+                path.pop_back();
+            }
+
+            for (size_t i = n_prefix; piece[i] != 0; ++i) {
+                path.push_back(trie.nodes.size());
+                trie.nodes.push_back({ 0, (uint32_t) trie.tokens.size(), (uint32_t) trie.tokens.size(), 0, (uint8_t) piece[i] });
+            }
+
+            trie.tokens.push_back(id);
+            trie.nodes[path.back()].tok_mid = trie.tokens.size();
+
+            prev = piece;
+        }
+
+        while (!path.empty()) {
+            auto & node = trie.nodes[path.back()];
+            node.end     = trie.nodes.size();
+            node.tok_end = trie.tokens.size();
+            path.pop_back();
+        }
+
+        LLAMA_LOG_DEBUG("%s: %zu nodes for %zu tokens\n", __func__, trie.nodes.size(), trie.tokens.size());
+    });
+
+    return pimpl->piece_trie;
+}
+
+llama_grammar_cache & llama_vocab::get_grammar_cache() const {
+    return pimpl->grammar_cache;
+}
+
 //
 // interface implementation
 //
@@ -8,6 +8,23 @@
 
 struct LLM_KV;
 struct llama_model_loader;
+struct llama_grammar_cache;
+
+// a byte-level trie over the pieces of the tokens (see llama_vocab::token_to_piece)
+// the nodes are in pre-order, so the nodes and the tokens of a subtree are contiguous
+// the pieces are cut at their first 0 byte, and the empty ones are not in the trie
+struct llama_vocab_trie {
+    struct node {
+        uint32_t end;       // the node after the subtree
+        uint32_t tok_begin; // the tokens of the subtree, starting with the ones whose piece ends at this node
+        uint32_t tok_mid;   // the end of the tokens whose piece ends at this node
+        uint32_t tok_end;   // the end of the tokens of the subtree
+        uint8_t  byte;
+    };
+
+    std::vector<node>        nodes; // nodes[0] is the root, for the empty prefix
+    std::vector<llama_token> tokens;
+};
 
 struct llama_vocab {
     struct token_data {
@@ -119,6 +136,12 @@ struct llama_vocab {
 
     void print_info() const;
 
+    // built on first use
+    const llama_vocab_trie & get_piece_trie() const;
+
+    // the grammars compiled against this vocab
+    llama_grammar_cache & get_grammar_cache() const;
+
 private:
     struct impl;
     std::unique_ptr<impl> pimpl;
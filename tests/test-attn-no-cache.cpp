@@ -0,0 +1,181 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-batch.h"
+#include "llama-cparams.h"
+#include "llama-graph.h"
+#include "llama-hparams.h"
+
+#include "ggml-backend.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const int64_t n_embd_head = 64;
+static const int64_t n_head      = 4;
+static const int64_t n_head_kv   = 2;
+
+// a ubatch of single tokens that alternate between two sequences, as split by llama_sbatch::split_simple
+struct test_ubatch {
+    std::vector<llama_pos>      pos;
+    std::vector<int32_t>        n_seq_id;
+    std::vector<llama_seq_id>   seq_ids;
+    std::vector<llama_seq_id *> seq_id;
+
+    llama_ubatch ubatch;
+
+    test_ubatch(uint32_t n_tokens) : pos(n_tokens), n_seq_id(n_tokens, 1), seq_ids(n_tokens) {
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            seq_ids[i] = i % 2;
+            pos[i]     = i / 2;
+        }
+        for (auto & s : seq_ids) {
+            seq_id.push_back(&s);
+        }
+
+        ubatch = {
+            /*equal_seqs   =*/ false,
+            /*n_tokens     =*/ n_tokens,
+            /*n_seq_tokens =*/ 1,
+            /*n_seqs       =*/ n_tokens,
+            /*token        =*/ nullptr,
+            /*embd         =*/ nullptr,
+            /*pos          =*/ pos.data(),
+            /*n_seq_id     =*/ n_seq_id.data(),
+            /*seq_id       =*/ seq_id.data(),
+            /*output       =*/ nullptr,
+        };
+    }
+};
+
+static void fill(ggml_tensor * t, float offs) {
+    std::vector<float> data(ggml_nelements(t));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = std::sin(offs + 0.37f*i);
+    }
+    ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+}
+
+// the output of the attention without KV cache of a model like BERT (no causal mask) or of an encoder
+// fattn_kv_pad: 0 for the attention without flash attention, the padding of K and V otherwise
+static std::vector<float> run_attn(ggml_backend_t backend, const test_ubatch & tu, bool causal, uint32_t fattn_kv_pad) {
+    const llama_ubatch & ubatch = tu.ubatch;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*256 + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * q = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_head,    ubatch.n_tokens);
+    ggml_tensor * k = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_head_kv, ubatch.n_tokens);
+    ggml_tensor * v = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_head_kv, ubatch.n_tokens);
+
+    llama_hparams hparams = {};
+    hparams.n_layer          = 1;
+    hparams.n_embd_head_k    = n_embd_head;
+    hparams.n_embd_head_v    = n_embd_head;
+    hparams.n_head_arr[0]    = n_head;
+    hparams.n_head_kv_arr[0] = n_head_kv;
+
+    llama_cparams cparams = {};
+    cparams.n_seq_max    = 2;
+    cparams.causal_attn  = causal;
+    cparams.offload_kqv  = true;
+    cparams.flash_attn   = fattn_kv_pad > 0;
+    cparams.fattn_kv_pad = fattn_kv_pad;
+
+    const llm_graph_cb cb;
+
+    llm_graph_params gparams = {
+        /*.ctx         =*/ ctx,
+        /*.arch        =*/ LLM_ARCH_BERT,
+        /*.hparams     =*/ hparams,
+        /*.cparams     =*/ cparams,
+        /*.ubatch      =*/ ubatch,
+        /*.sched       =*/ nullptr,
+        /*.backend_cpu =*/ nullptr,
+        /*.cvec        =*/ nullptr,
+        /*.loras       =*/ nullptr,
+        /*.loras_seq   =*/ nullptr,
+        /*.memory      =*/ nullptr,
+        /*.cross       =*/ nullptr,
+        /*.n_outputs   =*/ (int32_t) ubatch.n_tokens,
+        /*.cb          =*/ cb,
+    };
+
+    llm_graph_context g(gparams);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    auto * inp = g.build_attn_inp_no_cache();
+
+    const int64_t n_kv = cparams.flash_attn ? GGML_PAD(ubatch.n_tokens, fattn_kv_pad) : ubatch.n_tokens;
+    assert(inp->get_kq_mask()->ne[0] == n_kv);
+
+    ggml_tensor * res = g.build_attn(inp, gf, nullptr, nullptr, q, k, v, nullptr, 1.0f/std::sqrt(float(n_embd_head)), 0);
+    assert(res->ne[0] == n_embd_head*n_head && res->ne[1] == ubatch.n_tokens);
+
+    ggml_build_forward_expand(gf, res);
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    assert(buf != nullptr);
+
+    fill(q, 0.0f);
+    fill(k, 1.0f);
+    fill(v, 2.0f);
+
+    g.res->set_inputs(&ubatch);
+
+    assert(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+    std::vector<float> out(ggml_nelements(res));
+    ggml_backend_tensor_get(res, out.data(), 0, ggml_nbytes(res));
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+
+    return out;
+}
+
+int main(void) {
+    ggml_backend_load_all();
+
+    ggml_backend_t backend = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
+    assert(backend != nullptr);
+
+    for (uint32_t n_tokens : { 8, 113, 256 }) {
+        const test_ubatch tu(n_tokens);
+
+        for (bool causal : { false, true }) {
+            const std::vector<float> ref = run_attn(backend, tu, causal, 0);
+
+            // the K and V as they are for the CPU kernels, and padded for the GPU kernels
+            for (uint32_t fattn_kv_pad : { 1u, (uint32_t) LLAMA_FATTN_KV_PAD }) {
+                const std::vector<float> out = run_attn(backend, tu, causal, fattn_kv_pad);
+
+                assert(out.size() == ref.size());
+                for (size_t i = 0; i < out.size(); ++i) {
+                    // K and V are converted to F16 for the flash attention
+                    if (std::fabs(out[i] - ref[i]) > 1e-2f) {
+                        fprintf(stderr, "%s: n_tokens = %u, causal = %d, fattn_kv_pad = %u: at %zu expected %f, got %f\n",
+                                __func__, n_tokens, causal, fattn_kv_pad, i, ref[i], out[i]);
+                        assert(false);
+                    }
+                }
+            }
+
+            printf("%s: n_tokens = %3u, causal = %d: OK\n", __func__, n_tokens, causal);
+        }
+    }
+
+    ggml_backend_free(backend);
+
+    return 0;
+}
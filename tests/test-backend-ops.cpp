@@ -4373,7 +4373,7 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
                     for (int nh : { 4, }) {
                         for (int nr : { 1, 4, 16 }) {
                             if (nr == 16 && hs != 128) continue;
-                            for (int kv : { 512, 1024, }) {
+                            for (int kv : { 113, 512, 1024, }) {
                                 if (nr != 1 && kv != 512) continue;
                                 for (int nb : { 1, 3, 32, 35, }) {
                                     for (ggml_type type_KV : {GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
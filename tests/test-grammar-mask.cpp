@@ -0,0 +1,309 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "gguf.h"
+#include "llama-grammar.h"
+#include "llama-vocab.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// a small SPM vocab: the byte tokens, and pieces that are ASCII, multi-byte or not valid UTF-8 on their own
+static const std::vector<std::string> vocab_pieces = {
+    "a", "b", "c", "ab", "abc", "ba", "0", "1", "2", "9", "12", "x", "y", "z",
+    "\"", "{", "}", ":", ",", "[", "]", "\\", "\"a", "a\"", "{\"", "\":",
+    "\xe2\x96\x81", "\xe2\x96\x81" "a", "\xe2\x96\x81true", "true", "false", "null", "tr", "ue",
+    "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "a\xc3\xa9", "\xc3\xa9\xe2\x82\xac", "\xe2\x82\xac" "1",
+    "\xc3", "\xe2\x82", "\xf0\x9f\x98", "\xa9", "\x82\xac", "\xac", "\x80", "\xff", "a\xe2", "\xe2\x82\xac\xe2",
+    "\xc0\xaf", "\xed\xa0\x80", "\xf5\x80\x80\x80", "\xa9" "a", "\xc3" "a",
+};
+
+static std::string build_vocab() {
+    const std::string fname = "test-grammar-mask.gguf";
+
+    std::vector<std::string> tokens = { "<unk>", "<s>", "</s>" };
+    std::vector<int32_t>     types  = { LLAMA_TOKEN_TYPE_UNKNOWN, LLAMA_TOKEN_TYPE_CONTROL, LLAMA_TOKEN_TYPE_CONTROL };
+    for (int i = 0; i < 256; ++i) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "<0x%02X>", i);
+        tokens.push_back(buf);
+        types.push_back(LLAMA_TOKEN_TYPE_BYTE);
+    }
+    for (const auto & piece : vocab_pieces) {
+        tokens.push_back(piece);
+        types.push_back(LLAMA_TOKEN_TYPE_NORMAL);
+    }
+
+    std::vector<const char *> tokens_c;
+    for (const auto & token : tokens) {
+        tokens_c.push_back(token.c_str());
+    }
+    std::vector<float> scores(tokens.size(), 0.0f);
+
+    gguf_context * ctx = gguf_init_empty();
+    gguf_set_val_str(ctx, "general.architecture", "llama");
+    gguf_set_val_u32(ctx, "llama.context_length", 128);
+    gguf_set_val_u32(ctx, "llama.embedding_length", 64);
+    gguf_set_val_u32(ctx, "llama.block_count", 1);
+    gguf_set_val_u32(ctx, "llama.feed_forward_length", 128);
+    gguf_set_val_u32(ctx, "llama.attention.head_count", 4);
+    gguf_set_val_f32(ctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_str(ctx, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str(ctx, "tokenizer.ggml.tokens", tokens_c.data(), tokens_c.size());
+    gguf_set_arr_data(ctx, "tokenizer.ggml.scores", GGUF_TYPE_FLOAT32, scores.data(), scores.size());
+    gguf_set_arr_data(ctx, "tokenizer.ggml.token_type", GGUF_TYPE_INT32, types.data(), types.size());
+    gguf_set_val_u32(ctx, "tokenizer.ggml.unknown_token_id", 0);
+    gguf_set_val_u32(ctx, "tokenizer.ggml.bos_token_id", 1);
+    gguf_set_val_u32(ctx, "tokenizer.ggml.eos_token_id", 2);
+    gguf_write_to_file(ctx, fname.c_str(), false);
+    gguf_free(ctx);
+
+    return fname;
+}
+
+static llama_grammar * init_grammar(const llama_vocab * vocab, const std::string & grammar_str) {
+    llama_grammar * grammar = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+    assert(grammar != nullptr);
+    return grammar;
+}
+
+// the tokens allowed by the grammar in its current state, with all the vocab as candidates
+static std::vector<bool> apply_all(const llama_vocab * vocab, const llama_grammar & grammar) {
+    const int32_t n_vocab = vocab->n_tokens();
+
+    std::vector<llama_token_data> data;
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        data.push_back({ id, 0.0f, 0.0f });
+    }
+    llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+
+    llama_grammar_apply_impl(grammar, &cur_p);
+
+    std::vector<bool> allowed(n_vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        allowed[id] = std::isfinite(data[id].logit);
+    }
+    return allowed;
+}
+
+static bool has_mask(const llama_grammar & grammar) {
+    return grammar.compiled->get_mask(llama_grammar_get_state(*grammar.stacks, grammar.partial_utf8)) != nullptr;
+}
+
+static void test_grammar_cache(const llama_vocab * vocab) {
+    fprintf(stderr, "%s\n", __func__);
+
+    llama_grammar_cache & cache = vocab->get_grammar_cache();
+    cache.max_size = 2;
+
+    const std::string grammar_a = "root ::= \"ab\" [0-9]+ | \"abc\"";
+    const std::string grammar_b = "root ::= [a-c]* \"\\u00e9\"";
+    const std::string grammar_c = "root ::= \"{\" ( [^\"] )* \"}\"";
+
+    // the grammars initialized from the same string share the compiled grammar and its masks
+    llama_grammar * g1 = init_grammar(vocab, grammar_a);
+    llama_grammar * g2 = init_grammar(vocab, grammar_a);
+    assert(g1->compiled == g2->compiled);
+    assert(cache.size() == 1);
+
+    assert(!has_mask(*g1));
+    const auto allowed1 = apply_all(vocab, *g1);
+    assert(g1->compiled->n_masks() == 1);
+
+    // cache hit: the mask of the start state is already there for the second grammar
+    assert(has_mask(*g2));
+    const auto allowed2 = apply_all(vocab, *g2);
+    assert(allowed1 == allowed2);
+    assert(g2->compiled->n_masks() == 1);
+
+    // the clones share it too
+    llama_grammar * g3 = llama_grammar_clone_impl(*g1);
+    assert(g3->compiled == g1->compiled);
+    assert(has_mask(*g3));
+
+    // the least recently used grammar is evicted
+    llama_grammar * gb = init_grammar(vocab, grammar_b);
+    llama_grammar * gc = init_grammar(vocab, grammar_c);
+    assert(gb->compiled != g1->compiled && gc->compiled != g1->compiled);
+    assert(cache.size() == 2);
+
+    llama_grammar * g4 = init_grammar(vocab, grammar_a);
+    assert(g4->compiled != g1->compiled);
+    assert(!has_mask(*g4));
+
+    // a disabled cache keeps nothing
+    cache.max_size = 0;
+    llama_grammar * g5 = init_grammar(vocab, grammar_b);
+    llama_grammar * g6 = init_grammar(vocab, grammar_b);
+    assert(g5->compiled != g6->compiled);
+    assert(cache.size() == 0);
+
+    for (auto * grammar : { g1, g2, g3, g4, g5, g6, gb, gc }) {
+        llama_grammar_free_impl(grammar);
+    }
+}
+
+static void test_mask_eviction(const llama_vocab * vocab) {
+    fprintf(stderr, "%s\n", __func__);
+
+    // room for the masks of two states only
+    vocab->get_grammar_cache().max_masks = 2;
+
+    llama_grammar * grammar = init_grammar(vocab, "root ::= \"a\" \"b\" \"c\" [0-9]");
+    llama_grammar * g0      = llama_grammar_clone_impl(*grammar);
+    assert(grammar->compiled->max_masks == 2);
+
+    const auto allowed_0 = apply_all(vocab, *grammar);
+    llama_grammar_accept_str(*grammar, "a");
+    const auto allowed_1 = apply_all(vocab, *grammar);
+    assert(grammar->compiled->n_masks() == 2);
+
+    // the start state is used again, so the mask of the second state is the least recently used one
+    assert(apply_all(vocab, *g0) == allowed_0);
+
+    llama_grammar_accept_str(*grammar, "b");
+    apply_all(vocab, *grammar);
+    assert(grammar->compiled->n_masks() == 2);
+    assert(has_mask(*grammar));
+    assert(has_mask(*g0));
+
+    // the dropped mask is computed again on demand, with the same result
+    llama_grammar_accept_str(*g0, "a");
+    assert(!has_mask(*g0));
+    assert(apply_all(vocab, *g0) == allowed_1);
+    assert(has_mask(*g0));
+    assert(grammar->compiled->n_masks() == 2);
+
+    vocab->get_grammar_cache().max_masks = 256;
+
+    llama_grammar_free_impl(grammar);
+    llama_grammar_free_impl(g0);
+}
+
+// the tokens allowed by the grammar, checked token by token: the candidates are passed in chunks too small to
+// compute the mask of the state
+static std::vector<bool> apply_per_token(const llama_vocab * vocab, const llama_grammar & grammar) {
+    const int32_t n_vocab = vocab->n_tokens();
+    const int32_t n_chunk = n_vocab/4 - 1;
+
+    std::vector<bool> allowed(n_vocab);
+    for (llama_token id0 = 0; id0 < n_vocab; id0 += n_chunk) {
+        std::vector<llama_token_data> data;
+        for (llama_token id = id0; id < std::min(id0 + n_chunk, n_vocab); ++id) {
+            data.push_back({ id, 0.0f, 0.0f });
+        }
+        llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+
+        llama_grammar_apply_impl(grammar, &cur_p);
+
+        for (const auto & td : data) {
+            allowed[td.id] = std::isfinite(td.logit);
+        }
+    }
+    return allowed;
+}
+
+static std::string piece_str(const llama_vocab * vocab, llama_token id) {
+    std::string res;
+    for (unsigned char c : vocab->token_to_piece(id)) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), c >= 0x20 && c < 0x7f ? "%c" : "\\x%02x", c);
+        res += buf;
+    }
+    return res;
+}
+
+// walk random paths through the grammar, and check in each state that the mask computed over the trie of the vocab
+// allows the same tokens as the per-token check
+static void test_compute_mask(const llama_vocab * vocab, const std::string & grammar_str) {
+    fprintf(stderr, "%s: %s\n", __func__, grammar_str.c_str());
+
+    // a compiled grammar of its own for each grammar, so that the per-token path never finds a mask
+    llama_grammar_cache & cache = vocab->get_grammar_cache();
+    cache.max_size = 0;
+
+    for (int seed = 0; seed < 16; ++seed) {
+        std::mt19937 rng(seed);
+
+        llama_grammar * grammar_mask  = init_grammar(vocab, grammar_str);
+        llama_grammar * grammar_token = init_grammar(vocab, grammar_str);
+        assert(grammar_mask->compiled != grammar_token->compiled);
+
+        std::string path;
+        for (int step = 0; step < 32; ++step) {
+            const auto allowed_mask  = apply_all(vocab, *grammar_mask);
+            const auto allowed_token = apply_per_token(vocab, *grammar_token);
+            assert(has_mask(*grammar_mask));
+            assert(!has_mask(*grammar_token));
+
+            std::vector<llama_token> next;
+            for (llama_token id = 0; id < (llama_token) allowed_mask.size(); ++id) {
+                if (allowed_mask[id] != allowed_token[id]) {
+                    fprintf(stderr, "%s: mismatch after '%s' for token %d '%s': mask %d, per token %d\n", __func__,
+                        path.c_str(), id, piece_str(vocab, id).c_str(), (int) allowed_mask[id], (int) allowed_token[id]);
+                    assert(false);
+                }
+                if (allowed_mask[id] && !vocab->is_eog(id)) {
+                    next.push_back(id);
+                }
+            }
+
+            if (next.empty()) {
+                break;
+            }
+
+            const llama_token id = next[rng() % next.size()];
+            llama_grammar_accept_impl(*grammar_mask,  id);
+            llama_grammar_accept_impl(*grammar_token, id);
+            path += piece_str(vocab, id);
+        }
+
+        llama_grammar_free_impl(grammar_mask);
+        llama_grammar_free_impl(grammar_token);
+    }
+}
+
+int main(void) {
+    llama_backend_init();
+
+    const std::string fname = build_vocab();
+
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(fname.c_str(), mparams);
+    assert(model != nullptr);
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+    assert(vocab->n_tokens() == (uint32_t) (3 + 256 + vocab_pieces.size()));
+
+    test_grammar_cache(vocab);
+    test_mask_eviction(vocab);
+
+    test_compute_mask(vocab, "root ::= \"ab\" [0-9]+ | \"abc\"");
+    test_compute_mask(vocab, "root ::= \"a\" | \"\"");
+    test_compute_mask(vocab, "root ::= ( [a-c] | \"\u00e9\" | \"\u20ac\" | \"\U0001F600\" )* \"}\"");
+    test_compute_mask(vocab, "root ::= \"\u00e9\u20ac\" [0-9] | \"\u00e9a\"");
+    test_compute_mask(vocab, "root ::= \"{\" [^\"}]* \"}\"");
+    test_compute_mask(vocab, "root ::= [\u00e0-\u00ff\u20ac]+ \"x\"");
+    test_compute_mask(vocab, "root ::= [^a-z\u00e9]+");
+    test_compute_mask(vocab, "root ::= .* \"\\\"\"");
+    test_compute_mask(vocab,
+        "root  ::= \"{\" ws \"\\\"\" [a-z]+ \"\\\"\" ws \":\" ws value ws \"}\"\n"
+        "value ::= \"true\" | \"false\" | \"null\" | [0-9]+ | \"[\" ( value ( \",\" value )* )? \"]\"\n"
+        "ws    ::= [ ]?");
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    std::remove(fname.c_str());
+
+    fprintf(stderr, "All tests passed.\n");
+    return 0;
+}
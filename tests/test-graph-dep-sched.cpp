@@ -0,0 +1,232 @@
+// compares the lockstep execution of a graph on the CPU threadpool with the dependency-aware level scheduling
+// (ggml_threadpool_params::dep_sched) - both have to produce bit-identical results
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpu.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_embd  = 64;
+static const int n_ff    = 96;
+static const int n_layer = 3;
+static const int n_cache = 16;
+
+struct test_graph {
+    ggml_context * ctx    = nullptr; // the nodes of the graph, allocated by galloc
+    ggml_context * ctx_w  = nullptr; // the weights, the input and the cache, allocated in buf
+    ggml_cgraph  * gf     = nullptr;
+    ggml_gallocr_t galloc = nullptr;
+
+    ggml_backend_buffer_t buf = nullptr;
+
+    ggml_tensor * inp   = nullptr;
+    ggml_tensor * out   = nullptr;
+    ggml_tensor * cache = nullptr;
+
+    std::vector<ggml_tensor *> weights;
+
+    ~test_graph() {
+        ggml_gallocr_free(galloc);
+        ggml_backend_buffer_free(buf);
+        ggml_free(ctx);
+        ggml_free(ctx_w);
+    }
+};
+
+static ggml_tensor * new_weight(test_graph & g, ggml_type type, int64_t ne0, int64_t ne1) {
+    ggml_tensor * w = ggml_new_tensor_2d(g.ctx_w, type, ne0, ne1);
+    g.weights.push_back(w);
+    return w;
+}
+
+// a few transformer-like layers: matrix multiplications that share their src1, views of the results, writes into
+// a view of a persistent tensor and in-place ops, so that the allocator reuses the buffers of the intermediate nodes
+static void build_graph(test_graph & g, int n_tokens) {
+    ggml_init_params params = {
+        /* .mem_size   = */ ggml_tensor_overhead()*1024 + ggml_graph_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ true,
+    };
+
+    g.ctx   = ggml_init(params);
+    g.ctx_w = ggml_init(params);
+    g.gf    = ggml_new_graph(g.ctx);
+
+    g.inp   = ggml_new_tensor_2d(g.ctx_w, GGML_TYPE_F32, n_embd, n_tokens);
+    g.cache = ggml_new_tensor_2d(g.ctx_w, GGML_TYPE_F32, n_embd, n_cache*n_layer);
+
+    ggml_tensor * cur = g.inp;
+
+    for (int il = 0; il < n_layer; ++il) {
+        ggml_tensor * wq = new_weight(g, GGML_TYPE_F16, n_embd, n_embd);
+        ggml_tensor * wk = new_weight(g, GGML_TYPE_F16, n_embd, n_embd);
+        ggml_tensor * wv = new_weight(g, GGML_TYPE_F16, n_embd, n_embd);
+        ggml_tensor * wo = new_weight(g, GGML_TYPE_F32, n_embd, n_embd);
+        ggml_tensor * wu = new_weight(g, GGML_TYPE_F16, n_embd, n_ff);
+        ggml_tensor * wg = new_weight(g, GGML_TYPE_F16, n_embd, n_ff);
+        ggml_tensor * wd = new_weight(g, GGML_TYPE_F32, n_ff,   n_embd);
+
+        ggml_tensor * x = ggml_rms_norm(g.ctx, cur, 1e-5f);
+
+        ggml_tensor * q = ggml_mul_mat(g.ctx, wq, x);
+        ggml_tensor * k = ggml_mul_mat(g.ctx, wk, x);
+        ggml_tensor * v = ggml_mul_mat(g.ctx, wv, x);
+
+        // store k in the cache and read it back through another view
+        ggml_tensor * k_view = ggml_view_2d(g.ctx, g.cache, n_embd, n_tokens, g.cache->nb[1], il*n_cache*g.cache->nb[1]);
+        ggml_tensor * k_cpy  = ggml_cpy(g.ctx, k, k_view);
+        ggml_tensor * k_all  = ggml_view_2d(g.ctx, g.cache, n_embd, n_cache, g.cache->nb[1], il*n_cache*g.cache->nb[1]);
+
+        ggml_build_forward_expand(g.gf, k_cpy);
+
+        ggml_tensor * kq = ggml_mul_mat(g.ctx, k_all, q);
+        kq = ggml_soft_max_ext(g.ctx, kq, nullptr, 0.125f, 0.0f);
+
+        // the halves of v
+        ggml_tensor * v0 = ggml_view_2d(g.ctx, v, n_embd/2, n_tokens, v->nb[1], 0);
+        ggml_tensor * v1 = ggml_view_2d(g.ctx, v, n_embd/2, n_tokens, v->nb[1], (n_embd/2)*ggml_element_size(v));
+        ggml_tensor * vv = ggml_concat(g.ctx, ggml_mul(g.ctx, v0, v1), ggml_add(g.ctx, v0, v1), 0);
+
+        ggml_tensor * kqv = ggml_mul_mat(g.ctx, ggml_cont(g.ctx, ggml_transpose(g.ctx, k_all)), kq);
+        kqv = ggml_add_inplace(g.ctx, kqv, vv);
+
+        cur = ggml_add(g.ctx, cur, ggml_mul_mat(g.ctx, wo, kqv));
+
+        x = ggml_rms_norm(g.ctx, cur, 1e-5f);
+
+        ggml_tensor * up   = ggml_mul_mat(g.ctx, wu, x);
+        ggml_tensor * gate = ggml_mul_mat(g.ctx, wg, x);
+
+        x = ggml_mul(g.ctx, ggml_silu_inplace(g.ctx, gate), up);
+        x = ggml_scale_inplace(g.ctx, ggml_mul_mat(g.ctx, wd, x), 0.5f);
+
+        cur = ggml_add(g.ctx, cur, x);
+    }
+
+    g.out = ggml_rms_norm(g.ctx, cur, 1e-5f);
+    ggml_set_output(g.out);
+
+    ggml_build_forward_expand(g.gf, g.out);
+}
+
+static bool run(int n_tokens, int n_threads) {
+    test_graph g;
+
+    build_graph(g, n_tokens);
+
+    g.buf = ggml_backend_alloc_ctx_tensors_from_buft(g.ctx_w, ggml_backend_cpu_buffer_type());
+    if (!g.buf) {
+        fprintf(stderr, "%s: failed to allocate the weights\n", __func__);
+        return false;
+    }
+
+    g.galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    if (!ggml_gallocr_alloc_graph(g.galloc, g.gf)) {
+        fprintf(stderr, "%s: failed to allocate the graph\n", __func__);
+        return false;
+    }
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    auto fill = [&](ggml_tensor * t) {
+        std::vector<float> data(ggml_nelements(t));
+        for (auto & x : data) {
+            x = dist(rng);
+        }
+        if (t->type == GGML_TYPE_F16) {
+            std::vector<ggml_fp16_t> data_f16(data.size());
+            ggml_fp32_to_fp16_row(data.data(), data_f16.data(), data.size());
+            ggml_backend_tensor_set(t, data_f16.data(), 0, ggml_nbytes(t));
+        } else {
+            ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+        }
+    };
+
+    for (ggml_tensor * w : g.weights) {
+        fill(w);
+    }
+    fill(g.inp);
+
+    std::vector<float> cache0(ggml_nelements(g.cache));
+    for (auto & x : cache0) {
+        x = dist(rng);
+    }
+
+    std::vector<float> out[2];
+    std::vector<float> cache[2];
+
+    for (int dep_sched = 0; dep_sched < 2; ++dep_sched) {
+        ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+        tpp.dep_sched = dep_sched;
+
+        ggml_threadpool * threadpool = ggml_threadpool_new(&tpp);
+        if (!threadpool) {
+            fprintf(stderr, "%s: threadpool create failed : n_threads %d\n", __func__, n_threads);
+            return false;
+        }
+
+        ggml_cplan cplan = ggml_graph_plan(g.gf, n_threads, threadpool);
+
+        std::vector<uint8_t> work_data(cplan.work_size);
+        cplan.work_data = work_data.data();
+
+        // the second run reuses the levels of the first one
+        for (int i = 0; i < 2; ++i) {
+            ggml_backend_tensor_set(g.cache, cache0.data(), 0, ggml_nbytes(g.cache));
+
+            if (ggml_graph_compute(g.gf, &cplan) != GGML_STATUS_SUCCESS) {
+                fprintf(stderr, "%s: graph compute failed\n", __func__);
+                ggml_threadpool_free(threadpool);
+                return false;
+            }
+
+            std::vector<float> res(ggml_nelements(g.out));
+            ggml_backend_tensor_get(g.out, res.data(), 0, ggml_nbytes(g.out));
+
+            std::vector<float> res_cache(ggml_nelements(g.cache));
+            ggml_backend_tensor_get(g.cache, res_cache.data(), 0, ggml_nbytes(g.cache));
+
+            if (i == 0) {
+                out[dep_sched]   = std::move(res);
+                cache[dep_sched] = std::move(res_cache);
+            } else if (res != out[dep_sched] || res_cache != cache[dep_sched]) {
+                fprintf(stderr, "%s: n_tokens = %d, n_threads = %d, dep_sched = %d: the results of the second run differ\n",
+                        __func__, n_tokens, n_threads, dep_sched);
+                ggml_threadpool_free(threadpool);
+                return false;
+            }
+        }
+
+        ggml_threadpool_free(threadpool);
+    }
+
+    if (memcmp(out[0].data(), out[1].data(), out[0].size()*sizeof(float)) != 0 ||
+        memcmp(cache[0].data(), cache[1].data(), cache[0].size()*sizeof(float)) != 0) {
+        fprintf(stderr, "%s: n_tokens = %d, n_threads = %d: the level scheduling differs from the lockstep execution\n",
+                __func__, n_tokens, n_threads);
+        return false;
+    }
+
+    printf("%s: n_tokens = %2d, n_threads = %d: OK\n", __func__, n_tokens, n_threads);
+
+    return true;
+}
+
+int main(void) {
+    bool ok = true;
+
+    for (int n_tokens : { 1, 7, n_cache }) {
+        for (int n_threads : { 2, 4 }) {
+            ok = run(n_tokens, n_threads) && ok;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
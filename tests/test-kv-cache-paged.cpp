@@ -0,0 +1,544 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-batch.h"
+#include "llama-cparams.h"
+#include "llama-kv-cache.h"
+#include "llama-model.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+static const uint32_t block_size = 4;
+static const uint32_t kv_size    = 32;
+
+// a ubatch with one token per sequence, as produced by llama_sbatch::split_simple
+struct test_ubatch {
+    std::vector<llama_pos>                 pos;
+    std::vector<int32_t>                   n_seq_id;
+    std::vector<std::vector<llama_seq_id>> seq_ids;
+    std::vector<llama_seq_id *>            seq_id;
+
+    llama_ubatch ubatch;
+
+    test_ubatch(const std::vector<std::pair<llama_seq_id, llama_pos>> & tokens) {
+        std::vector<std::pair<std::vector<llama_seq_id>, llama_pos>> tokens_multi;
+        for (const auto & t : tokens) {
+            tokens_multi.push_back({ { t.first }, t.second });
+        }
+        init(tokens_multi);
+    }
+
+    test_ubatch(const std::vector<std::pair<std::vector<llama_seq_id>, llama_pos>> & tokens) {
+        init(tokens);
+    }
+
+    void init(const std::vector<std::pair<std::vector<llama_seq_id>, llama_pos>> & tokens) {
+        for (const auto & t : tokens) {
+            seq_ids.push_back(t.first);
+            pos.push_back(t.second);
+            n_seq_id.push_back(t.first.size());
+        }
+        for (auto & s : seq_ids) {
+            seq_id.push_back(s.data());
+        }
+
+        ubatch = {
+            /*equal_seqs   =*/ false,
+            /*n_tokens     =*/ (uint32_t) tokens.size(),
+            /*n_seq_tokens =*/ 1,
+            /*n_seqs       =*/ (uint32_t) tokens.size(),
+            /*token        =*/ nullptr,
+            /*embd         =*/ nullptr,
+            /*pos          =*/ pos.data(),
+            /*n_seq_id     =*/ n_seq_id.data(),
+            /*seq_id       =*/ seq_id.data(),
+            /*output       =*/ nullptr,
+        };
+    }
+};
+
+// tokens [p0, p1) of a sequence
+static std::vector<std::pair<llama_seq_id, llama_pos>> seq_tokens(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    std::vector<std::pair<llama_seq_id, llama_pos>> res;
+    for (llama_pos p = p0; p < p1; ++p) {
+        res.emplace_back(seq_id, p);
+    }
+    return res;
+}
+
+// the block tables that are updated in place by the sequence edits must match the cells
+static void check_blocks(const llama_kv_cache_paged & kv) {
+    const uint32_t n_blocks = kv_size/block_size;
+
+    uint32_t n_free = 0;
+
+    for (uint32_t blk_id = 0; blk_id < n_blocks; ++blk_id) {
+        std::vector<llama_seq_id> seq_ids;
+        for (uint32_t i = blk_id*block_size; i < (blk_id + 1)*block_size; ++i) {
+            for (const llama_seq_id seq_id : kv.cells.seq_ids(i)) {
+                if (std::find(seq_ids.begin(), seq_ids.end(), seq_id) == seq_ids.end()) {
+                    seq_ids.push_back(seq_id);
+                }
+            }
+        }
+
+        // a block is in the table of a sequence iff it holds cells of the sequence
+        for (llama_seq_id seq_id = 0; seq_id < 128; ++seq_id) {
+            const auto & blocks = kv.get_seq_blocks(seq_id);
+
+            const bool in_table = std::find(blocks.begin(), blocks.end(), blk_id) != blocks.end();
+            const bool has_seq  = std::find(seq_ids.begin(), seq_ids.end(), seq_id) != seq_ids.end();
+
+            assert(in_table == has_seq);
+        }
+
+        assert(kv.get_block_refs(blk_id) == seq_ids.size());
+
+        n_free += seq_ids.empty();
+    }
+
+    assert(kv.get_n_free_blocks() == n_free);
+}
+
+static void test_cells() {
+    llama_kv_cells cells;
+    cells.resize(8, 2);
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        cells.pos[i] = i;
+        cells.seq_add(i, i%2);
+    }
+
+    // a sequence id beyond n_seq_max widens the bit masks without losing the existing sequences
+    cells.seq_add(3, 70);
+
+    assert(cells.seq_ids(3) == std::vector<llama_seq_id>({1, 70}));
+    assert(cells.has_seq_id(2, 0));
+    assert(!cells.has_seq_id(2, 70));
+    assert(cells.seq_count(3) == 2);
+
+    {
+        std::vector<llama_pos> pos(cells.size());
+        cells.seq_pos(1, nullptr, cells.size(), pos.data());
+        assert(pos == std::vector<llama_pos>({-1, 1, -1, 3, -1, 5, -1, 7}));
+
+        const uint32_t idxs[] = { 7, 3, 0 };
+        cells.seq_pos(70, idxs, 3, pos.data());
+        assert(pos[0] == -1 && pos[1] == 3 && pos[2] == -1);
+    }
+
+    cells.swap(3, 4);
+    assert(cells.pos[4] == 3 && cells.seq_ids(4) == std::vector<llama_seq_id>({1, 70}));
+
+    cells.copy(0, 4);
+    assert(cells.is_same_seq(0, 4));
+
+    cells.reset(4);
+    assert(cells.is_empty(4) && cells.pos[4] == -1);
+}
+
+static void test_alloc(llama_kv_cache_paged & kv) {
+    kv.clear();
+    assert(kv.get_n_free_blocks() == kv_size/block_size);
+
+    // two interleaved sequences get their own blocks
+    {
+        test_ubatch ub({ {0, 0}, {1, 0}, {0, 1}, {1, 1}, {0, 2} });
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0}));
+        assert(kv.get_seq_blocks(1) == std::vector<uint32_t>({1}));
+        assert(kv.get_used_cells() == 5);
+        assert(kv.get_n_free_blocks() == kv_size/block_size - 2);
+
+        const auto ranges = kv.get_slot_ranges(5);
+        const std::vector<std::pair<uint32_t, uint32_t>> expected = { {0, 1}, {4, 5}, {1, 2}, {5, 6}, {2, 3} };
+        assert(ranges == expected);
+    }
+
+    // the attention of a sequence only gathers its own blocks
+    {
+        test_ubatch ub(seq_tokens(1, 2, 5));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(1) == std::vector<uint32_t>({1, 2}));
+
+        const auto ranges = kv.get_slot_ranges(3);
+        const std::vector<std::pair<uint32_t, uint32_t>> expected = { {6, 9} };
+        assert(ranges == expected);
+
+        const auto & kv_idxs = kv.get_kv_idxs();
+        assert(kv_idxs.size() == 2*block_size);
+        assert(kv_idxs.front() == 1*block_size);
+        assert(kv_idxs.back()  == 3*block_size - 1);
+    }
+
+    // removing a sequence returns its blocks to the free list
+    {
+        assert(kv.seq_rm(1, -1, -1));
+
+        assert(kv.get_seq_blocks(1).empty());
+        assert(kv.get_used_cells() == 3);
+        assert(kv.get_n_free_blocks() == kv_size/block_size - 1);
+
+        // the freed blocks are reused without defragmentation
+        test_ubatch ub(seq_tokens(2, 0, 6));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(2) == std::vector<uint32_t>({1, 2}));
+    }
+
+    check_blocks(kv);
+}
+
+static void test_share(llama_kv_cache_paged & kv) {
+    kv.clear();
+
+    {
+        test_ubatch ub(seq_tokens(0, 0, 6));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+    }
+
+    // the prefix is shared without copying any cells
+    kv.seq_cp(0, 1, -1, -1);
+
+    assert(kv.get_used_cells() == 6);
+    assert(kv.get_seq_blocks(1) == std::vector<uint32_t>({0, 1}));
+    assert(kv.get_block_refs(0) == 2);
+    assert(kv.get_block_refs(1) == 2);
+
+    // the sequences diverge: the shared blocks are not modified and each sequence continues in a new block
+    {
+        test_ubatch ub({ {1, 6}, {0, 6} });
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(1) == std::vector<uint32_t>({0, 1, 2}));
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0, 1, 3}));
+        assert(kv.get_block_refs(1) == 2);
+    }
+
+    // releasing a sequence only drops its references
+    {
+        assert(kv.seq_rm(1, -1, -1));
+
+        assert(kv.get_used_cells() == 7);
+        assert(kv.get_block_refs(0) == 1);
+        assert(kv.get_n_free_blocks() == kv_size/block_size - 3);
+    }
+
+    // tokens that belong to several sequences share their blocks
+    {
+        test_ubatch ub({ { {4, 5}, 0 }, { {4, 5}, 1 }, { {4, 5}, 2 } });
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(4) == std::vector<uint32_t>({2}));
+        assert(kv.get_seq_blocks(5) == std::vector<uint32_t>({2}));
+        assert(kv.get_block_refs(2) == 2);
+    }
+
+    check_blocks(kv);
+}
+
+static void test_full(llama_kv_cache_paged & kv) {
+    kv.clear();
+
+    // one block per sequence, until the cache is full
+    for (llama_seq_id s = 0; s < (llama_seq_id) (kv_size/block_size); ++s) {
+        test_ubatch ub({ {s, 0} });
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+    }
+    assert(kv.get_n_free_blocks() == 0);
+
+    // the blocks still have free cells for their own sequences, but not for new ones
+    {
+        test_ubatch ub({ {100, 0} });
+        assert(!kv.find_slot(ub.ubatch));
+        assert(kv.get_used_cells() == kv_size/block_size);
+    }
+
+    // a failed slot does not leak cells
+    {
+        test_ubatch ub(seq_tokens(0, 1, 1 + block_size));
+        assert(!kv.find_slot(ub.ubatch));
+        assert(kv.get_used_cells() == kv_size/block_size);
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0}));
+    }
+
+    check_blocks(kv);
+}
+
+static void test_restore(llama_kv_cache_paged & kv) {
+    kv.clear();
+
+    {
+        test_ubatch ub(seq_tokens(0, 0, 3));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+    }
+
+    // roll back the slots of a failed decode
+    {
+        llama_kv_slot_restorer restorer(kv);
+
+        test_ubatch ub0(seq_tokens(0, 3, 6));
+        restorer.save(kv.find_slot(ub0.ubatch));
+
+        test_ubatch ub1(seq_tokens(1, 0, 5));
+        restorer.save(kv.find_slot(ub1.ubatch));
+
+        assert(kv.get_used_cells() == 11);
+
+        restorer.restore();
+        kv.commit();
+    }
+
+    assert(kv.get_used_cells() == 3);
+    assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0}));
+    assert(kv.get_seq_blocks(1).empty());
+    assert(kv.get_n_free_blocks() == kv_size/block_size - 1);
+
+    check_blocks(kv);
+}
+
+static void test_edit(llama_kv_cache_paged & kv) {
+    kv.clear();
+
+    {
+        test_ubatch ub(seq_tokens(0, 0, 6));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+    }
+
+    // rolling back the last tokens of a sequence frees the tail of its last block for the next tokens
+    {
+        assert(kv.seq_rm(0, 3, -1));
+
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0}));
+        assert(kv.get_used_cells() == 3);
+        check_blocks(kv);
+
+        test_ubatch ub(seq_tokens(0, 3, 8));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0, 1}));
+
+        const auto ranges = kv.get_slot_ranges(5);
+        const std::vector<std::pair<uint32_t, uint32_t>> expected = { {3, 8} };
+        assert(ranges == expected);
+    }
+
+    // the consecutive blocks of the ubatch are read in place, the padding extends the last run
+    {
+        kv.n = kv.get_n_kv(llama_cparams {});
+
+        const auto runs = kv.get_kv_runs();
+        assert(runs.size() == 1);
+        assert(runs[0].first == 0);
+    }
+
+    // a sequence that continues in a later block is read in several runs
+    {
+        test_ubatch ub1(seq_tokens(1, 0, 2));
+        assert(kv.find_slot(ub1.ubatch));
+        kv.commit();
+
+        test_ubatch ub0(seq_tokens(0, 8, 9));
+        assert(kv.find_slot(ub0.ubatch));
+        kv.commit();
+
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0, 1, 3}));
+
+        kv.n = kv.get_n_kv(llama_cparams {});
+
+        const auto runs = kv.get_kv_runs();
+        assert(runs.size() >= 2);
+        assert(runs[0].first == 0 && runs[0].second == 2*block_size);
+        assert(runs[1].first == 3*block_size);
+
+        uint32_t n = 0;
+        for (const auto & run : runs) {
+            n += run.second - run.first;
+        }
+        assert(n == kv.n);
+    }
+
+    // shifting the positions out of the context only drops the cells from the shifted sequence
+    {
+        kv.seq_cp(0, 2, 0, 4);
+        assert(kv.get_seq_blocks(2) == std::vector<uint32_t>({0}));
+
+        kv.seq_add(0, 0, 4, -4);
+
+        assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({1, 3}));
+        assert(kv.get_seq_blocks(2) == std::vector<uint32_t>({0}));
+        check_blocks(kv);
+
+        assert(kv.seq_rm(2, -1, -1));
+    }
+
+    // keeping a single sequence releases the blocks of the others
+    {
+        kv.seq_keep(1);
+
+        assert(kv.get_seq_blocks(0).empty());
+        assert(kv.get_seq_blocks(1) == std::vector<uint32_t>({2}));
+        assert(kv.get_used_cells() == 2);
+        assert(kv.get_n_free_blocks() == kv_size/block_size - 1);
+    }
+
+    check_blocks(kv);
+}
+
+// the positions of a sequence, in increasing order
+static std::vector<llama_pos> seq_positions(const llama_kv_cache_paged & kv, llama_seq_id seq_id) {
+    std::vector<llama_pos> res;
+    for (uint32_t i = 0; i < kv_size; ++i) {
+        if (kv.cells.has_seq_id(i, seq_id)) {
+            res.push_back(kv.cells.pos[i]);
+        }
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+static void test_shift_shared(llama_kv_cache_paged & kv) {
+    kv.clear();
+
+    {
+        test_ubatch ub(seq_tokens(0, 0, 6));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+    }
+
+    // give each cell a K row of its own
+    ggml_tensor * k = kv.k_l[0];
+
+    const size_t k_size_row = ggml_row_size(k->type, 4);
+
+    std::vector<ggml_fp16_t> row(4);
+    for (uint32_t i = 0; i < 6; ++i) {
+        std::fill(row.begin(), row.end(), ggml_fp32_to_fp16(float(i + 1)));
+        ggml_backend_tensor_set(k, row.data(), i*k_size_row, k_size_row);
+    }
+
+    kv.seq_cp(0, 1, -1, -1);
+    assert(kv.get_used_cells() == 6);
+
+    // shifting one of the sequences copies the shared cells instead of moving the other sequence
+    kv.seq_add(1, 2, -1, 3);
+
+    assert(seq_positions(kv, 0) == std::vector<llama_pos>({0, 1, 2, 3, 4, 5}));
+    assert(seq_positions(kv, 1) == std::vector<llama_pos>({0, 1, 5, 6, 7, 8}));
+
+    for (uint32_t i = 0; i < kv_size; ++i) {
+        if (kv.cells.has_seq_id(i, 0)) {
+            assert(kv.cells.delta[i] == 0);
+        }
+    }
+
+    assert(kv.get_used_cells() == 10);
+    assert(kv.get_seq_blocks(0) == std::vector<uint32_t>({0, 1}));
+    assert(kv.get_seq_blocks(1) == std::vector<uint32_t>({0, 2}));
+    check_blocks(kv);
+
+    // the copies hold the K data of the cells they were copied from
+    for (uint32_t i = 0; i < kv_size; ++i) {
+        if (kv.cells.has_seq_id(i, 1) && kv.cells.pos[i] >= 5) {
+            ggml_backend_tensor_get(k, row.data(), i*k_size_row, k_size_row);
+            assert(ggml_fp16_to_fp32(row[0]) == float(kv.cells.pos[i] - 3 + 1));
+        }
+    }
+
+    // dividing the positions is also copy on write
+    kv.seq_div(0, 0, -1, 2);
+
+    assert(seq_positions(kv, 0) == std::vector<llama_pos>({0, 0, 1, 1, 2, 2}));
+    assert(seq_positions(kv, 1) == std::vector<llama_pos>({0, 1, 5, 6, 7, 8}));
+    check_blocks(kv);
+}
+
+static void test_mask_rows(llama_kv_cache_paged & kv) {
+    kv.clear();
+
+    {
+        test_ubatch ub(seq_tokens(0, 0, 2*block_size));
+        assert(kv.find_slot(ub.ubatch));
+        kv.commit();
+    }
+
+    // a valid row for sequence 0
+    auto & mask_rows = kv.mask_rows;
+
+    mask_rows.rows .assign(1, std::vector<float>(kv_size, 0.0f));
+    mask_rows.pos  .assign(1, 2*block_size - 1);
+    mask_rows.dirty.assign(1, { 0, 0 });
+
+    // edits that do not change any cell keep the row as it is
+    assert(kv.seq_rm(0, 100, -1));
+    assert(kv.seq_rm(1, -1, -1));
+    kv.seq_add(0, 100, -1, 4);
+    kv.seq_cp(0, 0, -1, -1);
+
+    assert(mask_rows.pos[0] == 2*block_size - 1);
+    assert(mask_rows.dirty[0].first == mask_rows.dirty[0].second);
+
+    // the cells that changed are marked for the next ubatch
+    assert(kv.seq_rm(0, block_size - 1, block_size + 1));
+
+    assert(mask_rows.pos[0] == 2*block_size - 1);
+    assert(mask_rows.dirty[0].first == block_size - 1 && mask_rows.dirty[0].second == block_size + 1);
+
+    kv.seq_cp(0, 1, 0, 1);
+
+    assert(mask_rows.dirty[0].first == 0 && mask_rows.dirty[0].second == block_size + 1);
+
+    mask_rows.rows .clear();
+    mask_rows.pos  .clear();
+    mask_rows.dirty.clear();
+}
+
+int main(void) {
+    llama_model model(llama_model_default_params());
+
+    model.arch = LLM_ARCH_LLAMA;
+
+    model.hparams.n_layer       = 1;
+    model.hparams.n_embd_head_k = 4;
+    model.hparams.n_embd_head_v = 4;
+    model.hparams.n_head_kv_arr.fill(1);
+
+    llama_cparams cparams = {};
+
+    llama_kv_cache_paged kv(model.hparams, { nullptr }, block_size);
+
+    if (!kv.init(model, cparams, GGML_TYPE_F16, GGML_TYPE_F16, kv_size, false)) {
+        fprintf(stderr, "failed to initialize the paged KV cache\n");
+        return 1;
+    }
+
+    test_cells();
+    test_alloc(kv);
+    test_share(kv);
+    test_full(kv);
+    test_restore(kv);
+    test_edit(kv);
+    test_shift_shared(kv);
+    test_mask_rows(kv);
+
+    fprintf(stderr, "All tests passed.\n");
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "llama-adapter.h"
+#include "llama-batch.h"
+#include "llama-cparams.h"
+#include "llama-graph.h"
+#include "llama-hparams.h"
+
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const int64_t n_in  = 8;
+static const int64_t n_out = 6;
+static const int64_t rank  = 2;
+
+// a ubatch of n_seqs sequences with n_seq_tokens tokens each
+struct test_ubatch {
+    std::vector<llama_pos>                 pos;
+    std::vector<int32_t>                   n_seq_id;
+    std::vector<std::vector<llama_seq_id>> seq_ids;
+    std::vector<llama_seq_id *>            seq_id;
+    std::vector<int8_t>                    output;
+
+    llama_ubatch ubatch;
+
+    test_ubatch(const std::vector<llama_seq_id> & seqs, uint32_t n_seq_tokens, const std::vector<int8_t> & output) : output(output) {
+        for (const llama_seq_id s : seqs) {
+            seq_ids.push_back({ s });
+            n_seq_id.push_back(1);
+        }
+        for (auto & s : seq_ids) {
+            seq_id.push_back(s.data());
+        }
+        for (size_t i = 0; i < seqs.size()*n_seq_tokens; ++i) {
+            pos.push_back(i);
+        }
+
+        ubatch = {
+            /*equal_seqs   =*/ n_seq_tokens > 1,
+            /*n_tokens     =*/ (uint32_t) (seqs.size()*n_seq_tokens),
+            /*n_seq_tokens =*/ n_seq_tokens,
+            /*n_seqs       =*/ (uint32_t) seqs.size(),
+            /*token        =*/ nullptr,
+            /*embd         =*/ nullptr,
+            /*pos          =*/ pos.data(),
+            /*n_seq_id     =*/ n_seq_id.data(),
+            /*seq_id       =*/ seq_id.data(),
+            /*output       =*/ this->output.empty() ? nullptr : this->output.data(),
+        };
+    }
+
+    llama_seq_id seq_of(int32_t i) const {
+        return ubatch.seq_id[i / ubatch.n_seq_tokens][0];
+    }
+};
+
+static void fill(ggml_tensor * t, float offs) {
+    std::vector<float> data(ggml_nelements(t));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = std::sin(offs + 0.37f*i);
+    }
+    ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+}
+
+static std::vector<float> get(const ggml_tensor * t) {
+    std::vector<float> data(ggml_nelements(t));
+    ggml_backend_tensor_get(t, data.data(), 0, ggml_nbytes(t));
+    return data;
+}
+
+// y = w x for a row-major [ne1, ne0] matrix, as ggml_mul_mat
+static std::vector<float> matvec(const std::vector<float> & w, int64_t ne0, int64_t ne1, const float * x) {
+    std::vector<float> y(ne1, 0.0f);
+    for (int64_t r = 0; r < ne1; ++r) {
+        for (int64_t c = 0; c < ne0; ++c) {
+            y[r] += w[r*ne0 + c]*x[c];
+        }
+    }
+    return y;
+}
+
+struct test_lora {
+    llama_adapter_lora adapter;
+
+    std::vector<float> a;
+    std::vector<float> b;
+};
+
+static void test_route() {
+    llama_adapter_lora lora_a;
+    llama_adapter_lora lora_b;
+
+    llama_adapter_loras_seq loras_seq;
+    loras_seq[0][&lora_a] = 1.0f;
+    loras_seq[2][&lora_a] = 1.0f; // same adapters as seq 0
+    loras_seq[3][&lora_b] = 0.5f;
+    loras_seq[4] = {};            // cleared
+
+    // seq 1 has no adapters
+    test_ubatch tu({ 0, 1, 2, 0, 3, 1, 4 }, 1, { 1, 0, 1, 0, 1, 1, 0 });
+
+    auto groups = llama_adapter_lora_route(loras_seq, tu.ubatch, 4);
+
+    assert(groups.size() == 2);
+    assert(*groups[0].loras == loras_seq[0]);
+    assert((groups[0].idxs     == std::vector<int32_t>{ 0, 2, 3 }));
+    assert((groups[0].idxs_out == std::vector<int32_t>{ 0, 1 }));
+    assert(*groups[1].loras == loras_seq[3]);
+    assert((groups[1].idxs     == std::vector<int32_t>{ 4 }));
+    assert((groups[1].idxs_out == std::vector<int32_t>{ 2 }));
+
+    // all the tokens are outputs
+    groups = llama_adapter_lora_route(loras_seq, tu.ubatch, tu.ubatch.n_tokens);
+    assert((groups[0].idxs_out == groups[0].idxs));
+    assert((groups[1].idxs_out == groups[1].idxs));
+
+    // the tokens of a sequence split by llama_sbatch::split_equal
+    test_ubatch te({ 1, 3, 0 }, 2, {});
+
+    groups = llama_adapter_lora_route(loras_seq, te.ubatch, 1);
+    assert(groups.size() == 2);
+    assert((groups[0].idxs     == std::vector<int32_t>{ 2, 3 }));
+    assert((groups[0].idxs_out.empty()));
+    assert((groups[1].idxs     == std::vector<int32_t>{ 4, 5 }));
+    assert((groups[1].idxs_out == std::vector<int32_t>{ 0 }));
+
+    // the worst-case graphs have no sequences
+    assert(llama_adapter_lora_route({}, tu.ubatch, 4).empty());
+
+    printf("%s: OK\n", __func__);
+}
+
+// build_lora_mm on the tokens of the ubatch must give each token the adapters of its sequence
+// n_rows: the rows of the input, the tokens or the outputs of the ubatch
+// n_split: the input is 3-D [n_in, n_rows/n_split, n_split], as for the recurrent models
+static void test_mm(ggml_backend_t backend, const test_ubatch & tu, int32_t n_outputs, bool out, int64_t n_split) {
+    const llama_ubatch & ubatch = tu.ubatch;
+
+    const int64_t n_rows = out ? n_outputs : ubatch.n_tokens;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead()*256 + ggml_graph_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    test_lora loras[2];
+    for (int il = 0; il < 2; ++il) {
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_in, rank);
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, rank, n_out);
+        loras[il].adapter.ab_map["w"] = llama_adapter_lora_weight(a, b);
+        loras[il].adapter.alpha = 0.0f;
+    }
+
+    ggml_tensor * w = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_in, n_out);
+    ggml_set_name(w, "w");
+
+    ggml_tensor * x = n_split > 1 ?
+        ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_in, n_rows/n_split, n_split) :
+        ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_in, n_rows);
+
+    llama_adapter_loras_seq loras_seq;
+    loras_seq[0][&loras[0].adapter] = 1.0f;
+    loras_seq[2][&loras[0].adapter] = 1.0f;
+    loras_seq[2][&loras[1].adapter] = 0.25f;
+    loras_seq[3][&loras[1].adapter] = 0.5f;
+
+    llama_hparams hparams = {};
+    hparams.n_layer = 1;
+    llama_cparams cparams = {};
+    cparams.n_seq_max = 1;
+
+    const llama_adapter_loras loras_ctx;
+    const llm_graph_cb        cb;
+
+    llm_graph_params gparams = {
+        /*.ctx         =*/ ctx,
+        /*.arch        =*/ LLM_ARCH_LLAMA,
+        /*.hparams     =*/ hparams,
+        /*.cparams     =*/ cparams,
+        /*.ubatch      =*/ ubatch,
+        /*.sched       =*/ nullptr,
+        /*.backend_cpu =*/ nullptr,
+        /*.cvec        =*/ nullptr,
+        /*.loras       =*/ &loras_ctx,
+        /*.loras_seq   =*/ &loras_seq,
+        /*.memory      =*/ nullptr,
+        /*.cross       =*/ nullptr,
+        /*.n_outputs   =*/ n_outputs,
+        /*.cb          =*/ cb,
+    };
+
+    llm_graph_context g(gparams);
+
+    assert(g.inp_lora != nullptr);
+
+    ggml_tensor * res = g.build_lora_mm(w, x);
+
+    assert(res->ne[0] == n_out && ggml_nrows(res) == n_rows && res->ne[2] == x->ne[2]);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, res);
+
+    ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors(ctx, backend);
+    assert(buf != nullptr);
+
+    fill(w, 0.0f);
+    fill(x, 1.0f);
+    for (int il = 0; il < 2; ++il) {
+        const auto & lw = loras[il].adapter.ab_map["w"];
+        fill(lw.a, 2.0f + il);
+        fill(lw.b, 4.0f + il);
+        loras[il].a = get(lw.a);
+        loras[il].b = get(lw.b);
+    }
+
+    g.res->set_inputs(&ubatch);
+
+    assert(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+    const std::vector<float> w_data = get(w);
+    const std::vector<float> x_data = get(x);
+    const std::vector<float> y_data = get(res);
+
+    // the token of each row
+    std::vector<int32_t> rows;
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        if (!out || (ubatch.output ? ubatch.output[i] : i == ubatch.n_tokens - 1)) {
+            rows.push_back(i);
+        }
+    }
+    assert((int64_t) rows.size() == n_rows);
+
+    for (int64_t r = 0; r < n_rows; ++r) {
+        const float * xr = x_data.data() + r*n_in;
+
+        std::vector<float> y = matvec(w_data, n_in, n_out, xr);
+
+        const auto it = loras_seq.find(tu.seq_of(rows[r]));
+        if (it != loras_seq.end()) {
+            for (const auto & lora : it->second) {
+                const test_lora & tl = lora.first == &loras[0].adapter ? loras[0] : loras[1];
+
+                const auto ax  = matvec(tl.a, n_in, rank, xr);
+                const auto bax = matvec(tl.b, rank, n_out, ax.data());
+
+                for (int64_t c = 0; c < n_out; ++c) {
+                    y[c] += lora.second*bax[c];
+                }
+            }
+        }
+
+        for (int64_t c = 0; c < n_out; ++c) {
+            if (std::fabs(y[c] - y_data[r*n_out + c]) > 1e-4f) {
+                fprintf(stderr, "%s: row %lld, col %lld: expected %f, got %f\n", __func__, (long long) r, (long long) c, y[c], y_data[r*n_out + c]);
+                assert(false);
+            }
+        }
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+}
+
+int main(void) {
+    ggml_backend_load_all();
+
+    ggml_backend_t backend = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
+    assert(backend != nullptr);
+
+    test_route();
+
+    {
+        // two groups, the tokens of seq 1 have no adapters
+        test_ubatch tu({ 0, 1, 2, 0, 3, 1 }, 1, { 1, 0, 1, 0, 1, 1 });
+
+        test_mm(backend, tu, 4, false, 1);
+        test_mm(backend, tu, 4, true,  1);
+        test_mm(backend, tu, tu.ubatch.n_tokens, false, 1);
+    }
+
+    {
+        // all the tokens are in one group
+        test_ubatch tu({ 3, 3, 3 }, 1, {});
+
+        test_mm(backend, tu, 1, false, 1);
+        test_mm(backend, tu, 1, true,  1);
+    }
+
+    {
+        // the tokens of the recurrent models, [n_in, n_seq_tokens, n_seqs]
+        test_ubatch tu({ 2, 1, 0 }, 3, {});
+
+        test_mm(backend, tu, 1, false, 3);
+    }
+
+    printf("%s: OK\n", __func__);
+
+    ggml_backend_free(backend);
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include "ngram-cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+// the layout of the file written by common_ngram_cache_save
+constexpr size_t header_size   = 32;
+constexpr size_t entry_size    = 32;
+constexpr size_t offs_n_used   = 16;
+constexpr size_t offs_n_tokens = 16; // within an entry
+constexpr size_t offs_i_pool   = 20; // within an entry
+
+static std::vector<char> read_file(const std::string & fname) {
+    std::ifstream f(fname, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string & fname, const std::vector<char> & data) {
+    std::ofstream f(fname, std::ios::binary);
+    f.write(data.data(), data.size());
+}
+
+static bool load_throws(std::string & fname) {
+    try {
+        common_ngram_cache_load(fname);
+    } catch (const std::ifstream::failure &) {
+        return true;
+    }
+    return false;
+}
+
+// every n-gram of a must be in b with the same tokens and counts
+static void check_same(const common_ngram_cache & a, const common_ngram_cache & b) {
+    assert(a.size() == b.size());
+
+    size_t n_found = 0;
+    for (size_t i = 0; i < a.n_entries(); ++i) {
+        const common_ngram_cache_entry & ea = a.entries()[i];
+        if (ea.n_tokens == 0) {
+            continue;
+        }
+
+        const common_ngram_cache_entry * eb = b.find(ea.ngram);
+        assert(eb != nullptr);
+        assert(eb->n_tokens == ea.n_tokens);
+
+        const common_ngram_token_count * ta = a.get_tokens(ea);
+        const common_ngram_token_count * tb = b.get_tokens(*eb);
+        for (int j = 0; j < ea.n_tokens; ++j) {
+            assert(ta[j].token == tb[j].token);
+            assert(ta[j].count == tb[j].count);
+            assert(b.get_count(*eb, ta[j].token) == ta[j].count);
+        }
+        n_found++;
+    }
+    assert(n_found == a.size());
+}
+
+int main(void) {
+    std::string fname = "test-ngram-cache.bin";
+
+    // a small vocab so that many n-grams are followed by several tokens
+    std::mt19937 rng(42);
+    std::vector<llama_token> inp(20000);
+    for (auto & t : inp) {
+        t = rng() % 16;
+    }
+
+    common_ngram_cache nc;
+    common_ngram_cache_update(nc, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp, inp.size(), false);
+    assert(!nc.empty());
+
+    // lookup
+    {
+        const common_ngram ngram(&inp[100], 2);
+        const common_ngram_cache_entry * entry = nc.find(ngram);
+        assert(entry != nullptr);
+        assert(nc.get_count(*entry, inp[102]) > 0);
+        assert(nc.get_count(*entry, 1000) == 0);
+
+        const llama_token unseen[2] = { 1000, 1001 };
+        assert(nc.find(common_ngram(unseen, 2)) == nullptr);
+    }
+
+    // save and load
+    common_ngram_cache_save(nc, fname);
+    {
+        common_ngram_cache loaded = common_ngram_cache_load(fname);
+        check_same(nc, loaded);
+        check_same(loaded, nc);
+
+        // a loaded cache can still be updated
+        common_ngram_cache updated = loaded;
+        std::vector<llama_token> inp2 = { 1000, 1001, 1002, 1003, 1004 };
+        common_ngram_cache_update(updated, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp2, inp2.size(), false);
+        common_ngram_cache_update(loaded,  LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp2, inp2.size(), false);
+        check_same(updated, loaded);
+        assert(loaded.size() > nc.size());
+    }
+
+    // draft from the loaded cache
+    {
+        common_ngram_cache nc_context;
+        common_ngram_cache nc_dynamic;
+        common_ngram_cache nc_static = common_ngram_cache_load(fname);
+
+        std::vector<llama_token> prompt(inp.begin(), inp.begin() + 64);
+        std::vector<llama_token> draft = { inp[64] };
+        common_ngram_cache_draft(prompt, draft, 8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, nc_context, nc_dynamic, nc_static);
+        assert(draft.size() >= 1 && draft.size() <= 9);
+    }
+
+    const std::vector<char> data = read_file(fname);
+
+    uint64_t n_used;
+    memcpy(&n_used, data.data() + offs_n_used, sizeof(n_used));
+    assert(n_used == nc.size());
+
+    // the first entry with a list in the pool
+    size_t i_list = 0;
+    for (size_t offs = header_size; ; offs += entry_size) {
+        assert(offs + entry_size <= data.size());
+        int32_t n_tokens;
+        memcpy(&n_tokens, data.data() + offs + offs_n_tokens, sizeof(n_tokens));
+        if (n_tokens > 1) {
+            i_list = offs;
+            break;
+        }
+    }
+
+    common_ngram ngram_list;
+    memcpy(&ngram_list, data.data() + i_list, sizeof(ngram_list));
+    assert(nc.find(ngram_list) != nullptr);
+
+    // the entries of a file are only checked when they are used: a corrupted entry is not found, and it is dropped
+    // once the cache is updated or saved
+    auto check_dropped = [&](const std::vector<char> & bad) {
+        write_file(fname, bad);
+
+        common_ngram_cache loaded = common_ngram_cache_load(fname);
+        assert(loaded.find(ngram_list) == nullptr);
+
+        const common_ngram_cache_entry * entry = loaded.find(common_ngram(&inp[100], 2));
+        assert(entry == nullptr || loaded.get_count(*entry, inp[102]) > 0);
+
+        common_ngram_cache updated = loaded;
+        assert(updated.find(ngram_list) == nullptr);
+        assert(updated.size() == nc.size() - 1);
+
+        // note: not over the mapped file
+        std::string fname_saved = fname + ".saved";
+        common_ngram_cache_save(loaded, fname_saved);
+        {
+            common_ngram_cache saved = common_ngram_cache_load(fname_saved);
+            assert(saved.find(ngram_list) == nullptr);
+            check_same(updated, saved);
+        }
+        std::remove(fname_saved.c_str());
+    };
+
+    // a list out of the pool
+    {
+        std::vector<char> bad = data;
+        const uint32_t i_pool = 0xFFFFFFF0u;
+        memcpy(bad.data() + i_list + offs_i_pool, &i_pool, sizeof(i_pool));
+        check_dropped(bad);
+    }
+
+    // a list that runs past the end of the pool
+    {
+        std::vector<char> bad = data;
+        const int32_t n_tokens = 1 << 30;
+        memcpy(bad.data() + i_list + offs_n_tokens, &n_tokens, sizeof(n_tokens));
+        check_dropped(bad);
+    }
+
+    // a negative number of tokens
+    {
+        std::vector<char> bad = data;
+        const int32_t n_tokens = -1;
+        memcpy(bad.data() + i_list + offs_n_tokens, &n_tokens, sizeof(n_tokens));
+        check_dropped(bad);
+    }
+
+    // n_used that does not match the occupied entries, it is counted again once the cache is updated
+    {
+        std::vector<char> bad = data;
+        const uint64_t n_used_bad = n_used - 1;
+        memcpy(bad.data() + offs_n_used, &n_used_bad, sizeof(n_used_bad));
+        write_file(fname, bad);
+
+        common_ngram_cache loaded = common_ngram_cache_load(fname);
+        assert(loaded.size() == n_used_bad);
+
+        common_ngram_cache updated = loaded;
+        check_same(nc, updated);
+    }
+
+    // a truncated file
+    {
+        std::vector<char> bad(data.begin(), data.end() - 1);
+        write_file(fname, bad);
+        assert(load_throws(fname));
+    }
+
+    // an empty cache
+    {
+        common_ngram_cache empty;
+        common_ngram_cache_save(empty, fname);
+        common_ngram_cache loaded = common_ngram_cache_load(fname);
+        assert(loaded.empty());
+        assert(loaded.find(common_ngram(inp.data(), 2)) == nullptr);
+    }
+
+    std::remove(fname.c_str());
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
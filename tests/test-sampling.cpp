@@ -7,6 +7,8 @@
 
 #include <algorithm>
 #include <cmath>
+#include <numeric>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -267,6 +269,64 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// llama_sampler_apply_logits must leave the same candidates and select the same token as llama_sampler_apply
+static void test_apply_logits(const size_t n_vocab, const std::string & samplers_sequence, const int top_k, const float top_p, const float min_p, const float temp) {
+    // distinct logits, so that the order of the candidates does not depend on the sort
+    std::vector<int> order(n_vocab);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(n_vocab));
+
+    std::vector<float> logits(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        logits[i] = 16.0f*order[i]/n_vocab - 8.0f;
+    }
+    logits[order[0]] = -INFINITY;
+
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, 0, nullptr));
+    llama_sampler_chain_add(chain, llama_sampler_init_penalties(64, 1.0f, 0.0f, 0.0f));
+
+    for (auto s : samplers_sequence) {
+        switch (s){
+            case 'k': llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));     break;
+            case 'p': llama_sampler_chain_add(chain, llama_sampler_init_top_p(top_p, 1));  break;
+            case 'm': llama_sampler_chain_add(chain, llama_sampler_init_min_p(min_p, 1));  break;
+            case 't': llama_sampler_chain_add(chain, llama_sampler_init_temp (temp));      break;
+            default : GGML_ABORT("Unknown sampler");
+        }
+    }
+
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(42));
+
+    llama_sampler * chain_ref = llama_sampler_clone(chain);
+
+    std::vector<llama_token_data> cur(n_vocab);
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    llama_sampler_apply_logits(chain, logits.data(), n_vocab, &cur_p);
+
+    std::vector<llama_token_data> cur_ref;
+    for (llama_token token_id = 0; token_id < (llama_token) n_vocab; token_id++) {
+        cur_ref.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+    }
+    llama_token_data_array cur_p_ref = { cur_ref.data(), cur_ref.size(), -1, false };
+    llama_sampler_apply(chain_ref, &cur_p_ref);
+
+    GGML_ASSERT(cur_p.size == cur_p_ref.size);
+    GGML_ASSERT(cur_p.sorted == cur_p_ref.sorted);
+    for (size_t i = 0; i < cur_p.size; i++) {
+        GGML_ASSERT(cur_p.data[i].id == cur_p_ref.data[i].id);
+        GGML_ASSERT(cur_p.data[i].p  == cur_p_ref.data[i].p);
+    }
+    GGML_ASSERT(cur_p.data[cur_p.selected].id == cur_p_ref.data[cur_p_ref.selected].id);
+
+    llama_sampler_free(chain);
+    llama_sampler_free(chain_ref);
+
+    printf("Apply logits %4s OK with n_vocab=%05zu top_k=%05d top_p=%f min_p=%f temp=%f\n",
+           samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p, temp);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -287,6 +347,31 @@ static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vec
 
 #define BENCH(__cnstr, __data, __n_iter) bench((__cnstr), #__cnstr, (__data), (__n_iter))
 
+static void bench_logits(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
+    std::vector<float> logits(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        logits[i] = data[i].logit;
+    }
+    std::vector<llama_token_data> cur(data.size());
+    const int64_t t_start = ggml_time_us();
+    for (int i = 0; i < n_iter; i++) {
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_sampler_apply_logits(cnstr, logits.data(), logits.size(), &cur_p);
+        llama_sampler_reset(cnstr);
+    }
+    const int64_t t_end = ggml_time_us();
+    llama_sampler_free(cnstr);
+    printf("%-43s: %8.3f us/iter\n", cnstr_name, (t_end - t_start) / (float)n_iter);
+}
+
+static llama_sampler * chain_top_k(int32_t k) {
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(k));
+    return chain;
+}
+
+#define BENCH_LOGITS(__cnstr, __data, __n_iter) bench_logits((__cnstr), #__cnstr, (__data), (__n_iter))
+
 static void test_perf() {
     const int n_vocab = 1 << 17;
 
@@ -303,6 +388,8 @@ static void test_perf() {
     BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
     BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
+
+    BENCH_LOGITS(chain_top_k        (40),                     data, 32);
 }
 
 int main(void) {
@@ -391,6 +478,16 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_apply_logits(50000, "kpmt",    40, 0.95f, 0.05f, 0.8f);
+    test_apply_logits(50000, "kpmt",  1000, 0.95f, 0.05f, 0.8f);
+    test_apply_logits(50000, "kpmt", 50000, 0.95f, 0.05f, 0.8f);
+    test_apply_logits(50000, "kt",       1, 1.00f, 0.00f, 0.0f);
+    test_apply_logits(50000, "kmt",      0, 1.00f, 0.30f, 1.0f);
+    test_apply_logits(50000, "kpmt",     0, 1.00f, 0.10f, 1.0f);
+    test_apply_logits(50000, "mkt",     40, 1.00f, 0.50f, 1.0f);
+    test_apply_logits(50000, "pkt",     40, 0.50f, 0.00f, 1.0f);
+    test_apply_logits(   10, "kmt",     40, 1.00f, 0.05f, 1.0f);
+
     printf("OK\n");
 
     test_perf();
@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+#include "utils.hpp"
+
+// json_append_str must produce the same output as json::dump with error_handler_t::replace
+static void test_json_append_str(const std::string & str) {
+    std::string out;
+    json_append_str(out, str);
+
+    const std::string expected = json(str).dump(-1, ' ', false, json::error_handler_t::replace);
+    if (out != expected) {
+        fprintf(stderr, "%s: mismatch for input:", __func__);
+        for (unsigned char c : str) {
+            fprintf(stderr, " %02X", c);
+        }
+        fprintf(stderr, "\n  expected: %s\n  actual:   %s\n", expected.c_str(), out.c_str());
+        assert(false);
+    }
+}
+
+int main(void) {
+    const std::vector<std::string> cases = {
+        "",
+        "hello world",
+        "quote \" backslash \\ slash /",
+        "control \b\f\n\r\t \x01\x1f\x7f",
+        std::string("nul \0 byte", 10),
+        "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80",  // U+00E9 U+20AC U+1F600
+        "\xf4\x8f\xbf\xbf",                      // U+10FFFF
+        "\xef\xbf\xbd",                          // U+FFFD
+        "\xc0\x80",                              // overlong NUL
+        "\xc1\xbf",                              // overlong
+        "\xe0\x80\x80",                          // overlong
+        "\xe0\x9f\xbf",                          // overlong
+        "\xf0\x80\x80\x80",                      // overlong
+        "\xf0\x8f\xbf\xbf",                      // overlong
+        "\xed\xa0\x80",                          // surrogate U+D800
+        "\xed\xbf\xbf",                          // surrogate U+DFFF
+        "\xf4\x90\x80\x80",                      // U+110000
+        "\xf5\x80\x80\x80",                      // invalid lead byte
+        "\xff\xfe",                              // invalid bytes
+        "\x80\xbf",                              // lone continuation bytes
+        "\xe2\x82\x41",                          // truncated sequence followed by ASCII
+        "\xe2\x82",                              // truncated at the end
+        "abc\xf0\x9f\x98",                       // truncated at the end
+        "\xe2\xe2\x82\xac",                      // truncated sequence followed by a valid one
+        "\xf0\x9f\xc3\xa9\"",                    // truncated sequence followed by a valid one and a quote
+    };
+
+    for (const auto & str : cases) {
+        test_json_append_str(str);
+    }
+
+    // random byte strings biased towards UTF-8 lead and continuation bytes
+    std::mt19937 rng(42);
+    const uint8_t bytes[] = { 0x00, 0x0a, 0x22, 0x41, 0x5c, 0x7f, 0x80, 0x8f, 0x90, 0x9f, 0xa0, 0xbf,
+                              0xc0, 0xc2, 0xdf, 0xe0, 0xe2, 0xed, 0xef, 0xf0, 0xf4, 0xf5, 0xff };
+    for (int i = 0; i < 100000; ++i) {
+        std::string str(rng() % 8, ' ');
+        for (auto & c : str) {
+            c = (char) bytes[rng() % sizeof(bytes)];
+        }
+        test_json_append_str(str);
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}